@@ -0,0 +1,264 @@
+#include "analytics.h"
+#include "key.h"
+#include "mem.h"
+#include <intrin.h>
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+// Number of hash bits selecting the register of an endpoint.
+static const u32 PRECISION = 10;
+
+// Highest rank an endpoint can have: the remaining hash bits are all zero.
+static const u32 MAX_RANK = 64 - PRECISION + 1;
+
+// Limit of the HyperLogLog estimate for an infinite number of registers, 1 / (2 ln 2).
+static const f64 ALPHA = 0.721347520444481703680;
+
+static_assert((1 << PRECISION) == ANALYTICS_REGISTERS, "The precision must match the number of registers");
+static_assert(ANALYTICS_APPS < 256, "Counter indices must fit the index slots");
+
+// Returns the sum of x^(2^k) * 2^(k-1) for k from 0, which accounts for the registers still at zero. The fraction of
+// them must be below one.
+static f64 sigma(f64 x) {
+	f64 y = 1;
+	f64 z = x;
+
+	for (;;) {
+		x *= x;
+		f64 prev = z;
+		z += x * y;
+		y += y;
+
+		if (z == prev) {
+			return z;
+		}
+	}
+}
+
+// Returns the correction for the fraction x of registers at the highest rank.
+static f64 tau(f64 x) {
+	if (x == 0 || x == 1) {
+		return 0;
+	}
+
+	f64 y = 1;
+	f64 z = 1 - x;
+
+	for (;;) {
+		x = sqrt(x);
+		f64 prev = z;
+		y *= 0.5;
+		z -= (1 - x) * (1 - x) * y;
+
+		if (z == prev) {
+			return z / 3;
+		}
+	}
+}
+
+// Returns the estimated number of distinct endpoints added to the registers, following "New cardinality estimation
+// algorithms for HyperLogLog sketches" (Ertl, 2017).
+static u64 estimate(u8 const* registers) {
+	u32 histogram[MAX_RANK + 1] = {};
+	for (u32 i = 0; i < ANALYTICS_REGISTERS; ++i) {
+		histogram[registers[i]] += 1;
+	}
+
+	if (histogram[0] == ANALYTICS_REGISTERS) {
+		return 0;
+	}
+
+	f64 m = ANALYTICS_REGISTERS;
+	f64 z = m * tau(1 - histogram[MAX_RANK] / m);
+
+	for (u32 k = MAX_RANK - 1; k >= 1; --k) {
+		z = 0.5 * (z + histogram[k]);
+	}
+
+	z += m * sigma(histogram[0] / m);
+
+	return (u64)(ALPHA * m * m / z + 0.5);
+}
+
+Analytics::Analytics() {
+	InitializeSRWLock(&m_lock);
+}
+
+Analytics::~Analytics() {
+	if (m_counters) {
+		for (u32 i = 0; i < ANALYTICS_APPS; ++i) {
+			m_counters[i].path.reset();
+		}
+
+		mem_free(m_counters);
+	}
+}
+
+b32 Analytics::init() {
+	if (m_counters) {
+		return true;
+	}
+
+	m_counters = (AnalyticsCounter*)mem_calloc(MemoryTagAnalytics, ANALYTICS_APPS, sizeof(*m_counters));
+	return m_counters != nullptr;
+}
+
+void Analytics::record(WCHAR const* app, size_t count, u8 const* endpoint, size_t endpoint_size) {
+	assert(app || count == 0);
+	assert(endpoint || endpoint_size == 0);
+
+	if (m_counters == nullptr) {
+		return;
+	}
+
+	size_t hash = keyhash((u8 const*)app, count * sizeof(*app));
+
+	// The top bits of the endpoint hash select the register and the position of the highest set bit in the rest
+	// gives the rank, with a guard bit bounding it.
+	u32 slot = 0;
+	u8 rank = 0;
+
+	if (endpoint) {
+		u64 endpoint_hash = keyhash(endpoint, endpoint_size);
+		unsigned long bit;
+		_BitScanReverse64(&bit, (endpoint_hash << PRECISION) | (1ull << (PRECISION - 1)));
+
+		slot = (u32)(endpoint_hash >> (64 - PRECISION));
+		rank = (u8)(64 - bit);
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	m_total += 1;
+
+	i32 i = find(app, count, hash);
+	if (i < 0) {
+		// Take over the counter with the lowest count. Unused counters have none. Counts only grow and a taken over
+		// counter ends up above the previous lowest count, so the lowest count never decreases and the search can stop
+		// at the first counter still at it. The search resumes after the last counter taken over, where the counters
+		// that have been at the lowest count the longest are.
+		u32 lowest = m_cursor;
+		for (u32 j = 1; j < ANALYTICS_APPS && m_counts[lowest] != m_lowest; ++j) {
+			u32 k = (m_cursor + j) % ANALYTICS_APPS;
+			if (m_counts[k] < m_counts[lowest]) {
+				lowest = k;
+			}
+		}
+
+		i = lowest;
+		m_lowest = m_counts[i];
+		m_cursor = (i + 1) % ANALYTICS_APPS;
+
+		AnalyticsCounter* counter = m_counters + i;
+		if (m_counts[i]) {
+			unlink(i);
+		}
+
+		if (counter->path.assign(app, count) == false) {
+			counter->path.clear();
+			m_counts[i] = 0;
+			m_lowest = 0;
+			ReleaseSRWLockExclusive(&m_lock);
+			return;
+		}
+
+		m_hashes[i] = hash;
+		counter->error = m_counts[i];
+		memset(counter->registers, 0, sizeof(counter->registers));
+
+		u32 mask = COUNT(m_index) - 1;
+		u32 index = (u32)hash & mask;
+		while (m_index[index]) {
+			index = (index + 1) & mask;
+		}
+
+		m_index[index] = (u8)(i + 1);
+	}
+
+	AnalyticsCounter* counter = m_counters + i;
+	m_counts[i] += 1;
+
+	if (rank > counter->registers[slot]) {
+		counter->registers[slot] = rank;
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+u64 Analytics::visit(AnalyticsVisitor visitor, void* context) {
+	assert(visitor);
+
+	AcquireSRWLockShared(&m_lock);
+
+	// Insertion sort of the counters in use, by descending count.
+	u8 order[ANALYTICS_APPS];
+	u32 count = 0;
+
+	for (u32 i = 0; m_counters && i < ANALYTICS_APPS; ++i) {
+		u64 value = m_counts[i];
+		if (value == 0) {
+			continue;
+		}
+
+		u32 j = count++;
+		while (j && m_counts[order[j - 1]] < value) {
+			order[j] = order[j - 1];
+			j -= 1;
+		}
+
+		order[j] = (u8)i;
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		AnalyticsCounter const* counter = m_counters + order[i];
+
+		AnalyticsApp app;
+		app.count = m_counts[order[i]];
+		app.error = counter->error;
+		app.endpoints = estimate(counter->registers);
+
+		visitor(counter->path.c_str(), &app, context);
+	}
+
+	u64 total = m_total;
+
+	ReleaseSRWLockShared(&m_lock);
+
+	return total;
+}
+
+i32 Analytics::find(WCHAR const* app, size_t count, size_t hash) const {
+	u32 mask = COUNT(m_index) - 1;
+
+	for (u32 i = (u32)hash & mask; m_index[i]; i = (i + 1) & mask) {
+		u32 counter = m_index[i] - 1;
+		if (m_hashes[counter] == hash && m_counters[counter].path.size() == count &&
+			memcmp(m_counters[counter].path.c_str(), app, count * sizeof(*app)) == 0) {
+			return counter;
+		}
+	}
+
+	return -1;
+}
+
+void Analytics::unlink(u32 counter) {
+	u32 mask = COUNT(m_index) - 1;
+
+	u32 i = (u32)m_hashes[counter] & mask;
+	while (m_index[i] != counter + 1) {
+		i = (i + 1) & mask;
+	}
+
+	// Shift back the entries of the probe run that would no longer be reachable across the hole.
+	for (u32 j = (i + 1) & mask; m_index[j]; j = (j + 1) & mask) {
+		u32 home = (u32)m_hashes[m_index[j] - 1] & mask;
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			m_index[i] = m_index[j];
+			i = j;
+		}
+	}
+
+	m_index[i] = 0;
+}
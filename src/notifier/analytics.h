@@ -0,0 +1,74 @@
+#pragma once
+#include "core.h"
+#include "path.h"
+#include <Windows.h>
+
+// Number of applications tracked by the analytics.
+#define ANALYTICS_APPS 64
+
+// Number of registers of the distinct endpoint sketch of each tracked application. Must be a power of two.
+#define ANALYTICS_REGISTERS 1024
+
+// Estimates for a tracked application. The true number of drop events lies between count - error and count. The
+// endpoints are the estimated number of distinct remote endpoints seen since the application was last taken in.
+struct AnalyticsApp {
+	u64 count;
+	u64 error;
+	u64 endpoints;
+};
+
+// Visitor for the tracked applications. Passes back the path, its estimates and the user context data.
+typedef void(*AnalyticsVisitor)(WCHAR const* path, AnalyticsApp const* app, void* context);
+
+// Streaming drop event analytics in fixed memory, whatever the event rate. The applications with the most drop events
+// are tracked with the Space-Saving algorithm: a miss takes over the counter with the lowest count, inheriting that
+// count as its error, so any application with more than total / ANALYTICS_APPS events is always tracked. Each tracked
+// application carries a HyperLogLog sketch of the remote endpoints (address and port) it was blocked from reaching,
+// read with Ertl's improved estimator, which stays within about 3% at every cardinality without empirical bias
+// tables. Thread safe.
+class Analytics {
+public:
+	// Creates analytics without any memory.
+	Analytics();
+
+	// Destroys the analytics.
+	~Analytics();
+
+	Analytics(Analytics const&) = delete;
+	Analytics& operator=(Analytics const&) = delete;
+
+	// Allocates the counters and sketches. Returns true on success.
+	b32 init();
+
+	// Records a drop event for the application identified by the first count characters of the path. The endpoint is
+	// the remote address followed by the remote port, or null if unknown.
+	void record(WCHAR const* app, size_t count, u8 const* endpoint, size_t endpoint_size);
+
+	// Calls the visitor for every tracked application, highest count first. Returns the total number of drop events
+	// recorded. Events cannot be recorded until the visitor returns.
+	u64 visit(AnalyticsVisitor visitor, void* context);
+
+private:
+	// A tracked application. Its count and path hash are kept apart, so finding the lowest count on a miss and probing
+	// the hash index only touch a few cache lines.
+	struct AnalyticsCounter {
+		Path path;
+		u64 error;
+		u8 registers[ANALYTICS_REGISTERS];
+	};
+
+	// Returns the index of the counter of the application with the given path and hash, or -1 if untracked.
+	i32 find(WCHAR const* app, size_t count, size_t hash) const;
+
+	// Removes the counter at the given index from the hash index.
+	void unlink(u32 counter);
+
+	SRWLOCK m_lock;
+	AnalyticsCounter* m_counters = nullptr;
+	u64 m_counts[ANALYTICS_APPS] = {};
+	size_t m_hashes[ANALYTICS_APPS] = {};
+	u8 m_index[4 * ANALYTICS_APPS] = {};
+	u64 m_lowest = 0;
+	u32 m_cursor = 0;
+	u64 m_total = 0;
+};
@@ -1,8 +1,15 @@
 #include "app.h"
+#include "canon.h"
+#include "fs.h"
+#include "mem.h"
 #include "resource.h"
+#include "trace.h"
+#include <Psapi.h>
 #include <ShlObj.h>
 #include <shellapi.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 // Application messages.
@@ -13,14 +20,71 @@
 #define ID_ENABLE_FIREWALL 102
 #define ID_DISABLE_FIREWALL 103
 #define ID_RULES 104
+#define ID_COMPACT_RULES 105
+
+// Maximum number of decisions in a single control request.
+static const u32 MAX_CONTROL_DECISIONS = 0x10000;
+
+// Pending applications collected for a control response.
+struct PendingList {
+	ControlBuffer* response;
+	u32 count;
+	b32 is_failed;
+};
+
+// Appends a pending application to the list.
+static void append_pending(WCHAR const* path, Key const* key, void* context) {
+	UNREFERENCED_PARAMETER(key);
+
+	PendingList* list = (PendingList*)context;
+
+	if (list->is_failed == false && control_append_string(list->response, path)) {
+		++list->count;
+	} else {
+		list->is_failed = true;
+	}
+}
+
+// Tracked applications collected for a control response.
+struct AnalyticsList {
+	ControlBuffer* response;
+	u32 count;
+	b32 is_failed;
+};
+
+// Appends a tracked application to the list.
+static void append_analytics(WCHAR const* path, AnalyticsApp const* app, void* context) {
+	AnalyticsList* list = (AnalyticsList*)context;
+
+	if (list->is_failed == false && control_append_string(list->response, path) &&
+		control_append(list->response, app, sizeof(*app))) {
+		++list->count;
+	} else {
+		list->is_failed = true;
+	}
+}
+
+// File name of the drop event history, located in the notifier directory of the user.
+static WCHAR const HISTORY_NAME[] = L"history.dat";
+
+// File name of the warm restart snapshot, located in the notifier directory of the user.
+static WCHAR const SNAPSHOT_NAME[] = L"snapshot.dat";
+
+// File name of the hot path trace, located next to the executable. Only written when built with NOTIFIER_TRACE.
+static WCHAR const TRACE_NAME[] = L"trace.json";
+
+// File name of the workload report, located next to the executable. Only written when built with NOTIFIER_WORKLOAD.
+static WCHAR const WORKLOAD_NAME[] = L"workload.csv";
 
 App::App() {
+	InitializeCriticalSection(&m_prompt_lock);
 }
 
 App::~App() {
+	DeleteCriticalSection(&m_prompt_lock);
 }
 
-void App::run() {
+void App::run(WCHAR const* sync_dir, WorkloadConfig const* workload) {
 	WNDCLASS wc = { 0 };
 	wc.hInstance = GetModuleHandleW(nullptr);
 	wc.hbrBackground = (HBRUSH)(COLOR_WINDOW);
@@ -51,9 +115,52 @@ void App::run() {
 		wcscpy_s(nid.szTip, ARRAYSIZE(nid.szTip), L"Firewall Notifier");
 		b32 tray = Shell_NotifyIconW(NIM_ADD, &nid);
 
+		WCHAR trace_path[MAX_PATH + 1];
+		if (fs_module_path(trace_path, COUNT(trace_path), TRACE_NAME)) {
+			trace_start(trace_path);
+		}
+
+		m_analytics.init();
+
+		// Synthetic runs leave no trace in the history or the firewall rules. Every user has a history of their own,
+		// since the file is held open for writing.
+		m_is_synthetic = (workload != nullptr);
+
+		WCHAR history_path[MAX_PATH + 1];
+		if (m_is_synthetic == false && fs_user_path(history_path, COUNT(history_path), HISTORY_NAME)) {
+			m_history.open(history_path);
+		}
+
+		if (sync_dir) {
+			m_sync.start(sync_dir, &m_firewall);
+		}
+
+		m_control.start(control_callback, this);
+
+		m_verdicts.set_firewall(&m_firewall);
+
+		// Synthetic runs neither pick up nor leave behind any state. Every user has a snapshot of their own.
+		WCHAR snapshot_path[MAX_PATH + 1];
+		b32 has_snapshot = workload == nullptr && fs_user_path(snapshot_path, COUNT(snapshot_path), SNAPSHOT_NAME);
+		if (has_snapshot) {
+			m_snapshot.restore(snapshot_path, &m_monitor, &m_verdicts);
+		}
+
+		m_monitor.set_callback(drop_event_callback, this);
+		m_monitor.set_builtin_rules(m_firewall.builtin_rules());
 		m_monitor.start();
+		m_enricher.start(&m_monitor, &m_fingerprints);
 		HANDLE thread = CreateThread(0, 0, notifier_thread_callback, this, 0, 0);
 
+		if (has_snapshot) {
+			m_snapshot.start(snapshot_path, &m_monitor, &m_verdicts, snapshot_source_callback, this);
+		}
+
+		WCHAR workload_path[MAX_PATH + 1];
+		if (workload && fs_module_path(workload_path, COUNT(workload_path), WORKLOAD_NAME)) {
+			m_workload.start(workload, &m_monitor, workload_path, wnd);
+		}
+
 		MSG msg = { 0 };
 		while (m_is_open && GetMessageW(&msg, nullptr, 0, 0)) {
 			if (IsDialogMessageW(wnd, &msg) == FALSE) {
@@ -62,7 +169,10 @@ void App::run() {
 			}
 		}
 
+		m_snapshot.stop();
+		m_workload.stop();
 		m_monitor.stop();
+		m_history.close();
 
 		if (m_tray_menu) {
 			DestroyMenu(m_tray_menu);
@@ -73,6 +183,10 @@ void App::run() {
 		}
 
 		WaitForSingleObject(thread, INFINITE);
+		m_enricher.stop();
+		m_control.stop();
+		m_sync.stop();
+		trace_stop();
 	}
 
 	DestroyWindow(wnd);
@@ -96,10 +210,10 @@ LRESULT App::handle_msg(HWND wnd, UINT msg, WPARAM wp, LPARAM lp) {
 
 				case ID_RULES:
 				{
-					static wchar_t command[MAX_EXT_PATH + 1];
+					wchar_t command[MAX_PATH + 32];
 
 					if (SHGetFolderPathW(NULL, CSIDL_SYSTEM, NULL, SHGFP_TYPE_DEFAULT, command) == S_OK) {
-						if (wcscat_s(command, MAX_EXT_PATH, L"\\mmc.exe wf.msc") == 0) {
+						if (wcscat_s(command, COUNT(command), L"\\mmc.exe wf.msc") == 0) {
 							STARTUPINFOW si = { 0 };
 							si.cb = sizeof(si);
 
@@ -112,6 +226,23 @@ LRESULT App::handle_msg(HWND wnd, UINT msg, WPARAM wp, LPARAM lp) {
 					}
 				} break;
 
+				case ID_COMPACT_RULES:
+				{
+					FirewallCompaction report;
+					if (m_firewall.compact(&report) == false) {
+						MessageBoxW(0, L"Could not compact firewall rules.", L"Error", MB_OK);
+						break;
+					}
+
+					WCHAR message[256];
+					_snwprintf_s(message, COUNT(message), _TRUNCATE,
+						L"Removed %u duplicate and %u shadowed rules in %llu ms.\nRules: %u before, %u after.%s",
+						report.duplicates, report.shadowed, report.elapsed, report.rules_before, report.rules_after,
+						report.failed ? L"\nSome rules could not be added back." : L"");
+
+					MessageBoxW(0, message, L"Compact Rules", MB_OK);
+				} break;
+
 				case ID_DISABLE_FIREWALL:
 				{
 					m_firewall.set_filtering(false);
@@ -149,6 +280,7 @@ LRESULT App::handle_msg(HWND wnd, UINT msg, WPARAM wp, LPARAM lp) {
 					}
 
 					AppendMenuW(m_tray_menu, MF_DEFAULT | MF_STRING, ID_RULES, L"Rules");
+					AppendMenuW(m_tray_menu, MF_STRING, ID_COMPACT_RULES, L"Compact Rules");
 
 					if (m_firewall.is_filtering()) {
 						AppendMenuW(m_tray_menu, MF_CHECKED | MF_STRING, ID_DISABLE_FIREWALL, L"Toggle Firewall");
@@ -179,21 +311,412 @@ LRESULT CALLBACK App::handle_msg_callback(HWND wnd, UINT msg, WPARAM wp, LPARAM
 	return DefWindowProcW(wnd, msg, wp, lp);
 }
 
+ControlStatus App::control(ControlOp op, u8 const* request, u32 request_size, ControlBuffer* response) {
+	assert(request || request_size == 0);
+	assert(response);
+
+	ControlStatus status = ControlStatusUnknown;
+
+	switch (op) {
+		case ControlOpPendingEvents:
+		{
+			status = control_pending(response);
+		} break;
+
+		case ControlOpMetrics:
+		{
+			ControlMetrics metrics = {};
+			metrics.queued_events = m_monitor.queued();
+			metrics.dropped_history_events = m_history.dropped();
+			metrics.requests = m_control.requests();
+			metrics.is_filtering = m_firewall.is_filtering() ? 1 : 0;
+
+			status = control_append(response, &metrics, sizeof(metrics)) ? ControlStatusOk : ControlStatusFailed;
+		} break;
+
+		case ControlOpGetFiltering:
+		{
+			u32 state = m_firewall.is_filtering() ? 1 : 0;
+			status = control_append(response, &state, sizeof(state)) ? ControlStatusOk : ControlStatusFailed;
+		} break;
+
+		case ControlOpSetFiltering:
+		{
+			u32 state;
+			if (request_size != sizeof(state)) {
+				status = ControlStatusInvalid;
+				break;
+			}
+
+			memcpy(&state, request, sizeof(state));
+			status = m_firewall.set_filtering(state != 0) ? ControlStatusOk : ControlStatusFailed;
+		} break;
+
+		case ControlOpDecide:
+		{
+			status = control_decide(request, request_size, response);
+		} break;
+
+		case ControlOpMemory:
+		{
+			status = control_memory(response);
+		} break;
+
+		case ControlOpAnalytics:
+		{
+			status = control_analytics(response);
+		} break;
+
+		case ControlOpIdle:
+		{
+			status = control_idle(response);
+		} break;
+	}
+
+	return status;
+}
+
+ControlStatus App::control_memory(ControlBuffer* response) {
+	assert(response);
+
+	MemoryStats stats[MemoryTagCount];
+	mem_stats(stats);
+
+	u32 count = MemoryTagCount;
+	b32 result = control_append(response, &count, sizeof(count));
+
+	for (u32 i = 0; i < count && result; ++i) {
+		result = control_append_string(response, mem_tag_name((MemoryTag)i)) &&
+			control_append(response, stats + i, sizeof(stats[i]));
+	}
+
+	return result ? ControlStatusOk : ControlStatusFailed;
+}
+
+ControlStatus App::control_idle(ControlBuffer* response) {
+	assert(response);
+
+	ControlIdle idle = {};
+	idle.idle_count = m_idle_count;
+
+	u64 idle_since = m_idle_since;
+	if (idle_since) {
+		idle.idle_time = GetTickCount64() - idle_since;
+	}
+
+	ULONG64 cycles = 0;
+	if (QueryProcessCycleTime(GetCurrentProcess(), &cycles)) {
+		idle.cycle_time = cycles;
+	}
+
+	PROCESS_MEMORY_COUNTERS_EX memory = {};
+	memory.cb = sizeof(memory);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&memory, sizeof(memory))) {
+		idle.working_set = memory.WorkingSetSize;
+		idle.private_bytes = memory.PrivateUsage;
+	}
+
+	return control_append(response, &idle, sizeof(idle)) ? ControlStatusOk : ControlStatusFailed;
+}
+
+ControlStatus App::control_analytics(ControlBuffer* response) {
+	assert(response);
+
+	AnalyticsList list = {};
+	list.response = response;
+
+	u64 total = 0;
+	u32 header_offset = response->size;
+	if (control_append(response, &total, sizeof(total)) == false ||
+		control_append(response, &list.count, sizeof(list.count)) == false) {
+		return ControlStatusFailed;
+	}
+
+	total = m_analytics.visit(append_analytics, &list);
+
+	if (list.is_failed) {
+		return ControlStatusFailed;
+	}
+
+	memcpy(response->data + header_offset, &total, sizeof(total));
+	memcpy(response->data + header_offset + sizeof(total), &list.count, sizeof(list.count));
+
+	return ControlStatusOk;
+}
+
+ControlStatus App::control_pending(ControlBuffer* response) {
+	assert(response);
+
+	PendingList list = {};
+	list.response = response;
+
+	u32 count_offset = response->size;
+	if (control_append(response, &list.count, sizeof(list.count)) == false) {
+		return ControlStatusFailed;
+	}
+
+	visit_pending(append_pending, &list);
+
+	if (list.is_failed) {
+		return ControlStatusFailed;
+	}
+
+	memcpy(response->data + count_offset, &list.count, sizeof(list.count));
+
+	return ControlStatusOk;
+}
+
+void App::visit_pending(MonitorVisitor visitor, void* context) {
+	assert(visitor);
+
+	EnterCriticalSection(&m_prompt_lock);
+
+	if (m_prompt.empty() == false) {
+		visitor(m_prompt.c_str(), nullptr, context);
+	}
+
+	LeaveCriticalSection(&m_prompt_lock);
+
+	m_monitor.visit_queued(visitor, context);
+}
+
+void App::snapshot_source_callback(MonitorVisitor visitor, void* visitor_context, void* context) {
+	App* app = (App*)context;
+	if (app) {
+		app->visit_pending(visitor, visitor_context);
+	}
+}
+
+ControlStatus App::control_decide(u8 const* request, u32 request_size, ControlBuffer* response) {
+	assert(request || request_size == 0);
+	assert(response);
+
+	u32 count;
+	if (request_size < sizeof(count)) {
+		return ControlStatusInvalid;
+	}
+
+	memcpy(&count, request, sizeof(count));
+	if (count > MAX_CONTROL_DECISIONS) {
+		return ControlStatusInvalid;
+	}
+
+	Arena arena(MemoryTagUi);
+	RuleDecision* decisions = (RuleDecision*)arena.alloc((count + 1) * sizeof(*decisions));
+	if (decisions == nullptr) {
+		return ControlStatusFailed;
+	}
+
+	u8 const* src = request + sizeof(count);
+	u8 const* end = request + request_size;
+
+	for (u32 i = 0; i < count; ++i) {
+		u16 length;
+		if (end - src < 1 + (ptrdiff_t)sizeof(length)) {
+			return ControlStatusInvalid;
+		}
+
+		u8 verdict = src[0];
+		memcpy(&length, src + 1, sizeof(length));
+		src += 1 + sizeof(length);
+
+		if (verdict > 1 || length == 0 || end - src < (ptrdiff_t)(length * sizeof(WCHAR))) {
+			return ControlStatusInvalid;
+		}
+
+		Path path;
+		Path key;
+		if (path.assign((WCHAR const*)src, length) == false || canon_path(path.c_str(), &key) == false) {
+			return ControlStatusInvalid;
+		}
+
+		src += length * sizeof(WCHAR);
+
+		decisions[i].path = arena.wcsdup(key.c_str());
+		decisions[i].is_allowed = (verdict == 1);
+
+		if (decisions[i].path == nullptr) {
+			return ControlStatusFailed;
+		}
+	}
+
+	if (src != end) {
+		return ControlStatusInvalid;
+	}
+
+	u32 added = m_firewall.add_rules(decisions, count);
+
+	for (u32 i = 0; i < count; ++i) {
+		m_sync.record(decisions[i].path, decisions[i].is_allowed);
+	}
+
+	return control_append(response, &added, sizeof(added)) ? ControlStatusOk : ControlStatusFailed;
+}
+
+ControlStatus App::control_callback(ControlOp op, u8 const* request, u32 request_size, ControlBuffer* response,
+	void* context) {
+	App* app = (App*)context;
+	if (app) {
+		return app->control(op, request, request_size, response);
+	}
+
+	return ControlStatusFailed;
+}
+
+void App::drop_event(FWPM_NET_EVENT1 const* ev) {
+	assert(ev);
+
+	u64 time = ((u64)ev->header.timeStamp.dwHighDateTime << 32) | ev->header.timeStamp.dwLowDateTime;
+	m_history.append((WCHAR const*)ev->header.appId.data, time / 10000);
+
+	WCHAR const* path = (WCHAR const*)ev->header.appId.data;
+	size_t count = ev->header.appId.size / sizeof(*path);
+	while (count && path[count - 1] == 0) {
+		count -= 1;
+	}
+
+	// The endpoint is the remote address followed by the remote port.
+	u8 endpoint[sizeof(ev->header.remoteAddrV6) + sizeof(ev->header.remotePort)];
+	size_t endpoint_size = 0;
+
+	if (ev->header.flags & FWPM_NET_EVENT_FLAG_REMOTE_ADDR_SET) {
+		if (ev->header.ipVersion == FWP_IP_VERSION_V6) {
+			memcpy(endpoint, ev->header.remoteAddrV6.byteArray16, sizeof(ev->header.remoteAddrV6));
+			endpoint_size = sizeof(ev->header.remoteAddrV6);
+		} else {
+			memcpy(endpoint, &ev->header.remoteAddrV4, sizeof(ev->header.remoteAddrV4));
+			endpoint_size = sizeof(ev->header.remoteAddrV4);
+		}
+
+		if (ev->header.flags & FWPM_NET_EVENT_FLAG_REMOTE_PORT_SET) {
+			memcpy(endpoint + endpoint_size, &ev->header.remotePort, sizeof(ev->header.remotePort));
+			endpoint_size += sizeof(ev->header.remotePort);
+		}
+	}
+
+	m_analytics.record(path, count, endpoint_size ? endpoint : nullptr, endpoint_size);
+	m_snapshot.touch();
+
+	// Rules for blocklisted addresses are added on the notifier thread, away from the rule store.
+	if (m_is_synthetic == false && (ev->header.flags & FWPM_NET_EVENT_FLAG_REMOTE_ADDR_SET) &&
+		m_firewall.check_remote_address(ev->header.ipVersion == FWP_IP_VERSION_V6, ev->header.remoteAddrV4,
+			ev->header.remoteAddrV6.byteArray16)) {
+		m_enricher.wake();
+	}
+}
+
+void App::drop_event_callback(FWPM_NET_EVENT1 const* ev, void* context) {
+	App* app = (App*)context;
+	if (app) {
+		app->drop_event(ev);
+	}
+}
+
+b32 App::idle() {
+	TRACE_SCOPE("App::idle");
+
+	b32 result = m_monitor.trim();
+	result = m_firewall.trim() && result;
+
+	m_notifier.trim();
+	mem_trim();
+
+	return result;
+}
+
 DWORD App::notifier_thread() {
-	WCHAR* path;
-	while (m_monitor.receive(&path)) {
+	AppEvent ev;
+	b32 is_idle = false;
+
+	for (;;) {
+		// After a quiet spell the caches are released and the thread blocks without a timeout until the next event,
+		// so an idle notifier never wakes up.
+		if (is_idle == false && m_enricher.wait(APP_IDLE_TIME) == false) {
+			is_idle = idle();
+			if (is_idle) {
+				m_idle_since = GetTickCount64();
+				m_idle_count = m_idle_count + 1;
+			}
+
+			continue;
+		}
+
+		if (m_enricher.receive(&ev) == false) {
+			break;
+		}
+
+		// A wake without an event does not end an idle spell.
+		if (ev.path.empty()) {
+			m_firewall.add_blocked_rules();
+			continue;
+		}
+
+		m_idle_since = 0;
+		is_idle = false;
+
+		WCHAR const* path = ev.path.c_str();
+
+		// Synthetic events end here, so that a workload run measures the pipeline up to the decision.
+		if (m_workload.consume(path)) {
+			continue;
+		}
+
 		if (m_firewall.has_rule(path)) {
 			continue;
 		}
 
+		// A temporary verdict is still in effect.
+		b32 is_allowed;
+		if (m_verdicts.find(path, &is_allowed)) {
+			continue;
+		}
+
+		// The same binary was already decided on under another path.
+		if (ev.has_fingerprint && m_fingerprints.get_verdict(&ev.fingerprint, &is_allowed)) {
+			if (m_firewall.add_rule(path, is_allowed)) {
+				m_sync.record(path, is_allowed);
+			}
+
+			continue;
+		}
+
+		EnterCriticalSection(&m_prompt_lock);
+		m_prompt.assign(path);
+		LeaveCriticalSection(&m_prompt_lock);
+
 		NotifierAction action = m_notifier.show(path);
+
+		EnterCriticalSection(&m_prompt_lock);
+		m_prompt.clear();
+		LeaveCriticalSection(&m_prompt_lock);
+
+		// The prompt may have outlasted the save scheduled by its drop event.
+		m_snapshot.touch();
 		if (action == NotifierActionSkip) {
 			continue;
 		}
 
+		// Temporary verdicts stay in memory, out of the rules, the fingerprints and the sync.
+		if (action == NotifierActionAllowTemporary || action == NotifierActionBlockSession) {
+			b32 is_added = (action == NotifierActionAllowTemporary) ?
+				m_verdicts.allow(path, APP_TEMPORARY_ALLOW_TIME) : m_verdicts.block(path);
+
+			if (is_added == false) {
+				MessageBoxW(0, L"Error adding temporary verdict.", L"Error", MB_OK);
+			}
+
+			continue;
+		}
+
+		if (ev.has_fingerprint) {
+			m_fingerprints.set_verdict(&ev.fingerprint, action == NotifierActionAllow);
+		}
+
 		if (m_firewall.add_rule(path, (action == NotifierActionAllow)) == false) {
 			MessageBoxW(0, L"Error adding rule to firewall.", L"Error", MB_OK);
 		}
+
+		m_sync.record(path, action == NotifierActionAllow);
 	}
 
 	return 0;
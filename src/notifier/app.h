@@ -1,8 +1,24 @@
 #pragma once
+#include "analytics.h"
+#include "control.h"
 #include "core.h"
+#include "enricher.h"
+#include "fingerprint.h"
 #include "firewall.h"
+#include "history.h"
 #include "monitor.h"
 #include "notifier.h"
+#include "snapshot.h"
+#include "sync.h"
+#include "verdicts.h"
+#include "workload.h"
+
+// Time an application stays allowed after a temporary allow, in milliseconds.
+#define APP_TEMPORARY_ALLOW_TIME 600000
+
+// Time without drop events after which the notifier goes idle, in milliseconds. At least the age of the rule cache, so
+// that the cache released when going idle was due for a rebuild anyway.
+#define APP_IDLE_TIME 300000
 
 // Firewall notifier application.
 class App {
@@ -13,8 +29,9 @@ public:
 	// Destroys the notifier application.
 	~App();
 
-	// Runs the notifier application.
-	void run();
+	// Runs the notifier application. Decisions are synced with other machines through the given directory, unless it
+	// is null. A synthetic workload drives the pipeline instead of prompting when given one.
+	void run(WCHAR const* sync_dir, WorkloadConfig const* workload);
 
 private:
 	// Handles a Win32 message.
@@ -23,6 +40,44 @@ private:
 	// Callback for handling Win32 messages.
 	static LRESULT CALLBACK handle_msg_callback(HWND wnd, UINT msg, WPARAM wp, LPARAM lp);
 
+	// Handles a control request.
+	ControlStatus control(ControlOp op, u8 const* request, u32 request_size, ControlBuffer* response);
+
+	// Lists the applications waiting for a decision.
+	ControlStatus control_pending(ControlBuffer* response);
+
+	// Calls the visitor for every application waiting for a decision, starting with the one being prompted for.
+	void visit_pending(MonitorVisitor visitor, void* context);
+
+	// Callback for listing the applications waiting for a decision into a snapshot.
+	static void snapshot_source_callback(MonitorVisitor visitor, void* visitor_context, void* context);
+
+	// Takes a snapshot of the memory accounting.
+	ControlStatus control_memory(ControlBuffer* response);
+
+	// Lists the applications with the most drop events.
+	ControlStatus control_analytics(ControlBuffer* response);
+
+	// Takes a snapshot of the idle state.
+	ControlStatus control_idle(ControlBuffer* response);
+
+	// Applies a batch of decisions received over the control pipe.
+	ControlStatus control_decide(u8 const* request, u32 request_size, ControlBuffer* response);
+
+	// Callback for handling control requests.
+	static ControlStatus control_callback(ControlOp op, u8 const* request, u32 request_size, ControlBuffer* response,
+		void* context);
+
+	// Handles a drop event from the monitor, before deduplication.
+	void drop_event(FWPM_NET_EVENT1 const* ev);
+
+	// Callback for handling drop events from the monitor.
+	static void drop_event_callback(FWPM_NET_EVENT1 const* ev, void* context);
+
+	// Releases the caches that are rebuilt on the next drop event, once no event came in for a while. Must be called
+	// from the notification thread. Returns true if everything was released.
+	b32 idle();
+
 	// Notification thread routine.
 	DWORD notifier_thread();
 
@@ -30,8 +85,22 @@ private:
 	static DWORD WINAPI notifier_thread_callback(LPVOID context);
 
 	Firewall m_firewall;
+	DecisionSync m_sync;
+	Fingerprints m_fingerprints;
+	Verdicts m_verdicts;
+	History m_history;
+	Analytics m_analytics;
 	Monitor m_monitor;
+	Enricher m_enricher;
 	Notifier m_notifier;
+	ControlServer m_control;
+	Workload m_workload;
+	Snapshot m_snapshot;
+	CRITICAL_SECTION m_prompt_lock;
+	Path m_prompt;
 	HMENU m_tray_menu = nullptr;
+	volatile u64 m_idle_since = 0;
+	volatile u64 m_idle_count = 0;
 	b32 m_is_open = false;
+	b32 m_is_synthetic = false;
 };
@@ -0,0 +1,78 @@
+#include "arena.h"
+#include <assert.h>
+#include <string.h>
+#include <wchar.h>
+
+// Minimum size of an arena block, in bytes.
+static const size_t BLOCK_SIZE = 64 * 1024;
+
+// Alignment of every arena allocation, in bytes.
+static const size_t ALLOC_ALIGN = 16;
+
+// Offset of the first allocation in a block.
+static const size_t BLOCK_HEADER = (sizeof(void*) * 3 + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+
+Arena::Arena(MemoryTag tag) : m_tag(tag) {
+}
+
+Arena::~Arena() {
+	reset();
+}
+
+void* Arena::alloc(size_t size) {
+	size = (size + ALLOC_ALIGN - 1) & ~(ALLOC_ALIGN - 1);
+
+	ArenaBlock* block = m_head;
+	if (block == nullptr || block->size - block->used < size) {
+		size_t block_size = MAX(BLOCK_SIZE, BLOCK_HEADER + size);
+
+		block = (ArenaBlock*)mem_alloc(m_tag, block_size);
+		if (block == nullptr) {
+			return nullptr;
+		}
+
+		block->next = m_head;
+		block->size = block_size;
+		block->used = BLOCK_HEADER;
+
+		m_head = block;
+		m_reserved += block_size;
+	}
+
+	void* result = (u8*)block + block->used;
+	block->used += size;
+
+	memset(result, 0, size);
+
+	return result;
+}
+
+WCHAR* Arena::wcsdup(WCHAR const* src) {
+	assert(src);
+
+	size_t size = (wcslen(src) + 1) * sizeof(*src);
+
+	WCHAR* dst = (WCHAR*)alloc(size);
+	if (dst) {
+		memcpy(dst, src, size);
+	}
+
+	return dst;
+}
+
+void Arena::reset() {
+	ArenaBlock* block = m_head;
+	while (block) {
+		ArenaBlock* next = block->next;
+		mem_free(block);
+		block = next;
+	}
+
+	m_head = nullptr;
+	m_reserved = 0;
+}
+
+void Arena::set_tag(MemoryTag tag) {
+	assert(m_head == nullptr);
+	m_tag = tag;
+}
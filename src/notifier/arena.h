@@ -0,0 +1,46 @@
+#pragma once
+#include "core.h"
+#include "mem.h"
+#include <Windows.h>
+
+// Monotonic allocator. Individual allocations are never freed; everything is released at once by reset.
+class Arena {
+public:
+	// Creates an empty arena whose memory is accounted to the given tag.
+	Arena(MemoryTag tag = MemoryTagOther);
+
+	// Destroys the arena, releasing all allocations.
+	~Arena();
+
+	Arena(Arena const&) = delete;
+	Arena& operator=(Arena const&) = delete;
+
+	// Allocates zeroed memory of the given size. Returns null on failure.
+	void* alloc(size_t size);
+
+	// Copies the null terminated string into the arena. Returns null on failure.
+	WCHAR* wcsdup(WCHAR const* src);
+
+	// Releases all allocations made from the arena.
+	void reset();
+
+	// Changes the tag that the memory of the arena is accounted to. Must be called while the arena is empty.
+	void set_tag(MemoryTag tag);
+
+	// Returns the number of bytes the arena holds from the system.
+	size_t reserved() const {
+		return m_reserved;
+	}
+
+private:
+	// A block of memory owned by the arena.
+	struct ArenaBlock {
+		ArenaBlock* next;
+		size_t size;
+		size_t used;
+	};
+
+	ArenaBlock* m_head = nullptr;
+	size_t m_reserved = 0;
+	MemoryTag m_tag;
+};
@@ -0,0 +1,797 @@
+#include "blocklist.h"
+#include "mem.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Blocklist image identifier, "FNBL".
+static const u32 BLOCKLIST_MAGIC = 0x4c424e46;
+
+// Blocklist image format version.
+static const u32 BLOCKLIST_VERSION = 2;
+
+// Number of address bits resolved by the direct table.
+static const u32 DIRECT_BITS = 18;
+
+// Number of entries in the direct table of each address family.
+static const u32 DIRECT_SIZE = 1 << DIRECT_BITS;
+
+// Number of address bits consumed by every node.
+static const u32 STRIDE = 6;
+
+// Number of slots of every node.
+static const u32 NODE_SLOTS = 1 << STRIDE;
+
+// Flag of a direct table entry that holds a leaf value in its lowest bit instead of the index of a node.
+static const u32 DIRECT_LEAF = 0x80000000;
+
+// Initial capacity of the node array of a build.
+static const u32 MIN_NODES = 1024;
+
+// Largest blocklist image that is loaded, in bytes.
+static const u64 MAX_IMAGE_SIZE = 0x40000000;
+
+// Header of a blocklist image. All offsets are in bytes from the start of the image.
+struct BlocklistHeader {
+	u32 magic;
+	u32 version;
+	u32 v4_node_count;
+	u32 v6_node_count;
+	u64 v4_range_count;
+	u64 v6_range_count;
+	u64 v4_direct_offset;
+	u64 v6_direct_offset;
+	u64 v4_node_offset;
+	u64 v6_node_offset;
+	u64 v4_range_offset;
+	u64 v6_range_offset;
+};
+
+// A node of the trie. Slots with their bit set in the vector continue in the children, which are stored together from
+// the base index. Every other slot is a leaf, and slots with their bit set in the leaf vector start a new run of
+// leaves. The first run has the given value and the value flips with every run.
+struct BlocklistNode {
+	u64 vector;
+	u64 leafvec;
+	u32 base;
+	u32 first;
+};
+
+// Kinds of a slot during a build.
+enum SlotKind {
+	SlotClear,
+	SlotBlocked,
+	SlotMixed
+};
+
+// A trie under construction.
+struct BlocklistBuild {
+	BlocklistRange const* ranges;
+	size_t range_count;
+	BlocklistNode* nodes;
+	u32 node_count;
+	u32 node_capacity;
+	b32 is_failed;
+};
+
+// Returns the number of bits set in the value.
+static u32 popcount(u64 value) {
+	value = value - ((value >> 1) & 0x5555555555555555);
+	value = (value & 0x3333333333333333) + ((value >> 2) & 0x3333333333333333);
+	value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0f;
+
+	return (u32)((value * 0x0101010101010101) >> 56);
+}
+
+// Returns true if address a comes before address b.
+static b32 is_less(BlocklistAddress a, BlocklistAddress b) {
+	return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+// Returns the address with its lowest bits set.
+static BlocklistAddress set_low_bits(BlocklistAddress address, u32 bits) {
+	assert(bits <= 128);
+
+	if (bits >= 64) {
+		address.lo = ~(u64)0;
+		address.hi |= (bits == 128) ? ~(u64)0 : (((u64)1 << (bits - 64)) - 1);
+	} else if (bits) {
+		address.lo |= ((u64)1 << bits) - 1;
+	}
+
+	return address;
+}
+
+// Returns the address with its lowest bits cleared.
+static BlocklistAddress clear_low_bits(BlocklistAddress address, u32 bits) {
+	BlocklistAddress mask = set_low_bits({}, bits);
+	address.hi &= ~mask.hi;
+	address.lo &= ~mask.lo;
+
+	return address;
+}
+
+// Returns the address with the value added at the given bit position. The bits the value lands on must be clear.
+static BlocklistAddress or_shifted(BlocklistAddress address, u64 value, u32 bits) {
+	assert(bits < 128);
+
+	if (bits >= 64) {
+		address.hi |= value << (bits - 64);
+	} else {
+		address.lo |= value << bits;
+		address.hi |= bits ? value >> (64 - bits) : 0;
+	}
+
+	return address;
+}
+
+// Returns the stride bits of the address that start at the given offset from its top, padded with zeros past its end.
+static u32 extract(BlocklistAddress address, u32 offset) {
+	u64 top;
+	if (offset >= 64) {
+		top = address.lo << (offset - 64);
+	} else {
+		top = (address.hi << offset) | (offset ? address.lo >> (64 - offset) : 0);
+	}
+
+	return (u32)(top >> (64 - STRIDE));
+}
+
+// Returns the value of a hexadecimal digit, or -1 if the character is not one.
+static int hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+// Parses a dotted IPv4 address. Returns true on success.
+static b32 parse_v4(char const* src, char const* end, BlocklistAddress* dst) {
+	u64 address = 0;
+
+	for (u32 part = 0; part < 4; ++part) {
+		if (part && (src == end || *src++ != '.')) {
+			return false;
+		}
+
+		u32 value = 0;
+		u32 digits = 0;
+		while (src < end && *src >= '0' && *src <= '9' && digits < 4) {
+			value = value * 10 + (u32)(*src++ - '0');
+			digits += 1;
+		}
+
+		if (digits == 0 || value > 255) {
+			return false;
+		}
+
+		address = (address << 8) | value;
+	}
+
+	dst->hi = address << 32;
+	dst->lo = 0;
+
+	return src == end;
+}
+
+// Parses a colon separated IPv6 address, with at most one "::". Returns true on success.
+static b32 parse_v6(char const* src, char const* end, BlocklistAddress* dst) {
+	u32 groups[8];
+	u32 count = 0;
+	i64 gap = -1;
+
+	if (end - src >= 2 && src[0] == ':' && src[1] == ':') {
+		gap = 0;
+		src += 2;
+	}
+
+	while (src < end) {
+		u32 value = 0;
+		u32 digits = 0;
+		while (src < end && hex_value(*src) >= 0 && digits < 5) {
+			value = (value << 4) | (u32)hex_value(*src++);
+			digits += 1;
+		}
+
+		if (digits == 0 || digits > 4 || count == COUNT(groups)) {
+			return false;
+		}
+
+		groups[count++] = value;
+
+		if (src < end) {
+			if (*src++ != ':' || src == end) {
+				return false;
+			}
+
+			if (*src == ':') {
+				if (gap >= 0) {
+					return false;
+				}
+
+				gap = count;
+				src += 1;
+			}
+		}
+	}
+
+	if ((gap < 0 && count != 8) || (gap >= 0 && count > 7)) {
+		return false;
+	}
+
+	u32 expanded[8] = {};
+	u32 head = (gap < 0) ? count : (u32)gap;
+
+	for (u32 i = 0; i < count; ++i) {
+		expanded[(i < head) ? i : 8 - count + i] = groups[i];
+	}
+
+	dst->hi = ((u64)expanded[0] << 48) | ((u64)expanded[1] << 32) | ((u64)expanded[2] << 16) | expanded[3];
+	dst->lo = ((u64)expanded[4] << 48) | ((u64)expanded[5] << 32) | ((u64)expanded[6] << 16) | expanded[7];
+
+	return true;
+}
+
+// Orders ranges by their first address.
+static int compare_ranges(void const* a, void const* b) {
+	BlocklistRange const* ra = (BlocklistRange const*)a;
+	BlocklistRange const* rb = (BlocklistRange const*)b;
+
+	if (is_less(ra->first, rb->first)) {
+		return -1;
+	}
+
+	return is_less(rb->first, ra->first) ? 1 : 0;
+}
+
+// Classifies the slot of addresses from first to last against the ranges, starting at the cursor. The cursor is moved
+// past the ranges that end before the slot.
+static SlotKind classify(BlocklistBuild const* build, size_t* cursor, BlocklistAddress first, BlocklistAddress last) {
+	BlocklistRange const* ranges = build->ranges;
+
+	while (*cursor < build->range_count && is_less(ranges[*cursor].last, first)) {
+		*cursor += 1;
+	}
+
+	if (*cursor == build->range_count || is_less(last, ranges[*cursor].first)) {
+		return SlotClear;
+	}
+
+	if (is_less(first, ranges[*cursor].first) == false && is_less(ranges[*cursor].last, last) == false) {
+		return SlotBlocked;
+	}
+
+	return SlotMixed;
+}
+
+// Reserves room for the given number of nodes. Returns the index of the first one.
+static u32 alloc_nodes(BlocklistBuild* build, u32 count) {
+	if (build->node_count + (u64)count > build->node_capacity) {
+		u64 capacity = MAX(build->node_capacity, MIN_NODES);
+		while (capacity < build->node_count + (u64)count) {
+			capacity *= 2;
+		}
+
+		void* nodes = nullptr;
+		if (capacity < DIRECT_LEAF) {
+			nodes = mem_realloc(MemoryTagPolicy, build->nodes, (size_t)capacity * sizeof(*build->nodes));
+		}
+
+		if (nodes == nullptr) {
+			build->is_failed = true;
+			return 0;
+		}
+
+		build->nodes = (BlocklistNode*)nodes;
+		build->node_capacity = (u32)capacity;
+	}
+
+	u32 index = build->node_count;
+	build->node_count += count;
+
+	return index;
+}
+
+// Fills in the node covering the addresses from start that share its first depth bits, and builds its children.
+static void build_node(BlocklistBuild* build, u32 index, BlocklistAddress start, u32 depth, size_t cursor) {
+	assert(depth < 128);
+
+	// Past the end of the address, the padding bits of a slot all lead to the same addresses.
+	u32 bits = MIN(128 - depth, STRIDE);
+	u32 slot_bits = 128 - depth - bits;
+
+	u8 kinds[NODE_SLOTS];
+	size_t cursors[NODE_SLOTS];
+	BlocklistNode node = {};
+	u32 previous = SlotMixed;
+
+	for (u32 i = 0; i < NODE_SLOTS; ++i) {
+		BlocklistAddress first = or_shifted(start, i >> (STRIDE - bits), slot_bits);
+
+		cursors[i] = cursor;
+		kinds[i] = (u8)classify(build, &cursor, first, set_low_bits(first, slot_bits));
+
+		if (kinds[i] == SlotMixed) {
+			node.vector |= (u64)1 << i;
+		} else if (kinds[i] != previous) {
+			node.first = (previous == SlotMixed) ? kinds[i] : node.first;
+			node.leafvec |= (u64)1 << i;
+			previous = kinds[i];
+		}
+	}
+
+	node.base = alloc_nodes(build, popcount(node.vector));
+	if (build->is_failed) {
+		return;
+	}
+
+	build->nodes[index] = node;
+
+	u32 child = node.base;
+	for (u32 i = 0; i < NODE_SLOTS && build->is_failed == false; ++i) {
+		if (kinds[i] == SlotMixed) {
+			BlocklistAddress first = or_shifted(start, i >> (STRIDE - bits), slot_bits);
+			build_node(build, child++, first, depth + STRIDE, cursors[i]);
+		}
+	}
+}
+
+// Builds the direct table and the nodes of a single address family. Returns true on success.
+static b32 build_family(BlocklistBuild* build, u32* direct) {
+	size_t cursor = 0;
+	u32 slot_bits = 128 - DIRECT_BITS;
+
+	for (u32 i = 0; i < DIRECT_SIZE && build->is_failed == false; ++i) {
+		BlocklistAddress first = or_shifted({}, i, slot_bits);
+
+		size_t node_cursor = cursor;
+		SlotKind kind = classify(build, &cursor, first, set_low_bits(first, slot_bits));
+
+		if (kind == SlotMixed) {
+			direct[i] = alloc_nodes(build, 1);
+			if (build->is_failed == false) {
+				build_node(build, direct[i], first, DIRECT_BITS, node_cursor);
+			}
+		} else {
+			direct[i] = DIRECT_LEAF | (u32)kind;
+		}
+	}
+
+	return build->is_failed == false;
+}
+
+// Returns true if the direct table and nodes of an address family are well formed.
+static b32 is_valid_family(u32 const* direct, BlocklistNode const* nodes, u32 node_count) {
+	for (u32 i = 0; i < DIRECT_SIZE; ++i) {
+		if ((direct[i] & DIRECT_LEAF) == 0 && direct[i] >= node_count) {
+			return false;
+		}
+	}
+
+	for (u32 i = 0; i < node_count; ++i) {
+		BlocklistNode const* node = nodes + i;
+		u64 leaves = ~node->vector;
+
+		if ((u64)node->base + popcount(node->vector) > node_count || (node->leafvec & node->vector) || node->first > 1 ||
+			(leaves && (node->leafvec & (leaves & (~leaves + 1))) == 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+b32 blocklist_parse(char const* text, size_t count, BlocklistRange* dst, b32* is_v6) {
+	assert(text || count == 0);
+	assert(dst);
+	assert(is_v6);
+
+	char const* end = text + count;
+	char const* slash = (char const*)memchr(text, '/', count);
+	char const* address_end = slash ? slash : end;
+
+	BlocklistAddress address;
+	*is_v6 = memchr(text, ':', (size_t)(address_end - text)) != nullptr;
+
+	if ((*is_v6 ? parse_v6(text, address_end, &address) : parse_v4(text, address_end, &address)) == false) {
+		return false;
+	}
+
+	u32 max_length = *is_v6 ? 128 : 32;
+	u32 length = max_length;
+
+	if (slash) {
+		length = 0;
+
+		char const* digit = slash + 1;
+		if (digit == end || end - digit > 3) {
+			return false;
+		}
+
+		for (; digit < end; ++digit) {
+			if (*digit < '0' || *digit > '9') {
+				return false;
+			}
+
+			length = length * 10 + (u32)(*digit - '0');
+		}
+
+		if (length > max_length) {
+			return false;
+		}
+	}
+
+	// An IPv4 range covers every padding bit below the address, so lookups can leave them clear.
+	dst->first = clear_low_bits(address, 128 - length);
+	dst->last = set_low_bits(dst->first, 128 - length);
+
+	return true;
+}
+
+size_t blocklist_merge(BlocklistRange* ranges, size_t count) {
+	assert(ranges || count == 0);
+
+	if (count == 0) {
+		return 0;
+	}
+
+	qsort(ranges, count, sizeof(*ranges), compare_ranges);
+
+	size_t merged = 0;
+	for (size_t i = 1; i < count; ++i) {
+		BlocklistRange* last = ranges + merged;
+
+		// The range continues the last one if it starts no later than one past its end.
+		BlocklistAddress next = last->last;
+		next.lo += 1;
+		next.hi += (next.lo == 0);
+
+		b32 is_end = (last->last.hi == ~(u64)0 && last->last.lo == ~(u64)0);
+
+		if (is_end || is_less(next, ranges[i].first) == false) {
+			if (is_less(last->last, ranges[i].last)) {
+				last->last = ranges[i].last;
+			}
+		} else {
+			ranges[++merged] = ranges[i];
+		}
+	}
+
+	return merged + 1;
+}
+
+size_t blocklist_build(BlocklistRange const* v4, size_t v4_count, BlocklistRange const* v6, size_t v6_count, u8** dst) {
+	assert(v4 || v4_count == 0);
+	assert(v6 || v6_count == 0);
+	assert(dst);
+
+	*dst = nullptr;
+
+	u32* direct = (u32*)mem_alloc(MemoryTagPolicy, 2 * DIRECT_SIZE * sizeof(*direct));
+	if (direct == nullptr) {
+		return 0;
+	}
+
+	BlocklistBuild builds[2] = {};
+	builds[0].ranges = v4;
+	builds[0].range_count = v4_count;
+	builds[1].ranges = v6;
+	builds[1].range_count = v6_count;
+
+	size_t size = 0;
+
+	if (build_family(builds, direct) && build_family(builds + 1, direct + DIRECT_SIZE)) {
+		BlocklistHeader header = {};
+		header.magic = BLOCKLIST_MAGIC;
+		header.version = BLOCKLIST_VERSION;
+		header.v4_node_count = builds[0].node_count;
+		header.v6_node_count = builds[1].node_count;
+		header.v4_range_count = v4_count;
+		header.v6_range_count = v6_count;
+		header.v4_direct_offset = sizeof(header);
+		header.v6_direct_offset = header.v4_direct_offset + DIRECT_SIZE * sizeof(*direct);
+		header.v4_node_offset = header.v6_direct_offset + DIRECT_SIZE * sizeof(*direct);
+		header.v6_node_offset = header.v4_node_offset + (u64)builds[0].node_count * sizeof(BlocklistNode);
+		header.v4_range_offset = header.v6_node_offset + (u64)builds[1].node_count * sizeof(BlocklistNode);
+		header.v6_range_offset = header.v4_range_offset + (u64)v4_count * sizeof(BlocklistRange);
+
+		u64 image_size = header.v6_range_offset + (u64)v6_count * sizeof(BlocklistRange);
+
+		u8* image = (image_size < 0x7fffffff) ? (u8*)mem_alloc(MemoryTagPolicy, (size_t)image_size) : nullptr;
+		if (image) {
+			memcpy(image, &header, sizeof(header));
+			memcpy(image + header.v4_direct_offset, direct, 2 * DIRECT_SIZE * sizeof(*direct));
+			memcpy(image + header.v4_node_offset, builds[0].nodes, builds[0].node_count * sizeof(BlocklistNode));
+			memcpy(image + header.v6_node_offset, builds[1].nodes, builds[1].node_count * sizeof(BlocklistNode));
+			memcpy(image + header.v4_range_offset, v4, v4_count * sizeof(BlocklistRange));
+			memcpy(image + header.v6_range_offset, v6, v6_count * sizeof(BlocklistRange));
+
+			*dst = image;
+			size = (size_t)image_size;
+		}
+	}
+
+	mem_free(builds[0].nodes);
+	mem_free(builds[1].nodes);
+	mem_free(direct);
+
+	return size;
+}
+
+b32 blocklist_is_valid(u8 const* data, u64 size) {
+	assert(data || size == 0);
+
+	if (size < sizeof(BlocklistHeader)) {
+		return false;
+	}
+
+	BlocklistHeader const* header = (BlocklistHeader const*)data;
+	if (header->magic != BLOCKLIST_MAGIC || header->version != BLOCKLIST_VERSION) {
+		return false;
+	}
+
+	u64 direct_size = DIRECT_SIZE * sizeof(u32);
+	u64 v4_node_end = header->v4_node_offset + (u64)header->v4_node_count * sizeof(BlocklistNode);
+	u64 v6_node_end = header->v6_node_offset + (u64)header->v6_node_count * sizeof(BlocklistNode);
+
+	// Range counts are checked against the size first, so that the end offsets cannot wrap around.
+	u64 range_max = size / sizeof(BlocklistRange);
+	if (header->v4_range_count > range_max || header->v6_range_count > range_max) {
+		return false;
+	}
+
+	u64 v4_range_end = header->v4_range_offset + header->v4_range_count * sizeof(BlocklistRange);
+	u64 v6_range_end = header->v6_range_offset + header->v6_range_count * sizeof(BlocklistRange);
+
+	if (header->v4_direct_offset < sizeof(*header) || header->v4_direct_offset > size - direct_size ||
+		header->v6_direct_offset < sizeof(*header) || header->v6_direct_offset > size - direct_size ||
+		header->v4_node_offset < sizeof(*header) || v4_node_end > size ||
+		header->v6_node_offset < sizeof(*header) || v6_node_end > size ||
+		header->v4_range_offset < sizeof(*header) || header->v4_range_offset > size || v4_range_end > size ||
+		header->v6_range_offset < sizeof(*header) || header->v6_range_offset > size || v6_range_end > size ||
+		(header->v4_direct_offset % sizeof(u32)) || (header->v6_direct_offset % sizeof(u32)) ||
+		(header->v4_node_offset % sizeof(u64)) || (header->v6_node_offset % sizeof(u64)) ||
+		(header->v4_range_offset % sizeof(u64)) || (header->v6_range_offset % sizeof(u64)) ||
+		header->v4_node_count >= DIRECT_LEAF || header->v6_node_count >= DIRECT_LEAF) {
+		return false;
+	}
+
+	return is_valid_family((u32 const*)(data + header->v4_direct_offset),
+		(BlocklistNode const*)(data + header->v4_node_offset), header->v4_node_count) &&
+		is_valid_family((u32 const*)(data + header->v6_direct_offset),
+		(BlocklistNode const*)(data + header->v6_node_offset), header->v6_node_count);
+}
+
+// Finds the range holding the address among the sorted ranges of the image. Returns false if there is none.
+static b32 find_range(u8 const* image, BlocklistAddress address, b32 is_v6, BlocklistRange* dst) {
+	BlocklistHeader const* header = (BlocklistHeader const*)image;
+	BlocklistRange const* ranges =
+		(BlocklistRange const*)(image + (is_v6 ? header->v6_range_offset : header->v4_range_offset));
+
+	// Finds the number of ranges that start at or before the address.
+	size_t low = 0;
+	size_t high = (size_t)(is_v6 ? header->v6_range_count : header->v4_range_count);
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (is_less(address, ranges[middle].first)) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+
+	if (low == 0 || is_less(ranges[low - 1].last, address)) {
+		return false;
+	}
+
+	*dst = ranges[low - 1];
+
+	return true;
+}
+
+b32 blocklist_find(u8 const* image, BlocklistAddress address, b32 is_v6, BlocklistRange* range) {
+	assert(image);
+
+	BlocklistHeader const* header = (BlocklistHeader const*)image;
+	u32 const* direct = (u32 const*)(image + (is_v6 ? header->v6_direct_offset : header->v4_direct_offset));
+	BlocklistNode const* nodes = (BlocklistNode const*)(image + (is_v6 ? header->v6_node_offset : header->v4_node_offset));
+
+	u32 entry = direct[address.hi >> (64 - DIRECT_BITS)];
+	if (entry & DIRECT_LEAF) {
+		return (entry & 1) && (range == nullptr || find_range(image, address, is_v6, range));
+	}
+
+	// Every level consumes a stride, so even a damaged image cannot keep the lookup going.
+	for (u32 offset = DIRECT_BITS; offset < 128; offset += STRIDE) {
+		BlocklistNode const* node = nodes + entry;
+
+		u32 slot = extract(address, offset);
+		u64 mask = ((u64)2 << slot) - 1;
+
+		if ((node->vector & ((u64)1 << slot)) == 0) {
+			b32 is_blocked = (node->first ^ (popcount(node->leafvec & mask) - 1)) & 1;
+			return is_blocked && (range == nullptr || find_range(image, address, is_v6, range));
+		}
+
+		entry = node->base + popcount(node->vector & mask) - 1;
+	}
+
+	return false;
+}
+
+Blocklist::Blocklist() {
+	InitializeSRWLock(&m_lock);
+}
+
+Blocklist::~Blocklist() {
+	fs_release(&m_image);
+}
+
+b32 Blocklist::compile(WCHAR const* src_path, WCHAR const* dst_path) {
+	assert(src_path);
+	assert(dst_path);
+
+	MappedFile src;
+	if (fs_map(src_path, &src) == false) {
+		return false;
+	}
+
+	char const* text = (char const*)src.data;
+	size_t size = (size_t)src.size;
+
+	size_t line_count = 1;
+	for (size_t i = 0; i < size; ++i) {
+		line_count += (text[i] == '\n');
+	}
+
+	BlocklistRange* v4 = (BlocklistRange*)mem_alloc(MemoryTagPolicy, line_count * sizeof(*v4));
+	BlocklistRange* v6 = (BlocklistRange*)mem_alloc(MemoryTagPolicy, line_count * sizeof(*v6));
+	size_t v4_count = 0;
+	size_t v6_count = 0;
+
+	b32 result = (v4 && v6 && src.size < 0x7fffffff);
+
+	for (size_t i = 0; i < size && result;) {
+		size_t line = i;
+		while (i < size && text[i] != '\n') {
+			++i;
+		}
+
+		size_t end = i;
+		i += (i < size);
+
+		while (line < end && (text[line] == ' ' || text[line] == '\t' || text[line] == '\r')) {
+			++line;
+		}
+
+		while (end > line && (text[end - 1] == ' ' || text[end - 1] == '\t' || text[end - 1] == '\r')) {
+			--end;
+		}
+
+		if (line == end || text[line] == '#') {
+			continue;
+		}
+
+		BlocklistRange range;
+		b32 is_v6;
+		result = blocklist_parse(text + line, end - line, &range, &is_v6);
+
+		if (result) {
+			if (is_v6) {
+				v6[v6_count++] = range;
+			} else {
+				v4[v4_count++] = range;
+			}
+		}
+	}
+
+	fs_unmap(&src);
+
+	if (result) {
+		v4_count = blocklist_merge(v4, v4_count);
+		v6_count = blocklist_merge(v6, v6_count);
+
+		u8* image = nullptr;
+		size_t image_size = blocklist_build(v4, v4_count, v6, v6_count, &image);
+
+		result = image_size && fs_write_atomic(dst_path, image, image_size);
+		mem_free(image);
+	}
+
+	mem_free(v4);
+	mem_free(v6);
+
+	return result;
+}
+
+b32 Blocklist::load(WCHAR const* path) {
+	assert(path);
+
+	if (path != m_path) {
+		if (wcslen(path) >= COUNT(m_path)) {
+			return false;
+		}
+
+		AcquireSRWLockExclusive(&m_lock);
+		wcscpy_s(m_path, COUNT(m_path), path);
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	// The image is read into memory rather than mapped, so that the file can be replaced while it is in use.
+	LoadedFile image;
+	if (fs_load(path, MemoryTagPolicy, MAX_IMAGE_SIZE, &image) == false) {
+		return false;
+	}
+
+	if (blocklist_is_valid(image.data, image.size) == false) {
+		fs_release(&image);
+		return false;
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+	LoadedFile old_image = m_image;
+	m_image = image;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	fs_release(&old_image);
+
+	return true;
+}
+
+b32 Blocklist::refresh() {
+	if (m_path[0] == 0) {
+		return false;
+	}
+
+	FILETIME write_time = fs_write_time(m_path);
+
+	AcquireSRWLockShared(&m_lock);
+	LONG cmp = CompareFileTime(&write_time, &m_image.write_time);
+	ReleaseSRWLockShared(&m_lock);
+
+	if (cmp == 0) {
+		return false;
+	}
+
+	return load(m_path);
+}
+
+b32 Blocklist::lookup_v4(u32 address, BlocklistRange* range) {
+	assert(range);
+
+	BlocklistAddress key = {};
+	key.hi = (u64)address << 32;
+
+	AcquireSRWLockShared(&m_lock);
+	b32 result = m_image.data && blocklist_find(m_image.data, key, false, range);
+	ReleaseSRWLockShared(&m_lock);
+
+	return result;
+}
+
+b32 Blocklist::lookup_v6(u8 const* address, BlocklistRange* range) {
+	assert(address);
+	assert(range);
+
+	BlocklistAddress key = {};
+	for (u32 i = 0; i < 8; ++i) {
+		key.hi = (key.hi << 8) | address[i];
+		key.lo = (key.lo << 8) | address[i + 8];
+	}
+
+	AcquireSRWLockShared(&m_lock);
+	b32 result = m_image.data && blocklist_find(m_image.data, key, true, range);
+	ReleaseSRWLockShared(&m_lock);
+
+	return result;
+}
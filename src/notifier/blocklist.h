@@ -0,0 +1,79 @@
+#pragma once
+#include "core.h"
+#include "fs.h"
+#include <Windows.h>
+
+// A 128-bit address. IPv4 addresses are kept in the top 32 bits.
+struct BlocklistAddress {
+	u64 hi;
+	u64 lo;
+};
+
+// A range of blocked addresses, both ends included.
+struct BlocklistRange {
+	BlocklistAddress first;
+	BlocklistAddress last;
+};
+
+// Parses an IPv4 or IPv6 prefix from the first count characters of the text into the range of addresses it covers.
+// Returns true on success.
+b32 blocklist_parse(char const* text, size_t count, BlocklistRange* dst, b32* is_v6);
+
+// Sorts the ranges and merges overlapping and adjacent ones in place. Returns the number of ranges left.
+size_t blocklist_merge(BlocklistRange* ranges, size_t count);
+
+// Builds a blocklist image from the merged ranges of each address family. Returns the size of the image, or zero on
+// failure. The image must be freed with mem_free.
+size_t blocklist_build(BlocklistRange const* v4, size_t v4_count, BlocklistRange const* v6, size_t v6_count, u8** dst);
+
+// Returns true if the data is a well formed blocklist image.
+b32 blocklist_is_valid(u8 const* data, u64 size);
+
+// Returns true if the well formed blocklist image blocks the address. Unless null, the range stores the merged range
+// of blocked addresses that holds it.
+b32 blocklist_find(u8 const* image, BlocklistAddress address, b32 is_v6, BlocklistRange* range);
+
+// Precompiled binary remote address blocklist. The image is read into memory and queried in place.
+//
+// The text form of a blocklist has one IPv4 or IPv6 prefix per line, such as "192.0.2.0/24" or "2001:db8::/32". A
+// prefix without a length covers a single address. Blank lines and lines starting with '#' are ignored.
+//
+// The prefixes of each address family are merged into disjoint ranges and compiled into a compressed multibit trie in
+// the style of poptrie: a direct table indexed by the first 18 bits of the address, followed by nodes that consume 6
+// bits each. A node holds a bitmap of the slots that continue in a child node and a bitmap of the slots that start a
+// run of equal leaves, and finds both by counting bits. A blocklist has only two leaf values and neighbouring runs
+// always differ, so a node only stores the value of its first run. The merged ranges follow the trie, so that a blocked
+// address can be traced back to its range.
+class Blocklist {
+public:
+	// Creates an empty blocklist.
+	Blocklist();
+
+	// Destroys the blocklist, freeing the current image.
+	~Blocklist();
+
+	Blocklist(Blocklist const&) = delete;
+	Blocklist& operator=(Blocklist const&) = delete;
+
+	// Compiles the text blocklist at the source path into a binary image at the destination path. Returns true on
+	// success.
+	static b32 compile(WCHAR const* src_path, WCHAR const* dst_path);
+
+	// Reads the binary image at the given path and atomically replaces the current image. The path is remembered for
+	// later refreshes even if the image could not be read. Returns true on success.
+	b32 load(WCHAR const* path);
+
+	// Reloads the image if the file it was loaded from has changed. Returns true if a new image was loaded.
+	b32 refresh();
+
+	// Returns true if the IPv4 address, in host byte order, is blocked, storing the blocked range that holds it.
+	b32 lookup_v4(u32 address, BlocklistRange* range);
+
+	// Returns true if the IPv6 address, in network byte order, is blocked, storing the blocked range that holds it.
+	b32 lookup_v6(u8 const* address, BlocklistRange* range);
+
+private:
+	SRWLOCK m_lock;
+	LoadedFile m_image = {};
+	WCHAR m_path[MAX_PATH + 1] = {};
+};
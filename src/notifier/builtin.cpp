@@ -0,0 +1,103 @@
+#include "builtin.h"
+#include "builtin_table.h"
+#include <assert.h>
+#include <wchar.h>
+
+// Number of slots in the built-in table.
+#define BUILTIN_SLOTS (1u << BUILTIN_BITS)
+
+// Number of buckets in the built-in table.
+#define BUILTIN_BUCKETS (1u << BUILTIN_BUCKET_BITS)
+
+static_assert(BUILTIN_SLOTS <= BUILTIN_MAX_SLOTS, "The built-in table has too many slots.");
+
+// Returns true if every entry from the given slot on sits in the slot its path hashes to.
+static constexpr b32 builtin_verify(u32 slot) {
+	return slot == BUILTIN_SLOTS || ((BUILTIN_TABLE[slot].path == nullptr ||
+		(builtin_hash(BUILTIN_TABLE[slot].path, BUILTIN_SEED) == BUILTIN_TABLE[slot].hash &&
+		builtin_slot(BUILTIN_TABLE[slot].hash, BUILTIN_DISPLACEMENTS[BUILTIN_TABLE[slot].hash & (BUILTIN_BUCKETS - 1)],
+		BUILTIN_BITS) == slot)) && builtin_verify(slot + 1));
+}
+
+static_assert(builtin_verify(0), "The built-in table does not match builtin_hash; run builtin.ps1 again.");
+
+BuiltinVerdict builtin_lookup(WCHAR const* path, u32* slot) {
+	assert(path);
+	assert(slot);
+
+	u32 hash = BUILTIN_SEED;
+	for (WCHAR const* c = path; *c; ++c) {
+		hash = (hash ^ (u32)builtin_fold(*c)) * 16777619u;
+	}
+
+	u32 index = builtin_slot(hash, BUILTIN_DISPLACEMENTS[hash & (BUILTIN_BUCKETS - 1)], BUILTIN_BITS);
+	BuiltinEntry const* entry = BUILTIN_TABLE + index;
+
+	if (entry->hash != hash || entry->path == nullptr) {
+		return BuiltinVerdictNone;
+	}
+
+	WCHAR const* a = path;
+	WCHAR const* b = entry->path;
+	while (*b && builtin_fold(*a) == *b) {
+		++a;
+		++b;
+	}
+
+	if (*a || *b) {
+		return BuiltinVerdictNone;
+	}
+
+	*slot = index;
+
+	return (BuiltinVerdict)entry->verdict;
+}
+
+WCHAR const* builtin_path(u32 slot) {
+	return (slot < BUILTIN_SLOTS) ? BUILTIN_TABLE[slot].path : nullptr;
+}
+
+b32 builtin_root(WCHAR* drive, size_t drive_count, WCHAR* device, size_t device_count) {
+	assert(drive);
+	assert(device);
+
+	WCHAR windows[MAX_PATH + 1];
+	UINT count = GetSystemWindowsDirectoryW(windows, COUNT(windows));
+	if (count < 2 || count >= COUNT(windows) || windows[1] != L':' || drive_count < 4) {
+		return false;
+	}
+
+	WCHAR name[3] = { (WCHAR)towlower(windows[0]), L':', L'\0' };
+
+	DWORD size = QueryDosDeviceW(name, device, (DWORD)device_count);
+	size_t length = size ? wcslen(device) : 0;
+	if (length == 0 || length + 2 > device_count) {
+		return false;
+	}
+
+	_wcslwr(device);
+	device[length] = L'\\';
+	device[length + 1] = L'\0';
+
+	drive[0] = name[0];
+	drive[1] = L':';
+	drive[2] = L'\\';
+	drive[3] = L'\0';
+
+	return true;
+}
+
+b32 BuiltinRules::has(u32 slot) const {
+	assert(slot < BUILTIN_MAX_SLOTS);
+	return (m_slots[slot / 32] & (LONG)(1u << (slot % 32))) != 0;
+}
+
+void BuiltinRules::add(u32 slot) {
+	assert(slot < BUILTIN_MAX_SLOTS);
+	InterlockedBitTestAndSet(&m_slots[slot / 32], (LONG)(slot % 32));
+}
+
+void BuiltinRules::remove(u32 slot) {
+	assert(slot < BUILTIN_MAX_SLOTS);
+	InterlockedBitTestAndReset(&m_slots[slot / 32], (LONG)(slot % 32));
+}
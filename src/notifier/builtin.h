@@ -0,0 +1,67 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Largest number of slots in the built-in table.
+#define BUILTIN_MAX_SLOTS 4096
+
+// Verdicts of the built-in table.
+enum BuiltinVerdict {
+	BuiltinVerdictNone,
+	BuiltinVerdictBlock,
+	BuiltinVerdictAllow
+};
+
+// An entry of the built-in table. Paths are relative to the root of the system volume and in lowercase.
+struct BuiltinEntry {
+	WCHAR const* path;
+	u32 hash;
+	u32 verdict;
+};
+
+// Folds an ASCII letter to lowercase. Built-in paths are ASCII, so no other character can match them.
+constexpr WCHAR builtin_fold(WCHAR c) {
+	return (c >= L'A' && c <= L'Z') ? (WCHAR)(c + (L'a' - L'A')) : c;
+}
+
+// FNV-1a hash of the folded characters of the path, continuing from the given hash. Recursive, so that the generated
+// table can be checked against it at compile time.
+constexpr u32 builtin_hash(WCHAR const* path, u32 hash) {
+	return *path ? builtin_hash(path + 1, (hash ^ (u32)builtin_fold(*path)) * 16777619u) : hash;
+}
+
+// Returns the slot of a path hash moved by the displacement of its bucket, in a table of 2^bits slots.
+constexpr u32 builtin_slot(u32 hash, u32 displacement, u32 bits) {
+	return (u32)((hash ^ displacement) * 2654435761u) >> (32 - bits);
+}
+
+// Looks up the path in the built-in table of system binaries, which is generated into builtin_table.h by builtin.ps1
+// from builtin.txt and an optional builtin.override.txt. The path is relative to the root of the system volume, such
+// as windows\system32\svchost.exe, and compared case insensitively. The table is a perfect hash, so a lookup takes a
+// single probe and never allocates. Stores the slot of the entry, below BUILTIN_MAX_SLOTS, on a hit. Returns the
+// verdict of the entry, or BuiltinVerdictNone if the path is not built in.
+BuiltinVerdict builtin_lookup(WCHAR const* path, u32* slot);
+
+// Returns the path of the entry in the given slot of the built-in table, or nullptr if the slot is empty.
+WCHAR const* builtin_path(u32 slot);
+
+// Retrieves the root of the system volume in lowercase, both as a drive such as c:\ and as a device path such as
+// \device\harddiskvolume3\, for turning paths into the relative form of the built-in table. Returns true on success.
+b32 builtin_root(WCHAR* drive, size_t drive_count, WCHAR* device, size_t device_count);
+
+// Set of built-in table slots whose application has a firewall rule. Updated by the firewall as it adds and finds
+// rules, and read by the monitor without locks.
+class BuiltinRules {
+public:
+	// Returns true if the application in the given slot has a rule.
+	b32 has(u32 slot) const;
+
+	// Records that the application in the given slot has a rule.
+	void add(u32 slot);
+
+	// Records that the application in the given slot no longer has a rule.
+	void remove(u32 slot);
+
+private:
+	volatile LONG m_slots[BUILTIN_MAX_SLOTS / 32] = {};
+};
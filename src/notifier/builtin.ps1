@@ -0,0 +1,225 @@
+# Generates builtin_table.h, the perfect hash table of built-in system binaries, from builtin.txt and an optional
+# builtin.override.txt next to it. Runs before every build and only rewrites the table when its contents change, so
+# that an unchanged table does not rebuild anything. The hash and slot functions must match builtin.h, which checks
+# the generated table at compile time.
+
+$ErrorActionPreference = 'Stop'
+
+$directory = Split-Path -Parent $MyInvocation.MyCommand.Path
+$output = Join-Path $directory 'builtin_table.h'
+
+# Mask of the low 32 bits. PowerShell 5.1 reads hex literals as Int32, so the constants below are decimal.
+$mask = [uint64]4294967295
+
+# FNV-1a offset basis and prime, and the multiplier of the slot function.
+$basis = [uint64]2166136261
+$prime = [uint64]16777619
+$multiplier = [uint64]2654435761
+
+# Largest displacement of a bucket, so that it fits in a u16.
+$displacement_max = 65535
+
+# Largest number of slots, as BUILTIN_MAX_SLOTS in builtin.h.
+$slots_max = 4096
+
+# Reads the entries of an input file into the map, later entries taking precedence.
+function Read-Entries($path, $entries, $can_remove) {
+	$number = 0
+	foreach ($line in [System.IO.File]::ReadAllLines($path)) {
+		$number += 1
+		$line = $line.Trim()
+		if ($line.Length -eq 0 -or $line.StartsWith('#')) {
+			continue
+		}
+
+		$parts = $line -split '\s+', 2
+		if ($parts.Count -ne 2) {
+			throw "${path}(${number}): expected an operation and a path."
+		}
+
+		$name = $parts[1].Trim().Replace('/', '\').TrimStart('\').ToLowerInvariant()
+		foreach ($c in $name.ToCharArray()) {
+			if ([int]$c -gt 127) {
+				throw "${path}(${number}): paths must be ASCII."
+			}
+		}
+
+		switch ($parts[0].ToLowerInvariant()) {
+			'allow' { $entries[$name] = 'BuiltinVerdictAllow' }
+			'block' { $entries[$name] = 'BuiltinVerdictBlock' }
+			'remove' {
+				if ($can_remove -eq $false) {
+					throw "${path}(${number}): remove is only allowed in builtin.override.txt."
+				}
+				$entries.Remove($name)
+			}
+			default { throw "${path}(${number}): unknown operation $($parts[0])." }
+		}
+	}
+}
+
+# Returns the FNV-1a hash of the path, which is already in lowercase.
+function Get-Hash($name, $seed) {
+	$hash = [uint64]$seed
+	foreach ($c in $name.ToCharArray()) {
+		$hash = (($hash -bxor [uint64][int]$c) * $prime) -band $mask
+	}
+	return $hash
+}
+
+# Returns the slot of a hash moved by a displacement, in a table of 2^bits slots.
+function Get-Slot($hash, $displacement, $bits) {
+	return [int](((($hash -bxor [uint64]$displacement) * $multiplier) -band $mask) -shr (32 - $bits))
+}
+
+$entries = New-Object 'System.Collections.Generic.Dictionary[string,string]' ([StringComparer]::Ordinal)
+Read-Entries (Join-Path $directory 'builtin.txt') $entries $false
+
+$override = Join-Path $directory 'builtin.override.txt'
+if (Test-Path $override) {
+	Read-Entries $override $entries $true
+}
+
+$names = [string[]]@($entries.Keys)
+[Array]::Sort($names, [StringComparer]::Ordinal)
+$count = $names.Count
+
+# Slots are at least one and a half times the entries, and buckets at least half of them.
+$bits = 1
+while ((1 -shl $bits) -lt $count + [int][math]::Floor($count / 2)) {
+	$bits += 1
+}
+
+$bucket_bits = 0
+while ((1 -shl $bucket_bits) -lt [int][math]::Ceiling($count / 2)) {
+	$bucket_bits += 1
+}
+
+$slot_count = 1 -shl $bits
+$bucket_count = 1 -shl $bucket_bits
+if ($slot_count -gt $slots_max) {
+	throw "Too many built-in entries: $count."
+}
+
+# Tries seeds until every bucket finds a displacement that puts its entries into free slots.
+$seed = $basis
+while ($true) {
+	$hashes = @{}
+	$seen = @{}
+	$collision = $false
+	foreach ($name in $names) {
+		$hash = Get-Hash $name $seed
+		if ($seen.ContainsKey($hash)) {
+			$collision = $true
+			break
+		}
+		$seen[$hash] = $true
+		$hashes[$name] = $hash
+	}
+
+	if ($collision) {
+		$seed = ($seed + 1) -band $mask
+		continue
+	}
+
+	$buckets = @()
+	for ($i = 0; $i -lt $bucket_count; ++$i) {
+		$buckets += ,(New-Object 'System.Collections.Generic.List[string]')
+	}
+	foreach ($name in $names) {
+		$buckets[[int]($hashes[$name] -band [uint64]($bucket_count - 1))].Add($name)
+	}
+
+	$order = 0..($bucket_count - 1) | Sort-Object -Property @{ Expression = { $buckets[$_].Count }; Descending = $true }, @{ Expression = { $_ } }
+
+	$displacements = New-Object 'int[]' $bucket_count
+	$table = New-Object 'string[]' $slot_count
+	$failed = $false
+
+	foreach ($bucket in $order) {
+		$members = $buckets[$bucket]
+		if ($members.Count -eq 0) {
+			break
+		}
+
+		$placed = $false
+		for ($displacement = 0; $displacement -le $displacement_max; ++$displacement) {
+			$slots = @()
+			$fits = $true
+			foreach ($name in $members) {
+				$slot = Get-Slot $hashes[$name] $displacement $bits
+				if ($null -ne $table[$slot] -or $slots -contains $slot) {
+					$fits = $false
+					break
+				}
+				$slots += $slot
+			}
+
+			if ($fits) {
+				for ($i = 0; $i -lt $members.Count; ++$i) {
+					$table[$slots[$i]] = $members[$i]
+				}
+				$displacements[$bucket] = $displacement
+				$placed = $true
+				break
+			}
+		}
+
+		if ($placed -eq $false) {
+			$failed = $true
+			break
+		}
+	}
+
+	if ($failed -eq $false) {
+		break
+	}
+
+	$seed = ($seed + 1) -band $mask
+}
+
+$lines = New-Object 'System.Collections.Generic.List[string]'
+$lines.Add('// Generated by builtin.ps1 from builtin.txt and builtin.override.txt. Do not edit.')
+$lines.Add('#pragma once')
+$lines.Add('#include "builtin.h"')
+$lines.Add('')
+$lines.Add('// Number of entries in the built-in table.')
+$lines.Add("#define BUILTIN_COUNT $count")
+$lines.Add('')
+$lines.Add('// Number of bits of a slot in the built-in table.')
+$lines.Add("#define BUILTIN_BITS $bits")
+$lines.Add('')
+$lines.Add('// Number of bits of a bucket in the built-in table.')
+$lines.Add("#define BUILTIN_BUCKET_BITS $bucket_bits")
+$lines.Add('')
+$lines.Add('// Seed of the path hash.')
+$lines.Add(('static constexpr u32 BUILTIN_SEED = 0x{0:x8}u;' -f $seed))
+$lines.Add('')
+$lines.Add('// Displacement of each bucket.')
+$lines.Add('static constexpr u16 BUILTIN_DISPLACEMENTS[1 << BUILTIN_BUCKET_BITS] = {')
+for ($i = 0; $i -lt $bucket_count; $i += 16) {
+	$row = @()
+	for ($j = $i; $j -lt [math]::Min($i + 16, $bucket_count); ++$j) {
+		$row += [string]$displacements[$j]
+	}
+	$lines.Add("`t" + ($row -join ', ') + ',')
+}
+$lines.Add('};')
+$lines.Add('')
+$lines.Add('// Entries by slot.')
+$lines.Add('static constexpr BuiltinEntry BUILTIN_TABLE[1 << BUILTIN_BITS] = {')
+foreach ($name in $table) {
+	if ($null -eq $name) {
+		$lines.Add("`t{ nullptr, 0, BuiltinVerdictNone },")
+	} else {
+		$lines.Add(("`t{{ L""{0}"", 0x{1:x8}u, {2} }}," -f $name.Replace('\', '\\'), $hashes[$name], $entries[$name]))
+	}
+}
+$lines.Add('};')
+
+$text = ($lines -join "`r`n") + "`r`n"
+if ((Test-Path $output) -and [System.IO.File]::ReadAllText($output) -eq $text) {
+	exit 0
+}
+
+[System.IO.File]::WriteAllText($output, $text, (New-Object System.Text.UTF8Encoding $false))
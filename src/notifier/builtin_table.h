@@ -0,0 +1,89 @@
+// Generated by builtin.ps1 from builtin.txt and builtin.override.txt. Do not edit.
+#pragma once
+#include "builtin.h"
+
+// Number of entries in the built-in table.
+#define BUILTIN_COUNT 33
+
+// Number of bits of a slot in the built-in table.
+#define BUILTIN_BITS 6
+
+// Number of bits of a bucket in the built-in table.
+#define BUILTIN_BUCKET_BITS 5
+
+// Seed of the path hash.
+static constexpr u32 BUILTIN_SEED = 0x811c9dc5u;
+
+// Displacement of each bucket.
+static constexpr u16 BUILTIN_DISPLACEMENTS[1 << BUILTIN_BUCKET_BITS] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 2, 0, 0,
+	0, 0, 1, 0, 0, 0, 0, 2, 0, 1, 0, 2, 1, 0, 0, 0,
+};
+
+// Entries by slot.
+static constexpr BuiltinEntry BUILTIN_TABLE[1 << BUILTIN_BITS] = {
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"program files\\windows defender\\msmpeng.exe", 0x38d3e761u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\sppsvc.exe", 0xaade2f19u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\backgroundtaskhost.exe", 0x30490ef3u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\lsass.exe", 0x482bc42eu, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"program files\\windows defender\\nissrv.exe", 0x412977f1u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\wuauclt.exe", 0xdda72103u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\smartscreen.exe", 0xb46a3c21u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\spoolsv.exe", 0x55c52ec2u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\taskhostex.exe", 0x12f29fc6u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\taskhostw.exe", 0xb355e038u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\searchprotocolhost.exe", 0xc2cc2f66u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\lsaiso.exe", 0x79e2f855u, BuiltinVerdictAllow },
+	{ L"program files\\windows defender advanced threat protection\\mssense.exe", 0xd4c1b571u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\taskhost.exe", 0xd5d9b9fbu, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\tiworker.exe", 0x2b47a031u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\diagtrack.exe", 0x85a529deu, BuiltinVerdictBlock },
+	{ L"windows\\system32\\inventory.exe", 0x9f81a55cu, BuiltinVerdictBlock },
+	{ L"windows\\system32\\usoclient.exe", 0xe8b547aau, BuiltinVerdictAllow },
+	{ L"windows\\system32\\runtimebroker.exe", 0xab3a8a4du, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\svchost.exe", 0xd74518e4u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\aitagent.exe", 0x1178b7afu, BuiltinVerdictBlock },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"program files\\windows defender\\mpcopyaccelerator.exe", 0x05a0e751u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\sihost.exe", 0x3478b3c2u, BuiltinVerdictAllow },
+	{ L"windows\\servicing\\trustedinstaller.exe", 0xa798fbddu, BuiltinVerdictAllow },
+	{ L"windows\\system32\\searchindexer.exe", 0xe1c919f3u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\dashost.exe", 0xae916a32u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\services.exe", 0xae65bd94u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\mousocoreworker.exe", 0xd9e4e294u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\wlanext.exe", 0xef02e4e3u, BuiltinVerdictAllow },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ nullptr, 0, BuiltinVerdictNone },
+	{ L"windows\\system32\\compattelrunner.exe", 0xb493b22du, BuiltinVerdictBlock },
+	{ L"program files\\windows defender advanced threat protection\\sensecncproxy.exe", 0xecd11257u, BuiltinVerdictAllow },
+	{ L"windows\\system32\\devicecensus.exe", 0x5cfd7139u, BuiltinVerdictBlock },
+	{ L"windows\\system32\\wsqmcons.exe", 0xae759f91u, BuiltinVerdictBlock },
+};
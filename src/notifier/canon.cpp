@@ -0,0 +1,394 @@
+#include "canon.h"
+#include "mem.h"
+#include "trace.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+// Number of memoized expansions of each kind. Must be a power of two.
+static const u32 MEMO_SIZE = 256;
+
+// Length of a \\?\Volume{GUID} prefix, in characters.
+static const size_t VOLUME_PREFIX_SIZE = 48;
+
+// A memoized expansion. The key and the value share a single allocation.
+struct CanonMemo {
+	size_t hash;
+	WCHAR* key;
+	WCHAR const* value;
+	size_t key_count;
+};
+
+// Memoized environment variable expansions, keyed by %NAME%.
+static CanonMemo g_variables[MEMO_SIZE];
+
+// Memoized volume drive roots, keyed by \\?\Volume{GUID}.
+static CanonMemo g_volumes[MEMO_SIZE];
+
+// Memoized long paths, keyed by reduced paths containing short names.
+static CanonMemo g_long_names[MEMO_SIZE];
+
+// Guards the memoized expansions.
+static SRWLOCK g_memo_lock = SRWLOCK_INIT;
+
+// Returns true if the character is a path separator.
+static b32 is_separator(WCHAR c) {
+	return c == L'\\' || c == L'/';
+}
+
+// Returns the case insensitive hash of the first count characters of the string.
+static size_t memo_hash(WCHAR const* src, size_t count) {
+	/* FNV1-a: http://www.isthe.com/chongo/tech/comp/fnv/ */
+	size_t hash = 14695981039346656037;
+
+	for (size_t i = 0; i < count; ++i) {
+		hash ^= towlower(src[i]);
+		hash *= 1099511628211;
+	}
+
+	return hash;
+}
+
+// Appends the memoized expansion of the key to the destination. Returns true if the key was memoized and appended.
+static b32 memo_get(CanonMemo const* memo, WCHAR const* key, size_t count, size_t hash, Path* dst) {
+	CanonMemo const* entry = memo + (hash & (MEMO_SIZE - 1));
+	b32 result = false;
+
+	AcquireSRWLockShared(&g_memo_lock);
+
+	if (entry->key && entry->hash == hash && entry->key_count == count && _wcsnicmp(entry->key, key, count) == 0) {
+		result = dst->append(entry->value);
+	}
+
+	ReleaseSRWLockShared(&g_memo_lock);
+
+	return result;
+}
+
+// Memoizes the expansion of the key, replacing the expansion previously memoized in the same slot.
+static void memo_put(CanonMemo* memo, WCHAR const* key, size_t count, size_t hash, WCHAR const* value) {
+	size_t value_count = wcslen(value);
+
+	WCHAR* copy = (WCHAR*)mem_alloc(MemoryTagPaths, (count + value_count + 2) * sizeof(*copy));
+	if (copy == nullptr) {
+		return;
+	}
+
+	memcpy(copy, key, count * sizeof(*copy));
+	copy[count] = 0;
+	memcpy(copy + count + 1, value, (value_count + 1) * sizeof(*copy));
+
+	CanonMemo* entry = memo + (hash & (MEMO_SIZE - 1));
+
+	AcquireSRWLockExclusive(&g_memo_lock);
+
+	WCHAR* old_key = entry->key;
+	entry->hash = hash;
+	entry->key = copy;
+	entry->value = copy + count + 1;
+	entry->key_count = count;
+
+	ReleaseSRWLockExclusive(&g_memo_lock);
+
+	mem_free(old_key);
+}
+
+// Copies the source to the destination, expanding %NAME% environment variables. Returns true on success.
+static b32 expand_variables(WCHAR const* src, Path* dst) {
+	dst->clear();
+
+	WCHAR const* run = src;
+	while (*src) {
+		if (*src != L'%') {
+			++src;
+			continue;
+		}
+
+		WCHAR const* end = wcschr(src + 1, L'%');
+		if (end == nullptr) {
+			break;
+		}
+
+		size_t count = (size_t)(end - src) + 1;
+		if (count == 2) {
+			src = end + 1;
+			continue;
+		}
+
+		if (dst->append(run, (size_t)(src - run)) == false) {
+			return false;
+		}
+
+		size_t hash = memo_hash(src, count);
+		if (memo_get(g_variables, src, count, hash, dst) == false) {
+			Path name;
+			if (name.assign(src, count) == false) {
+				return false;
+			}
+
+			WCHAR value[MAX_PATH + 1];
+			DWORD value_count = ExpandEnvironmentStringsW(name.c_str(), value, COUNT(value));
+
+			WCHAR const* expansion = (value_count && value_count <= COUNT(value)) ? value : name.c_str();
+			memo_put(g_variables, src, count, hash, expansion);
+
+			if (dst->append(expansion) == false) {
+				return false;
+			}
+		}
+
+		src = end + 1;
+		run = src;
+	}
+
+	return dst->append(run);
+}
+
+// Returns true if the path starts with a \\?\Volume{GUID} or \??\Volume{GUID} prefix.
+static b32 is_volume_path(Path const* path) {
+	WCHAR const* src = path->c_str();
+
+	return path->size() >= VOLUME_PREFIX_SIZE && is_separator(src[0]) && (is_separator(src[1]) || src[1] == L'?') &&
+		src[2] == L'?' && is_separator(src[3]) && _wcsnicmp(src + 4, L"volume{", 7) == 0 &&
+		src[VOLUME_PREFIX_SIZE - 1] == L'}' && (src[VOLUME_PREFIX_SIZE] == 0 || is_separator(src[VOLUME_PREFIX_SIZE]));
+}
+
+// Replaces a volume GUID prefix of the path with the drive root the volume is mounted on. Paths of volumes without a
+// drive letter are left unchanged. Returns true on success.
+static b32 expand_volume(Path* path) {
+	if (is_volume_path(path) == false) {
+		return true;
+	}
+
+	WCHAR const* src = path->c_str();
+	size_t hash = memo_hash(src, VOLUME_PREFIX_SIZE);
+
+	Path result;
+	if (memo_get(g_volumes, src, VOLUME_PREFIX_SIZE, hash, &result) == false) {
+		WCHAR volume[VOLUME_PREFIX_SIZE + 2];
+		memcpy(volume, L"\\\\?\\", 4 * sizeof(*volume));
+		memcpy(volume + 4, src + 4, (VOLUME_PREFIX_SIZE - 4) * sizeof(*volume));
+		volume[VOLUME_PREFIX_SIZE] = L'\\';
+		volume[VOLUME_PREFIX_SIZE + 1] = 0;
+
+		WCHAR names[MAX_PATH + 1];
+		DWORD names_count = 0;
+
+		if (GetVolumePathNamesForVolumeNameW(volume, names, COUNT(names), &names_count) == FALSE || names[0] == 0) {
+			volume[VOLUME_PREFIX_SIZE] = 0;
+			wcscpy_s(names, COUNT(names), volume);
+		}
+
+		memo_put(g_volumes, src, VOLUME_PREFIX_SIZE, hash, names);
+
+		if (result.append(names) == false) {
+			return false;
+		}
+	}
+
+	if (result.append(src + VOLUME_PREFIX_SIZE) == false) {
+		return false;
+	}
+
+	*path = static_cast<Path&&>(result);
+
+	return true;
+}
+
+// Replaces the reduced path with its reduced long form if it contains 8.3 short names. Paths of files that do not
+// exist are left unchanged. Returns true on success.
+static b32 expand_long_name(Path* path) {
+	WCHAR const* src = path->c_str();
+	size_t hash = memo_hash(src, path->size());
+
+	Path long_path;
+	if (memo_get(g_long_names, src, path->size(), hash, &long_path) == false) {
+		WCHAR value[MAX_PATH + 1];
+		DWORD value_count = 0;
+
+		if (path->size() < MAX_PATH) {
+			value_count = GetLongPathNameW(src, value, COUNT(value));
+		}
+
+		WCHAR const* expansion = (value_count && value_count < COUNT(value)) ? value : src;
+		memo_put(g_long_names, src, path->size(), hash, expansion);
+
+		if (long_path.assign(expansion) == false) {
+			return false;
+		}
+	}
+
+	return canon_reduce(long_path.c_str(), long_path.size(), path);
+}
+
+b32 canon_reduce(WCHAR const* src, size_t count, Path* dst) {
+	assert(src || count == 0);
+	assert(dst);
+	assert(src != dst->c_str() || count == 0);
+
+	WCHAR const* end = src + count;
+	size_t floor = 0;
+	b32 is_unc = false;
+
+	size_t lead = 0;
+	while (lead < count && is_separator(src[lead])) {
+		++lead;
+	}
+
+	WCHAR const* rest = src + lead;
+	size_t rest_count = count - lead;
+	b32 is_device = false;
+
+	if (lead >= 2 && rest_count >= 2 && (rest[0] == L'?' || rest[0] == L'.') && is_separator(rest[1])) {
+		src = rest + 2;
+		is_device = true;
+	} else if (lead == 1 && rest_count >= 3 && rest[0] == L'?' && rest[1] == L'?' && is_separator(rest[2])) {
+		src = rest + 3;
+		is_device = true;
+	} else if (lead >= 2) {
+		src = rest;
+		is_unc = true;
+	}
+
+	while (is_device && src < end && is_separator(*src)) {
+		++src;
+	}
+
+	if (is_device && end - src >= 4 && _wcsnicmp(src, L"unc", 3) == 0 && is_separator(src[3])) {
+		src += 4;
+		is_unc = true;
+	}
+
+	dst->clear();
+
+	if (is_unc) {
+		floor = 2;
+		if (dst->append(L"\\\\", 2) == false) {
+			return false;
+		}
+	} else if (src < end && is_separator(*src)) {
+		floor = 1;
+		if (dst->append(L"\\", 1) == false) {
+			return false;
+		}
+	}
+
+	size_t root = is_unc ? 2 : 0;
+	size_t depth = 0;
+	b32 is_first = true;
+
+	while (src < end) {
+		while (src < end && is_separator(*src)) {
+			++src;
+		}
+
+		WCHAR const* part = src;
+		while (src < end && is_separator(*src) == false) {
+			++src;
+		}
+
+		size_t part_count = (size_t)(src - part);
+		if (part_count == 0) {
+			break;
+		}
+
+		if (is_first && floor == 0 && part_count == 2 && part[1] == L':') {
+			root = 1;
+		}
+
+		if (part_count == 1 && part[0] == L'.') {
+			continue;
+		}
+
+		b32 is_prefix = (floor == 1 && part_count == 2 && part[0] == L'?' && part[1] == L'?') ||
+			(floor == 2 && part_count == 1 && part[0] == L'?');
+
+		if (is_prefix && dst->size() == floor) {
+			dst->clear();
+			floor = 0;
+			root = 0;
+			continue;
+		}
+
+		if (part_count == 2 && part[0] == L'.' && part[1] == L'.') {
+			if (depth > root) {
+				WCHAR const* data = dst->c_str();
+
+				size_t i = dst->size();
+				while (i > floor && data[i - 1] != L'\\') {
+					--i;
+				}
+
+				dst->truncate(MAX(i ? i - 1 : 0, floor));
+				--depth;
+				continue;
+			}
+
+			if (root || floor) {
+				continue;
+			}
+		} else {
+			++depth;
+		}
+
+		is_first = false;
+
+		if (dst->size() > floor && dst->c_str()[dst->size() - 1] != L'\\' && dst->append(L"\\", 1) == false) {
+			return false;
+		}
+
+		if (dst->append(part, part_count) == false) {
+			return false;
+		}
+	}
+
+	if (dst->size() == 2 && dst->c_str()[1] == L':' && dst->append(L"\\", 1) == false) {
+		return false;
+	}
+
+	WCHAR* data = dst->data();
+	for (size_t i = 0; i < dst->size(); ++i) {
+		data[i] = (WCHAR)towlower(data[i]);
+	}
+
+	return dst->empty() == false;
+}
+
+b32 canon_path(WCHAR const* src, Path* dst) {
+	TRACE_SCOPE("canon_path");
+	assert(src);
+	assert(dst);
+	assert(src != dst->c_str());
+
+	Path expanded;
+	if (expand_variables(src, &expanded) == false || expand_volume(&expanded) == false) {
+		return false;
+	}
+
+	if (canon_reduce(expanded.c_str(), expanded.size(), dst) == false) {
+		return false;
+	}
+
+	if (wcschr(dst->c_str(), L'~') == nullptr) {
+		return true;
+	}
+
+	return expand_long_name(dst);
+}
+
+void canon_release() {
+	CanonMemo* memos[] = { g_variables, g_volumes, g_long_names };
+
+	AcquireSRWLockExclusive(&g_memo_lock);
+
+	for (size_t i = 0; i < COUNT(memos); ++i) {
+		for (u32 j = 0; j < MEMO_SIZE; ++j) {
+			mem_free(memos[i][j].key);
+			memset(memos[i] + j, 0, sizeof(memos[i][j]));
+		}
+	}
+
+	ReleaseSRWLockExclusive(&g_memo_lock);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include "core.h"
+#include "path.h"
+#include <Windows.h>
+
+// Reduces the lexical form of a path to its canonical key: strips the \\?\, \??\ and \\.\ prefixes, rewrites
+// \\?\UNC\ to \\, unifies separators, resolves '.' and '..' components and lowercases. Uses no system calls, so the
+// result only depends on the input. Returns true on success.
+b32 canon_reduce(WCHAR const* src, size_t count, Path* dst);
+
+// Reduces any form of an application path to its canonical key. In addition to the lexical reduction, expands
+// environment variables, maps volume GUID paths to drive letters and expands 8.3 short names. The expansions are
+// memoized, so repeated forms only pay for the lexical reduction. Thread safe. Returns true on success.
+b32 canon_path(WCHAR const* src, Path* dst);
+
+// Releases the memoized expansions, which are then memoized again as paths come in. Thread safe.
+void canon_release();
@@ -0,0 +1,47 @@
+#include "codec.h"
+#include <assert.h>
+
+u32 checksum(u8 const* data, size_t size) {
+	assert(data || size == 0);
+
+	/* FNV1-a: http://www.isthe.com/chongo/tech/comp/fnv/ */
+	u32 hash = 2166136261;
+
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+u8* put_varint(u8* dst, u64 value) {
+	assert(dst);
+
+	while (value >= 0x80) {
+		*dst++ = (u8)(value | 0x80);
+		value >>= 7;
+	}
+
+	*dst++ = (u8)value;
+
+	return dst;
+}
+
+u8 const* get_varint(u8 const* src, u8 const* end, u64* value) {
+	assert(value);
+
+	u64 result = 0;
+
+	for (u32 shift = 0; src < end && shift < 64; shift += 7) {
+		u8 byte = *src++;
+		result |= (u64)(byte & 0x7f) << shift;
+
+		if ((byte & 0x80) == 0) {
+			*value = result;
+			return src;
+		}
+	}
+
+	return nullptr;
+}
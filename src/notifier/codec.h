@@ -0,0 +1,11 @@
+#pragma once
+#include "core.h"
+
+// Returns the 32-bit checksum of the data.
+u32 checksum(u8 const* data, size_t size);
+
+// Writes the value as a varint of at most 10 bytes. Returns the position after the value.
+u8* put_varint(u8* dst, u64 value);
+
+// Reads a varint. Returns the position after the value, or null if the data is malformed.
+u8 const* get_varint(u8 const* src, u8 const* end, u64* value);
@@ -0,0 +1,197 @@
+#include "collector.h"
+#include "mem.h"
+#include <sddl.h>
+#include <assert.h>
+#include <string.h>
+
+// Security descriptor of the collector event: full access for SYSTEM and administrators, so only they can stop the
+// collector, and wait access for everyone else, so notifiers can see it is running.
+static WCHAR const COLLECTOR_SDDL[] = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;0x00100000;;;AU)";
+
+Collector::Collector() {
+	InitializeCriticalSection(&m_lock);
+}
+
+Collector::~Collector() {
+	if (m_rings) {
+		for (u32 i = 0; i < m_ring_count; ++i) {
+			m_rings[i].ring.close();
+		}
+
+		mem_free(m_rings);
+	}
+
+	if (m_session) {
+		FwpmEngineClose0(m_session);
+	}
+
+	if (m_stop) {
+		CloseHandle(m_stop);
+	}
+
+	DeleteCriticalSection(&m_lock);
+}
+
+b32 Collector::run() {
+	if (m_stop) {
+		return false;
+	}
+
+	m_rings = (CollectorRing*)mem_calloc(MemoryTagRings, COLLECTOR_MAX_RINGS, sizeof(*m_rings));
+	if (m_rings == nullptr) {
+		return false;
+	}
+
+	SECURITY_ATTRIBUTES attributes = {};
+	attributes.nLength = sizeof(attributes);
+
+	if (ConvertStringSecurityDescriptorToSecurityDescriptorW(COLLECTOR_SDDL, SDDL_REVISION_1,
+		&attributes.lpSecurityDescriptor, nullptr) == FALSE) {
+		return false;
+	}
+
+	m_stop = CreateEventW(&attributes, TRUE, FALSE, RING_COLLECTOR_NAME);
+	b32 is_existing = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+	LocalFree(attributes.lpSecurityDescriptor);
+
+	if (m_stop == nullptr || is_existing) {
+		return false;
+	}
+
+	FWPM_SESSION0 session_desc = {};
+	session_desc.displayData.name = L"Firewall Notifier Collector";
+	session_desc.displayData.description = L"Outbound connection monitoring for all users.";
+
+	if (FwpmEngineOpen0(nullptr, RPC_C_AUTHN_DEFAULT, nullptr, &session_desc, &m_session) != ERROR_SUCCESS) {
+		m_session = nullptr;
+		return false;
+	}
+
+	FWP_VALUE0 val = {};
+	val.type = FWP_UINT32;
+	val.uint32 = 1;
+
+	if (FwpmEngineSetOption0(m_session, FWPM_ENGINE_COLLECT_NET_EVENTS, &val) != ERROR_SUCCESS) {
+		return false;
+	}
+
+	FWPM_NET_EVENT_SUBSCRIPTION0 sub_desc = {};
+
+	HANDLE subscription = nullptr;
+	if (FwpmNetEventSubscribe0(m_session, &sub_desc, drop_event_callback, (void*)this, &subscription) != ERROR_SUCCESS) {
+		subscription = nullptr;
+	}
+
+	if (subscription) {
+		WaitForSingleObject(m_stop, INFINITE);
+
+		// Returns only once no drop event callback is still running.
+		FwpmNetEventUnsubscribe0(m_session, subscription);
+	}
+
+	val.uint32 = 0;
+	FwpmEngineSetOption0(m_session, FWPM_ENGINE_COLLECT_NET_EVENTS, &val);
+
+	return subscription != nullptr;
+}
+
+b32 Collector::stop() {
+	HANDLE collector = OpenEventW(EVENT_MODIFY_STATE, FALSE, RING_COLLECTOR_NAME);
+	if (collector == nullptr) {
+		return false;
+	}
+
+	b32 result = SetEvent(collector);
+	CloseHandle(collector);
+
+	return result;
+}
+
+EventRing* Collector::find_ring(PSID sid) {
+	assert(sid);
+
+	for (u32 i = 0; i < m_ring_count; ++i) {
+		if (EqualSid(sid, (PSID)m_rings[i].sid)) {
+			return m_rings[i].ring.is_open() ? &m_rings[i].ring : nullptr;
+		}
+	}
+
+	DWORD size = GetLengthSid(sid);
+	if (m_ring_count == COLLECTOR_MAX_RINGS || size > sizeof(m_rings->sid)) {
+		return nullptr;
+	}
+
+	CollectorRing* ring = m_rings + m_ring_count++;
+	memcpy(ring->sid, sid, size);
+
+	// A user whose ring cannot be created keeps its slot, so it is not retried for every event.
+	WCHAR* sid_string = nullptr;
+	if (ConvertSidToStringSidW(sid, &sid_string)) {
+		ring->ring.create(sid_string);
+		LocalFree(sid_string);
+	}
+
+	return ring->ring.is_open() ? &ring->ring : nullptr;
+}
+
+void Collector::route(FWPM_NET_EVENT1 const* ev) {
+	assert(ev);
+
+	WCHAR const* path = (WCHAR const*)ev->header.appId.data;
+	size_t count = ev->header.appId.size / sizeof(*path);
+	while (count && path[count - 1] == 0) {
+		count -= 1;
+	}
+
+	RingEvent event = {};
+	event.time = ((u64)ev->header.timeStamp.dwHighDateTime << 32) | ev->header.timeStamp.dwLowDateTime;
+
+	if (ev->header.flags & FWPM_NET_EVENT_FLAG_REMOTE_ADDR_SET) {
+		if (ev->header.ipVersion == FWP_IP_VERSION_V6) {
+			event.remote_version = 6;
+			memcpy(event.remote_v6, ev->header.remoteAddrV6.byteArray16, sizeof(event.remote_v6));
+		} else {
+			event.remote_version = 4;
+			event.remote_v4 = ev->header.remoteAddrV4;
+		}
+	}
+
+	if (ev->header.flags & FWPM_NET_EVENT_FLAG_REMOTE_PORT_SET) {
+		event.remote_port = ev->header.remotePort;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	if ((ev->header.flags & FWPM_NET_EVENT_FLAG_USER_ID_SET) && ev->header.userId) {
+		EventRing* ring = find_ring(ev->header.userId);
+		if (ring) {
+			ring->write(path, count, &event);
+		}
+	} else {
+		for (u32 i = 0; i < m_ring_count; ++i) {
+			if (m_rings[i].ring.is_open()) {
+				m_rings[i].ring.write(path, count, &event);
+			}
+		}
+	}
+
+	LeaveCriticalSection(&m_lock);
+}
+
+void CALLBACK Collector::drop_event_callback(_Inout_ void* context, _In_ const FWPM_NET_EVENT1* ev) {
+	if (context == nullptr || ev == nullptr) {
+		return;
+	}
+
+	if (ev->type != FWPM_NET_EVENT_TYPE_CLASSIFY_DROP) {
+		return;
+	}
+
+	if ((ev->header.flags & FWPM_NET_EVENT_FLAG_APP_ID_SET) == 0 || ev->header.appId.data == nullptr) {
+		return;
+	}
+
+	Collector* collector = (Collector*)context;
+	collector->route(ev);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "core.h"
+#include "ring.h"
+#include <Windows.h>
+#include <fwpmu.h>
+#include <fwptypes.h>
+
+// Maximum number of users the collector keeps an event ring for.
+#define COLLECTOR_MAX_RINGS 256
+
+// System-wide drop event collector. Subscribes to the firewall drop events once for the whole machine and routes each
+// event by the SID of the user it belongs to into the event ring of that user, so the notifier of every interactive
+// user only sees its own events. Events without a user are handed to every user. Must run as SYSTEM.
+class Collector {
+public:
+	// Creates a stopped collector.
+	Collector();
+
+	// Destroys the collector.
+	~Collector();
+
+	Collector(Collector const&) = delete;
+	Collector& operator=(Collector const&) = delete;
+
+	// Collects drop events until the collector is stopped. Returns false if the collector could not be started or is
+	// already running.
+	b32 run();
+
+	// Stops the running collector, which may belong to another process. Returns true on success.
+	static b32 stop();
+
+private:
+	// The event ring of a single user.
+	struct CollectorRing {
+		u8 sid[SECURITY_MAX_SID_SIZE];
+		EventRing ring;
+	};
+
+	// Returns the event ring of the user with the given SID, creating it if needed. Returns null on failure.
+	EventRing* find_ring(PSID sid);
+
+	// Routes a drop event to the rings of the users it belongs to.
+	void route(FWPM_NET_EVENT1 const* ev);
+
+	// Callback from the system to handle a drop event notification event from the firewall.
+	static void CALLBACK drop_event_callback(_Inout_ void* context, _In_ const FWPM_NET_EVENT1* ev);
+
+	CRITICAL_SECTION m_lock;
+	HANDLE m_stop = nullptr;
+	HANDLE m_session = nullptr;
+	CollectorRing* m_rings = nullptr;
+	u32 m_ring_count = 0;
+};
@@ -0,0 +1,162 @@
+#include "compact.h"
+#include "mem.h"
+#include "wstr.h"
+#include <assert.h>
+#include <wchar.h>
+
+// Flags of an application in the analysis.
+enum CompactGroupFlag {
+	CompactGroupUserAllow = 0x1,
+	CompactGroupUserBlock = 0x2,
+	CompactGroupNotifierBlock = 0x4,
+	CompactGroupKeptAllow = 0x8,
+	CompactGroupKeptBlock = 0x10,
+	CompactGroupNameConflict = 0x20,
+};
+
+// A slot of an open addressing table of applications or rule names. The rule is the index of the first rule with the
+// key plus one, or zero for an empty slot.
+struct CompactSlot {
+	size_t hash;
+	u32 rule;
+	u32 flags;
+};
+
+// Returns the case insensitive hash of the given rule name.
+static size_t name_hash(WCHAR const* name) {
+	/* FNV1-a: http://www.isthe.com/chongo/tech/comp/fnv/ */
+	size_t hash = 14695981039346656037;
+
+	for (size_t i = 0; name[i]; ++i) {
+		hash ^= towlower(name[i]);
+		hash *= 1099511628211;
+	}
+
+	return hash;
+}
+
+// Returns the slot of the application of the rule in the table, claiming an empty one if needed.
+static CompactSlot* find_path(CompactSlot* table, u32 mask, CompactRule const* rules, u32 rule) {
+	WCHAR const* path = rules[rule].path;
+	size_t hash = wcshash(path);
+
+	u32 i = (u32)hash & mask;
+	while (table[i].rule && (table[i].hash != hash || wcscmp(rules[table[i].rule - 1].path, path) != 0)) {
+		i = (i + 1) & mask;
+	}
+
+	if (table[i].rule == 0) {
+		table[i].hash = hash;
+		table[i].rule = rule + 1;
+	}
+
+	return table + i;
+}
+
+// Returns the slot of the name of the rule in the table, claiming an empty one if needed.
+static CompactSlot* find_name(CompactSlot* table, u32 mask, CompactRule const* rules, u32 rule) {
+	WCHAR const* name = rules[rule].name;
+	size_t hash = name_hash(name);
+
+	u32 i = (u32)hash & mask;
+	while (table[i].rule && (table[i].hash != hash || _wcsicmp(rules[table[i].rule - 1].name, name) != 0)) {
+		i = (i + 1) & mask;
+	}
+
+	if (table[i].rule == 0) {
+		table[i].hash = hash;
+		table[i].rule = rule + 1;
+	}
+
+	return table + i;
+}
+
+b32 compact_analyze(CompactRule const* rules, u32 count, u8* verdicts, CompactStats* stats) {
+	assert(rules || count == 0);
+	assert(verdicts || count == 0);
+	assert(stats);
+
+	*stats = {};
+
+	u32 size = 1;
+	while (size < 2 * count) {
+		size <<= 1;
+	}
+
+	CompactSlot* paths = (CompactSlot*)mem_calloc(MemoryTagFirewallCache, size, sizeof(*paths));
+	CompactSlot* names = (CompactSlot*)mem_calloc(MemoryTagFirewallCache, size, sizeof(*names));
+
+	if (paths == nullptr || names == nullptr) {
+		mem_free(paths);
+		mem_free(names);
+		return false;
+	}
+
+	u32 mask = size - 1;
+
+	// Collect what decides each application apart from the notifier rules that are candidates for removal.
+	for (u32 i = 0; i < count; ++i) {
+		CompactRule const* rule = rules + i;
+		b32 is_notifier = (rule->flags & CompactFlagNotifier) != 0;
+
+		if (rule->name && is_notifier == false) {
+			find_name(names, mask, rules, i)->flags |= CompactGroupNameConflict;
+		}
+
+		if (rule->path == nullptr) {
+			continue;
+		}
+
+		CompactSlot* group = find_path(paths, mask, rules, i);
+		b32 is_allow = (rule->flags & CompactFlagAllow) != 0;
+
+		if (is_notifier) {
+			group->flags |= is_allow ? 0 : CompactGroupNotifierBlock;
+		} else if (rule->flags & CompactFlagCovering) {
+			group->flags |= is_allow ? CompactGroupUserAllow : CompactGroupUserBlock;
+		}
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		CompactRule const* rule = rules + i;
+		verdicts[i] = CompactVerdictKeep;
+
+		if ((rule->flags & CompactFlagNotifier) == 0 || rule->path == nullptr || rule->name == nullptr) {
+			continue;
+		}
+
+		stats->notifier_rules += 1;
+
+		if (find_name(names, mask, rules, i)->flags & CompactGroupNameConflict) {
+			continue;
+		}
+
+		CompactSlot* group = find_path(paths, mask, rules, i);
+
+		if (rule->flags & CompactFlagAllow) {
+			if (group->flags & (CompactGroupUserBlock | CompactGroupNotifierBlock | CompactGroupUserAllow)) {
+				verdicts[i] = CompactVerdictShadowed;
+			} else if (group->flags & CompactGroupKeptAllow) {
+				verdicts[i] = CompactVerdictDuplicate;
+			} else {
+				group->flags |= CompactGroupKeptAllow;
+			}
+		} else {
+			if (group->flags & CompactGroupUserBlock) {
+				verdicts[i] = CompactVerdictShadowed;
+			} else if (group->flags & CompactGroupKeptBlock) {
+				verdicts[i] = CompactVerdictDuplicate;
+			} else {
+				group->flags |= CompactGroupKeptBlock;
+			}
+		}
+
+		stats->duplicates += (verdicts[i] == CompactVerdictDuplicate);
+		stats->shadowed += (verdicts[i] == CompactVerdictShadowed);
+	}
+
+	mem_free(paths);
+	mem_free(names);
+
+	return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Flags of a rule in the rule store.
+enum CompactFlag {
+	// The rule allows the application, rather than blocking it.
+	CompactFlagAllow = 0x1,
+
+	// The rule was created by the notifier: it is named after its application path and has the notifier's scope.
+	CompactFlagNotifier = 0x2,
+
+	// The rule is enabled, outbound, and applies to every profile, protocol, port and address, so it decides every
+	// outbound connection of its application.
+	CompactFlagCovering = 0x4,
+};
+
+// A rule in the rule store, as seen by the compaction analysis. The path is the canonical application path, or null
+// for a rule that applies to every application.
+struct CompactRule {
+	WCHAR const* name;
+	WCHAR const* path;
+	u32 flags;
+};
+
+// Outcome of the compaction analysis for a single rule.
+enum CompactVerdict {
+	CompactVerdictKeep,
+	CompactVerdictDuplicate,
+	CompactVerdictShadowed,
+};
+
+// Totals of the compaction analysis.
+struct CompactStats {
+	u32 notifier_rules;
+	u32 duplicates;
+	u32 shadowed;
+};
+
+// Finds the notifier rules that can be removed without changing what the firewall lets through. A notifier rule is a
+// duplicate if an earlier notifier rule for the same application has the same action. It is shadowed if a covering
+// rule created by someone else already decides the application the same way, or if it allows an application that a
+// covering rule blocks, since blocking rules take precedence. Rules for every application are not considered, so
+// decisions survive their removal. Notifier rules sharing their name with a rule created by someone else are always
+// kept, since rules can only be removed by name. Writes a CompactVerdict for every rule. Returns true on success.
+b32 compact_analyze(CompactRule const* rules, u32 count, u8* verdicts, CompactStats* stats);
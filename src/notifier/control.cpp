@@ -0,0 +1,487 @@
+#include "control.h"
+#include "mem.h"
+#include "trace.h"
+#include <sddl.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Maximum number of clients served at once.
+static const u32 MAX_CLIENTS = 8;
+
+// Largest request frame accepted, in bytes.
+static const u32 MAX_FRAME_SIZE = 0x100000;
+
+// Size of the pipe buffers, in bytes. The input of a client grows by at least this much at a time.
+static const DWORD PIPE_BUFFER_SIZE = 0x10000;
+
+// Size of the pending responses of a client past which its requests wait for the responses to be written, in bytes.
+// Pipelined requests are cheap to send, so without this a client that never reads could grow its output unbounded.
+static const u32 MAX_OUTPUT_SIZE = 0x100000;
+
+// Minimum capacity of a response buffer, in bytes.
+static const u32 MIN_BUFFER_SIZE = 256;
+
+// Security descriptor of the control pipe: full access for SYSTEM, administrators and the user running the notifier.
+static WCHAR const PIPE_SDDL[] = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;%s)";
+
+// Gets the string SID of the user running the process. Returns true on success.
+static b32 user_sid_string(WCHAR* dst, size_t dst_count) {
+	HANDLE token = nullptr;
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token) == FALSE) {
+		return false;
+	}
+
+	union {
+		TOKEN_USER user;
+		u8 data[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+	} info;
+
+	DWORD info_size = 0;
+	b32 result = GetTokenInformation(token, TokenUser, &info, sizeof(info), &info_size);
+	CloseHandle(token);
+
+	WCHAR* string = nullptr;
+	if (result == false || ConvertSidToStringSidW(info.user.User.Sid, &string) == FALSE) {
+		return false;
+	}
+
+	result = (wcslen(string) < dst_count);
+	if (result) {
+		wcscpy_s(dst, dst_count, string);
+	}
+
+	LocalFree(string);
+
+	return result;
+}
+
+b32 control_append(ControlBuffer* buffer, void const* data, size_t size) {
+	assert(buffer);
+	assert(data || size == 0);
+
+	if (size > 0x7fffffff - buffer->size) {
+		return false;
+	}
+
+	u32 required = buffer->size + (u32)size;
+	if (required > buffer->capacity) {
+		u32 capacity = MAX(MAX(buffer->capacity * 2, required), MIN_BUFFER_SIZE);
+
+		u8* new_data = (u8*)mem_realloc(MemoryTagUi, buffer->data, capacity);
+		if (new_data == nullptr) {
+			return false;
+		}
+
+		buffer->data = new_data;
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size = required;
+
+	return true;
+}
+
+b32 control_append_string(ControlBuffer* buffer, WCHAR const* src) {
+	assert(buffer);
+	assert(src);
+
+	size_t count = wcslen(src);
+	if (count > 0xffff) {
+		return false;
+	}
+
+	u16 length = (u16)count;
+
+	return control_append(buffer, &length, sizeof(length)) && control_append(buffer, src, count * sizeof(*src));
+}
+
+ControlServer::ControlServer() {
+}
+
+ControlServer::~ControlServer() {
+	stop();
+}
+
+b32 ControlServer::start(ControlHandler handler, void* context) {
+	assert(handler);
+
+	if (m_thread) {
+		return false;
+	}
+
+	m_handler = handler;
+	m_handler_context = context;
+
+	m_clients = (ControlClient*)mem_calloc(MemoryTagUi, MAX_CLIENTS, sizeof(*m_clients));
+	if (m_clients == nullptr) {
+		return false;
+	}
+
+	for (u32 i = 0; i < MAX_CLIENTS; ++i) {
+		ControlClient* client = m_clients + i;
+		client->pipe = INVALID_HANDLE_VALUE;
+		client->state = ControlStateIdle;
+		client->overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+		if (client->overlapped.hEvent == nullptr) {
+			stop();
+			return false;
+		}
+	}
+
+	WCHAR sid[SECURITY_MAX_SID_SIZE * 4];
+	WCHAR sddl[COUNT(sid) + COUNT(PIPE_SDDL)];
+
+	if (user_sid_string(sid, COUNT(sid)) == false ||
+		_snwprintf_s(m_pipe_name, COUNT(m_pipe_name), _TRUNCATE, L"%s%s", CONTROL_PIPE_PREFIX, sid) < 0 ||
+		_snwprintf_s(sddl, COUNT(sddl), _TRUNCATE, PIPE_SDDL, sid) < 0) {
+		stop();
+		return false;
+	}
+
+	m_attributes.nLength = sizeof(m_attributes);
+	if (ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &m_attributes.lpSecurityDescriptor,
+		nullptr) == FALSE) {
+		stop();
+		return false;
+	}
+
+	// The first instance claims the pipe name for the whole run, as it is only disconnected between clients and never
+	// closed before the server stops.
+	m_clients[0].pipe = create_pipe(true);
+	if (m_clients[0].pipe == INVALID_HANDLE_VALUE) {
+		stop();
+		return false;
+	}
+
+	m_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	if (m_stop) {
+		m_thread = CreateThread(0, 0, server_thread_callback, this, 0, 0);
+	}
+
+	if (m_thread == nullptr) {
+		stop();
+		return false;
+	}
+
+	return true;
+}
+
+void ControlServer::stop() {
+	if (m_thread) {
+		SetEvent(m_stop);
+		WaitForSingleObject(m_thread, INFINITE);
+
+		CloseHandle(m_thread);
+		m_thread = nullptr;
+	}
+
+	if (m_stop) {
+		CloseHandle(m_stop);
+		m_stop = nullptr;
+	}
+
+	if (m_clients) {
+		for (u32 i = 0; i < MAX_CLIENTS; ++i) {
+			ControlClient* client = m_clients + i;
+
+			if (client->pipe && client->pipe != INVALID_HANDLE_VALUE) {
+				CloseHandle(client->pipe);
+			}
+
+			if (client->overlapped.hEvent) {
+				CloseHandle(client->overlapped.hEvent);
+			}
+
+			mem_free(client->input.data);
+			mem_free(client->output.data);
+		}
+
+		mem_free(m_clients);
+		m_clients = nullptr;
+	}
+
+	if (m_attributes.lpSecurityDescriptor) {
+		LocalFree(m_attributes.lpSecurityDescriptor);
+		m_attributes.lpSecurityDescriptor = nullptr;
+	}
+}
+
+HANDLE ControlServer::create_pipe(b32 is_first) {
+	DWORD flags = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (is_first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0);
+
+	return CreateNamedPipeW(m_pipe_name, flags, PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+		PIPE_REJECT_REMOTE_CLIENTS, MAX_CLIENTS, PIPE_BUFFER_SIZE, PIPE_BUFFER_SIZE, 0, &m_attributes);
+}
+
+b32 ControlServer::connect(ControlClient* client) {
+	assert(client);
+
+	if (client->pipe == INVALID_HANDLE_VALUE) {
+		client->pipe = create_pipe(false);
+
+		if (client->pipe == INVALID_HANDLE_VALUE) {
+			client->state = ControlStateIdle;
+			ResetEvent(client->overlapped.hEvent);
+			return false;
+		}
+	}
+
+	client->input.size = 0;
+	client->output.size = 0;
+	client->output_sent = 0;
+	client->state = ControlStateConnecting;
+
+	if (ConnectNamedPipe(client->pipe, &client->overlapped)) {
+		SetEvent(client->overlapped.hEvent);
+		return true;
+	}
+
+	DWORD error = GetLastError();
+	if (error == ERROR_IO_PENDING) {
+		return true;
+	}
+
+	if (error == ERROR_PIPE_CONNECTED) {
+		SetEvent(client->overlapped.hEvent);
+		return true;
+	}
+
+	client->state = ControlStateIdle;
+	ResetEvent(client->overlapped.hEvent);
+
+	return false;
+}
+
+void ControlServer::reconnect(ControlClient* client) {
+	assert(client);
+
+	DisconnectNamedPipe(client->pipe);
+
+	// Idle clients hold no memory.
+	mem_free(client->input.data);
+	mem_free(client->output.data);
+	client->input = {};
+	client->output = {};
+
+	connect(client);
+}
+
+b32 ControlServer::read(ControlClient* client) {
+	assert(client);
+	assert(client->input.size < MAX_FRAME_SIZE);
+
+	ControlBuffer* input = &client->input;
+
+	// The input grows on demand up to the largest frame, so a client that sends small requests costs little.
+	if (input->capacity - input->size < PIPE_BUFFER_SIZE && input->capacity < MAX_FRAME_SIZE) {
+		u32 capacity = MIN(MAX(input->capacity * 2, input->size + (u32)PIPE_BUFFER_SIZE), MAX_FRAME_SIZE);
+
+		u8* data = (u8*)mem_realloc(MemoryTagUi, input->data, capacity);
+		if (data == nullptr) {
+			return false;
+		}
+
+		input->data = data;
+		input->capacity = capacity;
+	}
+
+	client->state = ControlStateReading;
+
+	DWORD capacity = input->capacity - input->size;
+	if (ReadFile(client->pipe, input->data + input->size, capacity, nullptr, &client->overlapped)) {
+		return true;
+	}
+
+	return GetLastError() == ERROR_IO_PENDING;
+}
+
+b32 ControlServer::write(ControlClient* client) {
+	assert(client);
+	assert(client->output_sent < client->output.size);
+
+	client->state = ControlStateWriting;
+
+	DWORD size = client->output.size - client->output_sent;
+	if (WriteFile(client->pipe, client->output.data + client->output_sent, size, nullptr, &client->overlapped)) {
+		return true;
+	}
+
+	return GetLastError() == ERROR_IO_PENDING;
+}
+
+b32 ControlServer::process(ControlClient* client) {
+	TRACE_SCOPE("ControlServer::process");
+	assert(client);
+
+	ControlBuffer* input = &client->input;
+	u32 offset = 0;
+
+	while (input->size - offset >= sizeof(ControlFrame) && client->output.size < MAX_OUTPUT_SIZE) {
+		ControlFrame request;
+		memcpy(&request, input->data + offset, sizeof(request));
+
+		if (request.size < sizeof(request) || request.size > MAX_FRAME_SIZE) {
+			return false;
+		}
+
+		if (input->size - offset < request.size) {
+			break;
+		}
+
+		ControlFrame response = {};
+		response.id = request.id;
+		response.op = request.op;
+
+		u32 response_offset = client->output.size;
+		if (control_append(&client->output, &response, sizeof(response)) == false) {
+			return false;
+		}
+
+		ControlStatus status = m_handler((ControlOp)request.op, input->data + offset + sizeof(request),
+			request.size - (u32)sizeof(request), &client->output, m_handler_context);
+
+		// A failed request answers with the bare header.
+		if (status != ControlStatusOk) {
+			client->output.size = response_offset + (u32)sizeof(response);
+		}
+
+		response.size = client->output.size - response_offset;
+		response.status = (u16)status;
+		memcpy(client->output.data + response_offset, &response, sizeof(response));
+
+		offset += request.size;
+		++m_requests;
+	}
+
+	if (offset) {
+		memmove(input->data, input->data + offset, input->size - offset);
+		input->size -= offset;
+	}
+
+	return true;
+}
+
+void ControlServer::complete(ControlClient* client) {
+	assert(client);
+
+	DWORD transferred = 0;
+	BOOL result = GetOverlappedResult(client->pipe, &client->overlapped, &transferred, FALSE);
+
+	switch (client->state) {
+		case ControlStateIdle:
+		{
+			ResetEvent(client->overlapped.hEvent);
+		} break;
+
+		case ControlStateConnecting:
+		{
+			// A client that connected before the wait leaves no result behind, so only the first read can tell.
+			if (read(client) == false) {
+				reconnect(client);
+			}
+		} break;
+
+		case ControlStateReading:
+		{
+			if (result == FALSE) {
+				reconnect(client);
+				break;
+			}
+
+			client->input.size += transferred;
+
+			if (process(client) == false) {
+				reconnect(client);
+				break;
+			}
+
+			b32 is_started = client->output.size ? write(client) : read(client);
+			if (is_started == false) {
+				reconnect(client);
+			}
+		} break;
+
+		case ControlStateWriting:
+		{
+			if (result == FALSE) {
+				reconnect(client);
+				break;
+			}
+
+			client->output_sent += transferred;
+
+			if (client->output_sent < client->output.size) {
+				if (write(client) == false) {
+					reconnect(client);
+				}
+				break;
+			}
+
+			client->output.size = 0;
+			client->output_sent = 0;
+
+			// Requests held back by the output limit are handled before reading more.
+			if (process(client) == false) {
+				reconnect(client);
+				break;
+			}
+
+			b32 is_started = client->output.size ? write(client) : read(client);
+			if (is_started == false) {
+				reconnect(client);
+			}
+		} break;
+	}
+}
+
+DWORD ControlServer::server_thread() {
+	HANDLE events[MAX_CLIENTS + 1];
+	events[0] = m_stop;
+
+	for (u32 i = 0; i < MAX_CLIENTS; ++i) {
+		events[i + 1] = m_clients[i].overlapped.hEvent;
+		connect(m_clients + i);
+	}
+
+	for (;;) {
+		DWORD result = WaitForMultipleObjects(COUNT(events), events, FALSE, INFINITE);
+		if (result == WAIT_OBJECT_0 || result > WAIT_OBJECT_0 + MAX_CLIENTS) {
+			break;
+		}
+
+		complete(m_clients + (result - WAIT_OBJECT_0 - 1));
+	}
+
+	for (u32 i = 0; i < MAX_CLIENTS; ++i) {
+		ControlClient* client = m_clients + i;
+		if (client->pipe == INVALID_HANDLE_VALUE) {
+			continue;
+		}
+
+		if (client->state != ControlStateIdle) {
+			DWORD transferred;
+			CancelIoEx(client->pipe, &client->overlapped);
+			GetOverlappedResult(client->pipe, &client->overlapped, &transferred, TRUE);
+		}
+
+		CloseHandle(client->pipe);
+		client->pipe = INVALID_HANDLE_VALUE;
+		client->state = ControlStateIdle;
+	}
+
+	return 0;
+}
+
+DWORD WINAPI ControlServer::server_thread_callback(LPVOID context) {
+	ControlServer* server = (ControlServer*)context;
+	if (server) {
+		return server->server_thread();
+	}
+
+	return 0;
+}
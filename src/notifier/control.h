@@ -0,0 +1,175 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Prefix of the name of the control pipe. The name ends in the string SID of the user running the notifier, so the
+// notifiers of several users on one machine never share a pipe.
+#define CONTROL_PIPE_PREFIX L"\\\\.\\pipe\\FirewallNotifier."
+
+// Maximum length of the name of the control pipe, in characters including the null terminator.
+#define CONTROL_PIPE_NAME_SIZE 256
+
+// Control request operations.
+enum ControlOp {
+	// Lists the applications waiting for a decision. Response: u32 count, then per application a u16 length and the
+	// UTF-16 path.
+	ControlOpPendingEvents = 1,
+
+	// Takes a snapshot of the notifier metrics. Response: ControlMetrics.
+	ControlOpMetrics = 2,
+
+	// Queries the outbound filtering state. Response: u32 state.
+	ControlOpGetFiltering = 3,
+
+	// Sets the outbound filtering state. Request: u32 state.
+	ControlOpSetFiltering = 4,
+
+	// Allows or blocks a batch of applications. Request: u32 count, then per application a u8 verdict (1 allows), a
+	// u16 length and the UTF-16 path. Response: u32 number of rules added.
+	ControlOpDecide = 5,
+
+	// Takes a snapshot of the memory accounting. Response: u32 count, then per tag a u16 length, the UTF-16 tag name
+	// and a MemoryStats.
+	ControlOpMemory = 6,
+
+	// Lists the applications with the most drop events. Response: u64 total number of drop events, u32 count, then
+	// per application, highest count first, a u16 length, the UTF-16 path and an AnalyticsApp.
+	ControlOpAnalytics = 7,
+
+	// Takes a snapshot of the idle state and the resource use of the process. Response: ControlIdle.
+	ControlOpIdle = 8
+};
+
+// Control response statuses.
+enum ControlStatus {
+	ControlStatusOk = 0,
+	ControlStatusUnknown = 1,
+	ControlStatusInvalid = 2,
+	ControlStatusFailed = 3
+};
+
+// Frame header preceding every request and response. The size includes the header. A response carries the
+// identifier and operation of its request, so a client can pipeline requests and match the responses.
+struct ControlFrame {
+	u32 size;
+	u32 id;
+	u16 op;
+	u16 status;
+};
+
+// Snapshot of the notifier metrics.
+struct ControlMetrics {
+	u64 queued_events;
+	u64 dropped_history_events;
+	u64 requests;
+	u32 is_filtering;
+	u32 reserved;
+};
+
+// Snapshot of the idle state. The idle time is in milliseconds and zero while the notifier is busy. Sampling the cycle
+// time twice over a quiet spell measures what the notifier costs while idle.
+struct ControlIdle {
+	u64 idle_count;
+	u64 idle_time;
+	u64 cycle_time;
+	u64 working_set;
+	u64 private_bytes;
+};
+
+// A growable response payload.
+struct ControlBuffer {
+	u8* data;
+	u32 size;
+	u32 capacity;
+};
+
+// Appends the data to the buffer. Returns true on success.
+b32 control_append(ControlBuffer* buffer, void const* data, size_t size);
+
+// Appends the string as a u16 length followed by its characters. Returns true on success.
+b32 control_append_string(ControlBuffer* buffer, WCHAR const* src);
+
+// Control request handler. Appends the response payload to the buffer and returns the response status.
+typedef ControlStatus(*ControlHandler)(ControlOp op, u8 const* request, u32 request_size, ControlBuffer* response,
+	void* context);
+
+// Local control endpoint on a named pipe. A single thread serves every client with overlapped I/O, so slow clients
+// never hold up each other or the event pipeline. Only local clients of SYSTEM, administrators and the user running
+// the notifier are accepted, and the server fails to start if another process already owns the pipe.
+class ControlServer {
+public:
+	// Creates a stopped server.
+	ControlServer();
+
+	// Destroys the server, stopping it if needed.
+	~ControlServer();
+
+	// Starts serving requests with the given handler, which is called on the server thread. Returns true on success.
+	b32 start(ControlHandler handler, void* context);
+
+	// Disconnects every client and stops serving requests.
+	void stop();
+
+	// Returns the number of requests served.
+	u64 requests() const {
+		return m_requests;
+	}
+
+private:
+	// State of a pipe instance.
+	enum ControlState {
+		ControlStateIdle,
+		ControlStateConnecting,
+		ControlStateReading,
+		ControlStateWriting
+	};
+
+	// A pipe instance and its buffers. The buffers grow with the requests of the client and are released when it
+	// disconnects.
+	struct ControlClient {
+		HANDLE pipe;
+		OVERLAPPED overlapped;
+		ControlState state;
+		ControlBuffer input;
+		ControlBuffer output;
+		u32 output_sent;
+	};
+
+	// Creates a pipe instance. The first instance fails if the pipe already exists. Returns the pipe, or
+	// INVALID_HANDLE_VALUE on failure.
+	HANDLE create_pipe(b32 is_first);
+
+	// Creates the pipe instance if needed and waits for a client to connect to it. Returns true on success.
+	b32 connect(ControlClient* client);
+
+	// Disconnects the client and waits for the next one.
+	void reconnect(ControlClient* client);
+
+	// Starts reading requests from the client. Returns true on success.
+	b32 read(ControlClient* client);
+
+	// Starts writing the pending responses to the client. Returns true on success.
+	b32 write(ControlClient* client);
+
+	// Handles the complete requests received from the client until the pending responses pass MAX_OUTPUT_SIZE. The
+	// rest is handled once the responses are written. Returns false if the client broke the framing.
+	b32 process(ControlClient* client);
+
+	// Handles the completion of the pending operation of the client.
+	void complete(ControlClient* client);
+
+	// Server thread routine.
+	DWORD server_thread();
+
+	// Server thread routine callback.
+	static DWORD WINAPI server_thread_callback(LPVOID context);
+
+	ControlClient* m_clients = nullptr;
+	SECURITY_ATTRIBUTES m_attributes = {};
+	WCHAR m_pipe_name[CONTROL_PIPE_NAME_SIZE] = {};
+	ControlHandler m_handler = nullptr;
+	void* m_handler_context = nullptr;
+	HANDLE m_thread = nullptr;
+	HANDLE m_stop = nullptr;
+	volatile u64 m_requests = 0;
+};
@@ -0,0 +1,133 @@
+#include "dedup.h"
+#include "mem.h"
+#include <assert.h>
+
+DedupCache::DedupCache() {
+}
+
+DedupCache::~DedupCache() {
+	if (m_items) {
+		for (size_t i = 0; i < DEDUP_SIZE; ++i) {
+			m_items[i].key.reset();
+		}
+
+		mem_free(m_items);
+	}
+}
+
+b32 DedupCache::init() {
+	if (m_items) {
+		return true;
+	}
+
+	m_items = (DedupItem*)mem_calloc(MemoryTagMonitorCache, DEDUP_SIZE, sizeof(*m_items));
+	return m_items != nullptr;
+}
+
+b32 DedupCache::insert(Key const* key, u64 now) {
+	assert(key);
+
+	if (init() == false) {
+		return true;
+	}
+
+	u64 oldest_age = MAXUINT64;
+	size_t oldest_ind = 0;
+
+	for (size_t i = 0; i < DEDUP_SIZE; ++i) {
+		DedupItem* item = m_items + i;
+
+		if (item->age < oldest_age) {
+			oldest_age = item->age;
+			oldest_ind = i;
+		}
+
+		if (item->key.empty()) {
+			continue;
+		}
+
+		if (now - item->age < DEDUP_AGE && key->equals(item->key.data(), item->key.size(), item->key.hash())) {
+			return false;
+		}
+	}
+
+	DedupItem* item = m_items + oldest_ind;
+
+	// The key was already encoded by the caller, so its bytes are copied instead of encoding the path again.
+	if (item->key.load(key->data(), key->size())) {
+		item->age = now;
+	} else {
+		item->age = 0;
+	}
+
+	return true;
+}
+
+void DedupCache::restore(Key const* key, u64 seen, u64 now) {
+	assert(key);
+
+	if (key->empty() || seen > now || now - seen >= DEDUP_AGE || init() == false) {
+		return;
+	}
+
+	DedupItem* oldest = m_items;
+	for (size_t i = 1; i < DEDUP_SIZE; ++i) {
+		if (m_items[i].age < oldest->age) {
+			oldest = m_items + i;
+		}
+	}
+
+	if (oldest->key.load(key->data(), key->size())) {
+		oldest->age = seen;
+	} else {
+		oldest->age = 0;
+	}
+}
+
+void DedupCache::visit(DedupVisitor visitor, void* context, u64 now) const {
+	assert(visitor);
+
+	if (m_items == nullptr) {
+		return;
+	}
+
+	for (size_t i = 0; i < DEDUP_SIZE; ++i) {
+		DedupItem const* item = m_items + i;
+
+		if (item->key.empty() == false && now - item->age < DEDUP_AGE) {
+			visitor(&item->key, item->age, context);
+		}
+	}
+}
+
+u32 DedupCache::count(u64 now) const {
+	if (m_items == nullptr) {
+		return 0;
+	}
+
+	u32 result = 0;
+	for (size_t i = 0; i < DEDUP_SIZE; ++i) {
+		result += (m_items[i].key.empty() == false && now - m_items[i].age < DEDUP_AGE);
+	}
+
+	return result;
+}
+
+b32 DedupCache::release(u64 now) {
+	if (m_items == nullptr) {
+		return true;
+	}
+
+	if (count(now)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < DEDUP_SIZE; ++i) {
+		m_items[i].key.reset();
+	}
+
+	mem_free(m_items);
+	m_items = nullptr;
+
+	return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "core.h"
+#include "key.h"
+#include <Windows.h>
+
+// Number of applications remembered by a deduplication cache.
+#define DEDUP_SIZE 32
+
+// Time an application is remembered after its drop event, in milliseconds.
+#define DEDUP_AGE 60000
+
+// Visitor for the items in a deduplication cache. Passes back the key of the item, the time at which it was last seen
+// and the user context data.
+typedef void(*DedupVisitor)(Key const* key, u64 seen, void* context);
+
+// Applications seen recently, so that a burst of drop events for the same application is handled once. Items age out
+// after DEDUP_AGE; when every slot is taken, the oldest item makes room even if it is still in effect. Times are in
+// milliseconds and passed in by the caller, who reads them from its clock. Once every item has aged out, the slots can
+// be released; they are allocated again with the next item. Not thread safe.
+class DedupCache {
+public:
+	// Creates a cache without any memory.
+	DedupCache();
+
+	// Destroys the cache.
+	~DedupCache();
+
+	DedupCache(DedupCache const&) = delete;
+	DedupCache& operator=(DedupCache const&) = delete;
+
+	// Allocates the slots. Returns true on success.
+	b32 init();
+
+	// Adds the application with the given key, seen at the given time. Returns true if the item was added or the
+	// released slots could not be allocated, false if the cache already contained the item.
+	b32 insert(Key const* key, u64 now);
+
+	// Puts an item back into the cache, as last seen at the given time. Items that would already have aged out are
+	// ignored.
+	void restore(Key const* key, u64 seen, u64 now);
+
+	// Calls the visitor for every item still in effect at the given time.
+	void visit(DedupVisitor visitor, void* context, u64 now) const;
+
+	// Returns the number of items still in effect at the given time.
+	u32 count(u64 now) const;
+
+	// Releases the slots unless an item is still in effect at the given time. Returns true if the cache holds no
+	// memory.
+	b32 release(u64 now);
+
+private:
+	// An item in the cache, keyed by the compact form of its device path.
+	struct DedupItem {
+		Key key;
+		u64 age;
+	};
+
+	DedupItem* m_items = nullptr;
+};
@@ -0,0 +1,246 @@
+#include "enricher.h"
+#include "mem.h"
+#include "trace.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+// Number of events that can be in flight in the reorder buffer.
+static const u32 ENRICH_SLOTS = 64;
+
+Enricher::Enricher() {
+	InitializeCriticalSection(&m_lock);
+	InitializeConditionVariable(&m_ready);
+	InitializeConditionVariable(&m_space);
+}
+
+Enricher::~Enricher() {
+	stop();
+
+	if (m_slots) {
+		for (u32 i = 0; i < ENRICH_SLOTS; ++i) {
+			m_slots[i].event.path.reset();
+		}
+
+		mem_free(m_slots);
+	}
+
+	DeleteCriticalSection(&m_lock);
+}
+
+b32 Enricher::start(Monitor* monitor, Fingerprints* fingerprints) {
+	assert(monitor);
+	assert(fingerprints);
+
+	if (m_thread) {
+		return false;
+	}
+
+	if (m_slots == nullptr) {
+		m_slots = (EnrichSlot*)mem_calloc(MemoryTagQueue, ENRICH_SLOTS, sizeof(*m_slots));
+		if (m_slots == nullptr) {
+			return false;
+		}
+
+		for (u32 i = 0; i < ENRICH_SLOTS; ++i) {
+			m_slots[i].owner = this;
+		}
+	}
+
+	m_monitor = monitor;
+	m_fingerprints = fingerprints;
+	m_ended = false;
+	m_thread = CreateThread(nullptr, 0, pump_thread_callback, this, 0, nullptr);
+
+	if (m_thread == nullptr) {
+		m_ended = true;
+		return false;
+	}
+
+	return true;
+}
+
+void Enricher::stop() {
+	if (m_thread) {
+		WaitForSingleObject(m_thread, INFINITE);
+		CloseHandle(m_thread);
+		m_thread = nullptr;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	while (m_pending) {
+		SleepConditionVariableCS(&m_ready, &m_lock, INFINITE);
+	}
+
+	LeaveCriticalSection(&m_lock);
+}
+
+b32 Enricher::receive(AppEvent* ev) {
+	assert(ev);
+
+	if (m_slots == nullptr) {
+		return false;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	for (;;) {
+		if (m_is_woken) {
+			m_is_woken = false;
+			LeaveCriticalSection(&m_lock);
+
+			ev->path.clear();
+			return true;
+		}
+
+		if (m_head != m_tail && m_slots[m_head % ENRICH_SLOTS].is_done) {
+			break;
+		}
+
+		if (m_head == m_tail && m_ended) {
+			LeaveCriticalSection(&m_lock);
+			return false;
+		}
+
+		SleepConditionVariableCS(&m_ready, &m_lock, INFINITE);
+	}
+
+	EnrichSlot* slot = m_slots + (m_head % ENRICH_SLOTS);
+	ev->path = static_cast<Path&&>(slot->event.path);
+	ev->size = slot->event.size;
+	ev->write_time = slot->event.write_time;
+	ev->fingerprint = slot->event.fingerprint;
+	ev->exists = slot->event.exists;
+	ev->has_fingerprint = slot->event.has_fingerprint;
+
+	slot->is_done = false;
+	++m_head;
+
+	LeaveCriticalSection(&m_lock);
+	WakeConditionVariable(&m_space);
+
+	return true;
+}
+
+b32 Enricher::wait(u32 timeout) {
+	if (m_slots == nullptr) {
+		return true;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	b32 result = true;
+	for (;;) {
+		if (m_is_woken || (m_head != m_tail && m_slots[m_head % ENRICH_SLOTS].is_done)) {
+			break;
+		}
+
+		if (m_head == m_tail && m_ended) {
+			break;
+		}
+
+		if (SleepConditionVariableCS(&m_ready, &m_lock, timeout) == FALSE && GetLastError() == ERROR_TIMEOUT) {
+			result = false;
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	return result;
+}
+
+void Enricher::wake() {
+	EnterCriticalSection(&m_lock);
+	m_is_woken = true;
+	LeaveCriticalSection(&m_lock);
+
+	WakeAllConditionVariable(&m_ready);
+}
+
+void Enricher::enrich(AppEvent* ev) {
+	TRACE_SCOPE("Enricher::enrich");
+	assert(ev);
+
+	ev->size = 0;
+	ev->write_time = {};
+	ev->fingerprint = {};
+	ev->exists = false;
+	ev->has_fingerprint = false;
+
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (GetFileAttributesExW(ev->path.c_str(), GetFileExInfoStandard, &data) &&
+		(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+		ev->size = ((u64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		ev->write_time = data.ftLastWriteTime;
+		ev->exists = true;
+		ev->has_fingerprint = m_fingerprints->compute(ev->path.c_str(), &ev->fingerprint);
+	}
+}
+
+void CALLBACK Enricher::enrich_callback(PTP_CALLBACK_INSTANCE instance, PVOID context) {
+	EnrichSlot* slot = (EnrichSlot*)context;
+	Enricher* enricher = slot->owner;
+
+	enricher->enrich(&slot->event);
+
+	EnterCriticalSection(&enricher->m_lock);
+	slot->is_done = true;
+	--enricher->m_pending;
+	LeaveCriticalSection(&enricher->m_lock);
+
+	WakeAllConditionVariable(&enricher->m_ready);
+}
+
+DWORD Enricher::pump_thread() {
+	Path path;
+
+	while (m_monitor->receive(&path)) {
+		EnterCriticalSection(&m_lock);
+
+		b32 is_duplicate = false;
+		for (u64 i = m_head; i < m_tail && is_duplicate == false; ++i) {
+			is_duplicate = (wcscmp(m_slots[i % ENRICH_SLOTS].event.path.c_str(), path.c_str()) == 0);
+		}
+
+		if (is_duplicate) {
+			LeaveCriticalSection(&m_lock);
+			continue;
+		}
+
+		while (m_tail - m_head == ENRICH_SLOTS) {
+			SleepConditionVariableCS(&m_space, &m_lock, INFINITE);
+		}
+
+		EnrichSlot* slot = m_slots + (m_tail % ENRICH_SLOTS);
+		slot->event.path = static_cast<Path&&>(path);
+		slot->is_done = false;
+
+		++m_tail;
+		++m_pending;
+
+		LeaveCriticalSection(&m_lock);
+
+		if (TrySubmitThreadpoolCallback(enrich_callback, slot, nullptr) == FALSE) {
+			enrich_callback(nullptr, slot);
+		}
+	}
+
+	EnterCriticalSection(&m_lock);
+	m_ended = true;
+	LeaveCriticalSection(&m_lock);
+
+	WakeAllConditionVariable(&m_ready);
+
+	return 0;
+}
+
+DWORD WINAPI Enricher::pump_thread_callback(LPVOID context) {
+	Enricher* enricher = (Enricher*)context;
+	if (enricher) {
+		return enricher->pump_thread();
+	}
+
+	return 0;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "core.h"
+#include "fingerprint.h"
+#include "monitor.h"
+#include "path.h"
+#include <Windows.h>
+
+// A drop event enriched with metadata about the application that caused it.
+struct AppEvent {
+	Path path;
+	u64 size;
+	FILETIME write_time;
+	Fingerprint fingerprint;
+	b32 exists;
+	b32 has_fingerprint;
+};
+
+// Enrichment stage between the monitor and the decision step. Events are pulled from the monitor, enriched in
+// parallel on the system thread pool and handed on in the order they left the monitor. An event for an application
+// that is already being enriched is dropped, since the decision for the first event covers it.
+class Enricher {
+public:
+	// Creates a stopped enricher.
+	Enricher();
+
+	// Destroys the enricher, waiting for outstanding work.
+	~Enricher();
+
+	// Starts pulling events from the monitor, fingerprinting applications through the given cache. Returns true on
+	// success.
+	b32 start(Monitor* monitor, Fingerprints* fingerprints);
+
+	// Waits for the enricher to drain after the monitor has been stopped.
+	void stop();
+
+	// Blocks and receives the next enriched event, or an event with an empty path after a wake. Returns false once the
+	// monitor has stopped and every event has been delivered.
+	b32 receive(AppEvent* ev);
+
+	// Blocks until an event can be received or the enricher has ended, for at most the given time in milliseconds.
+	// Returns false if the time ran out.
+	b32 wait(u32 timeout);
+
+	// Wakes the receiving thread, whose next receive returns an event with an empty path ahead of the events that are
+	// ready. Lets other threads hand work to the receiving thread.
+	void wake();
+
+private:
+	// A slot in the reorder buffer.
+	struct EnrichSlot {
+		Enricher* owner;
+		AppEvent event;
+		b32 is_done;
+	};
+
+	// Enriches the event.
+	void enrich(AppEvent* ev);
+
+	// Thread pool callback for enriching a slot.
+	static void CALLBACK enrich_callback(PTP_CALLBACK_INSTANCE instance, PVOID context);
+
+	// Pump thread routine, moving events from the monitor into the reorder buffer.
+	DWORD pump_thread();
+
+	// Pump thread routine callback.
+	static DWORD WINAPI pump_thread_callback(LPVOID context);
+
+	CRITICAL_SECTION m_lock;
+	CONDITION_VARIABLE m_ready;
+	CONDITION_VARIABLE m_space;
+	Monitor* m_monitor = nullptr;
+	Fingerprints* m_fingerprints = nullptr;
+	EnrichSlot* m_slots = nullptr;
+	HANDLE m_thread = nullptr;
+	u64 m_head = 0;
+	u64 m_tail = 0;
+	u32 m_pending = 0;
+	b32 m_ended = true;
+	b32 m_is_woken = false;
+};
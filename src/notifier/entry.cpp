@@ -1,16 +1,142 @@
 #include "app.h"
+#include "blocklist.h"
+#include "canon.h"
+#include "collector.h"
+#include "fs.h"
+#include "mem.h"
+#include "policy.h"
+#include "sim.h"
 #include <Windows.h>
+#include <shellapi.h>
+#include <wchar.h>
 
+// File name of the simulation report, located next to the executable. Only written when built with NOTIFIER_SIMULATION.
+static WCHAR const SIMULATION_NAME[] = L"simulation.csv";
+
+// Runs a simulation of the pipeline and writes its report. Returns the exit code: zero if every check held.
+static int simulate(int argc, WCHAR** argv) {
+	SimulationConfig config = {};
+	if (simulation_parse(argc, argv, &config) == false) {
+		MessageBoxW(0, L"Invalid simulation.", L"Error", MB_OK);
+		return 1;
+	}
+
+	SimulationHour* hours = (SimulationHour*)mem_calloc(MemoryTagOther, config.hours, sizeof(*hours));
+	size_t size = 256 * ((size_t)config.hours + 1);
+	char* report = (char*)mem_alloc(MemoryTagOther, size);
+
+	int result = 1;
+
+	if (hours && report && simulation_run(&config, hours)) {
+		u64 failures = 0;
+		for (u32 i = 0; i < config.hours; ++i) {
+			failures += hours[i].failures;
+		}
+
+		WCHAR path[MAX_PATH + 1];
+		size_t count = simulation_format(hours, config.hours, report, size);
+
+		if (count && fs_module_path(path, COUNT(path), SIMULATION_NAME) && fs_write_atomic(path, report, count) &&
+			failures == 0) {
+			result = 0;
+		}
+	}
+
+	mem_free(report);
+	mem_free(hours);
+
+	return result;
+}
 
 // Entry point for the notifier.
 int CALLBACK WinMain(_In_ HINSTANCE instance, _In_ HINSTANCE prev, _In_ LPSTR line, _In_ int show) {
+	int argc = 0;
+	LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+
+	// Policy compiler: notifier.exe /compile <policy.txt> <policy.bin>
+	if (argv && argc == 4 && _wcsicmp(argv[1], L"/compile") == 0) {
+		b32 result = Policy::compile(argv[2], argv[3]);
+		LocalFree(argv);
+
+		if (result == false) {
+			MessageBoxW(0, L"Could not compile policy.", L"Error", MB_OK);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// Blocklist compiler: notifier.exe /blocklist <blocklist.txt> <blocklist.bin>
+	if (argv && argc == 4 && _wcsicmp(argv[1], L"/blocklist") == 0) {
+		b32 result = Blocklist::compile(argv[2], argv[3]);
+		LocalFree(argv);
+
+		if (result == false) {
+			MessageBoxW(0, L"Could not compile blocklist.", L"Error", MB_OK);
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// System-wide collector: notifier.exe /collector [stop]
+	if (argv && (argc == 2 || argc == 3) && _wcsicmp(argv[1], L"/collector") == 0) {
+		b32 result = false;
+		if (argc == 3 && _wcsicmp(argv[2], L"stop") == 0) {
+			result = Collector::stop();
+		} else if (argc == 2) {
+			Collector collector;
+			result = collector.run();
+		}
+
+		LocalFree(argv);
+
+		return result ? 0 : 1;
+	}
+
+	// Pipeline simulation: notifier.exe /simulate [apps=N] [skew=S] [rate=R] [answer=A] [temporary=T] [hours=H] [seed=X]
+	if (argv && argc >= 2 && _wcsicmp(argv[1], L"/simulate") == 0) {
+		int result = simulate(argc - 2, argv + 2);
+		LocalFree(argv);
+
+		return result;
+	}
+
+	// Decision sync: notifier.exe /sync <directory>
+	WCHAR const* sync_dir = nullptr;
+	if (argv && argc == 3 && _wcsicmp(argv[1], L"/sync") == 0) {
+		sync_dir = argv[2];
+	}
+
+	// Synthetic workload: notifier.exe /workload [apps=N] [skew=S] [rate=R] [burst=B] [churn=C] [endpoints=E] [seconds=T]
+	WorkloadConfig workload_config = {};
+	WorkloadConfig const* workload = nullptr;
+	if (argv && argc >= 2 && _wcsicmp(argv[1], L"/workload") == 0) {
+		if (workload_parse(argc - 2, argv + 2, &workload_config) == false) {
+			MessageBoxW(0, L"Invalid workload.", L"Error", MB_OK);
+			LocalFree(argv);
+			return 1;
+		}
+
+		workload = &workload_config;
+	}
+
 	if (FAILED(CoInitializeEx(0, COINIT_MULTITHREADED))) {
 		MessageBoxW(0, L"Could not initialize COM.", L"Error", MB_OK);
+		LocalFree(argv);
 		return 0;
 	}
 
-	App app;
-	app.run();
+	{
+		App app;
+		app.run(sync_dir, workload);
+	}
+
+	// Whatever is still allocated now has outlived its owner.
+	canon_release();
+	mem_report();
+
+	LocalFree(argv);
 
 	return 0;
 }
@@ -0,0 +1,232 @@
+#include "fingerprint.h"
+#include "mem.h"
+#include "trace.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of cached file fingerprints. Must be a power of two.
+static const u32 FILE_CACHE_SIZE = 1024;
+
+// Number of recorded fingerprint decisions. Must be a power of two.
+static const u32 VERDICT_CACHE_SIZE = 4096;
+
+// Largest file that is fingerprinted, in bytes.
+static const u64 MAX_FILE_SIZE = 0x80000000;
+
+// Bytes hashed per call, so that every call fits the length the hash functions take.
+static const u64 HASH_CHUNK_SIZE = 0x100000;
+
+// Hash mixing primes.
+static const u64 PRIME64_2 = 0xc2b2ae3d27d4eb4f;
+static const u64 PRIME64_3 = 0x165667b19e3779f9;
+
+// Returns the avalanched value of x.
+static u64 mix64(u64 x) {
+	x ^= x >> 33;
+	x *= PRIME64_2;
+	x ^= x >> 29;
+	x *= PRIME64_3;
+	x ^= x >> 32;
+
+	return x;
+}
+
+// Returns the first slot of the fingerprint in the verdict table.
+static u32 verdict_slot(Fingerprint const* fp) {
+	u32 slot;
+	memcpy(&slot, fp->digest, sizeof(slot));
+
+	return slot & (VERDICT_CACHE_SIZE - 1);
+}
+
+// Returns true if both fingerprints are the same.
+static b32 fingerprint_equals(Fingerprint const* a, Fingerprint const* b) {
+	return memcmp(a->digest, b->digest, sizeof(a->digest)) == 0;
+}
+
+Fingerprints::Fingerprints() {
+	InitializeSRWLock(&m_lock);
+
+	if (BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&m_algorithm, BCRYPT_SHA256_ALGORITHM, nullptr, 0)) == false) {
+		m_algorithm = nullptr;
+	}
+
+	m_files = (FingerprintFile*)mem_calloc(MemoryTagFingerprints, FILE_CACHE_SIZE, sizeof(*m_files));
+	m_verdicts = (FingerprintVerdict*)mem_calloc(MemoryTagFingerprints, VERDICT_CACHE_SIZE, sizeof(*m_verdicts));
+}
+
+Fingerprints::~Fingerprints() {
+	mem_free(m_verdicts);
+	mem_free(m_files);
+
+	if (m_algorithm) {
+		BCryptCloseAlgorithmProvider(m_algorithm, 0);
+	}
+}
+
+b32 Fingerprints::compute(WCHAR const* path, Fingerprint* dst) {
+	TRACE_SCOPE("Fingerprints::compute");
+	assert(path);
+	assert(dst);
+
+	if (m_files == nullptr || m_algorithm == nullptr) {
+		return false;
+	}
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(file, &info) == FALSE) {
+		CloseHandle(file);
+		return false;
+	}
+
+	FingerprintFile key = {};
+	key.file_id = ((u64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	key.size = ((u64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	key.write_time = ((u64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+	key.volume = info.dwVolumeSerialNumber;
+	key.is_used = true;
+
+	FingerprintFile* slot = m_files + (mix64(key.file_id ^ ((u64)key.volume << 32)) & (FILE_CACHE_SIZE - 1));
+
+	AcquireSRWLockShared(&m_lock);
+
+	b32 is_cached = slot->is_used && slot->file_id == key.file_id && slot->volume == key.volume &&
+		slot->size == key.size && slot->write_time == key.write_time;
+
+	if (is_cached) {
+		*dst = slot->fp;
+	}
+
+	ReleaseSRWLockShared(&m_lock);
+
+	if (is_cached) {
+		CloseHandle(file);
+		return true;
+	}
+
+	b32 result = false;
+
+	if (key.size == 0) {
+		result = hash_data(nullptr, 0, &key.fp);
+	} else if (key.size <= MAX_FILE_SIZE) {
+		HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping) {
+			u8 const* data = (u8 const*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			if (data) {
+				result = hash_data(data, key.size, &key.fp);
+				UnmapViewOfFile(data);
+			}
+
+			CloseHandle(mapping);
+		}
+	}
+
+	CloseHandle(file);
+
+	if (result) {
+		AcquireSRWLockExclusive(&m_lock);
+		*slot = key;
+		ReleaseSRWLockExclusive(&m_lock);
+
+		*dst = key.fp;
+	}
+
+	return result;
+}
+
+void Fingerprints::set_verdict(Fingerprint const* fp, b32 is_allowed) {
+	assert(fp);
+
+	if (m_verdicts == nullptr) {
+		return;
+	}
+
+	u32 mask = VERDICT_CACHE_SIZE - 1;
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	for (u32 i = verdict_slot(fp);; i = (i + 1) & mask) {
+		FingerprintVerdict* verdict = m_verdicts + i;
+
+		if (verdict->is_used && fingerprint_equals(&verdict->fp, fp)) {
+			verdict->is_allowed = is_allowed;
+			break;
+		}
+
+		if (verdict->is_used == false) {
+			if (m_verdict_count < VERDICT_CACHE_SIZE / 4 * 3) {
+				verdict->fp = *fp;
+				verdict->is_used = true;
+				verdict->is_allowed = is_allowed;
+				++m_verdict_count;
+			}
+
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+b32 Fingerprints::get_verdict(Fingerprint const* fp, b32* is_allowed) {
+	assert(fp);
+	assert(is_allowed);
+
+	if (m_verdicts == nullptr) {
+		return false;
+	}
+
+	u32 mask = VERDICT_CACHE_SIZE - 1;
+	b32 result = false;
+
+	AcquireSRWLockShared(&m_lock);
+
+	for (u32 i = verdict_slot(fp); m_verdicts[i].is_used; i = (i + 1) & mask) {
+		FingerprintVerdict const* verdict = m_verdicts + i;
+
+		if (fingerprint_equals(&verdict->fp, fp)) {
+			*is_allowed = verdict->is_allowed;
+			result = true;
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&m_lock);
+
+	return result;
+}
+
+b32 Fingerprints::hash_data(u8 const* data, u64 size, Fingerprint* dst) {
+	assert(data || size == 0);
+	assert(dst);
+
+	BCRYPT_HASH_HANDLE handle = nullptr;
+	if (BCRYPT_SUCCESS(BCryptCreateHash(m_algorithm, &handle, nullptr, 0, nullptr, 0, 0)) == false) {
+		return false;
+	}
+
+	b32 result = true;
+
+	// A mapped file that fails to page in raises an exception instead of returning an error.
+	__try {
+		for (u64 offset = 0; offset < size && result; offset += HASH_CHUNK_SIZE) {
+			ULONG count = (ULONG)MIN(size - offset, HASH_CHUNK_SIZE);
+			result = BCRYPT_SUCCESS(BCryptHashData(handle, (PUCHAR)data + offset, count, 0));
+		}
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		result = false;
+	}
+
+	result = result && BCRYPT_SUCCESS(BCryptFinishHash(handle, dst->digest, sizeof(dst->digest), 0));
+	BCryptDestroyHash(handle);
+
+	return result;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+#include <bcrypt.h>
+
+// A content fingerprint of an executable: the SHA-256 digest of the file, so that a crafted binary cannot take over
+// the decision made for another one.
+struct Fingerprint {
+	u8 digest[32];
+};
+
+// Content fingerprints of executables. Files are hashed through a read-only mapping, and the results are cached by
+// file identity, size and last write time so an unchanged binary is only hashed once. The decisions made for each
+// fingerprint are kept alongside, so the same binary reached through another path or a copy can reuse an earlier
+// decision.
+class Fingerprints {
+public:
+	// Creates an empty fingerprint cache.
+	Fingerprints();
+
+	// Destroys the fingerprint cache.
+	~Fingerprints();
+
+	// Computes the fingerprint of the file at the given path, using the cache when the file is unchanged. Returns
+	// true on success.
+	b32 compute(WCHAR const* path, Fingerprint* dst);
+
+	// Records the decision made for the binary with the given fingerprint.
+	void set_verdict(Fingerprint const* fp, b32 is_allowed);
+
+	// Retrieves the decision made for the binary with the given fingerprint. Returns true if one was recorded.
+	b32 get_verdict(Fingerprint const* fp, b32* is_allowed);
+
+private:
+	// Hashes the data into the fingerprint. Returns true on success.
+	b32 hash_data(u8 const* data, u64 size, Fingerprint* dst);
+
+	// A cached fingerprint of a file.
+	struct FingerprintFile {
+		u64 file_id;
+		u64 size;
+		u64 write_time;
+		u32 volume;
+		b32 is_used;
+		Fingerprint fp;
+	};
+
+	// A decision recorded for a fingerprint.
+	struct FingerprintVerdict {
+		Fingerprint fp;
+		b32 is_used;
+		b32 is_allowed;
+	};
+
+	SRWLOCK m_lock;
+	BCRYPT_ALG_HANDLE m_algorithm = nullptr;
+	FingerprintFile* m_files = nullptr;
+	FingerprintVerdict* m_verdicts = nullptr;
+	u32 m_verdict_count = 0;
+};
@@ -1,14 +1,58 @@
 #include "firewall.h"
+#include "canon.h"
+#include "compact.h"
+#include "fs.h"
+#include "key.h"
+#include "mem.h"
+#include "path.h"
+#include "rules.h"
+#include "trace.h"
 #include "wstr.h"
 #include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Minimum time to wait before rebuilding the cache, in milliseconds.
-static const ULONGLONG CACHE_AGE = 300000;
+static const u64 CACHE_AGE = 300000;
 
 // Maximum numebr of buckets in the block cache hash table.
 static const size_t CACHE_SIZE = 257;
 
+// File name of the precompiled application policy, located next to the executable.
+static WCHAR const POLICY_NAME[] = L"policy.bin";
+
+// File name of the precompiled remote address blocklist, located next to the executable.
+static WCHAR const BLOCKLIST_NAME[] = L"blocklist.bin";
+
+// Prefix of the names of the rules blocking addresses on the blocklist.
+static WCHAR const BLOCKLIST_RULE_PREFIX[] = L"Firewall Notifier blocklist ";
+
+// Number of buckets in the hash table of blocklist ranges with a rule.
+static const size_t BLOCKED_SIZE = 257;
+
+// Number of rules enumerated and extracted together during a cache rebuild.
+static const u32 RULE_BATCH_SIZE = 1024;
+
+// Number of rules a worker claims at a time while extracting a batch.
+static const LONG RULE_CHUNK_SIZE = 32;
+
+// Maximum number of pool workers extracting rule properties alongside the rebuilding thread.
+static const u32 MAX_RULE_WORKERS = 3;
+
+// A batch of rules whose properties are extracted in parallel.
+struct RuleBatch {
+	INetFwRule* rules[RULE_BATCH_SIZE];
+	Path paths[RULE_BATCH_SIZE];
+	b32 is_blocked[RULE_BATCH_SIZE];
+	u32 count;
+	volatile LONG next;
+};
+
+// Initial capacity of the rule list of a compaction.
+static const u32 COMPACT_CAPACITY = 4096;
+
 // Window firewall built-in profiles.
 static NET_FW_PROFILE_TYPE2 const PROFILE_TYPES[] = {
 	NET_FW_PROFILE2_PUBLIC,
@@ -16,9 +60,10 @@ static NET_FW_PROFILE_TYPE2 const PROFILE_TYPES[] = {
 	NET_FW_PROFILE2_DOMAIN
 };
 
-// Returns true if the rule is valid for the rule cache.
-static b32 is_valid_rule(INetFwRule* rule) {
+// Returns true if the rule is valid for the rule cache, and whether it blocks the application.
+static b32 is_valid_rule(INetFwRule* rule, b32* is_blocked) {
 	assert(rule);
+	assert(is_blocked);
 
 	NET_FW_RULE_DIRECTION dir;
 	if (FAILED(rule->get_Direction(&dir)) || dir == NET_FW_RULE_DIR_IN) {
@@ -37,6 +82,7 @@ static b32 is_valid_rule(INetFwRule* rule) {
 		NET_FW_ACTION action;
 		if (SUCCEEDED(rule->get_Action(&action))) {
 			if (action == NET_FW_ACTION_BLOCK || (action == NET_FW_ACTION_ALLOW && (ports == NULL || wcscmp(ports, L"*") == 0))) {
+				*is_blocked = (action == NET_FW_ACTION_BLOCK);
 				result = true;
 			}
 		}
@@ -47,12 +93,208 @@ static b32 is_valid_rule(INetFwRule* rule) {
 	return result;
 }
 
+// Extracts the canonical application path of the rule if the rule is valid for the rule cache, and whether it blocks
+// the application. Returns true on success.
+static b32 extract_rule_path(INetFwRule* rule, Path* dst, b32* is_blocked) {
+	assert(rule);
+	assert(dst);
+
+	if (is_valid_rule(rule, is_blocked) == false) {
+		return false;
+	}
+
+	BSTR path;
+	if (FAILED(rule->get_ApplicationName(&path)) || path == nullptr) {
+		return false;
+	}
+
+	b32 result = canon_path(path, dst);
+	SysFreeString(path);
+
+	return result;
+}
+
+// Returns true if the rule property is unset or matches everything.
+static b32 is_any(BSTR value) {
+	return value == nullptr || wcscmp(value, L"*") == 0 || _wcsicmp(value, L"All") == 0;
+}
+
+// Copies the string into the arena. Returns null on failure.
+static WCHAR const* arena_copy(Arena* arena, WCHAR const* src) {
+	assert(arena);
+	assert(src);
+
+	size_t size = (wcslen(src) + 1) * sizeof(*src);
+
+	WCHAR* dst = (WCHAR*)arena->alloc(size);
+	if (dst) {
+		memcpy(dst, src, size);
+	}
+
+	return dst;
+}
+
+// Extracts the properties of the rule used by the compaction analysis, copying its strings into the arena. Returns
+// true on success.
+static b32 extract_compact_rule(INetFwRule* rule, Arena* arena, CompactRule* dst) {
+	assert(rule);
+	assert(arena);
+	assert(dst);
+
+	*dst = {};
+
+	NET_FW_RULE_DIRECTION dir;
+	VARIANT_BOOL status;
+	NET_FW_ACTION action;
+	long protocol;
+	long profiles;
+
+	if (FAILED(rule->get_Direction(&dir)) || FAILED(rule->get_Enabled(&status)) || FAILED(rule->get_Action(&action)) ||
+		FAILED(rule->get_Protocol(&protocol)) || FAILED(rule->get_Profiles(&profiles))) {
+		return false;
+	}
+
+	b32 is_covering = dir == NET_FW_RULE_DIR_OUT && status == VARIANT_TRUE && protocol == NET_FW_IP_PROTOCOL_ANY &&
+		profiles == NET_FW_PROFILE2_ALL;
+
+	// Every restriction makes the rule narrower than the rules created by the notifier.
+	BSTR scopes[6] = {};
+	b32 has_scopes = SUCCEEDED(rule->get_LocalPorts(scopes + 0)) && SUCCEEDED(rule->get_RemotePorts(scopes + 1)) &&
+		SUCCEEDED(rule->get_LocalAddresses(scopes + 2)) && SUCCEEDED(rule->get_RemoteAddresses(scopes + 3)) &&
+		SUCCEEDED(rule->get_InterfaceTypes(scopes + 4)) && SUCCEEDED(rule->get_serviceName(scopes + 5));
+
+	for (size_t i = 0; i < COUNT(scopes); ++i) {
+		is_covering = is_covering && is_any(scopes[i]);
+		SysFreeString(scopes[i]);
+	}
+
+	if (has_scopes == false) {
+		return false;
+	}
+
+	BSTR name = nullptr;
+	BSTR app = nullptr;
+	if (FAILED(rule->get_Name(&name)) || FAILED(rule->get_ApplicationName(&app))) {
+		SysFreeString(name);
+		return false;
+	}
+
+	b32 result = true;
+
+	if (name) {
+		dst->name = arena_copy(arena, name);
+		result = (dst->name != nullptr);
+	}
+
+	Path path;
+	if (result && app && canon_path(app, &path)) {
+		dst->path = arena_copy(arena, path.c_str());
+		result = (dst->path != nullptr);
+	}
+
+	dst->flags |= (action == NET_FW_ACTION_ALLOW) ? CompactFlagAllow : 0;
+	dst->flags |= is_covering ? CompactFlagCovering : 0;
+	dst->flags |= (is_covering && name && app && wcscmp(name, app) == 0) ? CompactFlagNotifier : 0;
+
+	SysFreeString(name);
+	SysFreeString(app);
+
+	return result;
+}
+
+// Orders compaction rules by name, and rules of the same name by their position in the rule store.
+static int compare_rule_names(void const* a, void const* b) {
+	CompactRule const* ra = *(CompactRule const**)a;
+	CompactRule const* rb = *(CompactRule const**)b;
+
+	int result = _wcsicmp(ra->name, rb->name);
+	if (result == 0) {
+		result = (ra < rb) ? -1 : (ra > rb);
+	}
+
+	return result;
+}
+
+// Extracts rule paths from the batch until every rule in it has been claimed.
+static void extract_rule_batch(RuleBatch* batch) {
+	assert(batch);
+
+	for (;;) {
+		LONG start = InterlockedExchangeAdd(&batch->next, RULE_CHUNK_SIZE);
+		if (start >= (LONG)batch->count) {
+			break;
+		}
+
+		u32 end = MIN(batch->count, (u32)(start + RULE_CHUNK_SIZE));
+		for (u32 i = (u32)start; i < end; ++i) {
+			if (extract_rule_path(batch->rules[i], batch->paths + i, batch->is_blocked + i) == false) {
+				batch->paths[i].clear();
+			}
+		}
+	}
+}
+
+// Thread pool callback for extracting rule paths.
+static void CALLBACK extract_rule_batch_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work) {
+	extract_rule_batch((RuleBatch*)context);
+}
+
+// Formats the address in its text form. Returns the number of characters written.
+static size_t format_address(BlocklistAddress address, b32 is_v6, WCHAR* dst, size_t count) {
+	assert(dst);
+
+	int result;
+	if (is_v6) {
+		result = _snwprintf_s(dst, count, _TRUNCATE, L"%x:%x:%x:%x:%x:%x:%x:%x", (u32)(address.hi >> 48) & 0xffff,
+			(u32)(address.hi >> 32) & 0xffff, (u32)(address.hi >> 16) & 0xffff, (u32)address.hi & 0xffff,
+			(u32)(address.lo >> 48) & 0xffff, (u32)(address.lo >> 32) & 0xffff, (u32)(address.lo >> 16) & 0xffff,
+			(u32)address.lo & 0xffff);
+	} else {
+		u32 value = (u32)(address.hi >> 32);
+		result = _snwprintf_s(dst, count, _TRUNCATE, L"%u.%u.%u.%u", value >> 24, (value >> 16) & 0xff,
+			(value >> 8) & 0xff, value & 0xff);
+	}
+
+	return (result > 0) ? (size_t)result : 0;
+}
+
+// Returns the bucket of a blocklist range in the hash table of ranges with a rule.
+static size_t blocked_bucket(BlocklistRange const* range, b32 is_v6) {
+	u64 hash = (range->first.hi ^ (range->first.lo * 0x9e3779b97f4a7c15)) + is_v6;
+	return (size_t)((hash ^ (hash >> 32)) % BLOCKED_SIZE);
+}
+
 Firewall::Firewall() {
-	m_cache = (FirewallRule**)calloc(CACHE_SIZE, sizeof(*m_cache));
-	if (m_cache == nullptr) {
+	InitializeSRWLock(&m_lock);
+	InitializeSRWLock(&m_rebuild_lock);
+	InitializeSRWLock(&m_blocked_lock);
+
+	for (size_t i = 0; i < COUNT(m_caches); ++i) {
+		m_caches[i].arena.set_tag(MemoryTagFirewallCache);
+	}
+
+	m_blocked_arena.set_tag(MemoryTagFirewallCache);
+	m_blocked = (BlockedRange**)m_blocked_arena.alloc(BLOCKED_SIZE * sizeof(*m_blocked));
+
+	m_cache = m_caches;
+	if (m_blocked == nullptr || cache_reset(m_cache) == false) {
 		return;
 	}
 
+	WCHAR policy_path[MAX_PATH + 1];
+	if (fs_module_path(policy_path, COUNT(policy_path), POLICY_NAME)) {
+		m_app_policy.load(policy_path);
+	}
+
+	WCHAR blocklist_path[MAX_PATH + 1];
+	if (fs_module_path(blocklist_path, COUNT(blocklist_path), BLOCKLIST_NAME)) {
+		m_blocklist.load(blocklist_path);
+	}
+
+	// Paths in the built-in table are relative to the root of the system volume.
+	WCHAR system_device[MAX_PATH + 1];
+	builtin_root(m_system_root, COUNT(m_system_root), system_device, COUNT(system_device));
+
 	if (FAILED(CoCreateInstance(__uuidof(NetFwPolicy2), NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&m_policy)))) {
 		return;
 	}
@@ -77,8 +319,6 @@ Firewall::~Firewall() {
 	if (m_policy) {
 		m_policy->Release();
 	}
-
-	free(m_cache);
 }
 
 b32 Firewall::add_rule(WCHAR const* path, b32 is_allowed) {
@@ -88,60 +328,349 @@ b32 Firewall::add_rule(WCHAR const* path, b32 is_allowed) {
 		return false;
 	}
 
-	INetFwRule* rule;
-	if (FAILED(CoCreateInstance(__uuidof(NetFwRule), NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&rule)))) {
+	Key key;
+	if (key.assign(path) == false) {
 		return false;
 	}
 
-	bool result = false;
+	cache_restore();
 
-	BSTR com_path = SysAllocString(path);
-	if (com_path) {
-		rule->put_Name(com_path);
-		rule->put_ApplicationName(com_path);
-		rule->put_Profiles(NET_FW_PROFILE2_ALL);
-		rule->put_Protocol(NET_FW_IP_PROTOCOL_ANY);
-		rule->put_Direction(NET_FW_RULE_DIR_OUT);
-		rule->put_Enabled(VARIANT_TRUE);
-		rule->put_Action(is_allowed ? NET_FW_ACTION_ALLOW : NET_FW_ACTION_BLOCK);
+	// A second rule named after the same path would only pile up in the rule store.
+	AcquireSRWLockShared(&m_lock);
+	b32 is_cached = cache_find(m_cache, &key);
+	ReleaseSRWLockShared(&m_lock);
 
-		HRESULT hr = m_rules->Add(rule);
-		result = SUCCEEDED(hr);
+	if (is_cached) {
+		return true;
+	}
 
-		SysFreeString(com_path);
+	b32 result = insert_rule(path, is_allowed);
+
+	if (result) {
+		AcquireSRWLockExclusive(&m_lock);
+		cache_insert(&key, is_allowed == false);
+		ReleaseSRWLockExclusive(&m_lock);
 	}
 
-	rule->Release();
+	return result;
+}
+
+u32 Firewall::add_rules(RuleDecision const* decisions, u32 count) {
+	TRACE_SCOPE("Firewall::add_rules");
+	assert(decisions || count == 0);
+
+	if (m_is_initialized == false || count == 0) {
+		return 0;
+	}
+
+	b32* is_added = (b32*)mem_calloc(MemoryTagFirewallCache, count, sizeof(*is_added));
+	if (is_added == nullptr) {
+		return 0;
+	}
+
+	Key key;
+
+	cache_restore();
+	AcquireSRWLockShared(&m_lock);
+
+	for (u32 i = 0; i < count; ++i) {
+		is_added[i] = key.assign(decisions[i].path) && cache_find(m_cache, &key) == false;
+	}
+
+	ReleaseSRWLockShared(&m_lock);
+
+	u32 added = 0;
+	for (u32 i = 0; i < count; ++i) {
+		if (is_added[i]) {
+			is_added[i] = insert_rule(decisions[i].path, decisions[i].is_allowed);
+			added += (is_added[i] != false);
+		}
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	for (u32 i = 0; i < count; ++i) {
+		if (is_added[i] && key.assign(decisions[i].path)) {
+			cache_insert(&key, decisions[i].is_allowed == false);
+		}
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	mem_free(is_added);
+
+	return added;
+}
+
+b32 Firewall::check_remote_address(b32 is_v6, u32 address_v4, u8 const* address_v6) {
+	TRACE_SCOPE("Firewall::check_remote_address");
+	assert(is_v6 == false || address_v6);
+
+	if (m_is_initialized == false) {
+		return false;
+	}
+
+	BlocklistRange range;
+	if ((is_v6 ? m_blocklist.lookup_v6(address_v6, &range) : m_blocklist.lookup_v4(address_v4, &range)) == false) {
+		return false;
+	}
+
+	size_t bucket = blocked_bucket(&range, is_v6);
+
+	// Every address of a range is covered by the same rule, so a range is only queued once.
+	AcquireSRWLockExclusive(&m_blocked_lock);
+
+	BlockedRange* blocked = m_blocked[bucket];
+	while (blocked && (blocked->is_v6 != is_v6 || memcmp(&blocked->range, &range, sizeof(range)))) {
+		blocked = blocked->next;
+	}
+
+	b32 is_queued = false;
+	if (blocked == nullptr) {
+		blocked = (BlockedRange*)m_blocked_arena.alloc(sizeof(*blocked));
+		if (blocked) {
+			blocked->next = m_blocked[bucket];
+			blocked->range = range;
+			blocked->is_v6 = is_v6;
+			m_blocked[bucket] = blocked;
+			is_queued = true;
+		}
+	} else if (blocked->is_failed) {
+		blocked->is_failed = false;
+		is_queued = true;
+	}
+
+	if (is_queued) {
+		blocked->next_queued = m_blocked_queue;
+		m_blocked_queue = blocked;
+	}
+
+	ReleaseSRWLockExclusive(&m_blocked_lock);
+
+	return is_queued;
+}
+
+u32 Firewall::add_blocked_rules() {
+	TRACE_SCOPE("Firewall::add_blocked_rules");
+
+	AcquireSRWLockExclusive(&m_blocked_lock);
+	BlockedRange* queue = m_blocked_queue;
+	m_blocked_queue = nullptr;
+	ReleaseSRWLockExclusive(&m_blocked_lock);
+
+	// A range that failed can be queued again as soon as it is marked, so the link is read first.
+	u32 added = 0;
+	BlockedRange* next;
+	for (BlockedRange* blocked = queue; blocked; blocked = next) {
+		next = blocked->next_queued;
+
+		if (insert_blocked_rule(&blocked->range, blocked->is_v6)) {
+			added += 1;
+		} else {
+			AcquireSRWLockExclusive(&m_blocked_lock);
+			blocked->is_failed = true;
+			ReleaseSRWLockExclusive(&m_blocked_lock);
+		}
+	}
+
+	return added;
+}
+
+b32 Firewall::has_rule(WCHAR const * path) {
+	TRACE_SCOPE("Firewall::has_rule");
+	assert(path);
+
+	if (m_is_initialized == false) {
+		return false;
+	}
+
+	u64 now = GetTickCount64();
+	if (m_is_trimmed || now - m_cache_age > CACHE_AGE) {
+		m_app_policy.refresh();
+		m_blocklist.refresh();
+
+		cache_rebuild(false);
+	}
+
+	Key key;
+	if (key.assign(path) == false) {
+		return false;
+	}
+
+	u32 slot = 0;
+	BuiltinVerdict builtin = BuiltinVerdictNone;
+	if (m_system_root[0] && _wcsnicmp(path, m_system_root, 3) == 0) {
+		builtin = builtin_lookup(path + 3, &slot);
+	}
+
+	AcquireSRWLockShared(&m_lock);
+	b32 result = cache_find(m_cache, &key);
+	ReleaseSRWLockShared(&m_lock);
 
+	// The policy can override the verdicts of the built-in table.
 	if (result == false) {
-		cache_add_rule(path);
+		PolicyVerdict verdict = m_app_policy.lookup(path);
+
+		if (verdict != PolicyVerdictNone) {
+			result = add_rule(path, verdict == PolicyVerdictAllow);
+		} else if (builtin != BuiltinVerdictNone) {
+			result = add_rule(path, builtin == BuiltinVerdictAllow);
+		}
+	}
+
+	// The monitor ignores the drop events of a built-in binary only once its rule is known to exist.
+	if (result && builtin != BuiltinVerdictNone) {
+		m_builtin_rules.add(slot);
 	}
 
 	return result;
 }
 
-b32 Firewall::has_rule(WCHAR const * path) {
+b32 Firewall::has_block_rule(WCHAR const* path) {
 	assert(path);
 
+	// Looking the application up first adds the rules of the policy and the built-in table.
+	if (has_rule(path) == false) {
+		return false;
+	}
+
+	Key key;
+	if (key.assign(path) == false) {
+		return false;
+	}
+
+	AcquireSRWLockShared(&m_lock);
+	FirewallRule const* rule = cache_lookup(m_cache, &key);
+	b32 result = rule && rule->is_blocked;
+	ReleaseSRWLockShared(&m_lock);
+
+	return result;
+}
+
+b32 Firewall::compact(FirewallCompaction* report) {
+	TRACE_SCOPE("Firewall::compact");
+	assert(report);
+
+	*report = {};
+
 	if (m_is_initialized == false) {
 		return false;
 	}
 
-	ULONGLONG now = GetTickCount64();
-	if (now - m_cache_age > CACHE_AGE) {
-		cache_rebuild();
+	ULONGLONG start = GetTickCount64();
+
+	RuleSource source(m_rules);
+	if (source.failed()) {
+		return false;
 	}
 
-	FirewallRule* rule = m_cache[wcshash(path) % CACHE_SIZE];
-	while (rule) {
-		if (wcscmp(path, rule->path) == 0) {
-			return true;
+	Arena arena;
+	arena.set_tag(MemoryTagFirewallCache);
+
+	INetFwRule* batch[RULE_BATCH_SIZE];
+	u32 batch_count = 0;
+
+	CompactRule* rules = nullptr;
+	u32 count = 0;
+	u32 capacity = 0;
+	b32 result = true;
+
+	while (source.next(batch, RULE_BATCH_SIZE, &batch_count)) {
+		for (u32 i = 0; i < batch_count; ++i) {
+			if (result && count == capacity) {
+				u32 new_capacity = capacity ? 2 * capacity : COMPACT_CAPACITY;
+				void* memory = mem_realloc(MemoryTagFirewallCache, rules, new_capacity * sizeof(*rules));
+
+				if (memory) {
+					rules = (CompactRule*)memory;
+					capacity = new_capacity;
+				} else {
+					result = false;
+				}
+			}
+
+			// A rule that cannot be read could be the one deciding an application, so nothing is removed then.
+			if (result) {
+				result = extract_compact_rule(batch[i], &arena, rules + count++);
+			}
+
+			batch[i]->Release();
 		}
+	}
 
-		rule = rule->next;
+	u8* verdicts = result ? (u8*)mem_alloc(MemoryTagFirewallCache, count + 1) : nullptr;
+	CompactRule const** removals = result ? (CompactRule const**)mem_alloc(MemoryTagFirewallCache,
+		(count + 1) * sizeof(*removals)) : nullptr;
+
+	CompactStats stats = {};
+	result = result && source.failed() == false && verdicts && removals &&
+		compact_analyze(rules, count, verdicts, &stats);
+
+	if (result) {
+		report->rules_before = count;
+		report->duplicates = stats.duplicates;
+		report->shadowed = stats.shadowed;
+
+		// Rules can only be removed by name, so every notifier rule sharing a name with a removed one is removed and
+		// the ones to keep are added back.
+		u32 removal_count = 0;
+		for (u32 i = 0; i < count; ++i) {
+			if ((rules[i].flags & CompactFlagNotifier) && rules[i].name && rules[i].path) {
+				removals[removal_count++] = rules + i;
+			}
+		}
+
+		qsort(removals, removal_count, sizeof(*removals), compare_rule_names);
+
+		for (u32 first = 0, last = 0; first < removal_count; first = last) {
+			b32 is_removed = false;
+
+			for (last = first; last < removal_count && _wcsicmp(removals[first]->name, removals[last]->name) == 0; ++last) {
+				is_removed = is_removed || verdicts[removals[last] - rules] != CompactVerdictKeep;
+			}
+
+			if (is_removed == false) {
+				continue;
+			}
+
+			BSTR name = SysAllocString(removals[first]->name);
+			if (name == nullptr) {
+				report->failed += last - first;
+				continue;
+			}
+
+			u32 removed = 0;
+			while (removed < last - first && SUCCEEDED(m_rules->Remove(name))) {
+				removed += 1;
+			}
+
+			SysFreeString(name);
+
+			for (u32 i = first; i < last; ++i) {
+				CompactRule const* rule = removals[i];
+
+				if (verdicts[rule - rules] == CompactVerdictKeep &&
+					insert_rule(rule->name, (rule->flags & CompactFlagAllow) != 0) == false) {
+					report->failed += 1;
+				}
+			}
+		}
+
+		long rules_after = 0;
+		if (SUCCEEDED(m_rules->get_Count(&rules_after))) {
+			report->rules_after = (u32)rules_after;
+		}
+
+		cache_rebuild(true);
 	}
 
-	return false;
+	mem_free(removals);
+	mem_free(verdicts);
+	mem_free(rules);
+
+	report->elapsed = GetTickCount64() - start;
+
+	return result;
 }
 
 b32 Firewall::is_filtering() {
@@ -182,77 +711,310 @@ b32 Firewall::set_filtering(b32 is_filtering) {
 	return result;
 }
 
-void Firewall::cache_add_rule(WCHAR const* path) {
-	assert(m_is_initialized);
+b32 Firewall::trim() {
+	TRACE_SCOPE("Firewall::trim");
+
+	if (m_is_initialized == false) {
+		return true;
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	// A fresh cache is kept, since rebuilding it would cost more than it holds.
+	b32 result = m_is_trimmed || GetTickCount64() - m_cache_age >= CACHE_AGE;
+	if (result) {
+		m_cache->arena.reset();
+		m_cache->buckets = nullptr;
+		m_is_trimmed = true;
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return result;
+}
+
+b32 Firewall::insert_rule(WCHAR const* path, b32 is_allowed) {
 	assert(path);
+	assert(m_is_initialized);
+
+	INetFwRule* rule;
+	if (FAILED(CoCreateInstance(__uuidof(NetFwRule), NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&rule)))) {
+		return false;
+	}
+
+	bool result = false;
+
+	BSTR com_path = SysAllocString(path);
+	if (com_path) {
+		rule->put_Name(com_path);
+		rule->put_ApplicationName(com_path);
+		rule->put_Profiles(NET_FW_PROFILE2_ALL);
+		rule->put_Protocol(NET_FW_IP_PROTOCOL_ANY);
+		rule->put_Direction(NET_FW_RULE_DIR_OUT);
+		rule->put_Enabled(VARIANT_TRUE);
+		rule->put_Action(is_allowed ? NET_FW_ACTION_ALLOW : NET_FW_ACTION_BLOCK);
 
-	size_t i = wcshash(path) % CACHE_SIZE;
-	FirewallRule* rule = m_cache[i];
+		HRESULT hr = m_rules->Add(rule);
+		result = SUCCEEDED(hr);
+
+		SysFreeString(com_path);
+	}
+
+	rule->Release();
+
+	return result;
+}
+
+b32 Firewall::cache_find(FirewallCache const* cache, Key const* key) {
+	return cache_lookup(cache, key) != nullptr;
+}
+
+Firewall::FirewallRule* Firewall::cache_lookup(FirewallCache const* cache, Key const* key) {
+	assert(cache);
+	assert(key);
+
+	if (cache->buckets == nullptr) {
+		return nullptr;
+	}
 
+	FirewallRule* rule = cache->buckets[key->hash() % CACHE_SIZE];
 	while (rule) {
-		if (wcscmp(path, rule->path) == 0) {
-			return;
+		if (key->equals(rule->key, rule->size, rule->hash)) {
+			return rule;
 		}
 
 		rule = rule->next;
 	}
 
-	rule = (FirewallRule*)malloc(sizeof(*rule));
-	if (rule == nullptr) {
+	return nullptr;
+}
+
+void Firewall::cache_add_rule(FirewallCache* cache, Key const* key, b32 is_blocked) {
+	assert(cache);
+	assert(key);
+
+	if (cache->buckets == nullptr && cache_reset(cache) == false) {
+		return;
+	}
+
+	// Block rules take precedence over allow rules for the same application.
+	FirewallRule* rule = cache_lookup(cache, key);
+	if (rule) {
+		rule->is_blocked = rule->is_blocked || is_blocked;
 		return;
 	}
 
-	rule->path = _wcsdup(path);
-	if (rule->path == nullptr) {
-		free(rule);
+	size_t i = key->hash() % CACHE_SIZE;
+
+	rule = (FirewallRule*)cache->arena.alloc(offsetof(FirewallRule, key) + key->size());
+	if (rule == nullptr) {
 		return;
 	}
 
-	rule->next = m_cache[i];
-	m_cache[i] = rule;
+	memcpy(rule->key, key->data(), key->size());
+	rule->hash = key->hash();
+	rule->size = (u32)key->size();
+	rule->is_blocked = is_blocked;
+
+	rule->next = cache->buckets[i];
+	cache->buckets[i] = rule;
+}
+
+b32 Firewall::cache_reset(FirewallCache* cache) {
+	assert(cache);
+
+	cache->arena.reset();
+	cache->buckets = (FirewallRule**)cache->arena.alloc(CACHE_SIZE * sizeof(*cache->buckets));
+
+	return cache->buckets != nullptr;
+}
+
+void Firewall::cache_insert(Key const* key, b32 is_blocked) {
+	assert(key);
+
+	cache_add_rule(m_cache, key, is_blocked);
+
+	// The rebuild may have read the rule store before the rule was added.
+	if (m_building) {
+		cache_add_rule(m_building, key, is_blocked);
+	}
 }
 
-void Firewall::cache_rebuild() {
+void Firewall::cache_rebuild(b32 is_forced) {
+	TRACE_SCOPE("Firewall::cache_rebuild");
 	assert(m_is_initialized);
 
-	IUnknown* temp;
-	if (FAILED(m_rules->get__NewEnum(&temp))) {
+	AcquireSRWLockExclusive(&m_rebuild_lock);
+
+	// Another thread may have rebuilt the cache while this one waited.
+	if (is_forced == false && m_is_trimmed == false && GetTickCount64() - m_cache_age <= CACHE_AGE) {
+		ReleaseSRWLockExclusive(&m_rebuild_lock);
 		return;
 	}
 
-	IEnumVARIANT* enum_var;
-	HRESULT hr = temp->QueryInterface(IID_PPV_ARGS(&enum_var));
-	temp->Release();
+	RuleSource source(m_rules);
+	RuleBatch* batch = source.failed() ? nullptr :
+		(RuleBatch*)mem_calloc(MemoryTagFirewallCache, 1, sizeof(*batch));
+
+	FirewallCache* cache = nullptr;
+	if (batch) {
+		AcquireSRWLockExclusive(&m_lock);
 
-	if (FAILED(hr)) {
+		cache = (m_cache == m_caches) ? m_caches + 1 : m_caches;
+		if (cache_reset(cache)) {
+			m_building = cache;
+		} else {
+			cache = nullptr;
+		}
+
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	if (cache == nullptr) {
+		mem_free(batch);
+		ReleaseSRWLockExclusive(&m_rebuild_lock);
 		return;
 	}
 
-	for (;;) {
-		ULONG fetched;
-		VARIANT var;
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
 
-		hr = enum_var->Next(1, &var, &fetched);
-		if (FAILED(hr) || hr == S_FALSE) {
-			break;
+	u32 workers = MIN((u32)info.dwNumberOfProcessors, MAX_RULE_WORKERS + 1) - 1;
+	PTP_WORK work = workers ? CreateThreadpoolWork(extract_rule_batch_callback, batch, nullptr) : nullptr;
+	Key key;
+
+	while (source.next(batch->rules, RULE_BATCH_SIZE, &batch->count)) {
+		batch->next = 0;
+
+		if (work && batch->count > (u32)RULE_CHUNK_SIZE) {
+			for (u32 i = 0; i < workers; ++i) {
+				SubmitThreadpoolWork(work);
+			}
+
+			extract_rule_batch(batch);
+			WaitForThreadpoolWorkCallbacks(work, FALSE);
+		} else {
+			extract_rule_batch(batch);
 		}
 
-		if (var.vt == VT_DISPATCH && var.pdispVal != NULL) {
-			INetFwRule *rule;
-			if (SUCCEEDED(var.pdispVal->QueryInterface(IID_PPV_ARGS(&rule)))) {
-				if (is_valid_rule(rule)) {
-					BSTR path;
-					if (SUCCEEDED(rule->get_ApplicationName(&path)) && path) {
-						_wcslwr(path);
-						cache_add_rule(path);
-						SysFreeString(path);
-					}
-				}
+		// Only the insertion of a batch is serialized with lookups, never the rule store queries.
+		AcquireSRWLockExclusive(&m_lock);
 
-				rule->Release();
+		for (u32 i = 0; i < batch->count; ++i) {
+			if (batch->paths[i].empty() == false && key.assign(batch->paths[i].c_str(), batch->paths[i].size())) {
+				cache_add_rule(cache, &key, batch->is_blocked[i]);
 			}
 		}
 
-		VariantClear(&var);
+		ReleaseSRWLockExclusive(&m_lock);
+
+		for (u32 i = 0; i < batch->count; ++i) {
+			batch->rules[i]->Release();
+		}
+	}
+
+	if (work) {
+		CloseThreadpoolWork(work);
+	}
+
+	for (u32 i = 0; i < RULE_BATCH_SIZE; ++i) {
+		batch->paths[i].reset();
+	}
+
+	mem_free(batch);
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	m_building = nullptr;
+
+	if (source.failed() == false) {
+		FirewallCache* retired = m_cache;
+		m_cache = cache;
+		cache = retired;
+		m_is_trimmed = false;
+
+		builtin_refresh();
+	}
+
+	cache->arena.reset();
+	cache->buckets = nullptr;
+
+	m_cache_age = GetTickCount64();
+
+	ReleaseSRWLockExclusive(&m_lock);
+	ReleaseSRWLockExclusive(&m_rebuild_lock);
+}
+
+void Firewall::builtin_refresh() {
+	if (m_system_root[0] == L'\0') {
+		return;
+	}
+
+	Path path;
+	Key key;
+
+	for (u32 slot = 0; slot < BUILTIN_MAX_SLOTS; ++slot) {
+		WCHAR const* builtin = builtin_path(slot);
+		if (builtin == nullptr || m_builtin_rules.has(slot) == false) {
+			continue;
+		}
+
+		// A rule deleted by the user hands the drop events of the binary back to the notifier.
+		if (path.assign(m_system_root) == false || path.append(builtin) == false || key.assign(path.c_str()) == false ||
+			cache_find(m_cache, &key) == false) {
+			m_builtin_rules.remove(slot);
+		}
+	}
+}
+
+b32 Firewall::insert_blocked_rule(BlocklistRange const* range, b32 is_v6) {
+	assert(range);
+
+	// A range of a single address is written as the address alone.
+	WCHAR address[96];
+	size_t length = format_address(range->first, is_v6, address, COUNT(address));
+	if (memcmp(&range->first, &range->last, sizeof(range->first))) {
+		address[length++] = L'-';
+		format_address(range->last, is_v6, address + length, COUNT(address) - length);
+	}
+
+	WCHAR name[COUNT(BLOCKLIST_RULE_PREFIX) + COUNT(address)];
+	wcsmerge(name, COUNT(name), BLOCKLIST_RULE_PREFIX, address);
+
+	BSTR com_name = SysAllocString(name);
+	BSTR com_address = SysAllocString(address);
+
+	// The rule may have been added by an earlier run.
+	b32 result = false;
+	INetFwRule* rule = nullptr;
+	if (com_name && com_address) {
+		if (SUCCEEDED(m_rules->Item(com_name, &rule))) {
+			result = true;
+		} else if (SUCCEEDED(CoCreateInstance(__uuidof(NetFwRule), NULL, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&rule)))) {
+			rule->put_Name(com_name);
+			rule->put_RemoteAddresses(com_address);
+			rule->put_Profiles(NET_FW_PROFILE2_ALL);
+			rule->put_Protocol(NET_FW_IP_PROTOCOL_ANY);
+			rule->put_Direction(NET_FW_RULE_DIR_OUT);
+			rule->put_Enabled(VARIANT_TRUE);
+			rule->put_Action(NET_FW_ACTION_BLOCK);
+
+			result = SUCCEEDED(m_rules->Add(rule));
+		}
+	}
+
+	if (rule) {
+		rule->Release();
+	}
+
+	SysFreeString(com_name);
+	SysFreeString(com_address);
+
+	return result;
+}
+
+void Firewall::cache_restore() {
+	if (m_is_trimmed) {
+		cache_rebuild(false);
 	}
 }
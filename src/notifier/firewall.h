@@ -1,8 +1,30 @@
 #pragma once
+#include "arena.h"
+#include "blocklist.h"
+#include "builtin.h"
 #include "core.h"
+#include "key.h"
+#include "policy.h"
 #include <netfw.h>
 
-// Windows firewall interface for outbound connection blocking.
+// A decision to allow or block an application.
+struct RuleDecision {
+	WCHAR const* path;
+	b32 is_allowed;
+};
+
+// Outcome of a rule store compaction. The elapsed time is in milliseconds.
+struct FirewallCompaction {
+	u32 rules_before;
+	u32 rules_after;
+	u32 duplicates;
+	u32 shadowed;
+	u32 failed;
+	u64 elapsed;
+};
+
+// Windows firewall interface for outbound connection blocking. The rule cache is guarded by a lock, so rules can be
+// added and looked up from any thread.
 class Firewall {
 public:
 	// Creates the firewall interface.
@@ -14,31 +36,123 @@ public:
 	// Adds a rule into the firewall. Returns true on success.
 	b32 add_rule(WCHAR const* path, b32 is_allowed);
 
-	// Returns true if the firewall already contains a rule for the application at the given path.
+	// Adds rules for a batch of decisions, skipping applications that already have a rule, and inserts them into the
+	// rule cache in a single update. Returns the number of rules added.
+	u32 add_rules(RuleDecision const* decisions, u32 count);
+
+	// Checks the remote address of a drop event against the blocklist, and queues a rule blocking the blocklist range
+	// that holds it for every application unless the range already has one. Only touches memory, so it can run on the
+	// drop event callback. IPv4 addresses are in host byte order and IPv6 addresses in network byte order. Returns true
+	// if a rule was queued, in which case add_blocked_rules must be called.
+	b32 check_remote_address(b32 is_v6, u32 address_v4, u8 const* address_v6);
+
+	// Adds the rules queued by check_remote_address to the rule store. A range whose rule could not be added is queued
+	// again by its next address. Returns the number of rules added.
+	u32 add_blocked_rules();
+
+	// Returns true if the firewall already contains a rule for the application at the given path. Applications covered
+	// by the precompiled policy or the built-in table of system binaries have their rule added on first lookup, with the
+	// policy taking precedence.
 	b32 has_rule(WCHAR const* path);
 
+	// Returns true if the firewall contains a rule blocking the application at the given path.
+	b32 has_block_rule(WCHAR const* path);
+
+	// Returns the built-in table slots of the applications found to have a rule. A slot is removed again when a cache
+	// rebuild no longer finds the rule.
+	BuiltinRules const* builtin_rules() const {
+		return &m_builtin_rules;
+	}
+
+	// Removes the duplicate and shadowed rules created by the notifier from the rule store, as found by
+	// compact_analyze, and rebuilds the rule cache. Returns true on success.
+	b32 compact(FirewallCompaction* report);
+
 	// Returns true if the firewall is currently filtering outbound requests.
 	b32 is_filtering();
 
 	// Sets the outbounding filtering state for the firewall.
 	b32 set_filtering(b32 is_filtering);
 
-private:
-	// Inserts the given rule into the cache.
-	void cache_add_rule(WCHAR const* path);
+	// Releases the rule cache if it is due for a rebuild anyway, such as after a quiet spell. The cache is rebuilt by
+	// the next lookup or added rule. Returns true if the cache holds no rules.
+	b32 trim();
 
-	// Rebuilds the cache.
-	void cache_rebuild();
-
-	// A cached firewall rule.
+private:
+	// A cached firewall rule, keyed by the compact form of its application path. Blocks the application if any of its
+	// rules does.
 	struct FirewallRule {
-		WCHAR* path;
 		FirewallRule* next;
+		size_t hash;
+		u32 size;
+		b32 is_blocked;
+		u8 key[1];
 	};
 
-	FirewallRule** m_cache = nullptr;
+	// A blocklist range that has a rule, or is queued for one.
+	struct BlockedRange {
+		BlockedRange* next;
+		BlockedRange* next_queued;
+		BlocklistRange range;
+		b32 is_v6;
+		b32 is_failed;
+	};
+
+	// A generation of the rule cache. All of its memory comes from the arena and is released with it.
+	struct FirewallCache {
+		Arena arena;
+		FirewallRule** buckets;
+	};
+
+	// Creates a firewall rule for the application. Returns true on success.
+	b32 insert_rule(WCHAR const* path, b32 is_allowed);
+
+	// Returns true if the cache contains a rule for the given key.
+	b32 cache_find(FirewallCache const* cache, Key const* key);
+
+	// Returns the cached rule for the given key, or null.
+	FirewallRule* cache_lookup(FirewallCache const* cache, Key const* key);
+
+	// Inserts a rule for the given key into the cache.
+	void cache_add_rule(FirewallCache* cache, Key const* key, b32 is_blocked);
+
+	// Releases the cache and allocates an empty bucket array for it. Returns true on success.
+	b32 cache_reset(FirewallCache* cache);
+
+	// Inserts a rule for the given key into the current cache, and into the one being rebuilt if any. Must be called
+	// under the exclusive lock.
+	void cache_insert(Key const* key, b32 is_blocked);
+
+	// Rebuilds the cache into a new generation and retires the current one. Unless forced, only rebuilds a cache that
+	// was released by trim or has aged out. The rule store is read without the cache lock, so lookups and added rules
+	// never wait for it. Must be called without the cache lock.
+	void cache_rebuild(b32 is_forced);
+
+	// Rebuilds the cache if it was released by trim.
+	void cache_restore();
+
+	// Removes the built-in table slots whose rule is no longer in the cache.
+	void builtin_refresh();
+
+	// Adds a rule blocking the range of addresses for every application. Returns true on success.
+	b32 insert_blocked_rule(BlocklistRange const* range, b32 is_v6);
+
+	SRWLOCK m_lock;
+	SRWLOCK m_rebuild_lock;
+	SRWLOCK m_blocked_lock;
+	Policy m_app_policy;
+	Blocklist m_blocklist;
+	BuiltinRules m_builtin_rules;
+	Arena m_blocked_arena;
+	BlockedRange** m_blocked = nullptr;
+	BlockedRange* m_blocked_queue = nullptr;
+	FirewallCache m_caches[2];
+	FirewallCache* m_cache = nullptr;
+	FirewallCache* m_building = nullptr;
 	INetFwPolicy2* m_policy = nullptr;
 	INetFwRules* m_rules = nullptr;
-	ULONGLONG m_cache_age = 0;
+	WCHAR m_system_root[4] = {};
+	u64 m_cache_age = 0;
 	b32 m_is_initialized = false;
+	volatile b32 m_is_trimmed = false;
 };
@@ -0,0 +1,226 @@
+#include "fs.h"
+#include "wstr.h"
+#include <ShlObj.h>
+#include <assert.h>
+#include <wchar.h>
+
+// Directory of the notifier under the local application data of the user.
+static WCHAR const USER_DIRECTORY[] = L"\\Firewall Notifier\\";
+
+b32 fs_map(WCHAR const* path, MappedFile* dst) {
+	assert(path);
+	assert(dst);
+
+	*dst = {};
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	b32 result = false;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(file, &info)) {
+		u64 size = ((u64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+
+		if (size) {
+			HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping) {
+				void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				if (data) {
+					dst->mapping = mapping;
+					dst->data = (u8 const*)data;
+					dst->size = size;
+					dst->write_time = info.ftLastWriteTime;
+					result = true;
+				} else {
+					CloseHandle(mapping);
+				}
+			}
+		}
+	}
+
+	CloseHandle(file);
+
+	return result;
+}
+
+void fs_unmap(MappedFile* file) {
+	assert(file);
+
+	if (file->data) {
+		UnmapViewOfFile(file->data);
+	}
+
+	if (file->mapping) {
+		CloseHandle(file->mapping);
+	}
+
+	*file = {};
+}
+
+b32 fs_load(WCHAR const* path, MemoryTag tag, u64 max_size, LoadedFile* dst) {
+	assert(path);
+	assert(dst);
+
+	*dst = {};
+
+	HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	b32 result = false;
+
+	BY_HANDLE_FILE_INFORMATION info;
+	if (GetFileInformationByHandle(file, &info)) {
+		u64 size = ((u64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+
+		u8* data = (size && size <= max_size) ? (u8*)mem_alloc(tag, (size_t)size) : nullptr;
+		if (data) {
+			result = true;
+
+			for (u64 offset = 0; offset < size && result; ) {
+				DWORD chunk = (DWORD)MIN(size - offset, (u64)(1 << 30));
+				DWORD read = 0;
+
+				result = ReadFile(file, data + offset, chunk, &read, nullptr) && read == chunk;
+				offset += chunk;
+			}
+
+			if (result) {
+				dst->data = data;
+				dst->size = size;
+				dst->write_time = info.ftLastWriteTime;
+			} else {
+				mem_free(data);
+			}
+		}
+	}
+
+	CloseHandle(file);
+
+	return result;
+}
+
+void fs_release(LoadedFile* file) {
+	assert(file);
+
+	mem_free(file->data);
+	*file = {};
+}
+
+FILETIME fs_write_time(WCHAR const* path) {
+	assert(path);
+
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (GetFileAttributesExW(path, GetFileExInfoStandard, &data) == FALSE) {
+		FILETIME none = {};
+		return none;
+	}
+
+	return data.ftLastWriteTime;
+}
+
+b32 fs_module_path(WCHAR* dst, size_t dst_count, WCHAR const* name) {
+	assert(dst);
+	assert(dst_count);
+	assert(name);
+
+	DWORD len = GetModuleFileNameW(nullptr, dst, (DWORD)dst_count);
+	if (len == 0 || len >= dst_count) {
+		return false;
+	}
+
+	while (len && dst[len - 1] != L'\\') {
+		len -= 1;
+	}
+
+	if (len == 0) {
+		return false;
+	}
+
+	dst[len] = 0;
+	wcsmerge(dst, dst_count, dst, name);
+
+	return wcslen(dst) == len + wcslen(name);
+}
+
+b32 fs_user_path(WCHAR* dst, size_t dst_count, WCHAR const* name) {
+	assert(dst);
+	assert(dst_count);
+	assert(name);
+
+	// The folder path has to be freed even if the call fails.
+	PWSTR root = nullptr;
+	HRESULT hr = SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &root);
+
+	size_t len = 0;
+	if (SUCCEEDED(hr)) {
+		wcsmerge(dst, dst_count, root, USER_DIRECTORY);
+		len = wcslen(root) + COUNT(USER_DIRECTORY) - 1;
+	}
+
+	CoTaskMemFree(root);
+
+	if (len == 0 || wcslen(dst) != len) {
+		return false;
+	}
+
+	if (CreateDirectoryW(dst, nullptr) == FALSE && GetLastError() != ERROR_ALREADY_EXISTS) {
+		return false;
+	}
+
+	wcsmerge(dst, dst_count, dst, name);
+
+	return wcslen(dst) == len + wcslen(name);
+}
+
+b32 fs_write_atomic(WCHAR const* path, void const* data, size_t size) {
+	assert(path);
+	assert(data || size == 0);
+
+	WCHAR temp[MAX_PATH + 1];
+	wcsmerge(temp, COUNT(temp), path, L".tmp");
+	if (wcslen(temp) != wcslen(path) + 4) {
+		return false;
+	}
+
+	HANDLE file = CreateFileW(temp, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	b32 result = true;
+
+	u8 const* bytes = (u8 const*)data;
+	while (size && result) {
+		DWORD chunk = (DWORD)MIN(size, (size_t)(1 << 30));
+		DWORD written = 0;
+
+		result = WriteFile(file, bytes, chunk, &written, nullptr) && written == chunk;
+		bytes += chunk;
+		size -= chunk;
+	}
+
+	if (result) {
+		result = (FlushFileBuffers(file) != FALSE);
+	}
+
+	CloseHandle(file);
+
+	if (result) {
+		result = (MoveFileExW(temp, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE);
+	}
+
+	if (result == false) {
+		DeleteFileW(temp);
+	}
+
+	return result;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "core.h"
+#include "mem.h"
+#include <Windows.h>
+
+// A read-only memory mapped file.
+struct MappedFile {
+	HANDLE mapping;
+	u8 const* data;
+	u64 size;
+	FILETIME write_time;
+};
+
+// A file read into private memory. Unlike a mapped file, it does not keep the file from being replaced.
+struct LoadedFile {
+	u8* data;
+	u64 size;
+	FILETIME write_time;
+};
+
+// Maps the file at the given path into memory for reading. Returns true on success.
+b32 fs_map(WCHAR const* path, MappedFile* dst);
+
+// Unmaps a file mapped by fs_map.
+void fs_unmap(MappedFile* file);
+
+// Reads the whole file at the given path into memory allocated under the given tag. Files larger than max_size are
+// refused. Returns true on success.
+b32 fs_load(WCHAR const* path, MemoryTag tag, u64 max_size, LoadedFile* dst);
+
+// Frees a file read by fs_load.
+void fs_release(LoadedFile* file);
+
+// Returns the last write time of the file at the given path, or a zero time if the file does not exist.
+FILETIME fs_write_time(WCHAR const* path);
+
+// Builds the path of a file with the given name in the directory of the executable. Returns true on success.
+b32 fs_module_path(WCHAR* dst, size_t dst_count, WCHAR const* name);
+
+// Builds the path of a file with the given name in the notifier directory under the local application data of the
+// user running the process, creating the directory if needed. Returns true on success.
+b32 fs_user_path(WCHAR* dst, size_t dst_count, WCHAR const* name);
+
+// Writes the data to a temporary file and then replaces the file at the given path with it. Returns true on success.
+b32 fs_write_atomic(WCHAR const* path, void const* data, size_t size);
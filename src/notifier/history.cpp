@@ -0,0 +1,470 @@
+#include "history.h"
+#include "codec.h"
+#include "fs.h"
+#include "mem.h"
+#include "wstr.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// History block identifier, "FNHB".
+static const u32 HISTORY_MAGIC = 0x42484e46;
+
+// Maximum number of events buffered per block.
+static const u32 BLOCK_EVENTS = 8192;
+
+// Maximum number of applications in the dictionary.
+static const u32 MAX_APPS = 16384;
+
+// Number of slots in the dictionary hash table. Must be a power of two larger than the maximum number of apps.
+static const u32 APP_TABLE_SIZE = 32768;
+
+// Identifier returned when an application is not in the dictionary.
+static const u32 APP_NONE = 0xffffffff;
+
+// Maximum time an event stays buffered before it is committed, in milliseconds.
+static const DWORD COMMIT_INTERVAL = 1000;
+
+// Milliseconds per hour.
+static const u64 HOUR_MS = 3600000;
+
+// Header of a block on disk. The payload holds the new dictionary entries, then the time column as zigzag varint
+// deltas from the base time, then the application column as varints.
+struct HistoryBlockHeader {
+	u32 magic;
+	u32 payload_size;
+	u32 checksum;
+	u32 event_count;
+	u32 app_first;
+	u32 app_count;
+	u64 base_time;
+};
+
+History::History() : m_names(MemoryTagHistory) {
+	InitializeCriticalSection(&m_lock);
+	m_active = m_blocks;
+}
+
+History::~History() {
+	close();
+
+	mem_free(m_blocks[0].events);
+	mem_free(m_blocks[1].events);
+	mem_free(m_apps);
+	mem_free(m_app_table);
+	mem_free(m_buffer);
+
+	DeleteCriticalSection(&m_lock);
+}
+
+b32 History::open(WCHAR const* path) {
+	assert(path);
+
+	if (m_file != INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	m_apps = (HistoryApp*)mem_calloc(MemoryTagHistory, MAX_APPS, sizeof(*m_apps));
+	m_app_table = (u32*)mem_calloc(MemoryTagHistory, APP_TABLE_SIZE, sizeof(*m_app_table));
+	m_blocks[0].events = (HistoryEvent*)mem_calloc(MemoryTagHistory, BLOCK_EVENTS, sizeof(*m_blocks[0].events));
+	m_blocks[1].events = (HistoryEvent*)mem_calloc(MemoryTagHistory, BLOCK_EVENTS, sizeof(*m_blocks[1].events));
+
+	if (m_apps == nullptr || m_app_table == nullptr || m_blocks[0].events == nullptr || m_blocks[1].events == nullptr) {
+		return false;
+	}
+
+	u64 valid_size = 0;
+
+	MappedFile existing;
+	if (fs_map(path, &existing)) {
+		valid_size = restore(existing.data, existing.size);
+		fs_unmap(&existing);
+	}
+
+	m_file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER offset;
+	offset.QuadPart = (LONGLONG)valid_size;
+
+	if (SetFilePointerEx(m_file, offset, nullptr, FILE_BEGIN) == FALSE || SetEndOfFile(m_file) == FALSE) {
+		CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	m_wake = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+	m_full = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+
+	if (m_wake && m_full) {
+		m_stop = false;
+		m_thread = CreateThread(nullptr, 0, writer_thread_callback, this, 0, nullptr);
+	}
+
+	if (m_thread == nullptr) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+void History::close() {
+	if (m_thread) {
+		m_stop = true;
+		SetEvent(m_wake);
+		SetEvent(m_full);
+
+		WaitForSingleObject(m_thread, INFINITE);
+		CloseHandle(m_thread);
+		m_thread = nullptr;
+	}
+
+	if (m_wake) {
+		CloseHandle(m_wake);
+		m_wake = nullptr;
+	}
+
+	if (m_full) {
+		CloseHandle(m_full);
+		m_full = nullptr;
+	}
+
+	if (m_file != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+	}
+}
+
+void History::append(WCHAR const* app, u64 time) {
+	assert(app);
+
+	if (m_thread == nullptr) {
+		return;
+	}
+
+	size_t hash = wcshash(app);
+
+	EnterCriticalSection(&m_lock);
+
+	u32 id = intern(app, hash, true);
+	HistoryBlock* block = m_active;
+
+	if (id == APP_NONE || block->count == BLOCK_EVENTS) {
+		++m_dropped;
+		LeaveCriticalSection(&m_lock);
+		return;
+	}
+
+	HistoryEvent* ev = block->events + block->count++;
+	ev->time = time;
+	ev->app = id;
+
+	u32 count = block->count;
+
+	LeaveCriticalSection(&m_lock);
+
+	if (count == 1) {
+		SetEvent(m_wake);
+	} else if (count == BLOCK_EVENTS) {
+		SetEvent(m_full);
+	}
+}
+
+b32 History::app_rollup(WCHAR const* app, HistoryRollup* dst) {
+	assert(app);
+	assert(dst);
+
+	if (m_apps == nullptr) {
+		return false;
+	}
+
+	size_t hash = wcshash(app);
+
+	EnterCriticalSection(&m_lock);
+
+	u32 id = intern(app, hash, false);
+	if (id != APP_NONE) {
+		*dst = m_apps[id].rollup;
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	return id != APP_NONE;
+}
+
+u32 History::hour_rollups(HistoryHour* dst, u32 count) {
+	assert(dst || count == 0);
+
+	EnterCriticalSection(&m_lock);
+
+	u64 newest = 0;
+	for (u32 i = 0; i < HISTORY_HOURS; ++i) {
+		newest = MAX(newest, m_hours[i].hour);
+	}
+
+	u32 num = 0;
+	for (u64 hour = newest; num < count && hour && newest - hour < HISTORY_HOURS; --hour) {
+		HistoryHour const* slot = m_hours + (hour % HISTORY_HOURS);
+		if (slot->hour == hour && slot->count) {
+			dst[num++] = *slot;
+		}
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	return num;
+}
+
+u32 History::intern(WCHAR const* app, size_t hash, b32 add) {
+	assert(app);
+
+	u32 mask = APP_TABLE_SIZE - 1;
+
+	for (u32 i = (u32)hash & mask;; i = (i + 1) & mask) {
+		u32 slot = m_app_table[i];
+
+		if (slot == 0) {
+			if (add == false || m_app_count == MAX_APPS) {
+				return APP_NONE;
+			}
+
+			WCHAR const* name = m_names.wcsdup(app);
+			if (name == nullptr) {
+				return APP_NONE;
+			}
+
+			HistoryApp* entry = m_apps + m_app_count;
+			entry->name = name;
+			entry->hash = hash;
+			entry->rollup = {};
+
+			m_app_table[i] = ++m_app_count;
+
+			return m_app_count - 1;
+		}
+
+		HistoryApp const* entry = m_apps + slot - 1;
+		if (entry->hash == hash && wcscmp(entry->name, app) == 0) {
+			return slot - 1;
+		}
+	}
+}
+
+void History::rollup(HistoryEvent const* events, u32 count) {
+	assert(events || count == 0);
+
+	for (u32 i = 0; i < count; ++i) {
+		HistoryEvent const* ev = events + i;
+
+		HistoryRollup* app = &m_apps[ev->app].rollup;
+		app->first_time = app->count ? MIN(app->first_time, ev->time) : ev->time;
+		app->last_time = MAX(app->last_time, ev->time);
+		app->count += 1;
+
+		u64 hour = ev->time / HOUR_MS;
+		HistoryHour* slot = m_hours + (hour % HISTORY_HOURS);
+
+		if (slot->hour < hour) {
+			slot->hour = hour;
+			slot->count = 0;
+		}
+
+		if (slot->hour == hour) {
+			slot->count += 1;
+		}
+	}
+}
+
+u64 History::restore(u8 const* data, u64 size) {
+	assert(data);
+
+	HistoryEvent* events = m_blocks[1].events;
+	u64 offset = 0;
+
+	while (size - offset >= sizeof(HistoryBlockHeader)) {
+		HistoryBlockHeader header;
+		memcpy(&header, data + offset, sizeof(header));
+
+		u8 const* src = data + offset + sizeof(header);
+		u8 const* end = src + header.payload_size;
+
+		if (header.magic != HISTORY_MAGIC || header.payload_size > size - offset - sizeof(header) ||
+			header.checksum != checksum(src, header.payload_size) || header.event_count > BLOCK_EVENTS ||
+			header.app_first != m_app_count || header.app_count > MAX_APPS - m_app_count) {
+			break;
+		}
+
+		b32 valid = true;
+
+		for (u32 i = 0; valid && i < header.app_count; ++i) {
+			u64 count;
+			src = get_varint(src, end, &count);
+
+			valid = src && count < MAX_EXT_PATH && count * sizeof(WCHAR) <= (u64)(end - src);
+			if (valid) {
+				WCHAR* name = (WCHAR*)m_names.alloc((size_t)(count + 1) * sizeof(*name));
+				valid = (name != nullptr);
+
+				if (valid) {
+					memcpy(name, src, (size_t)count * sizeof(*name));
+					name[count] = 0;
+					src += count * sizeof(*name);
+
+					size_t hash = wcshash(name);
+					u32 mask = APP_TABLE_SIZE - 1;
+					u32 slot = (u32)hash & mask;
+
+					while (m_app_table[slot]) {
+						slot = (slot + 1) & mask;
+					}
+
+					HistoryApp* entry = m_apps + m_app_count;
+					entry->name = name;
+					entry->hash = hash;
+					entry->rollup = {};
+
+					m_app_table[slot] = ++m_app_count;
+				}
+			}
+		}
+
+		u64 time = header.base_time;
+		for (u32 i = 0; valid && i < header.event_count; ++i) {
+			u64 delta;
+			src = get_varint(src, end, &delta);
+
+			valid = (src != nullptr);
+			time += (delta & 1) ? ~(delta >> 1) : (delta >> 1);
+			events[i].time = time;
+		}
+
+		for (u32 i = 0; valid && i < header.event_count; ++i) {
+			u64 app;
+			src = get_varint(src, end, &app);
+
+			valid = src && app < m_app_count;
+			events[i].app = (u32)app;
+		}
+
+		if (valid == false || src != end) {
+			break;
+		}
+
+		rollup(events, header.event_count);
+		offset += sizeof(header) + header.payload_size;
+	}
+
+	m_apps_written = m_app_count;
+
+	return offset;
+}
+
+void History::commit() {
+	EnterCriticalSection(&m_lock);
+
+	HistoryBlock* block = m_active;
+	m_active = (block == m_blocks) ? m_blocks + 1 : m_blocks;
+	u32 app_end = m_app_count;
+
+	LeaveCriticalSection(&m_lock);
+
+	if (block->count == 0 && app_end == m_apps_written) {
+		return;
+	}
+
+	size_t size = sizeof(HistoryBlockHeader) + (size_t)block->count * 15;
+	for (u32 i = m_apps_written; i < app_end; ++i) {
+		size += 10 + wcslen(m_apps[i].name) * sizeof(WCHAR);
+	}
+
+	if (size > m_buffer_size) {
+		u8* buffer = (u8*)mem_realloc(MemoryTagHistory, m_buffer, size);
+		if (buffer == nullptr) {
+			block->count = 0;
+			return;
+		}
+
+		m_buffer = buffer;
+		m_buffer_size = size;
+	}
+
+	u8* payload = m_buffer + sizeof(HistoryBlockHeader);
+	u8* dst = payload;
+
+	for (u32 i = m_apps_written; i < app_end; ++i) {
+		size_t count = wcslen(m_apps[i].name);
+		dst = put_varint(dst, count);
+		memcpy(dst, m_apps[i].name, count * sizeof(WCHAR));
+		dst += count * sizeof(WCHAR);
+	}
+
+	u64 base_time = block->count ? block->events[0].time : 0;
+	u64 time = base_time;
+
+	for (u32 i = 0; i < block->count; ++i) {
+		i64 delta = (i64)(block->events[i].time - time);
+		time = block->events[i].time;
+		dst = put_varint(dst, ((u64)delta << 1) ^ (u64)(delta >> 63));
+	}
+
+	for (u32 i = 0; i < block->count; ++i) {
+		dst = put_varint(dst, block->events[i].app);
+	}
+
+	HistoryBlockHeader header = {};
+	header.magic = HISTORY_MAGIC;
+	header.payload_size = (u32)(dst - payload);
+	header.checksum = checksum(payload, header.payload_size);
+	header.event_count = block->count;
+	header.app_first = m_apps_written;
+	header.app_count = app_end - m_apps_written;
+	header.base_time = base_time;
+
+	memcpy(m_buffer, &header, sizeof(header));
+
+	DWORD size_written = 0;
+	DWORD size_block = (DWORD)(sizeof(header) + header.payload_size);
+
+	if (WriteFile(m_file, m_buffer, size_block, &size_written, nullptr) && size_written == size_block) {
+		m_apps_written = app_end;
+	} else {
+		LARGE_INTEGER back;
+		back.QuadPart = -(LONGLONG)size_written;
+		SetFilePointerEx(m_file, back, nullptr, FILE_CURRENT);
+	}
+
+	EnterCriticalSection(&m_lock);
+	rollup(block->events, block->count);
+	LeaveCriticalSection(&m_lock);
+
+	block->count = 0;
+}
+
+DWORD History::writer_thread() {
+	while (m_stop == false) {
+		WaitForSingleObject(m_wake, INFINITE);
+
+		if (m_stop == false) {
+			WaitForSingleObject(m_full, COMMIT_INTERVAL);
+		}
+
+		commit();
+	}
+
+	commit();
+
+	return 0;
+}
+
+DWORD WINAPI History::writer_thread_callback(LPVOID context) {
+	History* history = (History*)context;
+	if (history) {
+		return history->writer_thread();
+	}
+
+	return 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include "arena.h"
+#include "core.h"
+#include <Windows.h>
+
+// Number of hourly rollups kept by the history.
+#define HISTORY_HOURS 168
+
+// Rollup of the drop events recorded for a single application.
+struct HistoryRollup {
+	u64 count;
+	u64 first_time;
+	u64 last_time;
+};
+
+// Rollup of the drop events recorded in a single hour.
+struct HistoryHour {
+	u64 hour;
+	u64 count;
+};
+
+// Append-only store of drop events. Events are buffered in memory and group committed by a writer thread as
+// compressed column blocks: application identifiers are dictionary encoded and timestamps are delta encoded.
+// Per-application and per-hour rollups are maintained as blocks are committed. Times are in milliseconds since
+// January 1, 1601 (UTC).
+class History {
+public:
+	// Creates a closed history.
+	History();
+
+	// Destroys the history, committing any buffered events.
+	~History();
+
+	// Opens the history file at the given path, restores its rollups and starts the writer. Returns true on success.
+	b32 open(WCHAR const* path);
+
+	// Commits any buffered events and stops the writer.
+	void close();
+
+	// Records a drop event for the application with the given identifier. Never blocks on disk; events arriving
+	// while the buffers are full are counted and discarded.
+	void append(WCHAR const* app, u64 time);
+
+	// Retrieves the rollup for the application with the given identifier. Returns true if the application is known.
+	b32 app_rollup(WCHAR const* app, HistoryRollup* dst);
+
+	// Copies the most recent hourly rollups, newest first. Returns the number of rollups copied.
+	u32 hour_rollups(HistoryHour* dst, u32 count);
+
+	// Returns the number of events discarded because the buffers were full.
+	u64 dropped() const {
+		return m_dropped;
+	}
+
+private:
+	// A buffered drop event.
+	struct HistoryEvent {
+		u64 time;
+		u32 app;
+	};
+
+	// A block of buffered drop events.
+	struct HistoryBlock {
+		HistoryEvent* events;
+		u32 count;
+	};
+
+	// An application in the dictionary.
+	struct HistoryApp {
+		WCHAR const* name;
+		size_t hash;
+		HistoryRollup rollup;
+	};
+
+	// Returns the dictionary identifier of the application, adding it if needed. Requires the lock.
+	u32 intern(WCHAR const* app, size_t hash, b32 add);
+
+	// Applies the events to the rollups. Requires the lock.
+	void rollup(HistoryEvent const* events, u32 count);
+
+	// Parses the blocks of an existing history file. Returns the size of the well formed prefix of the file.
+	u64 restore(u8 const* data, u64 size);
+
+	// Encodes and writes the buffered events.
+	void commit();
+
+	// Writer thread routine.
+	DWORD writer_thread();
+
+	// Writer thread routine callback.
+	static DWORD WINAPI writer_thread_callback(LPVOID context);
+
+	CRITICAL_SECTION m_lock;
+	Arena m_names;
+	HistoryBlock m_blocks[2] = {};
+	HistoryBlock* m_active = nullptr;
+	HistoryApp* m_apps = nullptr;
+	u32* m_app_table = nullptr;
+	u32 m_app_count = 0;
+	u32 m_apps_written = 0;
+	HistoryHour m_hours[HISTORY_HOURS] = {};
+	u8* m_buffer = nullptr;
+	size_t m_buffer_size = 0;
+	u64 m_dropped = 0;
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_thread = nullptr;
+	HANDLE m_wake = nullptr;
+	HANDLE m_full = nullptr;
+	volatile b32 m_stop = false;
+};
@@ -0,0 +1,214 @@
+#include "key.h"
+#include "mem.h"
+#include <assert.h>
+#include <emmintrin.h>
+#include <string.h>
+#include <wchar.h>
+
+// Maximum length of a keyed path, in characters.
+static const size_t KEY_MAX_PATH = MAX_EXT_PATH;
+
+// Characters transcoded per vector step.
+static const size_t BLOCK_SIZE = 16;
+
+// Marker returned when the destination is too small.
+static const size_t ENCODE_OVERFLOW = ~(size_t)0;
+
+// Hash mixing primes.
+static const u64 PRIME64_1 = 0x9e3779b185ebca87;
+static const u64 PRIME64_2 = 0xc2b2ae3d27d4eb4f;
+
+// Transcodes the first count characters of the UTF-16 source to UTF-8 into a destination of dst_size bytes. Runs of
+// ASCII characters are narrowed 16 at a time. Returns the number of bytes written, or ENCODE_OVERFLOW if the
+// destination is too small.
+static size_t encode(WCHAR const* src, size_t count, u8* dst, size_t dst_size) {
+	__m128i const high_mask = _mm_set1_epi16((short)0xff80);
+	__m128i const zero = _mm_setzero_si128();
+
+	WCHAR const* end = src + count;
+	u8* dst_start = dst;
+	u8* dst_end = dst + dst_size;
+
+	while (src < end) {
+		while (end - src >= (ptrdiff_t)BLOCK_SIZE && dst_end - dst >= (ptrdiff_t)BLOCK_SIZE) {
+			__m128i lo = _mm_loadu_si128((__m128i const*)src);
+			__m128i hi = _mm_loadu_si128((__m128i const*)(src + 8));
+
+			__m128i high = _mm_and_si128(_mm_or_si128(lo, hi), high_mask);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xffff) {
+				break;
+			}
+
+			_mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(lo, hi));
+			src += BLOCK_SIZE;
+			dst += BLOCK_SIZE;
+		}
+
+		// Encodes characters one at a time up to the next block boundary, so a single non-ASCII character does not
+		// drop the rest of the path out of the vector loop.
+		WCHAR const* block_end = (end - src > (ptrdiff_t)BLOCK_SIZE) ? src + BLOCK_SIZE : end;
+
+		while (src < block_end) {
+			u32 c = *src++;
+
+			if (c < 0x80) {
+				if (dst_end - dst < 1) {
+					return ENCODE_OVERFLOW;
+				}
+
+				*dst++ = (u8)c;
+			} else if (c < 0x800) {
+				if (dst_end - dst < 2) {
+					return ENCODE_OVERFLOW;
+				}
+
+				*dst++ = (u8)(0xc0 | (c >> 6));
+				*dst++ = (u8)(0x80 | (c & 0x3f));
+			} else if (c >= 0xd800 && c < 0xdc00 && src < end && *src >= 0xdc00 && *src < 0xe000) {
+				if (dst_end - dst < 4) {
+					return ENCODE_OVERFLOW;
+				}
+
+				c = 0x10000 + ((c - 0xd800) << 10) + (*src++ - 0xdc00);
+
+				*dst++ = (u8)(0xf0 | (c >> 18));
+				*dst++ = (u8)(0x80 | ((c >> 12) & 0x3f));
+				*dst++ = (u8)(0x80 | ((c >> 6) & 0x3f));
+				*dst++ = (u8)(0x80 | (c & 0x3f));
+			} else {
+				if (dst_end - dst < 3) {
+					return ENCODE_OVERFLOW;
+				}
+
+				if (c >= 0xd800 && c < 0xe000) {
+					c = 0xfffd;
+				}
+
+				*dst++ = (u8)(0xe0 | (c >> 12));
+				*dst++ = (u8)(0x80 | ((c >> 6) & 0x3f));
+				*dst++ = (u8)(0x80 | (c & 0x3f));
+			}
+		}
+	}
+
+	return (size_t)(dst - dst_start);
+}
+
+size_t utf8_encode(WCHAR const* src, size_t count, u8* dst) {
+	assert(src || count == 0);
+	assert(dst || count == 0);
+
+	return encode(src, count, dst, 3 * count);
+}
+
+size_t keyhash(u8 const* src, size_t size) {
+	assert(src || size == 0);
+
+	u64 hash = PRIME64_1 ^ (size * PRIME64_2);
+
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		u64 word;
+		memcpy(&word, src + i, sizeof(word));
+
+		hash ^= word * PRIME64_2;
+		hash = ((hash << 31) | (hash >> 33)) * PRIME64_1;
+	}
+
+	u64 tail = 0;
+	if (i < size) {
+		memcpy(&tail, src + i, size - i);
+	}
+
+	hash ^= tail * PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= PRIME64_1;
+	hash ^= hash >> 32;
+
+	return (size_t)hash;
+}
+
+Key::Key() {
+}
+
+Key::~Key() {
+	mem_free(m_heap);
+}
+
+b32 Key::assign(WCHAR const* src, size_t count) {
+	assert(src || count == 0);
+
+	m_size = 0;
+	m_hash = 0;
+
+	if (count > KEY_MAX_PATH) {
+		return false;
+	}
+
+	u8* dst = m_heap ? m_heap : m_inline;
+	size_t dst_size = m_heap ? m_heap_capacity : KEY_INLINE_SIZE;
+
+	size_t size = encode(src, count, dst, dst_size);
+	if (size == ENCODE_OVERFLOW) {
+		size_t capacity = 3 * count;
+
+		u8* heap = (u8*)mem_realloc(MemoryTagPaths, m_heap, capacity);
+		if (heap == nullptr) {
+			return false;
+		}
+
+		m_heap = heap;
+		m_heap_capacity = (u32)capacity;
+
+		size = encode(src, count, m_heap, capacity);
+	}
+
+	m_size = (u32)size;
+	m_hash = keyhash(data(), size);
+
+	return true;
+}
+
+b32 Key::assign(WCHAR const* src) {
+	assert(src);
+	return assign(src, wcslen(src));
+}
+
+b32 Key::load(u8 const* data, size_t size) {
+	assert(data || size == 0);
+
+	m_size = 0;
+	m_hash = 0;
+
+	if (size > 3 * KEY_MAX_PATH) {
+		return false;
+	}
+
+	size_t capacity = m_heap ? m_heap_capacity : KEY_INLINE_SIZE;
+	if (size > capacity) {
+		u8* heap = (u8*)mem_realloc(MemoryTagPaths, m_heap, size);
+		if (heap == nullptr) {
+			return false;
+		}
+
+		m_heap = heap;
+		m_heap_capacity = (u32)size;
+	}
+
+	u8* dst = m_heap ? m_heap : m_inline;
+	memcpy(dst, data, size);
+
+	m_size = (u32)size;
+	m_hash = keyhash(dst, size);
+
+	return true;
+}
+
+void Key::reset() {
+	mem_free(m_heap);
+
+	m_heap = nullptr;
+	m_heap_capacity = 0;
+	m_size = 0;
+	m_hash = 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+#include <string.h>
+
+// Inline capacity of a key, in bytes.
+#define KEY_INLINE_SIZE MAX_PATH
+
+// Transcodes the first count characters of the UTF-16 source to UTF-8. The destination must hold at least 3 * count
+// bytes. Unpaired surrogates are written as U+FFFD. Returns the number of bytes written.
+size_t utf8_encode(WCHAR const* src, size_t count, u8* dst);
+
+// Returns the 64-bit hash of the first size bytes of the given data.
+size_t keyhash(u8 const* src, size_t size);
+
+// The compact UTF-8 form of a path, used to hash and compare cached paths. Paths are almost entirely ASCII, so a key
+// takes half the memory of the path and is hashed and compared over half the bytes. Only keys of long paths with many
+// non-ASCII characters spill to the heap. A zero initialized key is a valid empty key, so keys can live in calloc'd
+// arrays as long as reset is called before the array is freed.
+class Key {
+public:
+	// Creates an empty key.
+	Key();
+
+	// Destroys the key.
+	~Key();
+
+	Key(Key const&) = delete;
+	Key& operator=(Key const&) = delete;
+
+	// Replaces the contents with the key of the first count characters of the path. Returns true on success.
+	b32 assign(WCHAR const* src, size_t count);
+
+	// Replaces the contents with the key of the null terminated path. Returns true on success.
+	b32 assign(WCHAR const* src);
+
+	// Replaces the contents with a copy of key data produced by another key. Returns true on success.
+	b32 load(u8 const* data, size_t size);
+
+	// Empties the key and releases any heap storage.
+	void reset();
+
+	// Returns true if the key equals the given key data.
+	b32 equals(u8 const* data, size_t size, size_t hash) const {
+		return m_hash == hash && m_size == size && memcmp(this->data(), data, size) == 0;
+	}
+
+	// Returns the key data. It is not null terminated.
+	u8 const* data() const {
+		return m_heap ? m_heap : m_inline;
+	}
+
+	// Returns the size of the key, in bytes.
+	size_t size() const {
+		return m_size;
+	}
+
+	// Returns the hash of the key.
+	size_t hash() const {
+		return m_hash;
+	}
+
+	// Returns true if the key is empty.
+	b32 empty() const {
+		return m_size == 0;
+	}
+
+private:
+	u8* m_heap = nullptr;
+	u32 m_heap_capacity = 0;
+	u32 m_size = 0;
+	size_t m_hash = 0;
+	u8 m_inline[KEY_INLINE_SIZE];
+};
@@ -0,0 +1,313 @@
+#include "mem.h"
+#include <assert.h>
+#include <intrin.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#pragma intrinsic(_ReturnAddress)
+
+// Value marking a live allocation header.
+static const u32 HEADER_MAGIC = 0x4d454d54;
+
+// Number of leaked allocations listed per tag by the shutdown report.
+static const u32 REPORT_LIMIT = 16;
+
+// Minimum interval between allocation rate samples, in milliseconds.
+static const ULONGLONG RATE_INTERVAL = 1000;
+
+// Header in front of every allocation.
+struct MemoryHeader {
+	size_t size;
+	u32 tag;
+	u32 magic;
+#ifdef _DEBUG
+	MemoryHeader* prev;
+	MemoryHeader* next;
+	void* caller;
+#endif
+};
+
+// Size of the header, keeping the allocations 16-byte aligned.
+static const size_t HEADER_SIZE = (sizeof(MemoryHeader) + 15) & ~(size_t)15;
+
+// Counters of a tag, each tag on its own cache line.
+struct __declspec(align(64)) MemoryCounters {
+	volatile LONGLONG live_bytes;
+	volatile LONGLONG live_count;
+	volatile LONGLONG peak_bytes;
+	volatile LONGLONG allocations;
+};
+
+// Names of the tags.
+static WCHAR const* const TAG_NAMES[] = {
+	L"other",
+	L"firewall_cache",
+	L"monitor_cache",
+	L"queue",
+	L"paths",
+	L"ui",
+	L"history",
+	L"sync",
+	L"policy",
+	L"fingerprints",
+	L"verdicts",
+	L"snapshot",
+	L"rings",
+	L"analytics",
+};
+
+static_assert(COUNT(TAG_NAMES) == MemoryTagCount, "Every tag needs a name");
+
+static MemoryCounters g_counters[MemoryTagCount];
+
+// Allocation counts and time of the last rate sample, and the rates it gave.
+static SRWLOCK g_rate_lock = SRWLOCK_INIT;
+static ULONGLONG g_rate_time;
+static u64 g_rate_allocations[MemoryTagCount];
+static u64 g_rates[MemoryTagCount];
+
+#ifdef _DEBUG
+// Live allocations of every tag, most recent first.
+static SRWLOCK g_live_lock = SRWLOCK_INIT;
+static MemoryHeader* g_live[MemoryTagCount];
+
+// Links the allocation into the live list of its tag.
+static void track(MemoryHeader* header) {
+	AcquireSRWLockExclusive(&g_live_lock);
+
+	header->prev = nullptr;
+	header->next = g_live[header->tag];
+	if (header->next) {
+		header->next->prev = header;
+	}
+
+	g_live[header->tag] = header;
+
+	ReleaseSRWLockExclusive(&g_live_lock);
+}
+
+// Unlinks the allocation from the live list of its tag.
+static void untrack(MemoryHeader* header) {
+	AcquireSRWLockExclusive(&g_live_lock);
+
+	if (header->prev) {
+		header->prev->next = header->next;
+	} else {
+		g_live[header->tag] = header->next;
+	}
+
+	if (header->next) {
+		header->next->prev = header->prev;
+	}
+
+	ReleaseSRWLockExclusive(&g_live_lock);
+}
+#endif
+
+// Adds an allocation of the given size to the counters of the tag.
+static void count_alloc(u32 tag, size_t size) {
+	MemoryCounters* counters = g_counters + tag;
+
+	LONGLONG live = InterlockedExchangeAdd64(&counters->live_bytes, (LONGLONG)size) + (LONGLONG)size;
+	InterlockedIncrement64(&counters->live_count);
+	InterlockedIncrement64(&counters->allocations);
+
+	LONGLONG peak = counters->peak_bytes;
+	while (live > peak) {
+		LONGLONG previous = InterlockedCompareExchange64(&counters->peak_bytes, live, peak);
+		if (previous == peak) {
+			break;
+		}
+
+		peak = previous;
+	}
+}
+
+// Removes an allocation of the given size from the counters of the tag.
+static void count_free(u32 tag, size_t size) {
+	MemoryCounters* counters = g_counters + tag;
+
+	InterlockedExchangeAdd64(&counters->live_bytes, -(LONGLONG)size);
+	InterlockedDecrement64(&counters->live_count);
+}
+
+// Returns the header of an allocation.
+static MemoryHeader* header_of(void* memory) {
+	MemoryHeader* header = (MemoryHeader*)((u8*)memory - HEADER_SIZE);
+	assert(header->magic == HEADER_MAGIC);
+
+	return header;
+}
+
+// Allocates memory for the tag on behalf of the given caller.
+static void* alloc_for(MemoryTag tag, size_t size, void* caller) {
+	assert(tag < MemoryTagCount);
+
+	if (size > SIZE_MAX - HEADER_SIZE) {
+		return nullptr;
+	}
+
+	MemoryHeader* header = (MemoryHeader*)malloc(HEADER_SIZE + size);
+	if (header == nullptr) {
+		return nullptr;
+	}
+
+	header->size = size;
+	header->tag = tag;
+	header->magic = HEADER_MAGIC;
+
+#ifdef _DEBUG
+	header->caller = caller;
+	track(header);
+#else
+	(void)caller;
+#endif
+
+	count_alloc(tag, size);
+
+	return (u8*)header + HEADER_SIZE;
+}
+
+void* mem_alloc(MemoryTag tag, size_t size) {
+	return alloc_for(tag, size, _ReturnAddress());
+}
+
+void* mem_calloc(MemoryTag tag, size_t count, size_t size) {
+	if (size && count > SIZE_MAX / size) {
+		return nullptr;
+	}
+
+	void* memory = alloc_for(tag, count * size, _ReturnAddress());
+	if (memory) {
+		memset(memory, 0, count * size);
+	}
+
+	return memory;
+}
+
+void* mem_realloc(MemoryTag tag, void* memory, size_t size) {
+	if (memory == nullptr) {
+		return alloc_for(tag, size, _ReturnAddress());
+	}
+
+	if (size > SIZE_MAX - HEADER_SIZE) {
+		return nullptr;
+	}
+
+	MemoryHeader* header = header_of(memory);
+	assert(header->tag == (u32)tag);
+
+	size_t old_size = header->size;
+
+#ifdef _DEBUG
+	untrack(header);
+#endif
+
+	MemoryHeader* new_header = (MemoryHeader*)realloc(header, HEADER_SIZE + size);
+	if (new_header) {
+		header = new_header;
+		header->size = size;
+
+		count_free(header->tag, old_size);
+		count_alloc(header->tag, size);
+	}
+
+#ifdef _DEBUG
+	track(header);
+#endif
+
+	return new_header ? (u8*)new_header + HEADER_SIZE : nullptr;
+}
+
+void mem_free(void* memory) {
+	if (memory == nullptr) {
+		return;
+	}
+
+	MemoryHeader* header = header_of(memory);
+	count_free(header->tag, header->size);
+
+#ifdef _DEBUG
+	untrack(header);
+#endif
+
+	header->magic = 0;
+	free(header);
+}
+
+WCHAR const* mem_tag_name(MemoryTag tag) {
+	return tag < MemoryTagCount ? TAG_NAMES[tag] : L"unknown";
+}
+
+void mem_stats(MemoryStats* dst) {
+	assert(dst);
+
+	ULONGLONG now = GetTickCount64();
+
+	AcquireSRWLockExclusive(&g_rate_lock);
+
+	b32 is_sampled = (now - g_rate_time >= RATE_INTERVAL);
+	ULONGLONG elapsed = now - g_rate_time;
+
+	for (u32 i = 0; i < MemoryTagCount; ++i) {
+		MemoryCounters const* counters = g_counters + i;
+
+		dst[i].live_bytes = (u64)counters->live_bytes;
+		dst[i].live_count = (u64)counters->live_count;
+		dst[i].peak_bytes = (u64)counters->peak_bytes;
+		dst[i].allocations = (u64)counters->allocations;
+
+		if (is_sampled) {
+			g_rates[i] = g_rate_time ? (dst[i].allocations - g_rate_allocations[i]) * 1000 / elapsed : 0;
+			g_rate_allocations[i] = dst[i].allocations;
+		}
+
+		dst[i].allocation_rate = g_rates[i];
+	}
+
+	if (is_sampled) {
+		g_rate_time = now;
+	}
+
+	ReleaseSRWLockExclusive(&g_rate_lock);
+}
+
+void mem_trim() {
+	_heapmin();
+	SetProcessWorkingSetSize(GetCurrentProcess(), (SIZE_T)-1, (SIZE_T)-1);
+}
+
+void mem_report() {
+	WCHAR line[256];
+
+	MemoryStats stats[MemoryTagCount];
+	mem_stats(stats);
+
+#ifdef _DEBUG
+	HMODULE module = GetModuleHandleW(nullptr);
+	AcquireSRWLockShared(&g_live_lock);
+#endif
+
+	for (u32 i = 0; i < MemoryTagCount; ++i) {
+		swprintf_s(line, COUNT(line), L"memory: %s live %llu bytes in %llu allocations, peak %llu bytes\n",
+			TAG_NAMES[i], stats[i].live_bytes, stats[i].live_count, stats[i].peak_bytes);
+		OutputDebugStringW(line);
+
+#ifdef _DEBUG
+		// Callers are module offsets, to be resolved against the symbols of the build.
+		u32 listed = 0;
+		for (MemoryHeader* header = g_live[i]; header && listed < REPORT_LIMIT; header = header->next, ++listed) {
+			swprintf_s(line, COUNT(line), L"memory:   %llu bytes from +0x%llx\n", (u64)header->size,
+				(u64)((u8*)header->caller - (u8*)module));
+			OutputDebugStringW(line);
+		}
+#endif
+	}
+
+#ifdef _DEBUG
+	ReleaseSRWLockShared(&g_live_lock);
+#endif
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Tagged heap allocation. Every allocation carries a small header naming the subsystem that owns it, and each tag keeps
+// live, peak and cumulative counters that can be queried at any time. The counters are updated with interlocked
+// operations on separate cache lines, cheap enough to leave on in production. Debug builds also link every live
+// allocation with its caller, and mem_report lists what is still outstanding at shutdown. Diagnostic code such as the
+// tracer and the workload generator allocates outside the accounting.
+
+// Subsystems that own heap memory.
+enum MemoryTag {
+	MemoryTagOther,
+	MemoryTagFirewallCache,
+	MemoryTagMonitorCache,
+	MemoryTagQueue,
+	MemoryTagPaths,
+	MemoryTagUi,
+	MemoryTagHistory,
+	MemoryTagSync,
+	MemoryTagPolicy,
+	MemoryTagFingerprints,
+	MemoryTagVerdicts,
+	MemoryTagSnapshot,
+	MemoryTagRings,
+	MemoryTagAnalytics,
+	MemoryTagCount
+};
+
+// Allocation counters of a tag.
+struct MemoryStats {
+	u64 live_bytes;
+	u64 live_count;
+	u64 peak_bytes;
+	u64 allocations;
+	u64 allocation_rate;
+};
+
+// Allocates memory owned by the given tag. Returns null on failure.
+void* mem_alloc(MemoryTag tag, size_t size);
+
+// Allocates zeroed memory for an array owned by the given tag. Returns null on failure.
+void* mem_calloc(MemoryTag tag, size_t count, size_t size);
+
+// Resizes memory allocated by the tag, allocating it if null. Returns null on failure, leaving the memory as it was.
+void* mem_realloc(MemoryTag tag, void* memory, size_t size);
+
+// Frees memory allocated by any of the functions above. Null is ignored.
+void mem_free(void* memory);
+
+// Returns the name of the tag.
+WCHAR const* mem_tag_name(MemoryTag tag);
+
+// Takes a snapshot of the counters of every tag into an array of MemoryTagCount entries. The allocation rate is the
+// number of allocations per second since the previous snapshot that was at least a second earlier.
+void mem_stats(MemoryStats* dst);
+
+// Writes the allocations that are still live to the debugger output, per tag. Only debug builds track individual
+// allocations; other builds write the counters only.
+void mem_report();
+
+// Returns the free memory of the heap to the system and trims the working set of the process, for when the notifier
+// goes idle. Pages are faulted back in as they are used again.
+void mem_trim();
@@ -1,32 +1,94 @@
 #include "monitor.h"
-#include "wstr.h"
+#include "canon.h"
+#include "key.h"
+#include "trace.h"
+#include <sddl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <wchar.h>
 
-// Minimum time to wait before deleting a cached rule, in milliseconds.
-static const ULONGLONG CACHE_AGE = 60000;
+// Minimum time to wait before looking up the foreground application again, in milliseconds.
+static const u64 FOREGROUND_AGE = 1000;
 
-// Maximum number of paths in the cachce.
-static const size_t CACHE_SIZE = 32;
+// Time to wait before trying to open the event ring of the user again when the collector cannot signal its creation, in
+// milliseconds.
+static const DWORD RING_RETRY = 1000;
 
-// Maximum number of items in the queue.
-static const size_t QUEUE_SIZE = 1024;
+// Longest time to wait before trying to open the event ring again. The wait doubles after every attempt, but stays
+// short enough not to hold back the first prompt.
+static const DWORD RING_RETRY_MAX = 4000;
 
-// Maps the given device path to a real path on the system and returns the resulting path.
-static WCHAR* map_path(WCHAR const* path) {
-	WCHAR* device = (WCHAR*)calloc(MAX_EXT_PATH + 1, sizeof(*device));
-	if (device == nullptr) {
-		return nullptr;
+// Time between checks for the collector starting or stopping, in milliseconds.
+static const DWORD COLLECTOR_CHECK = 5000;
+
+// Flag of the callback count that is set while the monitor stops admitting drop event callbacks.
+static const LONG CALLBACKS_CLOSED = 0x40000000;
+
+// Gets the binary and string SID of the user running the process. Returns true on success.
+static b32 user_sid(u8* sid, size_t sid_size, WCHAR* sid_string, size_t sid_string_count) {
+	HANDLE token = nullptr;
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token) == FALSE) {
+		return false;
+	}
+
+	union {
+		TOKEN_USER user;
+		u8 data[sizeof(TOKEN_USER) + SECURITY_MAX_SID_SIZE];
+	} info;
+
+	DWORD info_size = 0;
+	b32 result = GetTokenInformation(token, TokenUser, &info, sizeof(info), &info_size);
+	CloseHandle(token);
+
+	if (result == false || GetLengthSid(info.user.User.Sid) > sid_size) {
+		return false;
+	}
+
+	memcpy(sid, info.user.User.Sid, GetLengthSid(info.user.User.Sid));
+
+	WCHAR* string = nullptr;
+	if (ConvertSidToStringSidW(info.user.User.Sid, &string) == FALSE) {
+		return false;
+	}
+
+	result = (wcslen(string) < sid_string_count);
+	if (result) {
+		wcscpy_s(sid_string, sid_string_count, string);
+	}
+
+	LocalFree(string);
+
+	return result;
+}
+
+// Maps a drive letter or UNC path back to the lowercase device path that drop events carry. Returns true on success.
+static b32 device_path(WCHAR const* path, Path* dst) {
+	WCHAR device[MAX_PATH + 1];
+
+	if (path[0] && path[1] == L':' && path[2] == L'\\') {
+		WCHAR drive[3] = { path[0], L':', L'\0' };
+		if (QueryDosDeviceW(drive, device, COUNT(device)) == 0) {
+			return false;
+		}
+
+		_wcslwr(device);
+		return dst->assign(device) && dst->append(path + 2);
 	}
 
-	size_t real_size = wcslen(path) + 1;
-	WCHAR* real_path = (WCHAR*)calloc(real_size, sizeof(*real_path));
-	if (real_path == nullptr) {
-		free(device);
-		return nullptr;
+	if (path[0] == L'\\' && path[1] == L'\\') {
+		return dst->assign(L"\\device\\mup") && dst->append(path + 1);
 	}
 
+	return false;
+}
+
+// Maps the given device path to a real path on the system. Returns true on success.
+static b32 map_path(WCHAR const* path, Path* real_path) {
+	TRACE_SCOPE("map_path");
+
+	WCHAR device[MAX_PATH + 1];
+
 	DWORD drives = GetLogicalDrives();
 	for (DWORD i = 0; i < 26; ++i) {
 		if ((drives & (0x1 << i)) == 0) {
@@ -38,7 +100,7 @@ static WCHAR* map_path(WCHAR const* path) {
 		drive[1] = L':';
 		drive[2] = L'\0';
 
-		if (QueryDosDeviceW(drive, device, MAX_EXT_PATH) == 0) {
+		if (QueryDosDeviceW(drive, device, COUNT(device)) == 0) {
 			continue;
 		}
 
@@ -55,43 +117,38 @@ static WCHAR* map_path(WCHAR const* path) {
 			continue;
 		}
 
-		wcsmerge(real_path, real_size, drive, (wchar_t const*)(path + c + 1));
-		free(device);
-
-		return real_path;
+		return real_path->assign(drive, 3) && real_path->append(path + c + 1);
 	}
 
-	free(real_path);
-	free(device);
-
-	return nullptr;
+	return false;
 }
 
 Monitor::Monitor() {
-	m_queue = (WCHAR**)calloc(QUEUE_SIZE, sizeof(*m_queue));
-	if (m_queue == nullptr) {
+	if (m_queue.init(MONITOR_QUEUE_SIZE) == false) {
 		return;
 	}
 
-	m_cache = (MonitorItem*)calloc(CACHE_SIZE, sizeof(*m_cache));
-	if (m_cache == nullptr) {
+	if (m_cache.init() == false) {
 		return;
 	}
 
+	if (builtin_root(m_system_drive, COUNT(m_system_drive), m_system_device, COUNT(m_system_device))) {
+		m_system_device_size = wcslen(m_system_device);
+	}
+
+	m_has_user_sid = user_sid(m_user_sid, sizeof(m_user_sid), m_user_sid_string, COUNT(m_user_sid_string));
+
+	// The session is opened even while the collector runs, so the monitor can subscribe on its own once it stops.
 	FWPM_SESSION0 session_desc = {};
 	session_desc.displayData.name = L"Firewall Notifier";
 	session_desc.displayData.description = L"Outbound connection monitoring.";
 
 	if (FwpmEngineOpen0(nullptr, RPC_C_AUTHN_DEFAULT, nullptr, &session_desc, &m_session) != ERROR_SUCCESS) {
-		return;
-	}
+		m_session = nullptr;
 
-	FWP_VALUE0 val = {};
-	val.type = FWP_UINT32;
-	val.uint32 = 1;
-
-	if (FwpmEngineSetOption0(m_session, FWPM_ENGINE_COLLECT_NET_EVENTS, &val) != ERROR_SUCCESS) {
-		return;
+		if (m_has_user_sid == false || ring_collector_running() == false) {
+			return;
+		}
 	}
 
 	InitializeCriticalSection(&m_cache_lock);
@@ -99,154 +156,540 @@ Monitor::Monitor() {
 	InitializeConditionVariable(&m_queue_not_empty);
 	InitializeConditionVariable(&m_queue_not_full);
 
+	m_callbacks_done = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	if (m_callbacks_done == nullptr) {
+		DeleteCriticalSection(&m_queue_lock);
+		DeleteCriticalSection(&m_cache_lock);
+		return;
+	}
+
 	m_initialized = true;
 }
 
 Monitor::~Monitor() {
 	stop();
 
-	if (m_session) {
+	if (m_initialized) {
 		DeleteCriticalSection(&m_queue_lock);
 		DeleteCriticalSection(&m_cache_lock);
+		CloseHandle(m_callbacks_done);
+	}
 
-		FWP_VALUE0 val = {};
-		val.type = FWP_UINT32;
-		val.uint32 = 0;
+	if (m_session) {
+		FwpmEngineClose0(m_session);
+	}
+}
 
-		FwpmEngineSetOption0(m_session, FWPM_ENGINE_COLLECT_NET_EVENTS, &val);
+b32 Monitor::receive(Path* path) {
+	assert(path);
+
+	if (m_initialized == false) {
+		return false;
 	}
 
-	if (m_cache) {
-		for (size_t i = 0; i < CACHE_SIZE; ++i) {
-			free(m_cache[i].path);
-		}
+	EnterCriticalSection(&m_queue_lock);
 
-		free(m_cache);
+	while (m_queue.count() == 0 && m_running) {
+		SleepConditionVariableCS(&m_queue_not_empty, &m_queue_lock, INFINITE);
 	}
 
-	if (m_queue) {
-		for (size_t i = 0; i < QUEUE_SIZE; ++i) {
-			free(m_queue[i]);
-		}
+	if (m_queue.pop(path) == false) {
+		LeaveCriticalSection(&m_queue_lock);
+		return false;
+	}
 
-		free(m_queue);
+	LeaveCriticalSection(&m_queue_lock);
+	WakeConditionVariable(&m_queue_not_full);
+
+	return true;
+}
+
+u32 Monitor::queued() {
+	if (m_initialized == false) {
+		return 0;
 	}
+
+	EnterCriticalSection(&m_queue_lock);
+	u32 result = m_queue.count();
+	LeaveCriticalSection(&m_queue_lock);
+
+	return result;
 }
 
-b32 Monitor::receive(WCHAR** path) {
+void Monitor::visit_queued(MonitorVisitor visitor, void* context) {
+	assert(visitor);
+
+	if (m_initialized == false) {
+		return;
+	}
 
 	EnterCriticalSection(&m_queue_lock);
 
-	while (m_queue_num == 0 && m_subscription) {
-		SleepConditionVariableCS(&m_queue_not_empty, &m_queue_lock, INFINITE);
+	m_queue.visit(visitor, context);
+
+	LeaveCriticalSection(&m_queue_lock);
+}
+
+void Monitor::visit_cached(MonitorCacheVisitor visitor, void* context) {
+	assert(visitor);
+
+	if (m_initialized == false) {
+		return;
 	}
 
-	if (m_subscription == nullptr && m_queue_num == 0) {
-		LeaveCriticalSection(&m_queue_lock);
+	EnterCriticalSection(&m_cache_lock);
+	m_cache.visit(visitor, context, GetTickCount64());
+	LeaveCriticalSection(&m_cache_lock);
+}
+
+void Monitor::restore_cached(Key const* key, u64 seen) {
+	assert(key);
+
+	if (m_initialized == false) {
+		return;
+	}
+
+	EnterCriticalSection(&m_cache_lock);
+	m_cache.restore(key, seen, GetTickCount64());
+	LeaveCriticalSection(&m_cache_lock);
+}
+
+b32 Monitor::restore_queued(WCHAR const* path, Key const* key) {
+	assert(path);
+	assert(m_running == false);
+
+	if (m_initialized == false) {
 		return false;
 	}
 
-	*path = m_queue[m_queue_ind];
-	--m_queue_num;
-	++m_queue_ind;
+	// Drop events key the queue on the device path, so an entry under its mapped path would be queued twice.
+	Key device_key;
+	if (key == nullptr) {
+		Path device;
+		if (device_path(path, &device) == false || device_key.assign(device.c_str()) == false) {
+			return false;
+		}
 
-	if (m_queue_ind == QUEUE_SIZE) {
-		m_queue_ind = 0;
+		key = &device_key;
+	}
+
+	EnterCriticalSection(&m_queue_lock);
+
+	u64 now = GetTickCount64();
+
+	b32 result = false;
+	if (m_queue.full() == false && m_queue.bump(key, false) == false) {
+		result = m_queue.push(key, path, now, false);
 	}
 
 	LeaveCriticalSection(&m_queue_lock);
-	WakeConditionVariable(&m_queue_not_full);
 
-	return true;
+	return result;
 }
 
-void Monitor::start() {
+b32 Monitor::trim() {
+	TRACE_SCOPE("Monitor::trim");
+
 	if (m_initialized == false) {
+		return true;
+	}
+
+	EnterCriticalSection(&m_cache_lock);
+	b32 result = m_cache.release(GetTickCount64());
+
+	if (result) {
+		m_foreground.reset();
+		m_foreground_age = 0;
+	}
+
+	LeaveCriticalSection(&m_cache_lock);
+
+	EnterCriticalSection(&m_queue_lock);
+	result = m_queue.release() && result;
+	LeaveCriticalSection(&m_queue_lock);
+
+	return result;
+}
+
+b32 Monitor::inject(FWPM_NET_EVENT1 const* ev) {
+	assert(ev);
+	assert(ev->header.appId.data);
+
+	if (enter_callback() == false) {
+		return false;
+	}
+
+	b32 result = false;
+	if (m_running) {
+		if (m_callback) {
+			m_callback(ev, m_callback_context);
+		}
+
+		result = drop_event((WCHAR*)ev->header.appId.data);
+	}
+
+	leave_callback();
+
+	return result;
+}
+
+b32 Monitor::enter_callback() {
+	for (;;) {
+		LONG count = m_callbacks;
+		if (count & CALLBACKS_CLOSED) {
+			return false;
+		}
+
+		if (InterlockedCompareExchange(&m_callbacks, count + 1, count) == count) {
+			return true;
+		}
+	}
+}
+
+void Monitor::leave_callback() {
+	if (InterlockedDecrement(&m_callbacks) == CALLBACKS_CLOSED) {
+		SetEvent(m_callbacks_done);
+	}
+}
+
+void Monitor::set_callback(MonitorCallback callback, void* context) {
+	m_callback = callback;
+	m_callback_context = context;
+}
+
+void Monitor::set_builtin_rules(BuiltinRules const* rules) {
+	assert(rules);
+	m_builtin_rules = rules;
+}
+
+void Monitor::start() {
+	if (m_initialized == false || m_source_thread) {
 		return;
 	}
 
-	FWPM_NET_EVENT_SUBSCRIPTION0 sub_desc = {};
-	sub_desc.sessionKey = m_session_key;
-	FwpmNetEventSubscribe0(m_session, &sub_desc, drop_event_callback, (void*)this, &m_subscription);
+	// Admits callbacks again after an earlier stop closed them.
+	ResetEvent(m_callbacks_done);
+	InterlockedExchange(&m_callbacks, 0);
+
+	EnterCriticalSection(&m_queue_lock);
+	m_running = true;
+	LeaveCriticalSection(&m_queue_lock);
+
+	HANDLE source_thread = nullptr;
+
+	m_source_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	if (m_source_stop) {
+		source_thread = CreateThread(nullptr, 0, source_thread_callback, this, 0, nullptr);
+	}
+
+	EnterCriticalSection(&m_queue_lock);
+	m_source_thread = source_thread;
+	m_running = (source_thread != nullptr);
+	LeaveCriticalSection(&m_queue_lock);
+
+	if (source_thread == nullptr) {
+		WakeAllConditionVariable(&m_queue_not_empty);
+	}
 }
 
 void Monitor::stop() {
-	if (m_session && m_subscription) {
-		FwpmNetEventUnsubscribe0(m_session, m_subscription);
+	if (m_initialized == false) {
+		return;
+	}
 
-		EnterCriticalSection(&m_queue_lock);
-		m_subscription = nullptr;
-		LeaveCriticalSection(&m_queue_lock);
+	EnterCriticalSection(&m_queue_lock);
+	m_running = false;
+	HANDLE source_thread = m_source_thread;
+	m_source_thread = nullptr;
+	LeaveCriticalSection(&m_queue_lock);
 
-		WakeAllConditionVariable(&m_queue_not_full);
-		WakeAllConditionVariable(&m_queue_not_empty);
+	WakeAllConditionVariable(&m_queue_not_full);
+	WakeAllConditionVariable(&m_queue_not_empty);
+
+	// The source thread unsubscribes before it ends.
+	if (source_thread) {
+		SetEvent(m_source_stop);
+		WaitForSingleObject(source_thread, INFINITE);
+		CloseHandle(source_thread);
+	}
+
+	if (m_source_stop) {
+		CloseHandle(m_source_stop);
+		m_source_stop = nullptr;
+	}
+
+	// Callbacks that were already admitted may still be mapping a path; stop admitting new ones and wait for the last
+	// one to leave before the caller is allowed to destroy the locks and buffers they use.
+	LONG count = InterlockedOr(&m_callbacks, CALLBACKS_CLOSED);
+	if ((count & ~CALLBACKS_CLOSED) != 0) {
+		WaitForSingleObject(m_callbacks_done, INFINITE);
 	}
 }
 
-b32 Monitor::cache(WCHAR const* path) {
-	assert(m_initialized);
+b32 Monitor::is_foreground(WCHAR const* path, u64 now) {
 	assert(path);
 
-	ULONGLONG now = GetTickCount64();
-	ULONGLONG oldest_age = MAXUINT64;
-	size_t oldest_ind = 0;
+	if (now - m_foreground_age >= FOREGROUND_AGE) {
+		m_foreground_age = now;
+		m_foreground.clear();
 
-	for (size_t i = 0; i < CACHE_SIZE; ++i) {
-		MonitorItem* item = m_cache + i;
+		DWORD process_id = 0;
+		HWND wnd = GetForegroundWindow();
 
-		if (item->age < oldest_age) {
-			oldest_age = item->age;
-			oldest_ind = i;
-		}
+		if (wnd && GetWindowThreadProcessId(wnd, &process_id) && process_id) {
+			HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, process_id);
+			if (process) {
+				WCHAR image[MAX_PATH + 1];
+				DWORD image_count = COUNT(image);
 
-		if (item->path == nullptr) {
-			continue;
+				if (QueryFullProcessImageNameW(process, PROCESS_NAME_NATIVE, image, &image_count)) {
+					m_foreground.assign(image, image_count);
+				}
+
+				CloseHandle(process);
+			}
 		}
+	}
+
+	return m_foreground.empty() == false && _wcsicmp(m_foreground.c_str(), path) == 0;
+}
+
+b32 Monitor::drop_event(WCHAR const* path) {
+	TRACE_SCOPE("Monitor::drop_event");
 
-		if (now - item->age < CACHE_AGE && wcscmp(item->path, path) == 0) {
+	// A system binary in the built-in table needs no caches while the firewall has a rule for it, and its path is mapped
+	// without querying every drive. The device path of the system volume is lowercase
+	// ASCII, so folding the path is enough to compare against it.
+	size_t prefix = 0;
+	while (prefix < m_system_device_size && builtin_fold(path[prefix]) == m_system_device[prefix]) {
+		prefix += 1;
+	}
+
+	u32 slot = 0;
+	b32 is_builtin = false;
+	if (m_system_device_size && prefix == m_system_device_size) {
+		is_builtin = builtin_lookup(path + m_system_device_size, &slot) != BuiltinVerdictNone;
+
+		if (is_builtin && m_builtin_rules && m_builtin_rules->has(slot)) {
 			return false;
 		}
 	}
 
-	MonitorItem* item = m_cache + oldest_ind;
-
-	free(item->path);
-	item->path = _wcsdup(path);
-	item->age = item->path ? now : 0;
+	Key key;
+	if (key.assign(path) == false) {
+		return false;
+	}
 
-	return true;
-}
+	u64 now = GetTickCount64();
 
-void Monitor::drop_event(WCHAR const* path) {
 	EnterCriticalSection(&m_cache_lock);
-	b32 cache_result = cache(path);
+	b32 is_new = m_cache.insert(&key, now);
+	b32 foreground = is_foreground(path, now);
 	LeaveCriticalSection(&m_cache_lock);
 
-	if (cache_result == false) {
-		return;
+	// A repeated drop event raises the application in the queue instead of queueing it again.
+	EnterCriticalSection(&m_queue_lock);
+	b32 is_bumped = m_queue.bump(&key, foreground);
+	LeaveCriticalSection(&m_queue_lock);
+
+	if (is_bumped || is_new == false) {
+		return false;
 	}
 
-	WCHAR* real_path = map_path(path);
-	if (real_path == nullptr) {
-		return;
+	Path real_path;
+	b32 is_mapped = is_builtin ?
+		real_path.assign(m_system_drive, 3) && real_path.append(path + m_system_device_size) :
+		map_path(path, &real_path);
+
+	if (is_mapped == false) {
+		return false;
 	}
 
-	EnterCriticalSection(&m_queue_lock);
+	Path app_path;
+	if (canon_path(real_path.c_str(), &app_path) == false) {
+		return false;
+	}
 
-	while (m_queue_num == QUEUE_SIZE && m_subscription) {
-		SleepConditionVariableCS(&m_queue_not_full, &m_queue_lock, INFINITE);
+	{
+		TRACE_SCOPE("Monitor::queue_wait");
+		EnterCriticalSection(&m_queue_lock);
+
+		while (m_queue.full() && m_running) {
+			SleepConditionVariableCS(&m_queue_not_full, &m_queue_lock, INFINITE);
+		}
 	}
 
-	if (m_subscription == nullptr) {
+	// Another event for the application may have queued it while this one was being mapped.
+	if (m_running == false || m_queue.bump(&key, foreground)) {
 		LeaveCriticalSection(&m_queue_lock);
-		return;
+		return false;
 	}
 
-	m_queue[(m_queue_ind + m_queue_num) % QUEUE_SIZE] = real_path;
-	++m_queue_num;
+	b32 result = m_queue.push(&key, app_path.c_str(), now, foreground);
 
 	LeaveCriticalSection(&m_queue_lock);
-	WakeConditionVariable(&m_queue_not_empty);
+
+	if (result) {
+		WakeConditionVariable(&m_queue_not_empty);
+	}
+
+	return result;
+}
+
+b32 Monitor::subscribe() {
+	if (m_session == nullptr) {
+		return false;
+	}
+
+	// The collector turns the collection of drop events off when it stops.
+	FWP_VALUE0 val = {};
+	val.type = FWP_UINT32;
+	val.uint32 = 1;
+
+	if (FwpmEngineSetOption0(m_session, FWPM_ENGINE_COLLECT_NET_EVENTS, &val) != ERROR_SUCCESS) {
+		return false;
+	}
+
+	FWPM_NET_EVENT_SUBSCRIPTION0 sub_desc = {};
+	sub_desc.sessionKey = m_session_key;
+
+	HANDLE subscription = nullptr;
+	if (FwpmNetEventSubscribe0(m_session, &sub_desc, drop_event_callback, (void*)this, &subscription) !=
+		ERROR_SUCCESS) {
+		return false;
+	}
+
+	m_subscription = subscription;
+
+	return true;
+}
+
+b32 Monitor::read_subscription() {
+	b32 is_subscribed = subscribe();
+	b32 is_stopped = false;
+
+	for (;;) {
+		if (WaitForSingleObject(m_source_stop, COLLECTOR_CHECK) != WAIT_TIMEOUT) {
+			is_stopped = true;
+			break;
+		}
+
+		if (m_has_user_sid && ring_collector_running()) {
+			break;
+		}
+
+		if (is_subscribed == false) {
+			is_subscribed = subscribe();
+		}
+	}
+
+	// Returns only once no drop event callback is still running.
+	if (m_subscription) {
+		FwpmNetEventUnsubscribe0(m_session, m_subscription);
+		m_subscription = nullptr;
+	}
+
+	// The collection is left on for a collector that took over.
+	if (is_stopped && is_subscribed) {
+		FWP_VALUE0 val = {};
+		val.type = FWP_UINT32;
+		val.uint32 = 0;
+
+		FwpmEngineSetOption0(m_session, FWPM_ENGINE_COLLECT_NET_EVENTS, &val);
+	}
+
+	return is_stopped;
+}
+
+b32 Monitor::read_ring() {
+	EventRing ring;
+
+	// The collector creates the ring of the user with its first drop event and signals the created event, which is
+	// opened before the ring so that the signal cannot be missed.
+	HANDLE created = EventRing::open_created(m_user_sid_string);
+	HANDLE waits[] = { m_source_stop, created };
+
+	DWORD retry = RING_RETRY;
+	b32 is_stopped = false;
+
+	while (ring.open(m_user_sid_string) == false) {
+		DWORD wait = created ? WaitForMultipleObjects(COUNT(waits), waits, FALSE, COLLECTOR_CHECK) :
+			WaitForSingleObject(m_source_stop, retry);
+
+		if (wait == WAIT_OBJECT_0) {
+			is_stopped = true;
+			break;
+		}
+
+		if (ring_collector_running() == false) {
+			break;
+		}
+
+		retry = MIN(retry * 2, RING_RETRY_MAX);
+	}
+
+	if (created) {
+		CloseHandle(created);
+	}
+
+	if (ring.is_open() == false) {
+		return is_stopped;
+	}
+
+	HANDLE events[] = { m_source_stop, ring.ready() };
+
+	Path path;
+	RingEvent event;
+
+	for (;;) {
+		while (ring.read(&path, &event)) {
+			FWPM_NET_EVENT1 ev = {};
+			ev.type = FWPM_NET_EVENT_TYPE_CLASSIFY_DROP;
+			ev.header.flags = FWPM_NET_EVENT_FLAG_APP_ID_SET;
+			ev.header.appId.data = (UINT8*)path.c_str();
+			ev.header.appId.size = (UINT32)((path.size() + 1) * sizeof(WCHAR));
+			ev.header.timeStamp.dwLowDateTime = (DWORD)event.time;
+			ev.header.timeStamp.dwHighDateTime = (DWORD)(event.time >> 32);
+
+			if (event.remote_version) {
+				ev.header.flags |= FWPM_NET_EVENT_FLAG_IP_VERSION_SET | FWPM_NET_EVENT_FLAG_REMOTE_ADDR_SET;
+				ev.header.ipVersion = (event.remote_version == 6) ? FWP_IP_VERSION_V6 : FWP_IP_VERSION_V4;
+				ev.header.remoteAddrV4 = event.remote_v4;
+
+				if (event.remote_version == 6) {
+					memcpy(ev.header.remoteAddrV6.byteArray16, event.remote_v6, sizeof(event.remote_v6));
+				}
+			}
+
+			if (event.remote_port) {
+				ev.header.flags |= FWPM_NET_EVENT_FLAG_REMOTE_PORT_SET;
+				ev.header.remotePort = (UINT16)event.remote_port;
+			}
+
+			inject(&ev);
+		}
+
+		// Events written by a collector that stopped meanwhile were read above.
+		DWORD wait = WaitForMultipleObjects(COUNT(events), events, FALSE, COLLECTOR_CHECK);
+		if (wait == WAIT_TIMEOUT && ring_collector_running() == false) {
+			return false;
+		}
+
+		if (wait != WAIT_TIMEOUT && wait != WAIT_OBJECT_0 + 1) {
+			return true;
+		}
+	}
+}
+
+DWORD Monitor::source_thread() {
+	for (;;) {
+		b32 is_stopped = (m_has_user_sid && ring_collector_running()) ? read_ring() : read_subscription();
+		if (is_stopped) {
+			break;
+		}
+	}
+
+	return 0;
 }
 
 void CALLBACK Monitor::drop_event_callback(_Inout_ void* context, _In_ const FWPM_NET_EVENT1* ev) {
@@ -263,5 +706,21 @@ void CALLBACK Monitor::drop_event_callback(_Inout_ void* context, _In_ const FWP
 	}
 
 	Monitor* monitor = (Monitor*)context;
-	monitor->drop_event((WCHAR*)ev->header.appId.data);
+
+	// Every monitor on the machine receives the drop events of every user; only the own ones are handled.
+	if ((ev->header.flags & FWPM_NET_EVENT_FLAG_USER_ID_SET) && ev->header.userId && monitor->m_has_user_sid &&
+		EqualSid(ev->header.userId, (PSID)monitor->m_user_sid) == FALSE) {
+		return;
+	}
+
+	monitor->inject(ev);
+}
+
+DWORD WINAPI Monitor::source_thread_callback(LPVOID context) {
+	Monitor* monitor = (Monitor*)context;
+	if (monitor) {
+		return monitor->source_thread();
+	}
+
+	return 0;
 }
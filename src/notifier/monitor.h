@@ -1,13 +1,33 @@
 #pragma once
+#include "builtin.h"
 #include "core.h"
+#include "dedup.h"
+#include "key.h"
+#include "path.h"
+#include "pending.h"
+#include "ring.h"
 #include <Windows.h>
 #include <fwpmu.h>
 #include <fwptypes.h>
 
-// Monitor outbound connection drop event callback. Passes back the device path and the user context data.
-typedef void(*MonitorCallback)(WCHAR const* path, void* context);
+// Maximum number of applications waiting in the queue.
+#define MONITOR_QUEUE_SIZE 1024
 
-// Windows firewall outbound connection monitor.
+// Monitor outbound connection drop event callback. Passes back the drop event and the user context data.
+typedef void(*MonitorCallback)(FWPM_NET_EVENT1 const* ev, void* context);
+
+// Visitor for the paths waiting in the monitor queue. Passes back the path, the key of the device path it was queued
+// under and the user context data.
+typedef PendingVisitor MonitorVisitor;
+
+// Visitor for the items in the monitor cache. Passes back the key of the item, the time at which it was last seen and
+// the user context data.
+typedef DedupVisitor MonitorCacheVisitor;
+
+// Windows firewall outbound connection monitor. Only drop events of the user running the monitor are handled. When the
+// system-wide collector is running, the events are read from the event ring of the user instead of subscribing to the
+// firewall directly, and the monitor switches between the two as the collector starts and stops. Drop events of system
+// binaries in the built-in table are ignored while the firewall has a rule for them.
 class Monitor {
 public:
 	// Creates the firewall monitor interface.
@@ -16,41 +36,109 @@ public:
 	// Destroys the firewall monitor interface.
 	~Monitor();
 
-	// Blocks and receives a drop event notification for a path. Returns true on success, false otherwise.
-	b32 receive(WCHAR** path);
+	// Blocks and receives a drop event notification for the path with the highest priority. Returns true on success,
+	// false otherwise.
+	b32 receive(Path* path);
+
+	// Returns the number of paths waiting in the queue.
+	u32 queued();
+
+	// Calls the visitor for every path waiting in the queue, in no particular order. The visitor must not call into the
+	// monitor.
+	void visit_queued(MonitorVisitor visitor, void* context);
+
+	// Calls the visitor for every item in the deduplication cache that is still in effect.
+	void visit_cached(MonitorCacheVisitor visitor, void* context);
+
+	// Puts an item back into the deduplication cache, as last seen at the given time. Items that would already have
+	// aged out are ignored.
+	void restore_cached(Key const* key, u64 seen);
+
+	// Puts a path back into the queue, such as one carried over from a previous run, under the key of its device path
+	// so that drop events find it. Without a key, the device path is mapped back from the path. Must be called before
+	// starting. Returns true if the path was queued.
+	b32 restore_queued(WCHAR const* path, Key const* key);
+
+	// Releases the deduplication cache and the queue while neither holds anything, such as after a quiet spell. Both
+	// are allocated again by the next drop event. Returns true if both were released.
+	b32 trim();
+
+	// Handles a drop event as if it came from the system, such as a synthetic one. Returns true if the path was queued.
+	b32 inject(FWPM_NET_EVENT1 const* ev);
+
+	// Sets the callback invoked for every drop event before it is deduplicated. Must be called before starting.
+	void set_callback(MonitorCallback callback, void* context);
+
+	// Sets the built-in table slots the firewall has a rule for. Must be called before starting.
+	void set_builtin_rules(BuiltinRules const* rules);
 
 	// Starts the firewall monitoring.
 	void start();
 
-	// Stops the firewall monitoring.
+	// Stops the firewall monitoring. Blocked producers and consumers are released, and the call returns only once no
+	// drop event callback is still running. Events already queued can still be received.
 	void stop();
 
 private:
-	// Adds an item to the cache. Returns true if the item was added, false if the cache already contained the item.
-	b32 cache(WCHAR const* path);
+	// Returns true if the application at the given device path owns the foreground window. Must be called under the
+	// cache lock.
+	b32 is_foreground(WCHAR const* path, u64 now);
+
+	// Handles a drop event for the item at the given path. Returns true if the path was queued.
+	b32 drop_event(WCHAR const* path);
+
+	// Admits a drop event callback unless the monitor has stopped admitting them. Returns true if the callback may run,
+	// in which case leave_callback must be called once it is done.
+	b32 enter_callback();
+
+	// Ends a drop event callback, waking a stop that waits for the last one.
+	void leave_callback();
+
+	// Subscribes to the drop events of the firewall. Returns true on success.
+	b32 subscribe();
+
+	// Receives drop events through a direct subscription until the monitor stops or the collector starts. Returns true
+	// if the monitor stopped.
+	b32 read_subscription();
+
+	// Reads drop events from the event ring of the user until the monitor stops or the collector goes away. Returns
+	// true if the monitor stopped.
+	b32 read_ring();
 
-	// Handles a drop event for the item at the given path.
-	void drop_event(WCHAR const* path);
+	// Thread routine that delivers the drop events, from the event ring of the user while the collector runs and from
+	// a direct subscription otherwise.
+	DWORD source_thread();
 
 	// Callback from the system to handle a drop event notification event from the firewall.
 	static void CALLBACK drop_event_callback(_Inout_ void* context, _In_ const FWPM_NET_EVENT1* ev);
 
-	// An item in the monitor cache.
-	struct MonitorItem {
-		WCHAR* path;
-		ULONGLONG age;
-	};
+	// Callback from the system to start the source thread.
+	static DWORD WINAPI source_thread_callback(LPVOID context);
 
 	CONDITION_VARIABLE m_queue_not_full;
 	CONDITION_VARIABLE m_queue_not_empty;
 	CRITICAL_SECTION m_cache_lock;
 	CRITICAL_SECTION m_queue_lock;
-	GUID m_session_key;
+	GUID m_session_key = {};
 	HANDLE m_session = nullptr;
 	HANDLE m_subscription = nullptr;
-	MonitorItem* m_cache = nullptr;
-	WCHAR** m_queue = nullptr;
-	u32 m_queue_num = 0;
-	u32 m_queue_ind = 0;
+	HANDLE m_source_thread = nullptr;
+	HANDLE m_source_stop = nullptr;
+	HANDLE m_callbacks_done = nullptr;
+	MonitorCallback m_callback = nullptr;
+	void* m_callback_context = nullptr;
+	DedupCache m_cache;
+	PendingQueue m_queue;
+	Path m_foreground;
+	u64 m_foreground_age = 0;
+	u8 m_user_sid[SECURITY_MAX_SID_SIZE] = {};
+	WCHAR m_user_sid_string[RING_SID_SIZE] = {};
+	WCHAR m_system_drive[4] = {};
+	WCHAR m_system_device[MAX_PATH + 1] = {};
+	size_t m_system_device_size = 0;
+	BuiltinRules const* m_builtin_rules = nullptr;
+	volatile LONG m_callbacks = 0;
 	b32 m_initialized = false;
+	b32 m_has_user_sid = false;
+	volatile b32 m_running = false;
 };
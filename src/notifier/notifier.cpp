@@ -1,5 +1,6 @@
 #include "notifier.h"
 #include "resource.h"
+#include "trace.h"
 #include <windowsx.h>
 #include <shellapi.h>
 #include <ShlObj.h>
@@ -9,6 +10,8 @@
 #define ID_BLOCK 102
 #define ID_SKIP 103
 #define ID_OPEN_PATH 104
+#define ID_ALLOW_TEMPORARY 105
+#define ID_BLOCK_SESSION 106
 
 // Notifier class name.
 static WCHAR const CLASS_NAME[] = L"firewall_notifier_class";
@@ -25,7 +28,43 @@ Notifier::Notifier() {
 	InitCommonControlsEx(&icex);
 
 	m_instance = GetModuleHandleW(nullptr);
-	m_app_icon = LoadIconW(m_instance, MAKEINTRESOURCEW(IDI_ICON1));
+	load();
+}
+
+Notifier::~Notifier() {
+	trim();
+}
+
+void Notifier::trim() {
+	if (m_font_underlined) {
+		DeleteObject(m_font_underlined);
+		m_font_underlined = nullptr;
+	}
+
+	if (m_font) {
+		DeleteObject(m_font);
+		m_font = nullptr;
+	}
+
+	if (m_is_class_registered) {
+		UnregisterClassW(CLASS_NAME, m_instance);
+		m_is_class_registered = false;
+	}
+
+	if (m_app_icon) {
+		DestroyIcon(m_app_icon);
+		m_app_icon = nullptr;
+	}
+}
+
+void Notifier::load() {
+	if (m_is_class_registered) {
+		return;
+	}
+
+	if (m_app_icon == nullptr) {
+		m_app_icon = LoadIconW(m_instance, MAKEINTRESOURCEW(IDI_ICON1));
+	}
 
 	WNDCLASS wc = { 0 };
 	wc.hbrBackground = (HBRUSH)(COLOR_WINDOW);
@@ -38,7 +77,7 @@ Notifier::Notifier() {
 
 	NONCLIENTMETRICS ncm = { 0 };
 	ncm.cbSize = sizeof(ncm);
-	if (SystemParametersInfoW(SPI_GETNONCLIENTMETRICS, sizeof(ncm), &ncm, 0)) {
+	if (m_font == nullptr && SystemParametersInfoW(SPI_GETNONCLIENTMETRICS, sizeof(ncm), &ncm, 0)) {
 		m_font = CreateFontIndirectW(&ncm.lfMessageFont);
 
 		ncm.lfMessageFont.lfUnderline = TRUE;
@@ -48,31 +87,16 @@ Notifier::Notifier() {
 	m_is_class_registered = (RegisterClassW(&wc) != 0);
 }
 
-Notifier::~Notifier() {
-	if (m_font_underlined) {
-		DeleteObject(m_font_underlined);
-	}
-
-	if (m_font) {
-		DeleteObject(m_font);
-	}
-
-	if (m_app_icon) {
-		DestroyIcon(m_app_icon);
-	}
-
-	if (m_is_class_registered) {
-		UnregisterClassW(CLASS_NAME, m_instance);
-	}
-}
-
 NotifierAction Notifier::show(WCHAR const * path) {
+	TRACE_SCOPE("Notifier::show");
 	NotifierAction action = NotifierActionSkip;
 
 	if (path == nullptr) {
 		return action;
 	}
 
+	load();
+
 	RECT screen = { 0 };
 	if (SystemParametersInfoW(SPI_GETWORKAREA, 0, &screen, 0) == FALSE) {
 		screen.right = 0;
@@ -80,7 +104,7 @@ NotifierAction Notifier::show(WCHAR const * path) {
 	}
 
 	DWORD style = WS_POPUP | WS_SYSMENU | WS_BORDER;
-	RECT window = { 0, 0, 253, 76 };
+	RECT window = { 0, 0, 253, 106 };
 	AdjustWindowRect(&window, style, FALSE);
 
 	i32 window_width = (window.right - window.left);
@@ -152,6 +176,20 @@ NotifierAction Notifier::show(WCHAR const * path) {
 		171, 46, 75, 23,
 		wnd, (HMENU)ID_SKIP, m_instance, nullptr);
 
+	CreateWindowExW(
+		0, WC_BUTTONW,
+		L"Allow 10 min",
+		WS_VISIBLE | WS_CHILD,
+		7, 76, 116, 23,
+		wnd, (HMENU)ID_ALLOW_TEMPORARY, m_instance, nullptr);
+
+	CreateWindowExW(
+		0, WC_BUTTONW,
+		L"Block session",
+		WS_VISIBLE | WS_CHILD,
+		130, 76, 116, 23,
+		wnd, (HMENU)ID_BLOCK_SESSION, m_instance, nullptr);
+
 	for (HWND temp = GetTopWindow(wnd); temp; temp = GetWindow(temp, GW_HWNDNEXT)) {
 		SendMessageW(temp, WM_SETFONT, (WPARAM)m_font, TRUE);
 	}
@@ -211,6 +249,18 @@ LRESULT Notifier::handle_msg(HWND wnd, UINT msg, WPARAM wp, LPARAM lp) {
 					m_is_open = false;
 				} break;
 
+				case ID_ALLOW_TEMPORARY:
+				{
+					m_action = NotifierActionAllowTemporary;
+					m_is_open = false;
+				} break;
+
+				case ID_BLOCK_SESSION:
+				{
+					m_action = NotifierActionBlockSession;
+					m_is_open = false;
+				} break;
+
 				case ID_OPEN_PATH:
 				{
 					LPITEMIDLIST idl = ILCreateFromPathW(m_path);
@@ -6,7 +6,9 @@
 enum NotifierAction {
 	NotifierActionSkip,
 	NotifierActionBlock,
-	NotifierActionAllow
+	NotifierActionAllow,
+	NotifierActionAllowTemporary,
+	NotifierActionBlockSession
 };
 
 // Creates the notifier.
@@ -21,7 +23,14 @@ public:
 	// Shows a firewall notification for the given path. Reeturns the action that user requested.
 	NotifierAction show(WCHAR const* path);
 
+	// Releases the window class, fonts and icon until the next notification. Must be called from the thread that shows
+	// the notifications.
+	void trim();
+
 private:
+	// Loads the window class, fonts and icon unless they are already loaded.
+	void load();
+
 	// Handles a Win32 message.
 	LRESULT handle_msg(HWND wnd, UINT msg, WPARAM wp, LPARAM lp);
 
@@ -0,0 +1,139 @@
+#include "path.h"
+#include "mem.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Maximum length of a path, in characters.
+static const size_t PATH_MAX_SIZE = MAX_EXT_PATH;
+
+Path::Path() {
+	m_inline[0] = 0;
+}
+
+Path::Path(Path&& other) {
+	m_inline[0] = 0;
+	*this = static_cast<Path&&>(other);
+}
+
+Path::~Path() {
+	mem_free(m_heap);
+}
+
+Path& Path::operator=(Path&& other) {
+	if (this == &other) {
+		return *this;
+	}
+
+	if (other.m_heap) {
+		mem_free(m_heap);
+
+		m_heap = other.m_heap;
+		m_heap_capacity = other.m_heap_capacity;
+		m_size = other.m_size;
+
+		other.m_heap = nullptr;
+		other.m_heap_capacity = 0;
+	} else {
+		WCHAR* dst = data();
+		memcpy(dst, other.m_inline, (other.m_size + 1) * sizeof(*dst));
+		m_size = other.m_size;
+	}
+
+	other.m_size = 0;
+	other.m_inline[0] = 0;
+
+	return *this;
+}
+
+b32 Path::assign(WCHAR const* src, size_t count) {
+	assert(src || count == 0);
+
+	if (reserve(count) == false) {
+		return false;
+	}
+
+	WCHAR* dst = data();
+	memmove(dst, src, count * sizeof(*dst));
+	dst[count] = 0;
+	m_size = (u32)count;
+
+	return true;
+}
+
+b32 Path::assign(WCHAR const* src) {
+	assert(src);
+	return assign(src, wcslen(src));
+}
+
+b32 Path::append(WCHAR const* src, size_t count) {
+	assert(src || count == 0);
+
+	if (reserve(m_size + count) == false) {
+		return false;
+	}
+
+	WCHAR* dst = data();
+	memmove(dst + m_size, src, count * sizeof(*dst));
+	m_size += (u32)count;
+	dst[m_size] = 0;
+
+	return true;
+}
+
+b32 Path::append(WCHAR const* src) {
+	assert(src);
+	return append(src, wcslen(src));
+}
+
+void Path::truncate(size_t count) {
+	if (count < m_size) {
+		m_size = (u32)count;
+		data()[count] = 0;
+	}
+}
+
+void Path::clear() {
+	m_size = 0;
+	data()[0] = 0;
+}
+
+void Path::reset() {
+	mem_free(m_heap);
+
+	m_heap = nullptr;
+	m_heap_capacity = 0;
+	m_size = 0;
+	m_inline[0] = 0;
+}
+
+b32 Path::reserve(size_t count) {
+	if (count > PATH_MAX_SIZE) {
+		return false;
+	}
+
+	size_t capacity = m_heap ? m_heap_capacity : PATH_INLINE_SIZE;
+	if (count < capacity) {
+		return true;
+	}
+
+	size_t new_capacity = PATH_MAX_SIZE + 1;
+	if (count < PATH_MAX_SIZE / 2) {
+		new_capacity = MAX(capacity * 2, count + 1);
+	}
+
+	WCHAR* heap = (WCHAR*)mem_realloc(MemoryTagPaths, m_heap, new_capacity * sizeof(*heap));
+	if (heap == nullptr) {
+		return false;
+	}
+
+	if (m_heap == nullptr) {
+		memcpy(heap, m_inline, (m_size + 1) * sizeof(*heap));
+	}
+
+	m_heap = heap;
+	m_heap_capacity = (u32)new_capacity;
+
+	return true;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Inline capacity of a path, in characters including the null terminator.
+#define PATH_INLINE_SIZE MAX_PATH
+
+// A null terminated path with inline storage for typical lengths. Only longer extended paths spill to the heap.
+// A zero initialized path is a valid empty path, so paths can live in calloc'd arrays as long as reset is called
+// before the array is freed.
+class Path {
+public:
+	// Creates an empty path.
+	Path();
+
+	// Moves the contents of another path into a new path, leaving the other path empty.
+	Path(Path&& other);
+
+	// Destroys the path.
+	~Path();
+
+	// Moves the contents of another path into this path, leaving the other path empty.
+	Path& operator=(Path&& other);
+
+	Path(Path const&) = delete;
+	Path& operator=(Path const&) = delete;
+
+	// Replaces the contents with the first count characters of the source. Returns true on success.
+	b32 assign(WCHAR const* src, size_t count);
+
+	// Replaces the contents with the null terminated source. Returns true on success.
+	b32 assign(WCHAR const* src);
+
+	// Appends the first count characters of the source. Returns true on success.
+	b32 append(WCHAR const* src, size_t count);
+
+	// Appends the null terminated source. Returns true on success.
+	b32 append(WCHAR const* src);
+
+	// Shortens the path to the first count characters.
+	void truncate(size_t count);
+
+	// Empties the path, keeping any heap storage for reuse.
+	void clear();
+
+	// Empties the path and releases any heap storage.
+	void reset();
+
+	// Returns the null terminated contents of the path.
+	WCHAR const* c_str() const {
+		return m_heap ? m_heap : m_inline;
+	}
+
+	// Returns the mutable contents of the path. The length must not be changed through the returned pointer.
+	WCHAR* data() {
+		return m_heap ? m_heap : m_inline;
+	}
+
+	// Returns the length of the path in characters, excluding the null terminator.
+	size_t size() const {
+		return m_size;
+	}
+
+	// Returns true if the path is empty.
+	b32 empty() const {
+		return m_size == 0;
+	}
+
+private:
+	// Ensures capacity for count characters plus the null terminator. Returns true on success.
+	b32 reserve(size_t count);
+
+	WCHAR* m_heap = nullptr;
+	u32 m_heap_capacity = 0;
+	u32 m_size = 0;
+	WCHAR m_inline[PATH_INLINE_SIZE];
+};
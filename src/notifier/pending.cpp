@@ -0,0 +1,298 @@
+#include "pending.h"
+#include "mem.h"
+#include <assert.h>
+#include <string.h>
+
+// Number of children of every heap node.
+static const u32 HEAP_ARITY = 4;
+
+// Priority gained for every doubling of the drop count, in milliseconds of waiting.
+static const i64 HIT_BONUS = 15000;
+
+// Priority gained by the foreground application, in milliseconds of waiting.
+static const i64 FOREGROUND_BONUS = 120000;
+
+// Returns the priority of an entry first seen at the given tick count. The score of an entry is the time it has been
+// waiting plus its bonuses, and since every entry waits for the same time to come, the priority leaves the current time
+// out. An entry therefore gains on every entry that arrives after it.
+static i64 entry_priority(u64 first_seen, u32 hits, b32 is_foreground) {
+	i64 priority = -(i64)first_seen;
+
+	for (u32 h = hits; h > 1; h >>= 1) {
+		priority += HIT_BONUS;
+	}
+
+	if (is_foreground) {
+		priority += FOREGROUND_BONUS;
+	}
+
+	return priority;
+}
+
+PendingQueue::PendingQueue() {
+}
+
+PendingQueue::~PendingQueue() {
+	deallocate();
+}
+
+b32 PendingQueue::init(u32 capacity) {
+	assert(m_capacity == 0);
+	assert(capacity);
+
+	u32 index_size = 1;
+	while (index_size < 2 * capacity) {
+		index_size <<= 1;
+	}
+
+	m_capacity = capacity;
+	m_index_size = index_size;
+
+	if (allocate() == false) {
+		m_capacity = 0;
+		return false;
+	}
+
+	return true;
+}
+
+b32 PendingQueue::release() {
+	if (m_count) {
+		return false;
+	}
+
+	deallocate();
+
+	return true;
+}
+
+b32 PendingQueue::bump(Key const* key, b32 is_foreground) {
+	assert(key);
+
+	if (m_count == 0) {
+		return false;
+	}
+
+	u32 entry = m_index[find_slot(key)];
+	if (entry == 0) {
+		return false;
+	}
+
+	PendingEntry* e = m_entries + entry - 1;
+	e->hits += (e->hits != MAXDWORD);
+	e->is_foreground = e->is_foreground || is_foreground;
+
+	// The priority never drops, so a bumped entry only moves towards the root.
+	e->priority = MAX(e->priority, entry_priority(e->first_seen, e->hits, e->is_foreground));
+	sift_up(e->position);
+
+	return true;
+}
+
+b32 PendingQueue::push(Key const* key, WCHAR const* path, u64 now, b32 is_foreground) {
+	assert(key);
+	assert(path);
+	assert(full() == false);
+
+	if (m_entries == nullptr && allocate() == false) {
+		return false;
+	}
+
+	u32 slot = find_slot(key);
+	assert(m_index[slot] == 0);
+
+	u32 entry = m_free[m_capacity - m_count - 1];
+	PendingEntry* e = m_entries + entry;
+
+	if (e->path.assign(path) == false || e->key.load(key->data(), key->size()) == false) {
+		return false;
+	}
+
+	e->hits = 1;
+	e->first_seen = now;
+	e->is_foreground = is_foreground;
+	e->priority = entry_priority(now, 1, is_foreground);
+	e->sequence = m_sequence++;
+	e->position = m_count;
+
+	m_index[slot] = entry + 1;
+	m_heap[m_count++] = entry;
+	sift_up(e->position);
+
+	return true;
+}
+
+b32 PendingQueue::pop(Path* path) {
+	assert(path);
+
+	if (m_count == 0) {
+		return false;
+	}
+
+	u32 entry = m_heap[0];
+	PendingEntry* e = m_entries + entry;
+
+	*path = static_cast<Path&&>(e->path);
+	unindex(entry);
+
+	--m_count;
+	m_free[m_capacity - m_count - 1] = entry;
+
+	if (m_count) {
+		m_heap[0] = m_heap[m_count];
+		m_entries[m_heap[0]].position = 0;
+		sift_down(0);
+	}
+
+	return true;
+}
+
+void PendingQueue::visit(PendingVisitor visitor, void* context) const {
+	assert(visitor);
+
+	for (u32 i = 0; i < m_count; ++i) {
+		PendingEntry const* e = m_entries + m_heap[i];
+		visitor(e->path.c_str(), &e->key, context);
+	}
+}
+
+b32 PendingQueue::allocate() {
+	assert(m_entries == nullptr);
+	assert(m_capacity);
+
+	m_entries = (PendingEntry*)mem_calloc(MemoryTagQueue, m_capacity, sizeof(*m_entries));
+	m_heap = (u32*)mem_calloc(MemoryTagQueue, m_capacity, sizeof(*m_heap));
+	m_index = (u32*)mem_calloc(MemoryTagQueue, m_index_size, sizeof(*m_index));
+	m_free = (u32*)mem_calloc(MemoryTagQueue, m_capacity, sizeof(*m_free));
+
+	if (m_entries == nullptr || m_heap == nullptr || m_index == nullptr || m_free == nullptr) {
+		deallocate();
+		return false;
+	}
+
+	for (u32 i = 0; i < m_capacity; ++i) {
+		m_free[i] = m_capacity - 1 - i;
+	}
+
+	return true;
+}
+
+void PendingQueue::deallocate() {
+	if (m_entries) {
+		for (u32 i = 0; i < m_capacity; ++i) {
+			m_entries[i].path.reset();
+			m_entries[i].key.reset();
+		}
+	}
+
+	mem_free(m_entries);
+	mem_free(m_heap);
+	mem_free(m_index);
+	mem_free(m_free);
+
+	m_entries = nullptr;
+	m_heap = nullptr;
+	m_index = nullptr;
+	m_free = nullptr;
+}
+
+b32 PendingQueue::before(u32 a, u32 b) const {
+	PendingEntry const* ea = m_entries + a;
+	PendingEntry const* eb = m_entries + b;
+
+	if (ea->priority != eb->priority) {
+		return ea->priority > eb->priority;
+	}
+
+	return ea->sequence < eb->sequence;
+}
+
+void PendingQueue::sift_up(u32 position) {
+	assert(position < m_count);
+
+	u32 entry = m_heap[position];
+
+	while (position) {
+		u32 parent = (position - 1) / HEAP_ARITY;
+		if (before(entry, m_heap[parent]) == false) {
+			break;
+		}
+
+		m_heap[position] = m_heap[parent];
+		m_entries[m_heap[position]].position = position;
+		position = parent;
+	}
+
+	m_heap[position] = entry;
+	m_entries[entry].position = position;
+}
+
+void PendingQueue::sift_down(u32 position) {
+	assert(position < m_count);
+
+	u32 entry = m_heap[position];
+
+	for (;;) {
+		u32 first = position * HEAP_ARITY + 1;
+		if (first >= m_count) {
+			break;
+		}
+
+		u32 last = MIN(first + HEAP_ARITY, m_count);
+		u32 best = first;
+
+		for (u32 child = first + 1; child < last; ++child) {
+			if (before(m_heap[child], m_heap[best])) {
+				best = child;
+			}
+		}
+
+		if (before(m_heap[best], entry) == false) {
+			break;
+		}
+
+		m_heap[position] = m_heap[best];
+		m_entries[m_heap[position]].position = position;
+		position = best;
+	}
+
+	m_heap[position] = entry;
+	m_entries[entry].position = position;
+}
+
+u32 PendingQueue::find_slot(Key const* key) const {
+	u32 mask = m_index_size - 1;
+	u32 slot = (u32)key->hash() & mask;
+
+	while (m_index[slot]) {
+		Key const* other = &m_entries[m_index[slot] - 1].key;
+		if (key->equals(other->data(), other->size(), other->hash())) {
+			break;
+		}
+
+		slot = (slot + 1) & mask;
+	}
+
+	return slot;
+}
+
+void PendingQueue::unindex(u32 entry) {
+	u32 mask = m_index_size - 1;
+	u32 slot = find_slot(&m_entries[entry].key);
+	assert(m_index[slot] == entry + 1);
+
+	// Backward shift deletion keeps every probe sequence free of holes.
+	u32 next = (slot + 1) & mask;
+	while (m_index[next]) {
+		u32 home = (u32)m_entries[m_index[next] - 1].key.hash() & mask;
+
+		if (((next - home) & mask) >= ((next - slot) & mask)) {
+			m_index[slot] = m_index[next];
+			slot = next;
+		}
+
+		next = (next + 1) & mask;
+	}
+
+	m_index[slot] = 0;
+}
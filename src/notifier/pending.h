@@ -0,0 +1,100 @@
+#pragma once
+#include "core.h"
+#include "key.h"
+#include "path.h"
+#include <Windows.h>
+
+// Visitor for the paths in a pending queue. Passes back the path, the key the entry is found by and the user context
+// data. The key is null where the entry has none.
+typedef void(*PendingVisitor)(WCHAR const* path, Key const* key, void* context);
+
+// Applications waiting for a decision, ordered by impact rather than by arrival. Entries live in an indexed 4-ary max
+// heap and are found by key, so a drop event for an application that is already waiting raises its entry in place
+// instead of queueing it again. The priority of an entry is the time it has been waiting, raised for every doubling of
+// its drop count and for belonging to the foreground application, so an entry that waits long enough comes out ahead
+// of any newer one; entries of equal priority come out oldest first. Not thread safe.
+class PendingQueue {
+public:
+	// Creates an empty queue without capacity.
+	PendingQueue();
+
+	// Destroys the queue.
+	~PendingQueue();
+
+	PendingQueue(PendingQueue const&) = delete;
+	PendingQueue& operator=(PendingQueue const&) = delete;
+
+	// Allocates room for the given number of entries. Returns true on success.
+	b32 init(u32 capacity);
+
+	// Releases the memory of an empty queue. The queue keeps its capacity and allocates the memory again with the next
+	// push. Returns true if the queue was empty.
+	b32 release();
+
+	// Records another drop event for the entry with the given key. Returns true if the key has an entry.
+	b32 bump(Key const* key, b32 is_foreground);
+
+	// Adds an entry for the path under the given key, seen at the given tick count. The queue must not be full and
+	// must not already contain the key. Returns true on success, false if the entry or the released memory of the
+	// queue could not be allocated.
+	b32 push(Key const* key, WCHAR const* path, u64 now, b32 is_foreground);
+
+	// Removes the entry with the highest priority and moves its path out. Returns false if the queue is empty.
+	b32 pop(Path* path);
+
+	// Calls the visitor for every entry, in no particular order.
+	void visit(PendingVisitor visitor, void* context) const;
+
+	// Returns the number of entries.
+	u32 count() const {
+		return m_count;
+	}
+
+	// Returns true if no more entries fit.
+	b32 full() const {
+		return m_count == m_capacity;
+	}
+
+private:
+	// An application waiting for a decision.
+	struct PendingEntry {
+		Path path;
+		Key key;
+		i64 priority;
+		u64 sequence;
+		u64 first_seen;
+		u32 hits;
+		u32 position;
+		b32 is_foreground;
+	};
+
+	// Allocates the entries, the heap, the index and the free list for the capacity. Returns true on success.
+	b32 allocate();
+
+	// Frees the entries, the heap, the index and the free list.
+	void deallocate();
+
+	// Returns true if entry a should come out before entry b.
+	b32 before(u32 a, u32 b) const;
+
+	// Moves the entry at the given heap position towards the root until the heap is ordered.
+	void sift_up(u32 position);
+
+	// Moves the entry at the given heap position towards the leaves until the heap is ordered.
+	void sift_down(u32 position);
+
+	// Returns the index slot holding the key, or the empty slot where it would go.
+	u32 find_slot(Key const* key) const;
+
+	// Removes the entry from the key index.
+	void unindex(u32 entry);
+
+	PendingEntry* m_entries = nullptr;
+	u32* m_heap = nullptr;
+	u32* m_index = nullptr;
+	u32* m_free = nullptr;
+	u32 m_capacity = 0;
+	u32 m_index_size = 0;
+	u32 m_count = 0;
+	u64 m_sequence = 0;
+};
@@ -0,0 +1,560 @@
+#include "policy.h"
+#include "canon.h"
+#include "mem.h"
+#include "wstr.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Policy image identifier, "FNPI".
+static const u32 POLICY_MAGIC = 0x49504e46;
+
+// Policy image format version.
+static const u32 POLICY_VERSION = 2;
+
+// Minimum number of buckets in the policy hash table.
+static const u32 MIN_BUCKETS = 16;
+
+// Largest policy image that is loaded, in bytes.
+static const u64 MAX_IMAGE_SIZE = 0x40000000;
+
+// Header flag set when the image contains directory prefix entries.
+static const u32 HEADER_HAS_PREFIXES = 0x1;
+
+// Header flag set when the image contains entries that are resolved at load time.
+static const u32 HEADER_HAS_DEFERRED = 0x2;
+
+// Entry flag set when the entry matches every path below a directory.
+static const u32 ENTRY_PREFIX = 0x1;
+
+// Entry flag set when the path depends on the machine, through environment variables, volume GUIDs or 8.3 short
+// names, and is resolved at load time.
+static const u32 ENTRY_DEFERRED = 0x2;
+
+// Header of a policy image. All offsets are in bytes from the start of the image.
+struct PolicyHeader {
+	u32 magic;
+	u32 version;
+	u32 flags;
+	u32 bucket_count;
+	u32 entry_count;
+	u32 string_count;
+	u64 bucket_offset;
+	u64 entry_offset;
+	u64 string_offset;
+};
+
+// An entry in the policy hash table. Entries are chained through one-based indices.
+struct PolicyEntry {
+	u64 hash;
+	u32 path_offset;
+	u32 path_count;
+	u32 verdict;
+	u32 flags;
+	u32 next;
+	u32 reserved;
+};
+
+// A parsed line of a text policy.
+struct PolicyLine {
+	WCHAR* path;
+	Path key;
+	u32 verdict;
+	u32 flags;
+};
+
+// Returns true if the character is whitespace.
+static b32 is_space(WCHAR c) {
+	return c == L' ' || c == L'\t' || c == L'\r' || c == L'\n';
+}
+
+// Decodes a UTF-16 (with byte order mark) or UTF-8 text file into a null terminated string. The result must be freed.
+static WCHAR* decode_text(MappedFile const* file) {
+	assert(file);
+
+	u8 const* data = file->data;
+	u64 size = file->size;
+
+	if (size > 0x7fffffff) {
+		return nullptr;
+	}
+
+	if (size >= 2 && data[0] == 0xff && data[1] == 0xfe) {
+		size_t count = (size_t)(size - 2) / sizeof(WCHAR);
+
+		WCHAR* text = (WCHAR*)mem_alloc(MemoryTagPolicy, (count + 1) * sizeof(*text));
+		if (text) {
+			memcpy(text, data + 2, count * sizeof(*text));
+			text[count] = 0;
+		}
+
+		return text;
+	}
+
+	if (size >= 3 && data[0] == 0xef && data[1] == 0xbb && data[2] == 0xbf) {
+		data += 3;
+		size -= 3;
+	}
+
+	int count = 0;
+	if (size) {
+		count = MultiByteToWideChar(CP_UTF8, 0, (char const*)data, (int)size, nullptr, 0);
+		if (count == 0) {
+			return nullptr;
+		}
+	}
+
+	WCHAR* text = (WCHAR*)mem_alloc(MemoryTagPolicy, (count + 1) * sizeof(*text));
+	if (text) {
+		if (count) {
+			MultiByteToWideChar(CP_UTF8, 0, (char const*)data, (int)size, text, count);
+		}
+
+		text[count] = 0;
+	}
+
+	return text;
+}
+
+// Parses the text policy into lines. Returns the number of lines parsed, or -1 if the policy is malformed.
+static i64 parse_text(WCHAR* text, PolicyLine* lines, size_t line_count) {
+	assert(text);
+	assert(lines);
+
+	size_t num = 0;
+	WCHAR* cursor = text;
+
+	while (*cursor) {
+		WCHAR* line = cursor;
+		while (*cursor && *cursor != L'\n') {
+			++cursor;
+		}
+
+		WCHAR* end = cursor;
+		if (*cursor) {
+			++cursor;
+		}
+
+		while (line < end && is_space(*line)) {
+			++line;
+		}
+
+		while (end > line && is_space(end[-1])) {
+			--end;
+		}
+
+		if (line == end || *line == L'#') {
+			continue;
+		}
+
+		WCHAR* word = line;
+		while (line < end && is_space(*line) == false) {
+			++line;
+		}
+
+		size_t word_count = (size_t)(line - word);
+		while (line < end && is_space(*line)) {
+			++line;
+		}
+
+		u32 verdict;
+		if (word_count == 5 && _wcsnicmp(word, L"allow", 5) == 0) {
+			verdict = PolicyVerdictAllow;
+		} else if (word_count == 5 && _wcsnicmp(word, L"block", 5) == 0) {
+			verdict = PolicyVerdictBlock;
+		} else {
+			return -1;
+		}
+
+		u32 flags = 0;
+		if (end - line >= 2 && end[-1] == L'*' && end[-2] == L'\\') {
+			flags |= ENTRY_PREFIX;
+			--end;
+		}
+
+		if (line == end || num == line_count) {
+			return -1;
+		}
+
+		*end = 0;
+
+		PolicyLine* dst = lines + num++;
+		dst->path = line;
+		dst->verdict = verdict;
+		dst->flags = flags;
+	}
+
+	return (i64)num;
+}
+
+// Returns true if the lexically reduced path depends on the machine it is used on.
+static b32 is_deferred(Path const* key) {
+	assert(key);
+
+	WCHAR const* src = key->c_str();
+	return wcschr(src, L'%') || wcschr(src, L'~') || wcsncmp(src, L"volume{", 7) == 0;
+}
+
+// Ends the key of a directory prefix entry with a separator. Returns true on success.
+static b32 end_prefix(Path* key) {
+	assert(key);
+	return key->empty() || key->c_str()[key->size() - 1] == L'\\' || key->append(L"\\", 1);
+}
+
+// Reduces the path of every parsed line to its canonical key. Only the lexical reduction is applied, so the image does
+// not depend on the machine it was compiled on; lines whose path still does are marked to be resolved at load time.
+// Returns true on success.
+static b32 reduce_lines(PolicyLine* lines, size_t count) {
+	assert(lines);
+
+	for (size_t i = 0; i < count; ++i) {
+		PolicyLine* line = lines + i;
+
+		if (canon_reduce(line->path, wcslen(line->path), &line->key) == false) {
+			return false;
+		}
+
+		if ((line->flags & ENTRY_PREFIX) && end_prefix(&line->key) == false) {
+			return false;
+		}
+
+		if (is_deferred(&line->key)) {
+			line->flags |= ENTRY_DEFERRED;
+		}
+	}
+
+	return true;
+}
+
+// Builds a policy image from the lines, later lines taking precedence. Returns the image, which must be freed with
+// mem_free, or null on failure.
+static u8* build_image(PolicyLine const* lines, u32 entry_count, size_t* size) {
+	assert(lines || entry_count == 0);
+	assert(size);
+
+	u32 bucket_count = MIN_BUCKETS;
+	while (bucket_count < entry_count * 2) {
+		bucket_count <<= 1;
+	}
+
+	u64 string_count = 0;
+	for (u32 i = 0; i < entry_count; ++i) {
+		string_count += lines[i].key.size();
+	}
+
+	PolicyHeader header = {};
+	header.magic = POLICY_MAGIC;
+	header.version = POLICY_VERSION;
+	header.bucket_count = bucket_count;
+	header.entry_count = entry_count;
+	header.string_count = (u32)string_count;
+	header.bucket_offset = sizeof(header);
+	header.entry_offset = header.bucket_offset + (u64)bucket_count * sizeof(u32);
+	header.string_offset = header.entry_offset + (u64)entry_count * sizeof(PolicyEntry);
+
+	*size = (size_t)(header.string_offset + string_count * sizeof(WCHAR));
+
+	u8* image = (string_count < 0x7fffffff) ? (u8*)mem_calloc(MemoryTagPolicy, *size, 1) : nullptr;
+	if (image == nullptr) {
+		return nullptr;
+	}
+
+	u32* buckets = (u32*)(image + header.bucket_offset);
+	PolicyEntry* entries = (PolicyEntry*)(image + header.entry_offset);
+	WCHAR* strings = (WCHAR*)(image + header.string_offset);
+	u32 string_offset = 0;
+
+	for (u32 i = 0; i < entry_count; ++i) {
+		PolicyLine const* line = lines + i;
+		PolicyEntry* entry = entries + i;
+
+		entry->hash = wcsnhash(line->key.c_str(), line->key.size());
+		entry->path_offset = string_offset;
+		entry->path_count = (u32)line->key.size();
+		entry->verdict = line->verdict;
+		entry->flags = line->flags;
+
+		memcpy(strings + string_offset, line->key.c_str(), line->key.size() * sizeof(*strings));
+		string_offset += (u32)line->key.size();
+
+		u32 bucket = (u32)(entry->hash & (bucket_count - 1));
+		entry->next = buckets[bucket];
+		buckets[bucket] = i + 1;
+
+		if (line->flags & ENTRY_PREFIX) {
+			header.flags |= HEADER_HAS_PREFIXES;
+		}
+
+		if (line->flags & ENTRY_DEFERRED) {
+			header.flags |= HEADER_HAS_DEFERRED;
+		}
+	}
+
+	memcpy(image, &header, sizeof(header));
+
+	return image;
+}
+
+// Builds an image in memory from a well formed image, with its deferred entries resolved on this machine and every
+// entry kept in its place. Returns the image, which must be freed with mem_free, or null if the image has no deferred
+// entries or on failure.
+static u8* resolve_image(u8 const* data) {
+	assert(data);
+
+	PolicyHeader const* header = (PolicyHeader const*)data;
+	if ((header->flags & HEADER_HAS_DEFERRED) == 0) {
+		return nullptr;
+	}
+
+	PolicyEntry const* entries = (PolicyEntry const*)(data + header->entry_offset);
+	WCHAR const* strings = (WCHAR const*)(data + header->string_offset);
+
+	PolicyLine* lines = (PolicyLine*)mem_calloc(MemoryTagPolicy, MAX(header->entry_count, 1u), sizeof(*lines));
+	if (lines == nullptr) {
+		return nullptr;
+	}
+
+	b32 result = true;
+	Path path;
+
+	for (u32 i = 0; i < header->entry_count && result; ++i) {
+		PolicyEntry const* entry = entries + i;
+		PolicyLine* line = lines + i;
+
+		line->verdict = entry->verdict;
+		line->flags = entry->flags & ~ENTRY_DEFERRED;
+
+		// An entry out of bounds never matches, as in the mapped image.
+		if ((u64)entry->path_offset + entry->path_count > header->string_count) {
+			continue;
+		}
+
+		result = line->key.assign(strings + entry->path_offset, entry->path_count);
+
+		// A path that cannot be resolved keeps its reduced form.
+		if (result && (entry->flags & ENTRY_DEFERRED) && path.assign(line->key.c_str(), line->key.size()) &&
+			canon_path(path.c_str(), &line->key) == false) {
+			result = line->key.assign(path.c_str(), path.size());
+		}
+
+		if (result && (line->flags & ENTRY_PREFIX)) {
+			result = end_prefix(&line->key);
+		}
+	}
+
+	size_t size;
+	u8* image = result ? build_image(lines, header->entry_count, &size) : nullptr;
+
+	for (u32 i = 0; i < header->entry_count; ++i) {
+		lines[i].key.reset();
+	}
+
+	mem_free(lines);
+
+	return image;
+}
+
+// Returns true if the loaded file is a well formed policy image.
+static b32 is_valid_image(LoadedFile const* image) {
+	assert(image);
+
+	if (image->size < sizeof(PolicyHeader)) {
+		return false;
+	}
+
+	PolicyHeader const* header = (PolicyHeader const*)image->data;
+	if (header->magic != POLICY_MAGIC || header->version != POLICY_VERSION) {
+		return false;
+	}
+
+	if (header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0) {
+		return false;
+	}
+
+	u64 bucket_end = header->bucket_offset + (u64)header->bucket_count * sizeof(u32);
+	u64 entry_end = header->entry_offset + (u64)header->entry_count * sizeof(PolicyEntry);
+	u64 string_end = header->string_offset + (u64)header->string_count * sizeof(WCHAR);
+
+	return header->bucket_offset >= sizeof(*header) && bucket_end <= image->size &&
+		header->entry_offset >= sizeof(*header) && entry_end <= image->size &&
+		header->string_offset >= sizeof(*header) && string_end <= image->size &&
+		(header->bucket_offset % sizeof(u32)) == 0 && (header->entry_offset % sizeof(u64)) == 0 &&
+		(header->string_offset % sizeof(WCHAR)) == 0;
+}
+
+Policy::Policy() {
+	InitializeSRWLock(&m_lock);
+}
+
+Policy::~Policy() {
+	fs_release(&m_image);
+	mem_free(m_resolved);
+}
+
+b32 Policy::compile(WCHAR const* src_path, WCHAR const* dst_path) {
+	assert(src_path);
+	assert(dst_path);
+
+	MappedFile src;
+	if (fs_map(src_path, &src) == false) {
+		return false;
+	}
+
+	WCHAR* text = decode_text(&src);
+	fs_unmap(&src);
+
+	if (text == nullptr) {
+		return false;
+	}
+
+	size_t line_count = 1;
+	for (WCHAR const* c = text; *c; ++c) {
+		line_count += (*c == L'\n');
+	}
+
+	b32 result = false;
+
+	PolicyLine* lines = (PolicyLine*)mem_calloc(MemoryTagPolicy, line_count, sizeof(*lines));
+	i64 num = lines ? parse_text(text, lines, line_count) : -1;
+
+	if (num >= 0 && num < 0x10000000 && reduce_lines(lines, (size_t)num)) {
+		size_t size;
+		u8* image = build_image(lines, (u32)num, &size);
+
+		if (image) {
+			result = fs_write_atomic(dst_path, image, size);
+			mem_free(image);
+		}
+	}
+
+	if (lines) {
+		for (size_t i = 0; i < line_count; ++i) {
+			lines[i].key.reset();
+		}
+	}
+
+	mem_free(lines);
+	mem_free(text);
+
+	return result;
+}
+
+b32 Policy::load(WCHAR const* path) {
+	assert(path);
+
+	if (path != m_path) {
+		if (wcslen(path) >= COUNT(m_path)) {
+			return false;
+		}
+
+		AcquireSRWLockExclusive(&m_lock);
+		wcscpy_s(m_path, COUNT(m_path), path);
+		ReleaseSRWLockExclusive(&m_lock);
+	}
+
+	// The image is read into memory rather than mapped, so that the file can be replaced while it is in use.
+	LoadedFile image;
+	if (fs_load(path, MemoryTagPolicy, MAX_IMAGE_SIZE, &image) == false) {
+		return false;
+	}
+
+	if (is_valid_image(&image) == false) {
+		fs_release(&image);
+		return false;
+	}
+
+	// Without a resolved image, deferred entries only match paths in their reduced form.
+	u8* resolved = resolve_image(image.data);
+
+	AcquireSRWLockExclusive(&m_lock);
+	LoadedFile old_image = m_image;
+	u8* old_resolved = m_resolved;
+	m_image = image;
+	m_resolved = resolved;
+	ReleaseSRWLockExclusive(&m_lock);
+
+	fs_release(&old_image);
+	mem_free(old_resolved);
+
+	return true;
+}
+
+b32 Policy::refresh() {
+	if (m_path[0] == 0) {
+		return false;
+	}
+
+	FILETIME write_time = fs_write_time(m_path);
+
+	AcquireSRWLockShared(&m_lock);
+	LONG cmp = CompareFileTime(&write_time, &m_image.write_time);
+	ReleaseSRWLockShared(&m_lock);
+
+	if (cmp == 0) {
+		return false;
+	}
+
+	return load(m_path);
+}
+
+PolicyVerdict Policy::lookup(WCHAR const* path) {
+	assert(path);
+
+	PolicyVerdict verdict = PolicyVerdictNone;
+
+	AcquireSRWLockShared(&m_lock);
+
+	u8 const* image = m_resolved ? m_resolved : m_image.data;
+	if (image) {
+		PolicyHeader const* header = (PolicyHeader const*)image;
+		size_t count = wcslen(path);
+
+		verdict = find(image, path, count, false);
+
+		if (header->flags & HEADER_HAS_PREFIXES) {
+			for (size_t i = count; i && verdict == PolicyVerdictNone; --i) {
+				if (path[i - 1] == L'\\') {
+					verdict = find(image, path, i, true);
+				}
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&m_lock);
+
+	return verdict;
+}
+
+PolicyVerdict Policy::find(u8 const* image, WCHAR const* path, size_t count, b32 is_prefix) {
+	assert(image);
+	assert(path);
+
+	PolicyHeader const* header = (PolicyHeader const*)image;
+	u32 const* buckets = (u32 const*)(image + header->bucket_offset);
+	PolicyEntry const* entries = (PolicyEntry const*)(image + header->entry_offset);
+	WCHAR const* strings = (WCHAR const*)(image + header->string_offset);
+
+	size_t hash = wcsnhash(path, count);
+	u32 index = buckets[hash & (header->bucket_count - 1)];
+
+	for (u32 i = 0; index && index <= header->entry_count && i < header->entry_count; ++i) {
+		PolicyEntry const* entry = entries + index - 1;
+
+		b32 entry_is_prefix = (entry->flags & ENTRY_PREFIX) != 0;
+		b32 in_bounds = (u64)entry->path_offset + entry->path_count <= header->string_count;
+
+		if (entry->hash == hash && entry->path_count == count && entry_is_prefix == (is_prefix != 0) && in_bounds &&
+			wmemcmp(strings + entry->path_offset, path, count) == 0) {
+			if (entry->verdict == PolicyVerdictAllow || entry->verdict == PolicyVerdictBlock) {
+				return (PolicyVerdict)entry->verdict;
+			}
+
+			return PolicyVerdictNone;
+		}
+
+		index = entry->next;
+	}
+
+	return PolicyVerdictNone;
+}
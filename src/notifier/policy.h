@@ -0,0 +1,51 @@
+#pragma once
+#include "core.h"
+#include "fs.h"
+#include <Windows.h>
+
+// Verdicts stored in a compiled policy.
+enum PolicyVerdict {
+	PolicyVerdictNone,
+	PolicyVerdictBlock,
+	PolicyVerdictAllow
+};
+
+// Precompiled binary application policy. The image is read into memory and queried in place.
+//
+// The text form of a policy has one entry per line, either "allow <path>" or "block <path>". A path ending in
+// "\*" matches every application below that directory. Blank lines and lines starting with '#' are ignored, and
+// later entries take precedence over earlier ones.
+//
+// Paths are compiled in their lexically reduced form, so an image can be shared between machines. Paths with
+// environment variables, volume GUIDs or 8.3 short names are resolved when the image is loaded, into a copy of the
+// image in memory that is queried instead.
+class Policy {
+public:
+	// Creates an empty policy.
+	Policy();
+
+	// Destroys the policy, freeing the current image.
+	~Policy();
+
+	// Compiles the text policy at the source path into a binary image at the destination path. Returns true on success.
+	static b32 compile(WCHAR const* src_path, WCHAR const* dst_path);
+
+	// Reads the binary image at the given path and atomically replaces the current image. The path is remembered for
+	// later refreshes even if the image could not be read. Returns true on success.
+	b32 load(WCHAR const* path);
+
+	// Reloads the image if the file it was loaded from has changed. Returns true if a new image was loaded.
+	b32 refresh();
+
+	// Returns the policy verdict for the application at the given path.
+	PolicyVerdict lookup(WCHAR const* path);
+
+private:
+	// Returns the verdict of the entry of the image matching the first count characters of the path. Requires the lock.
+	static PolicyVerdict find(u8 const* image, WCHAR const* path, size_t count, b32 is_prefix);
+
+	SRWLOCK m_lock;
+	LoadedFile m_image = {};
+	u8* m_resolved = nullptr;
+	WCHAR m_path[MAX_PATH + 1] = {};
+};
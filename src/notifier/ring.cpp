@@ -0,0 +1,303 @@
+#include "ring.h"
+#include <sddl.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Event ring identifier, "FNER".
+static const u32 RING_MAGIC = 0x52454e46;
+
+// Event ring layout version.
+static const u32 RING_VERSION = 2;
+
+// Marker of the record that skips the rest of the data area when a record does not fit before its end.
+static const u32 RECORD_WRAP = 0xffffffff;
+
+// Alignment of every record, in bytes.
+static const u32 RECORD_ALIGN = 8;
+
+// Security descriptor of the global objects of a ring: full access for SYSTEM and administrators, read and write
+// access for the user the ring belongs to.
+static WCHAR const RING_SDDL[] = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GRGWGX;;;%s)";
+
+// Header of a record in the data area. The header is followed by the path characters, padded to the alignment.
+struct RingRecord {
+	u32 size;
+	u32 count;
+	RingEvent event;
+};
+
+void ring_init(void* memory) {
+	assert(memory);
+
+	RingHeader* header = (RingHeader*)memory;
+	memset(header, 0, sizeof(*header));
+	header->version = RING_VERSION;
+	header->data_size = RING_DATA_SIZE;
+
+	MemoryBarrier();
+	header->magic = RING_MAGIC;
+}
+
+b32 ring_is_valid(void const* memory) {
+	assert(memory);
+
+	RingHeader const* header = (RingHeader const*)memory;
+	return header->magic == RING_MAGIC && header->version == RING_VERSION && header->data_size == RING_DATA_SIZE;
+}
+
+b32 ring_write(void* memory, WCHAR const* path, size_t count, RingEvent const* ev) {
+	assert(memory);
+	assert(path || count == 0);
+	assert(ev);
+
+	RingHeader* header = (RingHeader*)memory;
+	u8* data = (u8*)memory + sizeof(RingHeader);
+
+	if (count == 0 || count > MAX_EXT_PATH) {
+		return false;
+	}
+
+	u32 size = (u32)((sizeof(RingRecord) + count * sizeof(*path) + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1));
+
+	i64 head = header->head;
+	i64 tail = header->tail;
+	MemoryBarrier();
+
+	u32 offset = (u32)tail & (RING_DATA_SIZE - 1);
+	u32 contiguous = RING_DATA_SIZE - offset;
+	u32 needed = size + ((size > contiguous) ? contiguous : 0);
+
+	if ((u64)(tail - head) + needed > RING_DATA_SIZE) {
+		InterlockedIncrement64(&header->dropped);
+		return false;
+	}
+
+	if (size > contiguous) {
+		RingRecord* wrap = (RingRecord*)(data + offset);
+		wrap->size = contiguous;
+		wrap->count = RECORD_WRAP;
+
+		tail += contiguous;
+		offset = 0;
+	}
+
+	RingRecord* record = (RingRecord*)(data + offset);
+	record->size = size;
+	record->count = (u32)count;
+	record->event = *ev;
+	memcpy(record + 1, path, count * sizeof(*path));
+
+	// The record is complete before the consumer can see it.
+	InterlockedExchange64(&header->tail, tail + size);
+
+	return true;
+}
+
+b32 ring_read(void* memory, Path* path, RingEvent* ev) {
+	assert(memory);
+	assert(path);
+	assert(ev);
+
+	RingHeader* header = (RingHeader*)memory;
+	u8 const* data = (u8 const*)memory + sizeof(RingHeader);
+
+	for (;;) {
+		i64 head = header->head;
+		i64 tail = header->tail;
+		MemoryBarrier();
+
+		if (head == tail) {
+			return false;
+		}
+
+		RingRecord const* record = (RingRecord const*)(data + ((u32)head & (RING_DATA_SIZE - 1)));
+		RingRecord copy = *record;
+
+		// A damaged ring is emptied rather than trusted.
+		b32 is_valid = copy.size >= RECORD_ALIGN && copy.size <= (u64)(tail - head) && copy.size % RECORD_ALIGN == 0;
+		if (is_valid && copy.count != RECORD_WRAP) {
+			is_valid = copy.size >= sizeof(copy) && copy.count <= (copy.size - sizeof(copy)) / sizeof(WCHAR);
+		}
+
+		if (is_valid == false) {
+			InterlockedExchange64(&header->head, tail);
+			return false;
+		}
+
+		b32 result = false;
+		if (copy.count != RECORD_WRAP) {
+			result = path->assign((WCHAR const*)(record + 1), copy.count);
+			*ev = copy.event;
+		}
+
+		InterlockedExchange64(&header->head, head + copy.size);
+
+		if (copy.count != RECORD_WRAP) {
+			return result;
+		}
+	}
+}
+
+b32 ring_collector_running() {
+	HANDLE collector = OpenEventW(SYNCHRONIZE, FALSE, RING_COLLECTOR_NAME);
+	if (collector == nullptr) {
+		return false;
+	}
+
+	CloseHandle(collector);
+
+	return true;
+}
+
+EventRing::EventRing() {
+}
+
+EventRing::~EventRing() {
+	close();
+}
+
+b32 EventRing::create(WCHAR const* sid) {
+	assert(sid);
+	assert(is_open() == false);
+
+	WCHAR mapping_name[RING_SID_SIZE + 64];
+	WCHAR ready_name[RING_SID_SIZE + 64];
+	WCHAR created_name[RING_SID_SIZE + 64];
+	WCHAR sddl[RING_SID_SIZE + COUNT(RING_SDDL)];
+
+	if (make_name(mapping_name, COUNT(mapping_name), L"Ring", sid) == false ||
+		make_name(ready_name, COUNT(ready_name), L"Ready", sid) == false ||
+		make_name(created_name, COUNT(created_name), L"Created", sid) == false ||
+		_snwprintf_s(sddl, COUNT(sddl), _TRUNCATE, RING_SDDL, sid) < 0) {
+		return false;
+	}
+
+	SECURITY_ATTRIBUTES attributes = {};
+	attributes.nLength = sizeof(attributes);
+
+	if (ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl, SDDL_REVISION_1, &attributes.lpSecurityDescriptor,
+		nullptr) == FALSE) {
+		return false;
+	}
+
+	m_mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, &attributes, PAGE_READWRITE, 0, (DWORD)RING_SIZE, mapping_name);
+	b32 is_existing = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+	m_ready = CreateEventW(&attributes, FALSE, FALSE, ready_name);
+
+	// The notifier may already be waiting on the created event, in which case it exists with its own security.
+	HANDLE created = CreateEventW(&attributes, FALSE, FALSE, created_name);
+
+	LocalFree(attributes.lpSecurityDescriptor);
+
+	if (m_mapping) {
+		m_memory = MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, RING_SIZE);
+	}
+
+	if (m_memory == nullptr || m_ready == nullptr) {
+		if (created) {
+			CloseHandle(created);
+		}
+
+		close();
+		return false;
+	}
+
+	// A ring left behind by a previous collector is kept, along with the events the notifier has not read yet.
+	if (is_existing == false || ring_is_valid(m_memory) == false) {
+		ring_init(m_memory);
+	}
+
+	if (created) {
+		SetEvent(created);
+		CloseHandle(created);
+	}
+
+	return true;
+}
+
+b32 EventRing::open(WCHAR const* sid) {
+	assert(sid);
+	assert(is_open() == false);
+
+	WCHAR mapping_name[RING_SID_SIZE + 64];
+	WCHAR ready_name[RING_SID_SIZE + 64];
+
+	if (make_name(mapping_name, COUNT(mapping_name), L"Ring", sid) == false ||
+		make_name(ready_name, COUNT(ready_name), L"Ready", sid) == false) {
+		return false;
+	}
+
+	m_mapping = OpenFileMappingW(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, mapping_name);
+	m_ready = OpenEventW(SYNCHRONIZE, FALSE, ready_name);
+
+	if (m_mapping) {
+		m_memory = MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, RING_SIZE);
+	}
+
+	if (m_memory == nullptr || m_ready == nullptr || ring_is_valid(m_memory) == false) {
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+HANDLE EventRing::open_created(WCHAR const* sid) {
+	assert(sid);
+
+	WCHAR created_name[RING_SID_SIZE + 64];
+	if (make_name(created_name, COUNT(created_name), L"Created", sid) == false) {
+		return nullptr;
+	}
+
+	// Creating the event keeps it alive until the collector signals it, even if the collector has not started yet.
+	return CreateEventW(nullptr, FALSE, FALSE, created_name);
+}
+
+void EventRing::close() {
+	if (m_memory) {
+		UnmapViewOfFile(m_memory);
+		m_memory = nullptr;
+	}
+
+	if (m_mapping) {
+		CloseHandle(m_mapping);
+		m_mapping = nullptr;
+	}
+
+	if (m_ready) {
+		CloseHandle(m_ready);
+		m_ready = nullptr;
+	}
+}
+
+b32 EventRing::write(WCHAR const* path, size_t count, RingEvent const* ev) {
+	assert(is_open());
+
+	if (ring_write(m_memory, path, count, ev) == false) {
+		return false;
+	}
+
+	SetEvent(m_ready);
+
+	return true;
+}
+
+b32 EventRing::read(Path* path, RingEvent* ev) {
+	assert(is_open());
+	return ring_read(m_memory, path, ev);
+}
+
+b32 EventRing::make_name(WCHAR* dst, size_t dst_count, WCHAR const* kind, WCHAR const* sid) {
+	assert(dst);
+	assert(kind);
+	assert(sid);
+
+	if (wcslen(sid) >= RING_SID_SIZE) {
+		return false;
+	}
+
+	return _snwprintf_s(dst, dst_count, _TRUNCATE, L"Global\\FirewallNotifier.%s.%s", kind, sid) >= 0;
+}
@@ -0,0 +1,113 @@
+#pragma once
+#include "core.h"
+#include "path.h"
+#include <Windows.h>
+
+// Size of the data area of an event ring, in bytes. Must be a power of two.
+#define RING_DATA_SIZE 0x40000
+
+// Maximum length of a string SID naming an event ring, in characters including the null terminator.
+#define RING_SID_SIZE 192
+
+// Name of the event owned by the collector while it runs. Signaling it stops the collector.
+#define RING_COLLECTOR_NAME L"Global\\FirewallNotifier.Collector"
+
+// Control block at the start of an event ring. The producer only writes the tail and the dropped count and the
+// consumer only writes the head, each on its own cache line. The layout is fixed, so the collector and the notifiers
+// agree on it whatever they were built with.
+struct RingHeader {
+	u32 magic;
+	u32 version;
+	u32 data_size;
+	u8 reserved[52];
+	volatile i64 head;
+	u8 head_padding[56];
+	volatile i64 tail;
+	volatile i64 dropped;
+	u8 tail_padding[48];
+};
+
+// Details of a drop event passed through an event ring along with the application path. The time is in 100 ns
+// intervals since January 1, 1601 (UTC). The remote IP version is 4 or 6, or zero if the remote address is unknown;
+// the addresses are in the byte order of FWPM_NET_EVENT_HEADER1. The remote port is zero if unknown.
+struct RingEvent {
+	u64 time;
+	u32 remote_version;
+	u32 remote_v4;
+	u8 remote_v6[16];
+	u32 remote_port;
+	u32 reserved;
+};
+
+// Total size of an event ring, in bytes.
+#define RING_SIZE (sizeof(RingHeader) + RING_DATA_SIZE)
+
+// Initializes an empty event ring in memory of RING_SIZE bytes.
+void ring_init(void* memory);
+
+// Returns true if the memory of RING_SIZE bytes holds an initialized event ring.
+b32 ring_is_valid(void const* memory);
+
+// Appends a drop event for the first count characters of the device path to the ring. Must only be called by a single
+// producer at a time. Returns false if the ring is full, in which case the event is counted as dropped.
+b32 ring_write(void* memory, WCHAR const* path, size_t count, RingEvent const* ev);
+
+// Removes the oldest drop event from the ring. Must only be called by a single consumer at a time. Returns false if
+// the ring is empty.
+b32 ring_read(void* memory, Path* path, RingEvent* ev);
+
+// Returns true if the system-wide collector is running.
+b32 ring_collector_running();
+
+// A lock-free single producer, single consumer ring of drop events in shared memory, between the collector and the
+// notifier of a single user. The ring, its wake-up event and the event signaled when the ring is created are global
+// objects named after the string SID of the user, and only that user and administrators can open them.
+class EventRing {
+public:
+	// Creates a closed ring.
+	EventRing();
+
+	// Destroys the ring, closing it if needed.
+	~EventRing();
+
+	EventRing(EventRing const&) = delete;
+	EventRing& operator=(EventRing const&) = delete;
+
+	// Creates the ring of the user with the given string SID, as the producer. Returns true on success.
+	b32 create(WCHAR const* sid);
+
+	// Opens the ring of the user with the given string SID created by the collector, as the consumer. Returns true on
+	// success.
+	b32 open(WCHAR const* sid);
+
+	// Opens the event that the collector signals once it has created the ring of the user with the given string SID,
+	// creating the event if needed. Returns null on failure. The handle must be closed with CloseHandle.
+	static HANDLE open_created(WCHAR const* sid);
+
+	// Closes the ring.
+	void close();
+
+	// Appends a drop event and wakes up the consumer. Returns true on success.
+	b32 write(WCHAR const* path, size_t count, RingEvent const* ev);
+
+	// Removes the oldest drop event. Returns false if the ring is empty.
+	b32 read(Path* path, RingEvent* ev);
+
+	// Returns the event signaled when drop events are written.
+	HANDLE ready() const {
+		return m_ready;
+	}
+
+	// Returns true if the ring is open.
+	b32 is_open() const {
+		return m_memory != nullptr;
+	}
+
+private:
+	// Builds the name of a global object of the ring. Returns true on success.
+	static b32 make_name(WCHAR* dst, size_t dst_count, WCHAR const* kind, WCHAR const* sid);
+
+	HANDLE m_mapping = nullptr;
+	HANDLE m_ready = nullptr;
+	void* m_memory = nullptr;
+};
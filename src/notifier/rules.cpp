@@ -0,0 +1,75 @@
+#include "rules.h"
+#include <assert.h>
+
+// Maximum number of rules fetched from the enumerator per call. Matches the batches of the rule cache rebuild, so a
+// batch takes a single call.
+static const u32 FETCH_SIZE = 1024;
+
+RuleSource::RuleSource(INetFwRules* rules) {
+	assert(rules);
+
+	m_failed = true;
+
+	IUnknown* temp;
+	if (FAILED(rules->get__NewEnum(&temp))) {
+		return;
+	}
+
+	HRESULT hr = temp->QueryInterface(IID_PPV_ARGS(&m_enum));
+	temp->Release();
+
+	if (FAILED(hr)) {
+		m_enum = nullptr;
+		return;
+	}
+
+	m_failed = false;
+}
+
+RuleSource::~RuleSource() {
+	if (m_enum) {
+		m_enum->Release();
+	}
+}
+
+b32 RuleSource::next(INetFwRule** rules, u32 capacity, u32* count) {
+	assert(rules);
+	assert(count);
+
+	*count = 0;
+
+	if (m_enum == nullptr || m_done || m_failed) {
+		return false;
+	}
+
+	VARIANT vars[FETCH_SIZE];
+	ULONG fetched = 0;
+
+	HRESULT hr = m_enum->Next(MIN(capacity, FETCH_SIZE), vars, &fetched);
+	if (FAILED(hr)) {
+		m_failed = true;
+		return false;
+	}
+
+	if (hr == S_FALSE) {
+		m_done = true;
+	}
+
+	u32 num = 0;
+	for (ULONG i = 0; i < fetched; ++i) {
+		VARIANT* var = vars + i;
+
+		if (var->vt == VT_DISPATCH && var->pdispVal != NULL) {
+			INetFwRule* rule;
+			if (SUCCEEDED(var->pdispVal->QueryInterface(IID_PPV_ARGS(&rule)))) {
+				rules[num++] = rule;
+			}
+		}
+
+		VariantClear(var);
+	}
+
+	*count = num;
+
+	return fetched != 0;
+}
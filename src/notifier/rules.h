@@ -0,0 +1,27 @@
+#pragma once
+#include "core.h"
+#include <netfw.h>
+
+// Batched source of the rules in the system firewall rule store.
+class RuleSource {
+public:
+	// Creates a rule source enumerating the given rule collection.
+	RuleSource(INetFwRules* rules);
+
+	// Destroys the rule source.
+	~RuleSource();
+
+	// Fetches the next batch of at most capacity rules. The caller must release each returned rule. Returns false
+	// once the enumeration is exhausted or failed.
+	b32 next(INetFwRule** rules, u32 capacity, u32* count);
+
+	// Returns true if the enumeration failed before it was exhausted.
+	b32 failed() const {
+		return m_failed;
+	}
+
+private:
+	IEnumVARIANT* m_enum = nullptr;
+	b32 m_done = false;
+	b32 m_failed = false;
+};
@@ -0,0 +1,698 @@
+#include "sim.h"
+
+#ifdef NOTIFIER_SIMULATION
+
+#include "app.h"
+#include "dedup.h"
+#include "key.h"
+#include "mem.h"
+#include "monitor.h"
+#include "path.h"
+#include "pending.h"
+#include "timers.h"
+#include "verdicts.h"
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Largest number of applications in a simulation.
+static const u32 MAX_APPS = 0x100000;
+
+// Length of a simulated hour, in milliseconds.
+static const u64 HOUR_LENGTH = 3600000;
+
+// Time at which a simulation starts, in milliseconds: a machine that booted a day ago.
+static const u64 START_TIME = 24 * HOUR_LENGTH;
+
+// Hour of the day with the least traffic.
+static const u32 QUIET_HOUR = 4;
+
+// Share of the peak arrival rate left at the quietest hour of the day.
+static const f64 QUIET_RATE = 0.1;
+
+// Probability that a drop event is followed by a retry of the same connection.
+static const f64 RETRY_CHANCE = 0.6;
+
+// Mean time before a retry, in seconds.
+static const f64 RETRY_TIME = 3.0;
+
+// Directory that the simulated applications live under.
+static WCHAR const APP_ROOT[] = L"\\device\\harddiskvolume3\\program files\\vendor";
+
+// Kinds of scheduled events.
+enum SimKind {
+	SimKindArrival,
+	SimKindRetry,
+	SimKindAnswer,
+	SimKindWakeup,
+	SimKindIdle
+};
+
+// Verdicts the simulated user gives.
+enum SimVerdict {
+	SimVerdictNone,
+	SimVerdictAllow,
+	SimVerdictBlock,
+	SimVerdictTemporary
+};
+
+// A scheduled event. Events due at the same time run in the order they were scheduled.
+struct SimEvent {
+	u64 time;
+	u64 sequence;
+	u32 kind;
+	u32 app;
+};
+
+// A simulated application. The timer comes first, so an expired timer is its application.
+struct SimApp {
+	Timer timer;
+	u64 admitted;
+	u32 verdict;
+};
+
+// Returns the next number of a xorshift64* sequence.
+static u64 next_random(u64* state) {
+	u64 x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545f4914f6cdd1d;
+}
+
+// Returns a uniform number in [0, 1).
+static f64 next_uniform(u64* state) {
+	return (f64)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Returns an exponentially distributed delay with the given mean, in seconds, as milliseconds.
+static u64 next_delay(u64* state, f64 mean) {
+	return (u64)(-log(1.0 - next_uniform(state)) * mean * 1000.0);
+}
+
+// Draws a rank from a cumulative distribution.
+static u32 zipf_sample(f64 const* table, u32 count, u64* state) {
+	f64 u = next_uniform(state) * table[count - 1];
+
+	u32 lo = 0;
+	u32 hi = count - 1;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (table[mid] < u) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// Returns the share of the peak arrival rate at the given time, following a daily cycle.
+static f64 daily_rate(u64 now) {
+	f64 hour = (f64)(now % (24 * HOUR_LENGTH)) / (f64)HOUR_LENGTH;
+	f64 phase = (hour - QUIET_HOUR) * (2.0 * 3.14159265358979323846 / 24.0);
+
+	return QUIET_RATE + (1.0 - QUIET_RATE) * 0.5 * (1.0 - cos(phase));
+}
+
+// Appends the decimal digits of the value. Returns the number of characters written.
+static size_t append_number(WCHAR* dst, u32 value) {
+	WCHAR digits[10];
+	size_t count = 0;
+
+	do {
+		digits[count++] = (WCHAR)(L'0' + value % 10);
+		value /= 10;
+	} while (value);
+
+	for (size_t i = 0; i < count; ++i) {
+		dst[i] = digits[count - i - 1];
+	}
+
+	return count;
+}
+
+// Builds the device path of the application. The destination must hold MAX_PATH characters.
+static void app_path(u32 app, WCHAR* dst) {
+	size_t count = COUNT(APP_ROOT) - 1;
+	memcpy(dst, APP_ROOT, count * sizeof(*dst));
+
+	count += append_number(dst + count, app % 97);
+	memcpy(dst + count, L"\\app", 4 * sizeof(*dst));
+	count += 4;
+
+	count += append_number(dst + count, app);
+	memcpy(dst + count, L".exe", 5 * sizeof(*dst));
+}
+
+// Returns the application of a device path built by app_path.
+static u32 path_app(Path const* path) {
+	WCHAR const* end = path->c_str() + path->size() - 4;
+	WCHAR const* start = end;
+	while (start[-1] >= L'0' && start[-1] <= L'9') {
+		--start;
+	}
+
+	u32 app = 0;
+	for (WCHAR const* c = start; c < end; ++c) {
+		app = app * 10 + (u32)(*c - L'0');
+	}
+
+	return app;
+}
+
+// Live heap of the simulated pipeline components, in bytes.
+static u64 pipeline_bytes() {
+	MemoryStats stats[MemoryTagCount];
+	mem_stats(stats);
+
+	return stats[MemoryTagMonitorCache].live_bytes + stats[MemoryTagQueue].live_bytes +
+		stats[MemoryTagPaths].live_bytes;
+}
+
+// State of a simulation run.
+class Simulator {
+public:
+	// Creates a simulator for the given shape, starting at START_TIME.
+	Simulator(SimulationConfig const* config);
+
+	// Destroys the simulator.
+	~Simulator();
+
+	Simulator(Simulator const&) = delete;
+	Simulator& operator=(Simulator const&) = delete;
+
+	// Allocates the applications and the pipeline components. Returns true on success.
+	b32 init();
+
+	// Runs the simulation, filling one entry per hour.
+	void run(SimulationHour* hours);
+
+private:
+	// Schedules an event. Returns true on success.
+	b32 schedule(u64 time, u32 kind, u32 app);
+
+	// Removes the earliest event into dst. Returns false if none is left.
+	b32 next(SimEvent* dst);
+
+	// Handles a drop event for the application, as the monitor does.
+	void drop_event(u32 app);
+
+	// Takes applications from the queue until one needs a prompt, unless the user is busy.
+	void consume();
+
+	// Applies the answer of the user to the application being prompted for.
+	void answer(u32 app);
+
+	// Advances the timer wheel to the current time and lifts the temporary verdicts that ran out.
+	void expire();
+
+	// Schedules a wakeup for the next time the timer wheel can expire a timer, as the expiry timer of the verdicts.
+	void arm();
+
+	// Records that the consumer handled an application, waking the pipeline up if it was idle.
+	void touch();
+
+	// Releases the cache and the queue once nothing happened for APP_IDLE_TIME, as the notifier does, or waits again.
+	void idle();
+
+	SimulationConfig m_config;
+	u64 m_now = START_TIME;
+	DedupCache m_cache;
+	PendingQueue m_queue;
+	TimerWheel m_wheel;
+	SimApp* m_apps = nullptr;
+	f64* m_app_cdf = nullptr;
+	SimEvent* m_events = nullptr;
+	u32 m_event_count = 0;
+	u32 m_event_capacity = 0;
+	u64 m_sequence = 0;
+	u64 m_random = 0;
+	u64 m_armed = 0;
+	u64 m_evicted = 0;
+	u64 m_active = 0;
+	SimulationHour* m_hour = nullptr;
+	b32 m_is_prompting = false;
+	b32 m_is_idle = false;
+};
+
+Simulator::Simulator(SimulationConfig const* config) : m_config(*config), m_wheel(START_TIME / VERDICT_TICK_LENGTH) {
+	m_random = (config->seed * 0x9e3779b97f4a7c15) | 1;
+}
+
+Simulator::~Simulator() {
+	mem_free(m_apps);
+	mem_free(m_app_cdf);
+	mem_free(m_events);
+}
+
+b32 Simulator::init() {
+	m_apps = (SimApp*)mem_calloc(MemoryTagOther, m_config.apps, sizeof(*m_apps));
+	m_app_cdf = (f64*)mem_alloc(MemoryTagOther, m_config.apps * sizeof(*m_app_cdf));
+
+	if (m_apps == nullptr || m_app_cdf == nullptr || m_cache.init() == false ||
+		m_queue.init(MONITOR_QUEUE_SIZE) == false) {
+		return false;
+	}
+
+	f64 sum = 0.0;
+	for (u32 i = 0; i < m_config.apps; ++i) {
+		sum += 1.0 / pow((f64)(i + 1), m_config.skew);
+		m_app_cdf[i] = sum;
+	}
+
+	m_active = m_now;
+
+	return schedule(m_now + next_delay(&m_random, 1.0 / m_config.rate), SimKindArrival, 0) &&
+		schedule(m_active + APP_IDLE_TIME, SimKindIdle, 0);
+}
+
+void Simulator::run(SimulationHour* hours) {
+	assert(hours);
+
+	u64 baseline = pipeline_bytes();
+	u64 end = START_TIME + m_config.hours * HOUR_LENGTH;
+	u32 hour = 0;
+
+	m_hour = hours;
+	*m_hour = {};
+
+	SimEvent ev;
+	while (next(&ev) && ev.time < end) {
+		// Close the hours that are over. The pipeline has fixed capacity, so its heap never grows.
+		while (ev.time >= START_TIME + (hour + 1) * HOUR_LENGTH) {
+			m_hour->live_bytes = pipeline_bytes();
+			m_hour->failures += (m_hour->live_bytes > baseline);
+
+			m_hour = hours + ++hour;
+			*m_hour = {};
+		}
+
+		m_now = ev.time;
+		expire();
+
+		switch (ev.kind) {
+			case SimKindArrival:
+			{
+				// Arrivals at the peak rate are thinned down to the rate of the time of day.
+				if (next_uniform(&m_random) < daily_rate(ev.time)) {
+					drop_event(zipf_sample(m_app_cdf, m_config.apps, &m_random));
+				}
+
+				schedule(ev.time + next_delay(&m_random, 1.0 / m_config.rate), SimKindArrival, 0);
+			} break;
+
+			case SimKindRetry:
+			{
+				drop_event(ev.app);
+			} break;
+
+			case SimKindAnswer:
+			{
+				answer(ev.app);
+			} break;
+
+			case SimKindWakeup:
+			{
+				m_armed = 0;
+			} break;
+
+			case SimKindIdle:
+			{
+				idle();
+			} break;
+		}
+
+		arm();
+	}
+
+	while (hour < m_config.hours) {
+		m_hour->live_bytes = pipeline_bytes();
+		m_hour->failures += (m_hour->live_bytes > baseline);
+
+		if (++hour < m_config.hours) {
+			m_hour = hours + hour;
+			*m_hour = {};
+		}
+	}
+}
+
+b32 Simulator::schedule(u64 time, u32 kind, u32 app) {
+	if (m_event_count == m_event_capacity) {
+		u32 capacity = MAX(m_event_capacity * 2, 64u);
+		SimEvent* events = (SimEvent*)mem_realloc(MemoryTagOther, m_events, capacity * sizeof(*events));
+		if (events == nullptr) {
+			return false;
+		}
+
+		m_events = events;
+		m_event_capacity = capacity;
+	}
+
+	SimEvent ev;
+	ev.time = time;
+	ev.sequence = m_sequence++;
+	ev.kind = kind;
+	ev.app = app;
+
+	// Binary min heap ordered by time, then by sequence.
+	u32 i = m_event_count++;
+	while (i) {
+		SimEvent* parent = m_events + (i - 1) / 2;
+		if (parent->time < ev.time || (parent->time == ev.time && parent->sequence < ev.sequence)) {
+			break;
+		}
+
+		m_events[i] = *parent;
+		i = (i - 1) / 2;
+	}
+
+	m_events[i] = ev;
+
+	return true;
+}
+
+b32 Simulator::next(SimEvent* dst) {
+	assert(dst);
+
+	if (m_event_count == 0) {
+		return false;
+	}
+
+	*dst = m_events[0];
+
+	SimEvent last = m_events[--m_event_count];
+	u32 i = 0;
+
+	for (;;) {
+		u32 child = 2 * i + 1;
+		if (child >= m_event_count) {
+			break;
+		}
+
+		SimEvent* a = m_events + child;
+		if (child + 1 < m_event_count) {
+			SimEvent* b = a + 1;
+			if (b->time < a->time || (b->time == a->time && b->sequence < a->sequence)) {
+				a = b;
+				++child;
+			}
+		}
+
+		if (last.time < a->time || (last.time == a->time && last.sequence < a->sequence)) {
+			break;
+		}
+
+		m_events[i] = *a;
+		i = child;
+	}
+
+	m_events[i] = last;
+
+	return true;
+}
+
+void Simulator::drop_event(u32 app) {
+	SimApp* state = m_apps + app;
+
+	// Allowed applications get through, so the firewall never reports them.
+	if (state->verdict == SimVerdictAllow || state->verdict == SimVerdictTemporary) {
+		return;
+	}
+
+	u64 now = m_now;
+	m_hour->events += 1;
+
+	if (next_uniform(&m_random) < RETRY_CHANCE) {
+		schedule(now + next_delay(&m_random, RETRY_TIME), SimKindRetry, app);
+	}
+
+	WCHAR path[MAX_PATH];
+	app_path(app, path);
+
+	Key key;
+	if (key.assign(path) == false) {
+		m_hour->failures += 1;
+		return;
+	}
+
+	// The model: an application is remembered for DEDUP_AGE after it was admitted, unless a new application pushed it
+	// out of a full cache.
+	b32 is_remembered = state->admitted && now - state->admitted < DEDUP_AGE;
+	if (m_cache.count(now) == DEDUP_SIZE) {
+		m_evicted += 1;
+	}
+
+	b32 is_new = m_cache.insert(&key, now);
+	if (is_new) {
+		if (is_remembered) {
+			m_hour->evictions += 1;
+
+			// Every early admission needs an application pushed out of the full cache before it.
+			if (m_evicted == 0) {
+				m_hour->failures += 1;
+			} else {
+				m_evicted -= 1;
+			}
+		}
+
+		state->admitted = now;
+	} else {
+		m_hour->repeats += 1;
+
+		// A repeat must never be suppressed once its application has aged out.
+		m_hour->failures += (is_remembered == false);
+	}
+
+	m_hour->cache_peak = MAX(m_hour->cache_peak, m_cache.count(now));
+
+	b32 is_bumped = m_queue.bump(&key, false);
+	m_hour->bumps += is_bumped;
+
+	if (is_bumped || is_new == false) {
+		return;
+	}
+
+	if (m_queue.full()) {
+		m_hour->overflows += 1;
+		return;
+	}
+
+	if (m_queue.push(&key, path, now, false) == false) {
+		m_hour->failures += 1;
+		return;
+	}
+
+	m_hour->queue_peak = MAX(m_hour->queue_peak, m_queue.count());
+
+	consume();
+}
+
+void Simulator::consume() {
+	if (m_is_prompting) {
+		return;
+	}
+
+	Path path;
+	while (m_queue.pop(&path)) {
+		u32 app = path_app(&path);
+		if (app >= m_config.apps) {
+			m_hour->failures += 1;
+			continue;
+		}
+
+		// An application decided while it was waiting goes without a prompt, as in the notifier.
+		if (m_apps[app].verdict != SimVerdictNone) {
+			touch();
+
+			m_hour->skipped += 1;
+			continue;
+		}
+
+		touch();
+
+		m_hour->prompts += 1;
+		m_is_prompting = true;
+		schedule(m_now + next_delay(&m_random, m_config.answer), SimKindAnswer, app);
+
+		break;
+	}
+
+	path.reset();
+}
+
+void Simulator::answer(u32 app) {
+	SimApp* state = m_apps + app;
+	f64 u = next_uniform(&m_random);
+
+	if (u < m_config.temporary) {
+		state->verdict = SimVerdictTemporary;
+		m_wheel.insert(&state->timer, m_wheel.now() + APP_TEMPORARY_ALLOW_TIME / VERDICT_TICK_LENGTH);
+	} else if (u < m_config.temporary + (1.0 - m_config.temporary) * 0.5) {
+		state->verdict = SimVerdictAllow;
+	} else {
+		state->verdict = SimVerdictBlock;
+	}
+
+	m_is_prompting = false;
+	touch();
+	consume();
+}
+
+void Simulator::expire() {
+	u64 now = m_now / VERDICT_TICK_LENGTH;
+
+	Timer* timer = m_wheel.advance(now);
+	while (timer) {
+		SimApp* state = (SimApp*)timer;
+		timer = timer->next;
+
+		// Wakeups come exactly when the wheel is due, so no verdict outlives its expiry.
+		m_hour->failures += (now != state->timer.expiry);
+		m_hour->expirations += 1;
+
+		state->verdict = SimVerdictNone;
+	}
+}
+
+void Simulator::arm() {
+	u64 tick;
+	if (m_wheel.next_tick(&tick) == false || tick == m_armed) {
+		return;
+	}
+
+	if (schedule(MAX(tick * VERDICT_TICK_LENGTH, m_now), SimKindWakeup, 0)) {
+		m_armed = tick;
+	}
+}
+
+void Simulator::touch() {
+	m_active = m_now;
+
+	if (m_is_idle) {
+		m_is_idle = false;
+		schedule(m_active + APP_IDLE_TIME, SimKindIdle, 0);
+	}
+}
+
+void Simulator::idle() {
+	u64 now = m_now;
+
+	// The wait for the next event started over with the last one.
+	if (now - m_active < APP_IDLE_TIME) {
+		schedule(m_active + APP_IDLE_TIME, SimKindIdle, 0);
+		return;
+	}
+
+	// A prompt still showing keeps the notifier busy.
+	if (m_is_prompting) {
+		schedule(now + APP_IDLE_TIME, SimKindIdle, 0);
+		return;
+	}
+
+	b32 is_released = m_cache.release(now);
+	is_released = m_queue.release() && is_released;
+
+	if (is_released == false) {
+		schedule(now + APP_IDLE_TIME, SimKindIdle, 0);
+		return;
+	}
+
+	m_is_idle = true;
+	m_hour->idles += 1;
+
+	// Everything the pipeline holds is released; the next drop event allocates it again.
+	m_hour->failures += (pipeline_bytes() != 0);
+}
+
+b32 simulation_parse(int argc, WCHAR** argv, SimulationConfig* dst) {
+	assert(argv || argc == 0);
+	assert(dst);
+
+	dst->apps = 2000;
+	dst->skew = 1.1;
+	dst->rate = 2.0;
+	dst->answer = 20.0;
+	dst->temporary = 0.2;
+	dst->hours = 24;
+	dst->seed = 1;
+
+	for (int i = 0; i < argc; ++i) {
+		WCHAR const* arg = argv[i];
+
+		WCHAR const* value = wcschr(arg, L'=');
+		if (value == nullptr) {
+			return false;
+		}
+
+		size_t key_count = (size_t)(value - arg);
+		++value;
+
+		if (key_count == 4 && _wcsnicmp(arg, L"apps", key_count) == 0) {
+			dst->apps = (u32)wcstoul(value, nullptr, 10);
+		} else if (key_count == 4 && _wcsnicmp(arg, L"skew", key_count) == 0) {
+			dst->skew = wcstod(value, nullptr);
+		} else if (key_count == 4 && _wcsnicmp(arg, L"rate", key_count) == 0) {
+			dst->rate = wcstod(value, nullptr);
+		} else if (key_count == 6 && _wcsnicmp(arg, L"answer", key_count) == 0) {
+			dst->answer = wcstod(value, nullptr);
+		} else if (key_count == 9 && _wcsnicmp(arg, L"temporary", key_count) == 0) {
+			dst->temporary = wcstod(value, nullptr);
+		} else if (key_count == 5 && _wcsnicmp(arg, L"hours", key_count) == 0) {
+			dst->hours = (u32)wcstoul(value, nullptr, 10);
+		} else if (key_count == 4 && _wcsnicmp(arg, L"seed", key_count) == 0) {
+			dst->seed = wcstoull(value, nullptr, 10);
+		} else {
+			return false;
+		}
+	}
+
+	return dst->apps > 0 && dst->apps <= MAX_APPS && dst->skew >= 0.0 && dst->rate > 0.0 && dst->answer >= 0.0 &&
+		dst->temporary >= 0.0 && dst->temporary <= 1.0 && dst->hours > 0;
+}
+
+b32 simulation_run(SimulationConfig const* config, SimulationHour* hours) {
+	assert(config);
+	assert(hours);
+
+	Simulator simulator(config);
+	if (simulator.init() == false) {
+		return false;
+	}
+
+	simulator.run(hours);
+
+	return true;
+}
+
+size_t simulation_format(SimulationHour const* hours, u32 count, char* dst, size_t size) {
+	assert(hours || count == 0);
+	assert(dst);
+
+	int written = snprintf(dst, size, "hour,events,repeats,bumps,evictions,overflows,prompts,skipped,expirations,"
+		"idles,failures,queue_peak,cache_peak,live_bytes\r\n");
+
+	size_t used = 0;
+	for (u32 i = 0; written >= 0 && (size_t)written < size - used; ++i) {
+		used += (size_t)written;
+
+		if (i == count) {
+			return used;
+		}
+
+		SimulationHour const* h = hours + i;
+		written = snprintf(dst + used, size - used, "%u,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%u,%u,%llu\r\n",
+			i, h->events, h->repeats, h->bumps, h->evictions, h->overflows, h->prompts, h->skipped, h->expirations,
+			h->idles, h->failures, h->queue_peak, h->cache_peak, h->live_bytes);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Discrete-event simulation of the notifier pipeline under a virtual clock. Compiles to nothing unless
+// NOTIFIER_SIMULATION is defined. When enabled, the portable core of the pipeline - the deduplication cache, the
+// pending queue and the verdict timer wheel - is driven through simulated days of drop events without waiting for
+// real time to pass. Applications are Zipf distributed, traffic follows a daily cycle and retries come in bursts, and
+// a simulated user answers every prompt after a while with a permanent or a temporary verdict. After a quiet spell the
+// pipeline goes idle and releases its memory, as the notifier does. Each step is checked against a model of the
+// expected behavior, and the totals of every simulated hour are reported.
+
+// Simulation shape.
+struct SimulationConfig {
+	// Number of distinct applications.
+	u32 apps;
+
+	// Zipf exponent of the application popularity.
+	f64 skew;
+
+	// Arrival rate of new drop events at the daily peak, in events per second. Retries come on top.
+	f64 rate;
+
+	// Mean time the user takes to answer a prompt, in seconds.
+	f64 answer;
+
+	// Share of the answers that allow the application for a while instead of deciding for good.
+	f64 temporary;
+
+	// Length of the run, in hours.
+	u32 hours;
+
+	// Seed of the random sequence, so that a failing run can be repeated.
+	u64 seed;
+};
+
+// Totals of a simulated hour.
+struct SimulationHour {
+	// Drop events, retries included.
+	u64 events;
+
+	// Drop events suppressed by the deduplication cache.
+	u64 repeats;
+
+	// Drop events that raised an application already waiting in the queue.
+	u64 bumps;
+
+	// Drop events admitted again before aging out, because every slot of the cache held a newer application.
+	u64 evictions;
+
+	// Drop events lost because the queue was full.
+	u64 overflows;
+
+	// Prompts shown to the user.
+	u64 prompts;
+
+	// Applications taken from the queue that already had a verdict by then.
+	u64 skipped;
+
+	// Temporary verdicts that ran out.
+	u64 expirations;
+
+	// Times the pipeline went idle and released its memory.
+	u64 idles;
+
+	// Checks against the model that failed.
+	u64 failures;
+
+	// Largest number of applications waiting in the queue.
+	u32 queue_peak;
+
+	// Largest number of items in effect in the deduplication cache.
+	u32 cache_peak;
+
+	// Heap owned by the cache and the queue at the end of the hour, in bytes. Zero while idle.
+	u64 live_bytes;
+};
+
+#ifdef NOTIFIER_SIMULATION
+
+// Parses the simulation shape from key=value arguments, such as apps=2000 skew=1.1 rate=5 answer=20 temporary=0.2
+// hours=24 seed=1. Omitted keys keep their defaults. Returns true on success.
+b32 simulation_parse(int argc, WCHAR** argv, SimulationConfig* dst);
+
+// Runs the simulation, filling one entry per simulated hour. Returns false if the simulation could not be set up.
+b32 simulation_run(SimulationConfig const* config, SimulationHour* hours);
+
+// Writes the totals of every hour as CSV text. Returns the number of characters written, or zero if the destination
+// is too small.
+size_t simulation_format(SimulationHour const* hours, u32 count, char* dst, size_t size);
+
+#else
+
+inline b32 simulation_parse(int argc, WCHAR** argv, SimulationConfig* dst) {
+	return false;
+}
+
+inline b32 simulation_run(SimulationConfig const* config, SimulationHour* hours) {
+	return false;
+}
+
+inline size_t simulation_format(SimulationHour const* hours, u32 count, char* dst, size_t size) {
+	return 0;
+}
+
+#endif
@@ -0,0 +1,614 @@
+#include "snapshot.h"
+#include "codec.h"
+#include "fs.h"
+#include "key.h"
+#include "mem.h"
+#include "trace.h"
+#include <assert.h>
+#include <string.h>
+#include <wchar.h>
+
+// Snapshot image identifier, "FNSW".
+static const u32 SNAPSHOT_MAGIC = 0x57534e46;
+
+// Snapshot image format version.
+static const u32 SNAPSHOT_VERSION = 3;
+
+// Time from the first change of the state to its save, in milliseconds.
+static const DWORD SAVE_INTERVAL = 60000;
+
+// Time a save may be delayed to coalesce it with other timers, in milliseconds.
+static const DWORD SAVE_WINDOW = 5000;
+
+// Largest difference between two computations of the boot time of the same boot, in milliseconds.
+static const u64 BOOT_TOLERANCE = 5000;
+
+// Maximum number of entries of each kind in a snapshot.
+static const u64 MAX_ENTRIES = 0x100000;
+
+// Largest encoded size of an entry, excluding its key or path.
+static const size_t ENTRY_SIZE = 31;
+
+// Largest encoded size of a path character.
+static const size_t CHAR_SIZE = 3;
+
+// Header of a snapshot image. The payload holds the cache items, each as the varint tick count at which it was last
+// seen, the varint size of its key and the key; then the pending applications, each as a path followed by the varint
+// size of its key and the key; then the verdicts, each
+// as a byte holding the verdict, the varint tick count at which it expires and a path. Every list starts with its
+// varint length, and a path is its varint length followed by its characters as varints.
+struct SnapshotHeader {
+	u32 magic;
+	u32 version;
+	u32 checksum;
+	u32 reserved;
+	u64 logon;
+	u64 boot_time;
+	u64 payload_size;
+};
+
+// State collected from the visitors during a save.
+struct SnapshotCollector {
+	Arena* arena;
+	SnapshotState* state;
+	u32 item_capacity;
+	u32 pending_capacity;
+	u32 verdict_capacity;
+	b32 is_failed;
+};
+
+// Makes room for one more entry in a collected list. Returns true on success.
+static b32 reserve_entry(void** entries, u32 count, u32* capacity, size_t size) {
+	if (count < *capacity) {
+		return true;
+	}
+
+	u32 new_capacity = MAX(*capacity * 2, (u32)64);
+
+	void* new_entries = mem_realloc(MemoryTagSnapshot, *entries, new_capacity * size);
+	if (new_entries == nullptr) {
+		return false;
+	}
+
+	*entries = new_entries;
+	*capacity = new_capacity;
+
+	return true;
+}
+
+// Collects a cache item.
+static void collect_item(Key const* key, u64 seen, void* context) {
+	SnapshotCollector* collector = (SnapshotCollector*)context;
+	SnapshotState* state = collector->state;
+
+	if (collector->is_failed || reserve_entry((void**)&state->items, state->item_count, &collector->item_capacity,
+		sizeof(*state->items)) == false) {
+		collector->is_failed = true;
+		return;
+	}
+
+	u8* copy = (u8*)collector->arena->alloc(key->size());
+	if (copy == nullptr) {
+		collector->is_failed = true;
+		return;
+	}
+
+	memcpy(copy, key->data(), key->size());
+
+	SnapshotItem* item = state->items + state->item_count++;
+	item->key = copy;
+	item->size = (u32)key->size();
+	item->seen = seen;
+}
+
+// Collects an application waiting for a decision.
+static void collect_pending(WCHAR const* path, Key const* key, void* context) {
+	SnapshotCollector* collector = (SnapshotCollector*)context;
+	SnapshotState* state = collector->state;
+
+	if (collector->is_failed || reserve_entry((void**)&state->pending, state->pending_count,
+		&collector->pending_capacity, sizeof(*state->pending)) == false) {
+		collector->is_failed = true;
+		return;
+	}
+
+	SnapshotPending* pending = state->pending + state->pending_count;
+	pending->path = collector->arena->wcsdup(path);
+	pending->key = nullptr;
+	pending->size = key ? (u32)key->size() : 0;
+
+	u8* copy = pending->size ? (u8*)collector->arena->alloc(pending->size) : nullptr;
+	if (pending->path == nullptr || (pending->size && copy == nullptr)) {
+		collector->is_failed = true;
+		return;
+	}
+
+	if (copy) {
+		memcpy(copy, key->data(), pending->size);
+		pending->key = copy;
+	}
+
+	state->pending_count += 1;
+}
+
+// Collects a temporary verdict.
+static void collect_verdict(WCHAR const* path, b32 is_allowed, u64 expiry, void* context) {
+	SnapshotCollector* collector = (SnapshotCollector*)context;
+	SnapshotState* state = collector->state;
+
+	if (collector->is_failed || reserve_entry((void**)&state->verdicts, state->verdict_count,
+		&collector->verdict_capacity, sizeof(*state->verdicts)) == false) {
+		collector->is_failed = true;
+		return;
+	}
+
+	WCHAR const* copy = collector->arena->wcsdup(path);
+	if (copy == nullptr) {
+		collector->is_failed = true;
+		return;
+	}
+
+	SnapshotVerdict* verdict = state->verdicts + state->verdict_count++;
+	verdict->path = copy;
+	verdict->expiry = expiry;
+	verdict->is_allowed = is_allowed;
+}
+
+// Returns the current time, in milliseconds since January 1, 1601 (UTC).
+static u64 current_time() {
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+
+	return (((u64)now.dwHighDateTime << 32) | now.dwLowDateTime) / 10000;
+}
+
+// Returns the identifier of the logon session the process runs in, or zero if it is unknown. Unlike the terminal
+// session, it is never reused within a boot, so a new logon does not pick up the state of an earlier one.
+static u64 current_logon() {
+	HANDLE token;
+	if (OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token) == FALSE) {
+		return 0;
+	}
+
+	TOKEN_STATISTICS stats;
+	DWORD size = 0;
+	b32 result = GetTokenInformation(token, TokenStatistics, &stats, sizeof(stats), &size);
+	CloseHandle(token);
+
+	if (result == false) {
+		return 0;
+	}
+
+	return ((u64)(u32)stats.AuthenticationId.HighPart << 32) | stats.AuthenticationId.LowPart;
+}
+
+// Writes a path as its varint length followed by its characters as varints. Returns the position after the path.
+static u8* put_path(u8* dst, WCHAR const* path, size_t count) {
+	dst = put_varint(dst, count);
+
+	for (size_t i = 0; i < count; ++i) {
+		dst = put_varint(dst, path[i]);
+	}
+
+	return dst;
+}
+
+// Reads a path into the arena. Returns the position after the path, or null if the data is malformed.
+static u8 const* get_path(u8 const* src, u8 const* end, Arena* arena, WCHAR const** path) {
+	u64 count;
+	src = get_varint(src, end, &count);
+	if (src == nullptr || count == 0 || count > MAX_EXT_PATH) {
+		return nullptr;
+	}
+
+	WCHAR* dst = (WCHAR*)arena->alloc((size_t)(count + 1) * sizeof(*dst));
+	if (dst == nullptr) {
+		return nullptr;
+	}
+
+	for (u64 i = 0; i < count; ++i) {
+		u64 c;
+		src = get_varint(src, end, &c);
+		if (src == nullptr || c == 0 || c > 0xffff) {
+			return nullptr;
+		}
+
+		dst[i] = (WCHAR)c;
+	}
+
+	dst[count] = 0;
+	*path = dst;
+
+	return src;
+}
+
+size_t snapshot_encode(SnapshotState const* state, u8** dst) {
+	TRACE_SCOPE("snapshot_encode");
+	assert(state);
+	assert(dst);
+
+	size_t bound = sizeof(SnapshotHeader) + 3 * ENTRY_SIZE;
+
+	for (u32 i = 0; i < state->item_count; ++i) {
+		bound += ENTRY_SIZE + state->items[i].size;
+	}
+
+	for (u32 i = 0; i < state->pending_count; ++i) {
+		bound += ENTRY_SIZE + wcslen(state->pending[i].path) * CHAR_SIZE + state->pending[i].size;
+	}
+
+	for (u32 i = 0; i < state->verdict_count; ++i) {
+		bound += ENTRY_SIZE + wcslen(state->verdicts[i].path) * CHAR_SIZE;
+	}
+
+	u8* image = (u8*)mem_alloc(MemoryTagSnapshot, bound);
+	if (image == nullptr) {
+		return 0;
+	}
+
+	u8* payload = image + sizeof(SnapshotHeader);
+	u8* cursor = payload;
+
+	cursor = put_varint(cursor, state->item_count);
+	for (u32 i = 0; i < state->item_count; ++i) {
+		SnapshotItem const* item = state->items + i;
+
+		cursor = put_varint(cursor, item->seen);
+		cursor = put_varint(cursor, item->size);
+		memcpy(cursor, item->key, item->size);
+		cursor += item->size;
+	}
+
+	cursor = put_varint(cursor, state->pending_count);
+	for (u32 i = 0; i < state->pending_count; ++i) {
+		SnapshotPending const* pending = state->pending + i;
+
+		cursor = put_path(cursor, pending->path, wcslen(pending->path));
+		cursor = put_varint(cursor, pending->size);
+
+		if (pending->size) {
+			memcpy(cursor, pending->key, pending->size);
+			cursor += pending->size;
+		}
+	}
+
+	cursor = put_varint(cursor, state->verdict_count);
+	for (u32 i = 0; i < state->verdict_count; ++i) {
+		SnapshotVerdict const* verdict = state->verdicts + i;
+
+		*cursor++ = verdict->is_allowed ? 1 : 0;
+		cursor = put_varint(cursor, verdict->expiry);
+		cursor = put_path(cursor, verdict->path, wcslen(verdict->path));
+	}
+
+	SnapshotHeader header = {};
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.logon = state->logon;
+	header.boot_time = state->boot_time;
+	header.payload_size = (u64)(cursor - payload);
+	header.checksum = checksum(payload, (size_t)header.payload_size);
+
+	memcpy(image, &header, sizeof(header));
+
+	*dst = image;
+
+	return (size_t)(cursor - image);
+}
+
+b32 snapshot_decode(u8 const* data, size_t size, Arena* arena, SnapshotState* dst) {
+	TRACE_SCOPE("snapshot_decode");
+	assert(data || size == 0);
+	assert(arena);
+	assert(dst);
+
+	SnapshotHeader header;
+	if (size < sizeof(header)) {
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+
+	u8 const* src = data + sizeof(header);
+	if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+		header.payload_size != size - sizeof(header) || header.checksum != checksum(src, (size_t)header.payload_size)) {
+		return false;
+	}
+
+	u8 const* end = data + size;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->boot_time = header.boot_time;
+	dst->logon = header.logon;
+
+	u64 count;
+	src = get_varint(src, end, &count);
+	if (src == nullptr || count > MAX_ENTRIES) {
+		return false;
+	}
+
+	dst->items = (SnapshotItem*)arena->alloc((size_t)count * sizeof(*dst->items) + 1);
+	if (dst->items == nullptr) {
+		return false;
+	}
+
+	for (u64 i = 0; i < count; ++i) {
+		SnapshotItem* item = dst->items + i;
+
+		u64 key_size;
+		src = get_varint(src, end, &item->seen);
+		src = src ? get_varint(src, end, &key_size) : nullptr;
+		if (src == nullptr || key_size == 0 || key_size > (u64)(end - src)) {
+			return false;
+		}
+
+		item->key = src;
+		item->size = (u32)key_size;
+		src += key_size;
+	}
+
+	dst->item_count = (u32)count;
+
+	src = get_varint(src, end, &count);
+	if (src == nullptr || count > MAX_ENTRIES) {
+		return false;
+	}
+
+	dst->pending = (SnapshotPending*)arena->alloc((size_t)count * sizeof(*dst->pending) + 1);
+	if (dst->pending == nullptr) {
+		return false;
+	}
+
+	for (u64 i = 0; i < count; ++i) {
+		SnapshotPending* pending = dst->pending + i;
+
+		u64 key_size;
+		src = get_path(src, end, arena, &pending->path);
+		src = src ? get_varint(src, end, &key_size) : nullptr;
+		if (src == nullptr || key_size > (u64)(end - src)) {
+			return false;
+		}
+
+		pending->key = key_size ? src : nullptr;
+		pending->size = (u32)key_size;
+		src += key_size;
+	}
+
+	dst->pending_count = (u32)count;
+
+	src = get_varint(src, end, &count);
+	if (src == nullptr || count > MAX_ENTRIES) {
+		return false;
+	}
+
+	dst->verdicts = (SnapshotVerdict*)arena->alloc((size_t)count * sizeof(*dst->verdicts) + 1);
+	if (dst->verdicts == nullptr) {
+		return false;
+	}
+
+	for (u64 i = 0; i < count; ++i) {
+		SnapshotVerdict* verdict = dst->verdicts + i;
+
+		if (src == end || *src > 1) {
+			return false;
+		}
+
+		verdict->is_allowed = (*src++ != 0);
+
+		src = get_varint(src, end, &verdict->expiry);
+		src = src ? get_path(src, end, arena, &verdict->path) : nullptr;
+		if (src == nullptr) {
+			return false;
+		}
+	}
+
+	dst->verdict_count = (u32)count;
+
+	return src == end;
+}
+
+Snapshot::Snapshot() {
+	InitializeCriticalSection(&m_lock);
+}
+
+Snapshot::~Snapshot() {
+	stop();
+	DeleteCriticalSection(&m_lock);
+}
+
+b32 Snapshot::restore(WCHAR const* path, Monitor* monitor, Verdicts* verdicts) {
+	TRACE_SCOPE("Snapshot::restore");
+	assert(path);
+	assert(monitor);
+	assert(verdicts);
+
+	MappedFile file;
+	if (fs_map(path, &file) == false) {
+		return false;
+	}
+
+	Arena arena(MemoryTagSnapshot);
+	SnapshotState state;
+
+	b32 result = snapshot_decode(file.data, (size_t)file.size, &arena, &state);
+	if (result) {
+		u64 now = GetTickCount64();
+		u64 boot_time = current_time() - now;
+
+		// Tick counts of another boot are moved onto the current one through the wall clock.
+		u64 boot_delta = (state.boot_time > boot_time) ? state.boot_time - boot_time : boot_time - state.boot_time;
+		b32 is_same_boot = (boot_delta < BOOT_TOLERANCE);
+		u64 logon = current_logon();
+		b32 is_same_logon = is_same_boot && logon && state.logon == logon;
+		i64 offset = is_same_boot ? 0 : (i64)(state.boot_time - boot_time);
+
+		Key key;
+		for (u32 i = 0; i < state.item_count; ++i) {
+			i64 seen = (i64)state.items[i].seen + offset;
+			if (seen > 0 && key.load(state.items[i].key, state.items[i].size)) {
+				monitor->restore_cached(&key, (u64)seen);
+			}
+		}
+
+		for (u32 i = 0; i < state.pending_count; ++i) {
+			SnapshotPending const* pending = state.pending + i;
+
+			b32 has_key = pending->size && key.load(pending->key, pending->size);
+			monitor->restore_queued(pending->path, has_key ? &key : nullptr);
+		}
+
+		for (u32 i = 0; i < state.verdict_count; ++i) {
+			SnapshotVerdict const* verdict = state.verdicts + i;
+
+			if (verdict->expiry == 0) {
+				if (is_same_logon && verdict->is_allowed == false) {
+					verdicts->block(verdict->path);
+				}
+
+				continue;
+			}
+
+			i64 remaining = (i64)verdict->expiry + offset - (i64)now;
+			if (remaining > 0 && verdict->is_allowed) {
+				verdicts->allow(verdict->path, (u32)MIN(remaining, (i64)MAXDWORD));
+			}
+		}
+	}
+
+	fs_unmap(&file);
+
+	return result;
+}
+
+b32 Snapshot::start(WCHAR const* path, Monitor* monitor, Verdicts* verdicts, SnapshotSource source, void* context) {
+	assert(path);
+	assert(monitor);
+	assert(verdicts);
+	assert(source);
+
+	if (m_timer || wcscpy_s(m_path, COUNT(m_path), path) != 0) {
+		return false;
+	}
+
+	m_monitor = monitor;
+	m_verdicts = verdicts;
+	m_source = source;
+	m_context = context;
+
+	PTP_TIMER timer = CreateThreadpoolTimer(save_callback, this, nullptr);
+	if (timer == nullptr) {
+		return false;
+	}
+
+	EnterCriticalSection(&m_lock);
+	m_timer = timer;
+	LeaveCriticalSection(&m_lock);
+
+	// The restored state is written back once, in case it changed while it was read.
+	touch();
+
+	return true;
+}
+
+void Snapshot::stop() {
+	EnterCriticalSection(&m_lock);
+	PTP_TIMER timer = m_timer;
+	m_timer = nullptr;
+	m_is_armed = false;
+	LeaveCriticalSection(&m_lock);
+
+	if (timer == nullptr) {
+		return;
+	}
+
+	SetThreadpoolTimer(timer, nullptr, 0, 0);
+	WaitForThreadpoolTimerCallbacks(timer, TRUE);
+	CloseThreadpoolTimer(timer);
+
+	save();
+}
+
+void Snapshot::touch() {
+	// Most calls come while a save is already scheduled, so they get away without the lock.
+	if (m_is_armed) {
+		return;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	if (m_timer && m_is_armed == false) {
+		ULARGE_INTEGER relative;
+		relative.QuadPart = (ULONGLONG)(-(LONGLONG)SAVE_INTERVAL * 10000);
+
+		FILETIME due;
+		due.dwLowDateTime = relative.LowPart;
+		due.dwHighDateTime = relative.HighPart;
+
+		SetThreadpoolTimer(m_timer, &due, 0, SAVE_WINDOW);
+		m_is_armed = true;
+	}
+
+	LeaveCriticalSection(&m_lock);
+}
+
+b32 Snapshot::save() {
+	TRACE_SCOPE("Snapshot::save");
+
+	Arena arena(MemoryTagSnapshot);
+
+	SnapshotState state = {};
+	state.boot_time = current_time() - GetTickCount64();
+	state.logon = current_logon();
+
+	SnapshotCollector collector = {};
+	collector.arena = &arena;
+	collector.state = &state;
+
+	m_monitor->visit_cached(collect_item, &collector);
+	m_source(collect_pending, &collector, m_context);
+	m_verdicts->visit(collect_verdict, &collector);
+
+	b32 result = false;
+
+	u8* image = nullptr;
+	size_t size = collector.is_failed ? 0 : snapshot_encode(&state, &image);
+
+	if (size) {
+		SnapshotHeader header;
+		memcpy(&header, image, sizeof(header));
+
+		EnterCriticalSection(&m_lock);
+
+		// The boot time is recomputed on every save, so only the payload tells whether the state changed.
+		result = m_has_checksum && m_checksum == header.checksum;
+		if (result == false) {
+			result = fs_write_atomic(m_path, image, size);
+			m_checksum = header.checksum;
+			m_has_checksum = result;
+		}
+
+		LeaveCriticalSection(&m_lock);
+	}
+
+	mem_free(image);
+	mem_free(state.items);
+	mem_free((void*)state.pending);
+	mem_free(state.verdicts);
+
+	return result;
+}
+
+void CALLBACK Snapshot::save_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(timer);
+
+	Snapshot* snapshot = (Snapshot*)context;
+	if (snapshot) {
+		// Changes made while saving schedule the next save.
+		EnterCriticalSection(&snapshot->m_lock);
+		snapshot->m_is_armed = false;
+		LeaveCriticalSection(&snapshot->m_lock);
+
+		snapshot->save();
+	}
+}
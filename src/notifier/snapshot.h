@@ -0,0 +1,102 @@
+#pragma once
+#include "arena.h"
+#include "core.h"
+#include "monitor.h"
+#include "verdicts.h"
+#include <Windows.h>
+
+// An item of the monitor deduplication cache.
+struct SnapshotItem {
+	u8 const* key;
+	u32 size;
+	u64 seen;
+};
+
+// An application waiting for a decision, with the key of the device path it was queued under. The key is empty if the
+// application has none.
+struct SnapshotPending {
+	WCHAR const* path;
+	u8 const* key;
+	u32 size;
+};
+
+// A temporary verdict. The expiry is zero for a verdict that lasts until the notifier exits.
+struct SnapshotVerdict {
+	WCHAR const* path;
+	u64 expiry;
+	b32 is_allowed;
+};
+
+// The warm restart state of the notifier. Times are tick counts, in milliseconds since the given boot time, which is
+// in milliseconds since January 1, 1601 (UTC). The logon is the identifier of the logon session, unique within a boot.
+struct SnapshotState {
+	u64 boot_time;
+	u64 logon;
+	SnapshotItem* items;
+	u32 item_count;
+	SnapshotPending* pending;
+	u32 pending_count;
+	SnapshotVerdict* verdicts;
+	u32 verdict_count;
+};
+
+// Encodes the state as a snapshot image: times and path characters are varint encoded. Returns the size of the image,
+// or zero on failure. The image must be freed with mem_free.
+size_t snapshot_encode(SnapshotState const* state, u8** dst);
+
+// Decodes a snapshot image. The entries and their paths are allocated from the arena, while the keys point into the
+// image. Returns true on success.
+b32 snapshot_decode(u8 const* data, size_t size, Arena* arena, SnapshotState* dst);
+
+// Source of the applications waiting for a decision. Calls the visitor for every path.
+typedef void(*SnapshotSource)(MonitorVisitor visitor, void* visitor_context, void* context);
+
+// Carries the monitor deduplication cache, the applications waiting for a decision and the temporary verdicts over to
+// the next instance of the notifier. The state is saved to a snapshot file shortly after it was touched and when
+// stopping, and only rewritten when it changed, so an idle notifier never wakes up to save. On restore, entries that
+// expired while no instance was running are dropped, and verdicts that last until the notifier exits are only restored
+// within the same boot and logon session.
+class Snapshot {
+public:
+	// Creates a stopped snapshot.
+	Snapshot();
+
+	// Destroys the snapshot, stopping it if needed.
+	~Snapshot();
+
+	Snapshot(Snapshot const&) = delete;
+	Snapshot& operator=(Snapshot const&) = delete;
+
+	// Restores the state saved at the given path into the monitor and the verdicts. Must be called before the monitor
+	// is started. Returns true if a snapshot was restored.
+	b32 restore(WCHAR const* path, Monitor* monitor, Verdicts* verdicts);
+
+	// Starts saving the state of the monitor, the verdicts and the applications listed by the source to the given
+	// path. Returns true on success.
+	b32 start(WCHAR const* path, Monitor* monitor, Verdicts* verdicts, SnapshotSource source, void* context);
+
+	// Stops saving and saves the state a last time.
+	void stop();
+
+	// Schedules a save unless one is already scheduled. Called whenever the state may have changed; safe to call from
+	// any thread.
+	void touch();
+
+private:
+	// Collects the current state and writes it if it changed since the last write. Returns true on success.
+	b32 save();
+
+	// Callback from the thread pool to save the state.
+	static void CALLBACK save_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+
+	CRITICAL_SECTION m_lock;
+	WCHAR m_path[MAX_PATH + 1] = {};
+	Monitor* m_monitor = nullptr;
+	Verdicts* m_verdicts = nullptr;
+	SnapshotSource m_source = nullptr;
+	void* m_context = nullptr;
+	PTP_TIMER m_timer = nullptr;
+	volatile b32 m_is_armed = false;
+	u32 m_checksum = 0;
+	b32 m_has_checksum = false;
+};
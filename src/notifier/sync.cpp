@@ -0,0 +1,1027 @@
+#include "sync.h"
+#include "codec.h"
+#include "fs.h"
+#include "mem.h"
+#include "trace.h"
+#include "wstr.h"
+#include <bcrypt.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Delta image identifier, "FNSD".
+static const u32 SYNC_MAGIC = 0x44534e46;
+
+// Delta image format version.
+static const u32 SYNC_VERSION = 2;
+
+// State file identifier, "FNSS".
+static const u32 STATE_MAGIC = 0x53534e46;
+
+// State file format version.
+static const u32 STATE_VERSION = 3;
+
+// File name of the sync state, located next to the executable.
+static WCHAR const STATE_NAME[] = L"sync.dat";
+
+// Pattern matching the delta files in the shared directory.
+static WCHAR const DELTA_PATTERN[] = L"\\*.fnd";
+
+// Maximum number of machines tracked for import.
+static const u32 MAX_PEERS = 4096;
+
+// Maximum number of recorded decisions waiting for export.
+static const u32 MAX_PENDING = 0x100000;
+
+// Time between imports when the shared directory cannot be watched, in milliseconds.
+static const DWORD POLL_INTERVAL = 60000;
+
+// Time a recorded decision waits for others to share its delta file, in milliseconds.
+static const DWORD EXPORT_DELAY = 10000;
+
+// Number of recorded decisions that are exported without waiting for the delay.
+static const u32 EXPORT_BATCH = 4096;
+
+// Number of delta files a machine keeps in the shared directory before folding them into one.
+static const u32 MAX_DELTA_FILES = 32;
+
+// Largest encoded size of a decision, excluding its path.
+static const size_t RECORD_SIZE = 31;
+
+// Header of a delta image. The payload holds the decisions sorted by path, each as the varint length of the prefix
+// shared with the previous path, the varint length of the rest of the path, the rest of the path, the varint sequence
+// number relative to the first sequence number and a byte holding the verdict.
+struct SyncHeader {
+	u32 magic;
+	u32 version;
+	u32 count;
+	u32 checksum;
+	u64 source;
+	u64 first_sequence;
+	u64 last_sequence;
+	u64 payload_size;
+};
+
+// Header of the state file. The header is followed by the import progress of every known machine. The machine is a
+// hash of the computer name, which tells a state file copied from another machine apart.
+struct SyncStateHeader {
+	u32 magic;
+	u32 version;
+	u32 peer_count;
+	u32 checksum;
+	u64 machine;
+	u64 source;
+	u64 sequence;
+	u64 exported;
+};
+
+// A delta file of another machine waiting to be imported.
+struct SyncFile {
+	WCHAR const* name;
+	u64 source;
+	u64 first_sequence;
+	u64 last_sequence;
+};
+
+// Orders decisions by path, then by sequence number.
+static int compare_decisions(void const* a, void const* b) {
+	SyncDecision const* da = (SyncDecision const*)a;
+	SyncDecision const* db = (SyncDecision const*)b;
+
+	int cmp = wcscmp(da->path, db->path);
+	if (cmp) {
+		return cmp;
+	}
+
+	return (da->sequence > db->sequence) - (da->sequence < db->sequence);
+}
+
+// Orders delta files by source, then by the range of sequence numbers they cover.
+static int compare_files(void const* a, void const* b) {
+	SyncFile const* fa = (SyncFile const*)a;
+	SyncFile const* fb = (SyncFile const*)b;
+
+	if (fa->source != fb->source) {
+		return (fa->source > fb->source) - (fa->source < fb->source);
+	}
+
+	if (fa->first_sequence != fb->first_sequence) {
+		return (fa->first_sequence > fb->first_sequence) - (fa->first_sequence < fb->first_sequence);
+	}
+
+	return (fa->last_sequence > fb->last_sequence) - (fa->last_sequence < fb->last_sequence);
+}
+
+size_t sync_encode(SyncDecision* decisions, u32 count, u64 source, u64 first_sequence, u8** dst) {
+	assert(decisions || count == 0);
+	assert(dst);
+
+	*dst = nullptr;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	qsort(decisions, count, sizeof(*decisions), compare_decisions);
+
+	u32 unique = 0;
+	for (u32 i = 0; i < count; ++i) {
+		if (unique && wcscmp(decisions[unique - 1].path, decisions[i].path) == 0) {
+			decisions[unique - 1] = decisions[i];
+		} else {
+			decisions[unique++] = decisions[i];
+		}
+	}
+
+	u64 last_sequence = first_sequence;
+	size_t size = sizeof(SyncHeader);
+
+	for (u32 i = 0; i < unique; ++i) {
+		assert(decisions[i].sequence >= first_sequence);
+		last_sequence = MAX(last_sequence, decisions[i].sequence);
+		size += RECORD_SIZE + wcslen(decisions[i].path) * sizeof(WCHAR);
+	}
+
+	u8* image = (u8*)mem_alloc(MemoryTagSync, size);
+	if (image == nullptr) {
+		return 0;
+	}
+
+	u8* payload = image + sizeof(SyncHeader);
+	u8* cursor = payload;
+
+	WCHAR const* prev = L"";
+	for (u32 i = 0; i < unique; ++i) {
+		WCHAR const* path = decisions[i].path;
+
+		size_t shared = 0;
+		while (prev[shared] && prev[shared] == path[shared]) {
+			++shared;
+		}
+
+		size_t suffix = wcslen(path + shared);
+
+		cursor = put_varint(cursor, shared);
+		cursor = put_varint(cursor, suffix);
+		memcpy(cursor, path + shared, suffix * sizeof(WCHAR));
+		cursor += suffix * sizeof(WCHAR);
+		cursor = put_varint(cursor, decisions[i].sequence - first_sequence);
+		*cursor++ = decisions[i].is_allowed ? 1 : 0;
+
+		prev = path;
+	}
+
+	SyncHeader header = {};
+	header.magic = SYNC_MAGIC;
+	header.version = SYNC_VERSION;
+	header.count = unique;
+	header.source = source;
+	header.first_sequence = first_sequence;
+	header.last_sequence = last_sequence;
+	header.payload_size = (u64)(cursor - payload);
+	header.checksum = checksum(payload, (size_t)header.payload_size);
+
+	memcpy(image, &header, sizeof(header));
+	*dst = image;
+
+	return sizeof(header) + (size_t)header.payload_size;
+}
+
+i64 sync_decode(u8 const* data, size_t size, u64 after, Arena* arena, SyncDecision** dst) {
+	assert(data || size == 0);
+	assert(arena);
+	assert(dst);
+
+	if (size < sizeof(SyncHeader)) {
+		return -1;
+	}
+
+	SyncHeader header;
+	memcpy(&header, data, sizeof(header));
+
+	u8 const* src = data + sizeof(header);
+	u8 const* end = data + size;
+
+	if (header.magic != SYNC_MAGIC || header.version != SYNC_VERSION || header.payload_size != size - sizeof(header) ||
+		header.count > header.payload_size / 4 || header.first_sequence > header.last_sequence ||
+		header.checksum != checksum(src, (size_t)header.payload_size)) {
+		return -1;
+	}
+
+	SyncDecision* decisions = (SyncDecision*)arena->alloc((header.count + 1) * sizeof(*decisions));
+	if (decisions == nullptr) {
+		return -1;
+	}
+
+	WCHAR const* prev = L"";
+	u64 prev_count = 0;
+	u32 num = 0;
+
+	for (u32 i = 0; i < header.count; ++i) {
+		u64 shared;
+		u64 suffix;
+
+		src = get_varint(src, end, &shared);
+		src = src ? get_varint(src, end, &suffix) : nullptr;
+
+		if (src == nullptr || shared > prev_count || suffix > MAX_EXT_PATH || shared + suffix == 0 ||
+			shared + suffix > MAX_EXT_PATH || suffix * sizeof(WCHAR) > (u64)(end - src)) {
+			return -1;
+		}
+
+		WCHAR* path = (WCHAR*)arena->alloc((size_t)(shared + suffix + 1) * sizeof(*path));
+		if (path == nullptr) {
+			return -1;
+		}
+
+		memcpy(path, prev, (size_t)shared * sizeof(*path));
+		memcpy(path + shared, src, (size_t)suffix * sizeof(*path));
+		path[shared + suffix] = 0;
+		src += suffix * sizeof(*path);
+
+		u64 delta;
+		src = get_varint(src, end, &delta);
+
+		if (src == nullptr || src == end || delta > header.last_sequence - header.first_sequence || *src > 1) {
+			return -1;
+		}
+
+		u64 sequence = header.first_sequence + delta;
+		b32 is_allowed = *src++;
+
+		if (sequence > after) {
+			SyncDecision* decision = decisions + num++;
+			decision->path = path;
+			decision->sequence = sequence;
+			decision->is_allowed = is_allowed;
+		}
+
+		prev = path;
+		prev_count = shared + suffix;
+	}
+
+	if (src != end) {
+		return -1;
+	}
+
+	*dst = decisions;
+
+	return num;
+}
+
+// Decodes a mapped delta file, failing instead of faulting if the file becomes unreadable while it is decoded.
+static i64 decode_file(MappedFile const* file, u64 after, Arena* arena, SyncDecision** dst) {
+	__try {
+		return sync_decode(file->data, (size_t)file->size, after, arena, dst);
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		return -1;
+	}
+}
+
+// Reads the range of sequence numbers covered by a mapped delta file, failing instead of faulting if the file becomes
+// unreadable. Returns true if the file has a valid header.
+static b32 range_file(MappedFile const* file, u64* first_sequence, u64* last_sequence) {
+	SyncHeader header;
+
+	__try {
+		if (file->size < sizeof(header)) {
+			return false;
+		}
+
+		memcpy(&header, file->data, sizeof(header));
+	} __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+		return false;
+	}
+
+	if (header.magic != SYNC_MAGIC || header.version != SYNC_VERSION || header.first_sequence > header.last_sequence) {
+		return false;
+	}
+
+	*first_sequence = header.first_sequence;
+	*last_sequence = header.last_sequence;
+
+	return true;
+}
+
+// Lists the readable delta files of the given source, ordered by the range of sequence numbers they cover. The names
+// are allocated from the arena and the list must be freed with mem_free. Returns the number of files, or -1 on failure.
+static i64 list_deltas(WCHAR const* dir, u64 source, Arena* arena, SyncFile** dst) {
+	assert(dir);
+	assert(arena);
+	assert(dst);
+
+	*dst = nullptr;
+
+	WCHAR pattern[MAX_PATH + 1];
+	if (swprintf_s(pattern, COUNT(pattern), L"%s\\%016llx-*.fnd", dir, source) <= 0) {
+		return -1;
+	}
+
+	WIN32_FIND_DATAW data;
+	HANDLE find = FindFirstFileW(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return GetLastError() == ERROR_FILE_NOT_FOUND ? 0 : -1;
+	}
+
+	SyncFile* files = nullptr;
+	u32 count = 0;
+	u32 capacity = 0;
+	b32 result = true;
+
+	do {
+		u64 file_source;
+		u64 first_sequence;
+		u64 last_sequence;
+
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+			swscanf_s(data.cFileName, L"%16llx-%16llx.fnd", &file_source, &last_sequence) != 2 || file_source != source) {
+			continue;
+		}
+
+		WCHAR path[MAX_PATH + 1];
+		if (swprintf_s(path, COUNT(path), L"%s\\%s", dir, data.cFileName) <= 0) {
+			continue;
+		}
+
+		MappedFile file;
+		if (fs_map(path, &file) == false) {
+			continue;
+		}
+
+		b32 is_valid = range_file(&file, &first_sequence, &last_sequence);
+		fs_unmap(&file);
+
+		if (is_valid == false) {
+			continue;
+		}
+
+		if (count == capacity) {
+			u32 new_capacity = MAX(capacity * 2, 16u);
+
+			SyncFile* new_files = (SyncFile*)mem_realloc(MemoryTagSync, files, new_capacity * sizeof(*new_files));
+			if (new_files == nullptr) {
+				result = false;
+				break;
+			}
+
+			files = new_files;
+			capacity = new_capacity;
+		}
+
+		WCHAR const* name = arena->wcsdup(data.cFileName);
+		if (name == nullptr) {
+			result = false;
+			break;
+		}
+
+		SyncFile* entry = files + count++;
+		entry->name = name;
+		entry->source = source;
+		entry->first_sequence = first_sequence;
+		entry->last_sequence = last_sequence;
+	} while (FindNextFileW(find, &data));
+
+	FindClose(find);
+
+	if (result == false) {
+		mem_free(files);
+		return -1;
+	}
+
+	if (count) {
+		qsort(files, count, sizeof(*files), compare_files);
+	}
+
+	*dst = files;
+
+	return count;
+}
+
+DecisionSync::DecisionSync() : m_paths(MemoryTagSync) {
+	InitializeCriticalSection(&m_lock);
+	m_peers = (SyncPeer*)mem_calloc(MemoryTagSync, MAX_PEERS, sizeof(*m_peers));
+}
+
+DecisionSync::~DecisionSync() {
+	stop();
+
+	mem_free(m_pending);
+	mem_free(m_peers);
+
+	DeleteCriticalSection(&m_lock);
+}
+
+b32 DecisionSync::start(WCHAR const* dir, Firewall* firewall) {
+	assert(dir);
+	assert(firewall);
+
+	if (m_thread || m_peers == nullptr || wcslen(dir) >= COUNT(m_dir)) {
+		return false;
+	}
+
+	if (fs_module_path(m_state_path, COUNT(m_state_path), STATE_NAME) == false) {
+		return false;
+	}
+
+	WCHAR name[MAX_COMPUTERNAME_LENGTH + 1];
+	DWORD name_count = COUNT(name);
+
+	if (GetComputerNameW(name, &name_count) == FALSE) {
+		return false;
+	}
+
+	wcscpy_s(m_dir, COUNT(m_dir), dir);
+	m_firewall = firewall;
+	m_machine = wcshash(name);
+
+	// Without a state of its own the machine starts over under a new identifier, as peers have already seen the
+	// sequence numbers it would reuse under the old one.
+	if (load_state() == false) {
+		m_sequence = 0;
+		m_peer_count = 0;
+
+		if (new_source() == false) {
+			return false;
+		}
+	}
+
+	m_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	m_wake = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+
+	if (m_stop && m_wake) {
+		m_thread = CreateThread(0, 0, sync_thread_callback, this, 0, 0);
+	}
+
+	if (m_thread == nullptr) {
+		if (m_stop) {
+			CloseHandle(m_stop);
+			m_stop = nullptr;
+		}
+
+		if (m_wake) {
+			CloseHandle(m_wake);
+			m_wake = nullptr;
+		}
+
+		return false;
+	}
+
+	return true;
+}
+
+void DecisionSync::stop() {
+	if (m_thread == nullptr) {
+		return;
+	}
+
+	SetEvent(m_stop);
+	WaitForSingleObject(m_thread, INFINITE);
+
+	CloseHandle(m_thread);
+	CloseHandle(m_stop);
+	CloseHandle(m_wake);
+
+	m_thread = nullptr;
+	m_stop = nullptr;
+	m_wake = nullptr;
+}
+
+void DecisionSync::record(WCHAR const* path, b32 is_allowed) {
+	assert(path);
+
+	if (m_thread == nullptr) {
+		return;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	if (m_pending_count == m_pending_capacity && m_pending_capacity < MAX_PENDING) {
+		u32 capacity = m_pending_capacity ? m_pending_capacity * 2 : 64;
+
+		SyncDecision* pending = (SyncDecision*)mem_realloc(MemoryTagSync, m_pending, capacity * sizeof(*pending));
+		if (pending) {
+			m_pending = pending;
+			m_pending_capacity = capacity;
+		}
+	}
+
+	if (m_pending_count < m_pending_capacity) {
+		WCHAR* copy = m_paths.wcsdup(path);
+		if (copy) {
+			SyncDecision* decision = m_pending + m_pending_count++;
+			decision->path = copy;
+			decision->sequence = ++m_sequence;
+			decision->is_allowed = is_allowed;
+		}
+	}
+
+	// The sync thread starts the export delay on the first decision and skips it for a full batch.
+	b32 is_wake = (m_pending_count == 1 || m_pending_count == EXPORT_BATCH);
+
+	LeaveCriticalSection(&m_lock);
+
+	if (is_wake) {
+		SetEvent(m_wake);
+	}
+}
+
+b32 DecisionSync::load_state() {
+	MappedFile file;
+	if (fs_map(m_state_path, &file) == false) {
+		return false;
+	}
+
+	b32 result = false;
+
+	if (file.size >= sizeof(SyncStateHeader)) {
+		SyncStateHeader header;
+		memcpy(&header, file.data, sizeof(header));
+
+		u8 const* peers = file.data + sizeof(header);
+		u64 peers_size = (u64)header.peer_count * sizeof(SyncPeer);
+
+		result = (header.magic == STATE_MAGIC && header.version == STATE_VERSION && header.peer_count <= MAX_PEERS &&
+			file.size == sizeof(header) + peers_size && header.checksum == checksum(peers, (size_t)peers_size) &&
+			header.machine == m_machine && header.source);
+
+		if (result) {
+			m_source = header.source;
+			m_sequence = header.sequence;
+			m_exported = header.exported;
+			m_peer_count = header.peer_count;
+			memcpy(m_peers, peers, (size_t)peers_size);
+		}
+	}
+
+	fs_unmap(&file);
+
+	return result;
+}
+
+void DecisionSync::save_state() {
+	size_t peers_size = m_peer_count * sizeof(SyncPeer);
+
+	u8* data = (u8*)mem_alloc(MemoryTagSync, sizeof(SyncStateHeader) + peers_size);
+	if (data == nullptr) {
+		return;
+	}
+
+	SyncStateHeader header = {};
+	header.magic = STATE_MAGIC;
+	header.version = STATE_VERSION;
+	header.peer_count = m_peer_count;
+	header.checksum = checksum((u8 const*)m_peers, peers_size);
+	header.machine = m_machine;
+	header.source = m_source;
+
+	EnterCriticalSection(&m_lock);
+	header.sequence = m_sequence;
+	LeaveCriticalSection(&m_lock);
+
+	header.exported = m_exported;
+
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + sizeof(header), m_peers, peers_size);
+
+	fs_write_atomic(m_state_path, data, sizeof(header) + peers_size);
+
+	mem_free(data);
+}
+
+b32 DecisionSync::new_source() {
+	u64 source = 0;
+	if (BCRYPT_SUCCESS(BCryptGenRandom(nullptr, (PUCHAR)&source, sizeof(source), BCRYPT_USE_SYSTEM_PREFERRED_RNG)) ==
+		false || source == 0) {
+		return false;
+	}
+
+	m_source = source;
+	m_exported = 0;
+
+	return true;
+}
+
+void DecisionSync::check_source() {
+	TRACE_SCOPE("DecisionSync::check_source");
+
+	Arena arena(MemoryTagSync);
+	SyncFile* files;
+	i64 file_count = list_deltas(m_dir, m_source, &arena, &files);
+
+	u64 last_sequence = 0;
+	for (i64 i = 0; i < file_count; ++i) {
+		last_sequence = MAX(last_sequence, files[i].last_sequence);
+	}
+
+	mem_free(files);
+
+	if (last_sequence <= m_exported) {
+		return;
+	}
+
+	EnterCriticalSection(&m_lock);
+	u64 sequence = m_sequence;
+	LeaveCriticalSection(&m_lock);
+
+	// The sequence number is saved before every export, so a delta past the saved export alone was written right
+	// before a crash. A delta past the sequence number means the state was restored from an older copy, and the
+	// numbers recorded since would collide with ones peers have already applied.
+	if (last_sequence <= sequence) {
+		m_exported = last_sequence;
+	} else if (new_source() == false) {
+		return;
+	}
+
+	save_state();
+}
+
+u32 DecisionSync::pending_count() {
+	EnterCriticalSection(&m_lock);
+	u32 count = m_pending_count;
+	LeaveCriticalSection(&m_lock);
+
+	return count;
+}
+
+void DecisionSync::export_decisions() {
+	TRACE_SCOPE("DecisionSync::export_decisions");
+
+	EnterCriticalSection(&m_lock);
+
+	u32 count = m_pending_count;
+	SyncDecision* decisions = count ? (SyncDecision*)mem_alloc(MemoryTagSync, count * sizeof(*decisions)) : nullptr;
+
+	if (decisions) {
+		memcpy(decisions, m_pending, count * sizeof(*decisions));
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	if (decisions == nullptr) {
+		return;
+	}
+
+	u64 last_sequence = 0;
+	for (u32 i = 0; i < count; ++i) {
+		last_sequence = MAX(last_sequence, decisions[i].sequence);
+	}
+
+	// Paths stay valid without the lock: the arena is only reset below, by this thread. The delta picks up right after
+	// the previous one, so importers can tell when a delta is missing.
+	u8* image;
+	size_t size = sync_encode(decisions, count, m_source, m_exported + 1, &image);
+	mem_free(decisions);
+
+	if (size == 0) {
+		return;
+	}
+
+	// Persist the sequence number first, so that a crash never reuses the numbers of an exported delta.
+	save_state();
+
+	WCHAR path[MAX_PATH + 1];
+	int path_count = swprintf_s(path, COUNT(path), L"%s\\%016llx-%016llx.fnd", m_dir, m_source, last_sequence);
+
+	b32 result = path_count > 0 && fs_write_atomic(path, image, size);
+	mem_free(image);
+
+	if (result == false) {
+		return;
+	}
+
+	EnterCriticalSection(&m_lock);
+
+	// Decisions recorded in the meantime go into the next delta. Their paths are released along with the rest once
+	// nothing is pending.
+	m_pending_count -= count;
+	memmove(m_pending, m_pending + count, m_pending_count * sizeof(*m_pending));
+
+	if (m_pending_count == 0) {
+		m_paths.reset();
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	m_exported = last_sequence;
+	save_state();
+
+	compact_decisions();
+}
+
+void DecisionSync::compact_decisions() {
+	TRACE_SCOPE("DecisionSync::compact_decisions");
+
+	Arena arena(MemoryTagSync);
+	SyncFile* files;
+	i64 file_count = list_deltas(m_dir, m_source, &arena, &files);
+
+	if (file_count <= MAX_DELTA_FILES) {
+		mem_free(files);
+		return;
+	}
+
+	SyncDecision* decisions = nullptr;
+	u32 count = 0;
+	u32 capacity = 0;
+	u64 first_sequence = files[0].first_sequence;
+	u32 newest = 0;
+	i64 i = 0;
+
+	for (; i < file_count; ++i) {
+		WCHAR path[MAX_PATH + 1];
+		if (swprintf_s(path, COUNT(path), L"%s\\%s", m_dir, files[i].name) <= 0) {
+			break;
+		}
+
+		MappedFile file;
+		if (fs_map(path, &file) == false) {
+			break;
+		}
+
+		SyncDecision* decoded;
+		i64 num = decode_file(&file, 0, &arena, &decoded);
+		fs_unmap(&file);
+
+		if (num < 0) {
+			break;
+		}
+
+		if (count + num > capacity) {
+			u32 new_capacity = MAX(capacity * 2, count + (u32)num);
+
+			SyncDecision* new_decisions = (SyncDecision*)mem_realloc(MemoryTagSync, decisions,
+				new_capacity * sizeof(*new_decisions));
+			if (new_decisions == nullptr) {
+				break;
+			}
+
+			decisions = new_decisions;
+			capacity = new_capacity;
+		}
+
+		memcpy(decisions + count, decoded, (size_t)num * sizeof(*decoded));
+		count += (u32)num;
+
+		if (files[i].last_sequence > files[newest].last_sequence) {
+			newest = (u32)i;
+		}
+	}
+
+	// The folded file keeps only the latest decision for each path and replaces the newest delta, whose name it shares.
+	// A peer that falls behind resumes from anywhere within it, so the other deltas can go.
+	u8* image = nullptr;
+	size_t size = (i == file_count) ? sync_encode(decisions, count, m_source, first_sequence, &image) : 0;
+	mem_free(decisions);
+
+	WCHAR path[MAX_PATH + 1];
+	if (size && swprintf_s(path, COUNT(path), L"%s\\%s", m_dir, files[newest].name) > 0 &&
+		fs_write_atomic(path, image, size)) {
+		for (i = 0; i < file_count; ++i) {
+			if (i != newest && swprintf_s(path, COUNT(path), L"%s\\%s", m_dir, files[i].name) > 0) {
+				DeleteFileW(path);
+			}
+		}
+	}
+
+	mem_free(image);
+	mem_free(files);
+}
+
+void DecisionSync::import_decisions() {
+	TRACE_SCOPE("DecisionSync::import_decisions");
+
+	WCHAR pattern[MAX_PATH + 1];
+	wcsmerge(pattern, COUNT(pattern), m_dir, DELTA_PATTERN);
+
+	WIN32_FIND_DATAW data;
+	HANDLE find = FindFirstFileW(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+
+	Arena arena(MemoryTagSync);
+	SyncFile* files = nullptr;
+	u32 file_count = 0;
+	u32 file_capacity = 0;
+
+	do {
+		u64 source;
+		u64 last_sequence;
+
+		if ((data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+			swscanf_s(data.cFileName, L"%16llx-%16llx.fnd", &source, &last_sequence) != 2 || source == m_source) {
+			continue;
+		}
+
+		SyncPeer* peer = find_peer(source);
+		if (peer == nullptr || last_sequence <= peer->sequence) {
+			continue;
+		}
+
+		WCHAR path[MAX_PATH + 1];
+		if (swprintf_s(path, COUNT(path), L"%s\\%s", m_dir, data.cFileName) <= 0) {
+			continue;
+		}
+
+		MappedFile file;
+		if (fs_map(path, &file) == false) {
+			continue;
+		}
+
+		u64 first_sequence;
+		b32 is_valid = range_file(&file, &first_sequence, &last_sequence);
+		fs_unmap(&file);
+
+		if (is_valid == false || last_sequence <= peer->sequence) {
+			continue;
+		}
+
+		if (file_count == file_capacity) {
+			u32 capacity = MAX(file_capacity * 2, 16u);
+
+			SyncFile* new_files = (SyncFile*)mem_realloc(MemoryTagSync, files, capacity * sizeof(*new_files));
+			if (new_files == nullptr) {
+				continue;
+			}
+
+			files = new_files;
+			file_capacity = capacity;
+		}
+
+		WCHAR const* name = arena.wcsdup(data.cFileName);
+		if (name) {
+			SyncFile* entry = files + file_count++;
+			entry->name = name;
+			entry->source = source;
+			entry->first_sequence = first_sequence;
+			entry->last_sequence = last_sequence;
+		}
+	} while (FindNextFileW(find, &data));
+
+	FindClose(find);
+
+	// Enumeration order says nothing about the order the files were written in.
+	if (file_count) {
+		qsort(files, file_count, sizeof(*files), compare_files);
+	}
+
+	RuleDecision* batch = nullptr;
+	u32 batch_count = 0;
+	u32 batch_capacity = 0;
+	b32 is_changed = false;
+
+	for (u32 i = 0; i < file_count; ++i) {
+		SyncFile const* entry = files + i;
+
+		// A file starting past the next sequence number waits for the files in between, which are still on their way.
+		SyncPeer* peer = find_peer(entry->source);
+		if (peer == nullptr || entry->last_sequence <= peer->sequence || entry->first_sequence > peer->sequence + 1) {
+			continue;
+		}
+
+		WCHAR path[MAX_PATH + 1];
+		if (swprintf_s(path, COUNT(path), L"%s\\%s", m_dir, entry->name) <= 0) {
+			continue;
+		}
+
+		MappedFile file;
+		if (fs_map(path, &file) == false) {
+			continue;
+		}
+
+		SyncDecision* decisions;
+		i64 num = decode_file(&file, peer->sequence, &arena, &decisions);
+		fs_unmap(&file);
+
+		if (num < 0) {
+			continue;
+		}
+
+		if (batch_count + num > batch_capacity) {
+			u32 capacity = MAX(batch_capacity * 2, batch_count + (u32)num);
+
+			RuleDecision* new_batch = (RuleDecision*)mem_realloc(MemoryTagSync, batch, capacity * sizeof(*new_batch));
+			if (new_batch == nullptr) {
+				continue;
+			}
+
+			batch = new_batch;
+			batch_capacity = capacity;
+		}
+
+		for (i64 j = 0; j < num; ++j) {
+			RuleDecision* decision = batch + batch_count++;
+			decision->path = decisions[j].path;
+			decision->is_allowed = decisions[j].is_allowed;
+		}
+
+		peer->sequence = entry->last_sequence;
+		is_changed = true;
+	}
+
+	mem_free(files);
+
+	if (batch_count) {
+		m_firewall->add_rules(batch, batch_count);
+	}
+
+	mem_free(batch);
+
+	if (is_changed) {
+		save_state();
+	}
+}
+
+DecisionSync::SyncPeer* DecisionSync::find_peer(u64 source) {
+	for (u32 i = 0; i < m_peer_count; ++i) {
+		if (m_peers[i].source == source) {
+			return m_peers + i;
+		}
+	}
+
+	if (m_peer_count == MAX_PEERS) {
+		return nullptr;
+	}
+
+	SyncPeer* peer = m_peers + m_peer_count++;
+	peer->source = source;
+	peer->sequence = 0;
+
+	return peer;
+}
+
+DWORD DecisionSync::sync_thread() {
+	HANDLE change = FindFirstChangeNotificationW(m_dir, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+	b32 is_watching = (change != INVALID_HANDLE_VALUE);
+
+	HANDLE handles[] = { m_stop, m_wake, change };
+	DWORD handle_count = is_watching ? 3 : 2;
+
+	check_source();
+	import_decisions();
+
+	// Times of the next export and of the next poll, or zero if none is due.
+	u64 export_time = 0;
+	u64 import_time = is_watching ? 0 : GetTickCount64() + POLL_INTERVAL;
+
+	for (;;) {
+		u64 now = GetTickCount64();
+		u64 wake_time = export_time;
+		if (import_time && (wake_time == 0 || import_time < wake_time)) {
+			wake_time = import_time;
+		}
+
+		DWORD timeout = wake_time ? (DWORD)(wake_time > now ? wake_time - now : 0) : INFINITE;
+
+		DWORD result = WaitForMultipleObjects(handle_count, handles, FALSE, timeout);
+
+		if (result == WAIT_OBJECT_0) {
+			break;
+		}
+
+		now = GetTickCount64();
+
+		if (result == WAIT_OBJECT_0 + 1) {
+			if (pending_count() >= EXPORT_BATCH) {
+				export_time = now;
+			} else if (export_time == 0) {
+				export_time = now + EXPORT_DELAY;
+			}
+		} else if (result == WAIT_OBJECT_0 + 2) {
+			FindNextChangeNotification(change);
+			import_decisions();
+		} else if (result != WAIT_TIMEOUT) {
+			break;
+		}
+
+		if (import_time && now >= import_time) {
+			import_decisions();
+			import_time = now + POLL_INTERVAL;
+		}
+
+		// Decisions recorded during the export, or left behind by a failed one, wait for the next round.
+		if (export_time && now >= export_time) {
+			export_decisions();
+			export_time = pending_count() ? now + EXPORT_DELAY : 0;
+		}
+	}
+
+	export_decisions();
+
+	if (is_watching) {
+		FindCloseChangeNotification(change);
+	}
+
+	return 0;
+}
+
+DWORD WINAPI DecisionSync::sync_thread_callback(LPVOID context) {
+	DecisionSync* sync = (DecisionSync*)context;
+	if (sync) {
+		return sync->sync_thread();
+	}
+
+	return 0;
+}
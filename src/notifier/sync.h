@@ -0,0 +1,111 @@
+#pragma once
+#include "arena.h"
+#include "core.h"
+#include "firewall.h"
+#include <Windows.h>
+
+// A rule decision exchanged between machines. Sequence numbers are assigned by the machine that made the decision.
+struct SyncDecision {
+	WCHAR const* path;
+	u64 sequence;
+	b32 is_allowed;
+};
+
+// Encodes the decisions of the given source as a delta image: paths are sorted and prefix compressed and sequence
+// numbers are delta encoded. The decisions are sorted in place and only the latest decision for each path is kept. The
+// image covers every sequence number from the given first one up to the last decision, including the numbers of
+// decisions that were superseded or never exported. Returns the size of the image, or zero on failure. The image must
+// be freed with mem_free.
+size_t sync_encode(SyncDecision* decisions, u32 count, u64 source, u64 first_sequence, u8** dst);
+
+// Decodes the decisions of a delta image with a sequence number above the given one. The decisions and their paths
+// are allocated from the arena. Returns the number of decisions decoded, or -1 if the image is malformed.
+i64 sync_decode(u8 const* data, size_t size, u64 after, Arena* arena, SyncDecision** dst);
+
+// Exchanges rule decisions with other machines through a shared directory. Local decisions are gathered for a few
+// seconds and exported as delta files named after the machine and the last sequence number they contain, each covering
+// the sequence numbers right after the previous one. A machine with too many delta files folds them into one, so the
+// directory stays small. Delta files of other machines are imported as soon as they appear, in the order of their
+// sequence numbers, applying only the decisions made since the last import from that machine. A file that arrives
+// before the ones preceding it waits for them, so no decision is ever skipped. The sequence numbers and a random
+// machine identifier survive restarts in a state file next to the executable. A state file that is lost, copied from
+// another machine or behind the delta files in the directory starts a new identifier, so peers never skip decisions
+// because their sequence numbers were reused.
+class DecisionSync {
+public:
+	// Creates a stopped sync.
+	DecisionSync();
+
+	// Destroys the sync, stopping it if needed.
+	~DecisionSync();
+
+	// Starts syncing through the given directory and applying imported decisions to the firewall. Returns true on
+	// success.
+	b32 start(WCHAR const* dir, Firewall* firewall);
+
+	// Exports any recorded decisions and stops syncing.
+	void stop();
+
+	// Records a local decision for export. Never blocks on the shared directory.
+	void record(WCHAR const* path, b32 is_allowed);
+
+private:
+	// The import progress for another machine.
+	struct SyncPeer {
+		u64 source;
+		u64 sequence;
+	};
+
+	// Loads the machine identifier and the sequence numbers from the state file. Returns false if the file is missing,
+	// malformed or belongs to another machine.
+	b32 load_state();
+
+	// Saves the sequence numbers to the state file.
+	void save_state();
+
+	// Picks a new random machine identifier, starting its delta files over. Returns true on success.
+	b32 new_source();
+
+	// Compares the state with the delta files of the machine in the directory and picks a new identifier if the delta
+	// files contain sequence numbers that were never recorded.
+	void check_source();
+
+	// Returns the number of recorded decisions waiting for export.
+	u32 pending_count();
+
+	// Writes the recorded decisions to a delta file.
+	void export_decisions();
+
+	// Folds the delta files of the machine into one once there are too many of them.
+	void compact_decisions();
+
+	// Reads the new delta files of other machines and applies their decisions.
+	void import_decisions();
+
+	// Returns the import progress for the given machine, adding it if needed. Returns null if there are too many peers.
+	SyncPeer* find_peer(u64 source);
+
+	// Sync thread routine.
+	DWORD sync_thread();
+
+	// Sync thread routine callback.
+	static DWORD WINAPI sync_thread_callback(LPVOID context);
+
+	CRITICAL_SECTION m_lock;
+	Arena m_paths;
+	SyncDecision* m_pending = nullptr;
+	u32 m_pending_count = 0;
+	u32 m_pending_capacity = 0;
+	SyncPeer* m_peers = nullptr;
+	u32 m_peer_count = 0;
+	u64 m_machine = 0;
+	u64 m_source = 0;
+	u64 m_sequence = 0;
+	u64 m_exported = 0;
+	Firewall* m_firewall = nullptr;
+	WCHAR m_dir[MAX_PATH + 1] = {};
+	WCHAR m_state_path[MAX_PATH + 1] = {};
+	HANDLE m_thread = nullptr;
+	HANDLE m_stop = nullptr;
+	HANDLE m_wake = nullptr;
+};
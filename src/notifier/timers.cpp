@@ -0,0 +1,200 @@
+#include "timers.h"
+#include <assert.h>
+
+// Number of tick bits resolved by each level.
+static const u32 SLOT_BITS = 6;
+
+// Mask of the slot index within a level.
+static const u64 SLOT_MASK = TIMER_SLOTS - 1;
+
+// Number of ticks covered by the whole wheel. Later timers wait in the last level and are placed again on cascade.
+static const u64 WHEEL_SPAN = (u64)1 << (SLOT_BITS * TIMER_LEVELS);
+
+// Returns the occupancy bits rotated right so that bit 0 is the given slot.
+static u64 rotate_bits(u64 bits, u32 slot) {
+	return slot ? (bits >> slot) | (bits << (TIMER_SLOTS - slot)) : bits;
+}
+
+// Returns the index of the lowest set bit. The bits must not be zero.
+static u32 lowest_bit(u64 bits) {
+	assert(bits);
+
+	u32 index = 0;
+	while ((bits & 1) == 0) {
+		bits >>= 1;
+		++index;
+	}
+
+	return index;
+}
+
+TimerWheel::TimerWheel(u64 now) : m_now(now) {
+	for (u32 level = 0; level < TIMER_LEVELS; ++level) {
+		for (u32 slot = 0; slot < TIMER_SLOTS; ++slot) {
+			Timer* head = &m_slots[level][slot];
+			head->next = head;
+			head->prev = head;
+		}
+
+		m_occupied[level] = 0;
+	}
+}
+
+void TimerWheel::insert(Timer* timer, u64 expiry) {
+	assert(timer);
+
+	timer->expiry = MAX(expiry, m_now + 1);
+	link(timer);
+
+	++m_count;
+}
+
+void TimerWheel::cancel(Timer* timer) {
+	assert(timer);
+	assert(m_count);
+
+	Timer* next = timer->next;
+	timer->prev->next = next;
+	next->prev = timer->prev;
+
+	// A head linked to itself marks an empty slot, whose level and index follow from the head address.
+	if (next == timer->prev) {
+		size_t index = (size_t)(next - &m_slots[0][0]);
+		if (index < TIMER_LEVELS * TIMER_SLOTS) {
+			m_occupied[index / TIMER_SLOTS] &= ~((u64)1 << (index % TIMER_SLOTS));
+		}
+	}
+
+	timer->next = nullptr;
+	timer->prev = nullptr;
+
+	--m_count;
+}
+
+Timer* TimerWheel::advance(u64 now) {
+	Timer* expired = nullptr;
+
+	if (m_count == 0) {
+		m_now = MAX(m_now, now);
+		return nullptr;
+	}
+
+	while (m_now < now) {
+		// Ticks at which nothing expires or cascades are skipped, so a long suspend costs no more than a short one.
+		u64 tick;
+		if (next_tick(&tick) == false || tick > now) {
+			m_now = now;
+			break;
+		}
+
+		m_now = MAX(tick, m_now + 1);
+
+		// Every time a level wraps around, the next slot of the level above is due to move down.
+		u32 slot = (u32)(m_now & SLOT_MASK);
+		for (u32 level = 1; slot == 0 && level < TIMER_LEVELS; ++level) {
+			slot = (u32)((m_now >> (SLOT_BITS * level)) & SLOT_MASK);
+			cascade(level, slot);
+		}
+
+		slot = (u32)(m_now & SLOT_MASK);
+		if ((m_occupied[0] & ((u64)1 << slot)) == 0) {
+			continue;
+		}
+
+		Timer* head = &m_slots[0][slot];
+		Timer* timer = head->next;
+
+		while (timer != head) {
+			Timer* next = timer->next;
+
+			timer->prev = nullptr;
+			timer->next = expired;
+			expired = timer;
+
+			--m_count;
+			timer = next;
+		}
+
+		head->next = head;
+		head->prev = head;
+		m_occupied[0] &= ~((u64)1 << slot);
+
+		if (m_count == 0) {
+			m_now = now;
+		}
+	}
+
+	return expired;
+}
+
+b32 TimerWheel::next_tick(u64* tick) const {
+	assert(tick);
+
+	if (m_count == 0) {
+		return false;
+	}
+
+	u64 result = ~(u64)0;
+
+	// The first level holds exact expiries, the levels above only the ticks at which their slots cascade down.
+	for (u32 level = 0; level < TIMER_LEVELS; ++level) {
+		if (m_occupied[level] == 0) {
+			continue;
+		}
+
+		u32 shift = SLOT_BITS * level;
+		u64 period = (m_now >> shift) + 1;
+		u32 offset = lowest_bit(rotate_bits(m_occupied[level], (u32)(period & SLOT_MASK)));
+
+		result = MIN(result, (period + offset) << shift);
+	}
+
+	*tick = result;
+
+	return true;
+}
+
+void TimerWheel::link(Timer* timer) {
+	assert(timer);
+
+	// A timer cascading down at its own expiry lands in the current slot, which expires right after the cascade.
+	u64 expiry = MIN(timer->expiry, m_now + WHEEL_SPAN - 1);
+	u64 delta = expiry > m_now ? expiry - m_now : 0;
+
+	u32 level = 0;
+	while (level + 1 < TIMER_LEVELS && delta >= ((u64)1 << (SLOT_BITS * (level + 1)))) {
+		++level;
+	}
+
+	u32 slot = (u32)((expiry >> (SLOT_BITS * level)) & SLOT_MASK);
+
+	Timer* head = &m_slots[level][slot];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+
+	m_occupied[level] |= (u64)1 << slot;
+}
+
+void TimerWheel::cascade(u32 level, u32 slot) {
+	assert(level < TIMER_LEVELS);
+	assert(slot < TIMER_SLOTS);
+
+	if ((m_occupied[level] & ((u64)1 << slot)) == 0) {
+		return;
+	}
+
+	Timer* head = &m_slots[level][slot];
+	Timer* timer = head->next;
+
+	head->next = head;
+	head->prev = head;
+	m_occupied[level] &= ~((u64)1 << slot);
+
+	while (timer != head) {
+		Timer* next = timer->next;
+		link(timer);
+		timer = next;
+	}
+}
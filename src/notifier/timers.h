@@ -0,0 +1,64 @@
+#pragma once
+#include "core.h"
+
+// Number of levels in the timer wheel.
+#define TIMER_LEVELS 4
+
+// Number of slots per level of the timer wheel. Each level covers this many slots of the level below.
+#define TIMER_SLOTS 64
+
+// A timer in a timer wheel. Embedded in the record it times; the wheel never allocates.
+struct Timer {
+	Timer* next;
+	Timer* prev;
+	u64 expiry;
+};
+
+// Hierarchical timer wheel. Time advances in ticks whose length is up to the user. Timers due within TIMER_SLOTS
+// ticks wait in the first level, later timers wait in coarser levels and cascade down as their time approaches, so
+// inserting, cancelling and expiring a timer take constant time regardless of the number of timers.
+class TimerWheel {
+public:
+	// Creates an empty wheel at the given tick.
+	TimerWheel(u64 now);
+
+	TimerWheel(TimerWheel const&) = delete;
+	TimerWheel& operator=(TimerWheel const&) = delete;
+
+	// Schedules the timer to expire at the given tick. Timers already due expire on the next advance. The timer must
+	// not be scheduled already.
+	void insert(Timer* timer, u64 expiry);
+
+	// Cancels a scheduled timer.
+	void cancel(Timer* timer);
+
+	// Advances the wheel to the given tick, jumping from one occupied slot to the next. Returns the expired timers as a
+	// list linked through next, or null.
+	Timer* advance(u64 now);
+
+	// Retrieves the earliest tick at which an advance can expire a timer or move one closer to expiring. Returns true
+	// if any timer is scheduled.
+	b32 next_tick(u64* tick) const;
+
+	// Returns the current tick.
+	u64 now() const {
+		return m_now;
+	}
+
+	// Returns the number of scheduled timers.
+	u32 count() const {
+		return m_count;
+	}
+
+private:
+	// Links the timer into the slot for its expiry.
+	void link(Timer* timer);
+
+	// Moves every timer of the slot into the levels below it.
+	void cascade(u32 level, u32 slot);
+
+	Timer m_slots[TIMER_LEVELS][TIMER_SLOTS];
+	u64 m_occupied[TIMER_LEVELS];
+	u64 m_now;
+	u32 m_count = 0;
+};
@@ -0,0 +1,258 @@
+#include "trace.h"
+
+#ifdef NOTIFIER_TRACE
+
+#include <assert.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Number of spans buffered per thread. Must be a power of two.
+static const u32 TRACE_BUFFER_SIZE = 16384;
+
+// Interval between drains of the thread buffers, in milliseconds.
+static const DWORD TRACE_DRAIN_INTERVAL = 100;
+
+// A completed span.
+struct TraceSpan {
+	char const* name;
+	u64 start;
+	u64 end;
+};
+
+// Single producer, single consumer span buffer owned by one thread. Once the thread exits, the writer frees the
+// buffer after draining it.
+struct TraceBuffer {
+	TraceBuffer* next;
+	DWORD thread_id;
+	volatile LONG head;
+	volatile LONG tail;
+	volatile LONG dropped;
+	volatile LONG is_exited;
+	LONG dropped_written;
+	TraceSpan spans[TRACE_BUFFER_SIZE];
+};
+
+// Buffer of the calling thread.
+static __declspec(thread) TraceBuffer* g_thread_buffer;
+
+// List of every thread buffer, pushed lock-free as threads record their first span.
+static TraceBuffer* volatile g_buffers;
+
+// Fiber local storage slot whose callback tells the writer that the thread of a buffer exited.
+static DWORD g_fls_index = FLS_OUT_OF_INDEXES;
+
+static HANDLE g_file = INVALID_HANDLE_VALUE;
+static HANDLE g_thread;
+static HANDLE g_stop;
+static u64 g_frequency;
+static u64 g_origin;
+static b32 g_first_event;
+
+// Writes an event line to the trace file.
+static void trace_write(char const* line, int len) {
+	if (len > 0) {
+		DWORD written;
+		WriteFile(g_file, line, (DWORD)len, &written, nullptr);
+		g_first_event = false;
+	}
+}
+
+// Drains every thread buffer into the trace file, and frees the buffers of threads that exited. Spans dropped since
+// the last drain are written as a counter of the thread.
+static void trace_drain() {
+	char line[256];
+
+	TraceBuffer* prev = nullptr;
+	TraceBuffer* buffer = g_buffers;
+
+	while (buffer) {
+		b32 is_exited = buffer->is_exited;
+		LONG head = buffer->head;
+		_ReadBarrier();
+
+		for (LONG tail = buffer->tail; tail != head; ++tail) {
+			TraceSpan const* span = buffer->spans + ((u32)tail & (TRACE_BUFFER_SIZE - 1));
+
+			f64 ts = (f64)(i64)(span->start - g_origin) * 1000000.0 / (f64)g_frequency;
+			f64 dur = (f64)(span->end - span->start) * 1000000.0 / (f64)g_frequency;
+
+			int len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+				"%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+				g_first_event ? "\n" : ",\n", span->name, GetCurrentProcessId(), buffer->thread_id, ts, dur);
+
+			trace_write(line, len);
+		}
+
+		_ReadWriteBarrier();
+		buffer->tail = head;
+
+		LONG dropped = buffer->dropped;
+		if (dropped != buffer->dropped_written) {
+			f64 ts = (f64)(i64)(trace_now() - g_origin) * 1000000.0 / (f64)g_frequency;
+
+			int len = _snprintf_s(line, sizeof(line), _TRUNCATE,
+				"%s{\"name\":\"dropped spans\",\"ph\":\"C\",\"pid\":%lu,\"tid\":%lu,\"ts\":%.3f,"
+				"\"args\":{\"dropped\":%ld}}",
+				g_first_event ? "\n" : ",\n", GetCurrentProcessId(), buffer->thread_id, ts, dropped);
+
+			trace_write(line, len);
+			buffer->dropped_written = dropped;
+		}
+
+		TraceBuffer* next = buffer->next;
+
+		// Threads only push buffers at the head of the list, so a buffer behind another one can be unlinked directly.
+		// The head of the list is only unlinked if no thread pushed a buffer in the meantime, and is otherwise freed by
+		// a later drain.
+		if (is_exited) {
+			if (prev) {
+				prev->next = next;
+				free(buffer);
+				buffer = next;
+				continue;
+			}
+
+			if (InterlockedCompareExchangePointer((PVOID volatile*)&g_buffers, next, buffer) == buffer) {
+				free(buffer);
+				buffer = next;
+				continue;
+			}
+		}
+
+		prev = buffer;
+		buffer = next;
+	}
+}
+
+// Callback from the system when a thread that recorded spans exits.
+static void WINAPI trace_thread_exit(PVOID context) {
+	TraceBuffer* buffer = (TraceBuffer*)context;
+
+	if (buffer) {
+		g_thread_buffer = nullptr;
+		_WriteBarrier();
+		buffer->is_exited = true;
+	}
+}
+
+// Trace writer thread routine.
+static DWORD WINAPI trace_thread(LPVOID context) {
+	while (WaitForSingleObject(g_stop, TRACE_DRAIN_INTERVAL) == WAIT_TIMEOUT) {
+		trace_drain();
+	}
+
+	trace_drain();
+
+	return 0;
+}
+
+b32 trace_start(WCHAR const* path) {
+	assert(path);
+
+	if (g_file != INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	// The slot is kept for the lifetime of the process, since freeing it would run the callback for threads that are
+	// still recording.
+	if (g_fls_index == FLS_OUT_OF_INDEXES) {
+		g_fls_index = FlsAlloc(trace_thread_exit);
+		if (g_fls_index == FLS_OUT_OF_INDEXES) {
+			return false;
+		}
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	g_frequency = (u64)frequency.QuadPart;
+	g_origin = trace_now();
+	g_first_event = true;
+
+	g_file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (g_file == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	DWORD written;
+	WriteFile(g_file, "[", 1, &written, nullptr);
+
+	g_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	if (g_stop) {
+		g_thread = CreateThread(nullptr, 0, trace_thread, nullptr, 0, nullptr);
+	}
+
+	if (g_thread == nullptr) {
+		trace_stop();
+		return false;
+	}
+
+	return true;
+}
+
+void trace_stop() {
+	if (g_thread) {
+		SetEvent(g_stop);
+		WaitForSingleObject(g_thread, INFINITE);
+		CloseHandle(g_thread);
+		g_thread = nullptr;
+	}
+
+	if (g_stop) {
+		CloseHandle(g_stop);
+		g_stop = nullptr;
+	}
+
+	if (g_file != INVALID_HANDLE_VALUE) {
+		DWORD written;
+		WriteFile(g_file, "\n]\n", 3, &written, nullptr);
+		CloseHandle(g_file);
+		g_file = INVALID_HANDLE_VALUE;
+	}
+}
+
+void trace_span(char const* name, u64 start, u64 end) {
+	TraceBuffer* buffer = g_thread_buffer;
+
+	if (buffer == nullptr) {
+		if (g_fls_index == FLS_OUT_OF_INDEXES) {
+			return;
+		}
+
+		buffer = (TraceBuffer*)calloc(1, sizeof(*buffer));
+		if (buffer == nullptr) {
+			return;
+		}
+
+		buffer->thread_id = GetCurrentThreadId();
+
+		if (FlsSetValue(g_fls_index, buffer) == FALSE) {
+			free(buffer);
+			return;
+		}
+
+		TraceBuffer* head;
+		do {
+			head = g_buffers;
+			buffer->next = head;
+		} while (InterlockedCompareExchangePointer((PVOID volatile*)&g_buffers, buffer, head) != head);
+
+		g_thread_buffer = buffer;
+	}
+
+	LONG head = buffer->head;
+	if ((u32)(head - buffer->tail) >= TRACE_BUFFER_SIZE) {
+		buffer->dropped += 1;
+		return;
+	}
+
+	TraceSpan* span = buffer->spans + ((u32)head & (TRACE_BUFFER_SIZE - 1));
+	span->name = name;
+	span->start = start;
+	span->end = end;
+
+	_WriteBarrier();
+	buffer->head = head + 1;
+}
+
+#endif
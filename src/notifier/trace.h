@@ -0,0 +1,58 @@
+#pragma once
+#include "core.h"
+#include <Windows.h>
+
+// Hot path tracing. Spans compile to nothing unless NOTIFIER_TRACE is defined. When enabled, each thread records
+// completed spans into its own lock-free buffer, and a writer thread drains the buffers asynchronously into a
+// Chrome trace event JSON file that can be opened in chrome://tracing or Perfetto. Spans dropped because a buffer was
+// full show up as a counter of the thread.
+
+#define TRACE_CONCAT_INNER(x, y) x##y
+#define TRACE_CONCAT(x, y) TRACE_CONCAT_INNER(x, y)
+
+#ifdef NOTIFIER_TRACE
+
+// Opens a span with the given string literal name that is closed at the end of the enclosing scope.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+
+// Starts writing spans to the trace file at the given path. Returns true on success.
+b32 trace_start(WCHAR const* path);
+
+// Writes any remaining spans and closes the trace file.
+void trace_stop();
+
+// Returns the current trace timestamp, in performance counter ticks.
+inline u64 trace_now() {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (u64)now.QuadPart;
+}
+
+// Records a completed span for the calling thread.
+void trace_span(char const* name, u64 start, u64 end);
+
+// A span that records itself when it goes out of scope.
+struct TraceScope {
+	char const* name;
+	u64 start;
+
+	TraceScope(char const* name) : name(name), start(trace_now()) {
+	}
+
+	~TraceScope() {
+		trace_span(name, start, trace_now());
+	}
+};
+
+#else
+
+#define TRACE_SCOPE(name)
+
+inline b32 trace_start(WCHAR const* path) {
+	return false;
+}
+
+inline void trace_stop() {
+}
+
+#endif
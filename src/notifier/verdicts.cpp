@@ -0,0 +1,348 @@
+#include "verdicts.h"
+#include "mem.h"
+#include "trace.h"
+#include "wstr.h"
+#include <initguid.h>
+#include <fwpmu.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Number of buckets in the verdict table. Must be a power of two.
+static const u32 TABLE_SIZE = 0x10000;
+
+// Time the expiry timer may be delayed to coalesce it with other timers, in milliseconds.
+static const DWORD TIMER_WINDOW = 500;
+
+// Weight of the sublayer holding the permit filters, above the sublayers the system firewall places its filters in.
+static const u16 SUBLAYER_WEIGHT = 0xffff;
+
+// Sublayer holding the permit filters. Weighted above the sublayers of the system firewall.
+// {8a2f6c1e-4b37-4d2a-9e5c-3f1d7b60a914}
+static const GUID SUBLAYER_KEY = { 0x8a2f6c1e, 0x4b37, 0x4d2a, { 0x9e, 0x5c, 0x3f, 0x1d, 0x7b, 0x60, 0xa9, 0x14 } };
+
+// Returns the current timer wheel tick.
+static u64 current_tick() {
+	return GetTickCount64() / VERDICT_TICK_LENGTH;
+}
+
+Verdicts::Verdicts() : m_wheel(current_tick()) {
+	m_table = (Verdict**)mem_calloc(MemoryTagVerdicts, TABLE_SIZE, sizeof(*m_table));
+	if (m_table == nullptr) {
+		return;
+	}
+
+	m_timer = CreateThreadpoolTimer(expire_callback, this, nullptr);
+	if (m_timer == nullptr) {
+		return;
+	}
+
+	// A dynamic session takes its filters along when it closes, even if the process dies.
+	FWPM_SESSION0 session_desc = {};
+	session_desc.displayData.name = L"Firewall Notifier";
+	session_desc.displayData.description = L"Temporary verdicts.";
+	session_desc.flags = FWPM_SESSION_FLAG_DYNAMIC;
+
+	if (FwpmEngineOpen0(nullptr, RPC_C_AUTHN_DEFAULT, nullptr, &session_desc, &m_session) != ERROR_SUCCESS) {
+		m_session = nullptr;
+		return;
+	}
+
+	FWPM_SUBLAYER0 sublayer = {};
+	sublayer.subLayerKey = SUBLAYER_KEY;
+	sublayer.displayData.name = L"Firewall Notifier";
+	sublayer.displayData.description = L"Temporary verdicts.";
+	sublayer.weight = SUBLAYER_WEIGHT;
+
+	m_has_sublayer = (FwpmSubLayerAdd0(m_session, &sublayer, nullptr) == ERROR_SUCCESS);
+}
+
+Verdicts::~Verdicts() {
+	if (m_timer) {
+		SetThreadpoolTimer(m_timer, nullptr, 0, 0);
+		WaitForThreadpoolTimerCallbacks(m_timer, TRUE);
+		CloseThreadpoolTimer(m_timer);
+	}
+
+	if (m_table) {
+		for (u32 i = 0; i < TABLE_SIZE; ++i) {
+			while (m_table[i]) {
+				remove(m_table[i]);
+			}
+		}
+
+		mem_free(m_table);
+	}
+
+	if (m_session) {
+		FwpmEngineClose0(m_session);
+	}
+}
+
+b32 Verdicts::allow(WCHAR const* path, u32 duration) {
+	return insert(path, true, duration);
+}
+
+b32 Verdicts::block(WCHAR const* path) {
+	return insert(path, false, 0);
+}
+
+b32 Verdicts::find(WCHAR const* path, b32* is_allowed) {
+	assert(path);
+	assert(is_allowed);
+
+	if (m_table == nullptr) {
+		return false;
+	}
+
+	size_t hash = wcshash(path);
+
+	AcquireSRWLockShared(&m_lock);
+
+	Verdict* verdict = lookup(path, hash);
+	if (verdict) {
+		*is_allowed = verdict->is_allowed;
+	}
+
+	ReleaseSRWLockShared(&m_lock);
+
+	return verdict != nullptr;
+}
+
+u32 Verdicts::count() {
+	AcquireSRWLockShared(&m_lock);
+	u32 result = m_count;
+	ReleaseSRWLockShared(&m_lock);
+
+	return result;
+}
+
+void Verdicts::visit(VerdictVisitor visitor, void* context) {
+	assert(visitor);
+
+	if (m_table == nullptr) {
+		return;
+	}
+
+	AcquireSRWLockShared(&m_lock);
+
+	u64 now = current_tick();
+	for (u32 i = 0; i < TABLE_SIZE; ++i) {
+		for (Verdict* verdict = m_table[i]; verdict; verdict = verdict->next) {
+			if (verdict->is_timed == false) {
+				visitor(verdict->path, verdict->is_allowed, 0, context);
+			} else if (verdict->timer.expiry > now) {
+				visitor(verdict->path, verdict->is_allowed, verdict->timer.expiry * VERDICT_TICK_LENGTH, context);
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&m_lock);
+}
+
+Verdicts::Verdict* Verdicts::lookup(WCHAR const* path, size_t hash) {
+	assert(path);
+
+	for (Verdict* verdict = m_table[hash & (TABLE_SIZE - 1)]; verdict; verdict = verdict->next) {
+		if (verdict->hash == hash && wcscmp(verdict->path, path) == 0) {
+			return verdict;
+		}
+	}
+
+	return nullptr;
+}
+
+b32 Verdicts::insert(WCHAR const* path, b32 is_allowed, u32 duration) {
+	TRACE_SCOPE("Verdicts::insert");
+	assert(path);
+
+	if (m_table == nullptr || m_timer == nullptr) {
+		return false;
+	}
+
+	size_t count = wcslen(path);
+	if (count == 0 || count > MAX_EXT_PATH) {
+		return false;
+	}
+
+	Verdict* verdict = (Verdict*)mem_alloc(MemoryTagVerdicts, sizeof(*verdict) + count * sizeof(*path));
+	if (verdict == nullptr) {
+		return false;
+	}
+
+	memset(verdict, 0, sizeof(*verdict));
+	memcpy(verdict->path, path, (count + 1) * sizeof(*path));
+	verdict->hash = wcshash(path);
+	verdict->is_allowed = is_allowed;
+	verdict->is_timed = (duration != 0);
+
+	// The hard permit would override the block rules of the application, so they are checked first. The filters go in
+	// before the old verdict is lifted, so an allowed application is never cut off in between.
+	if (is_allowed && ((m_firewall && m_firewall->has_block_rule(path)) || add_filters(verdict) == false)) {
+		mem_free(verdict);
+		return false;
+	}
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	u64 now = current_tick();
+	collect(now);
+
+	Verdict* existing = lookup(verdict->path, verdict->hash);
+	if (existing) {
+		remove(existing);
+	}
+
+	Verdict** bucket = m_table + (verdict->hash & (TABLE_SIZE - 1));
+	verdict->next = *bucket;
+	*bucket = verdict;
+	++m_count;
+
+	if (verdict->is_timed) {
+		m_wheel.insert(&verdict->timer, now + (duration + VERDICT_TICK_LENGTH - 1) / VERDICT_TICK_LENGTH);
+		arm();
+	}
+
+	ReleaseSRWLockExclusive(&m_lock);
+
+	return true;
+}
+
+void Verdicts::remove(Verdict* verdict) {
+	assert(verdict);
+	assert(m_count);
+
+	Verdict** link = m_table + (verdict->hash & (TABLE_SIZE - 1));
+	while (*link != verdict) {
+		link = &(*link)->next;
+	}
+
+	*link = verdict->next;
+	--m_count;
+
+	if (verdict->is_timed) {
+		m_wheel.cancel(&verdict->timer);
+	}
+
+	delete_filters(verdict);
+	mem_free(verdict);
+}
+
+b32 Verdicts::add_filters(Verdict* verdict) {
+	TRACE_SCOPE("Verdicts::add_filters");
+	assert(verdict);
+
+	if (m_has_sublayer == false) {
+		return false;
+	}
+
+	FWP_BYTE_BLOB* app_id = nullptr;
+	if (FwpmGetAppIdFromFileName0(verdict->path, &app_id) != ERROR_SUCCESS) {
+		return false;
+	}
+
+	FWPM_FILTER_CONDITION0 condition = {};
+	condition.fieldKey = FWPM_CONDITION_ALE_APP_ID;
+	condition.matchType = FWP_MATCH_EQUAL;
+	condition.conditionValue.type = FWP_BYTE_BLOB_TYPE;
+	condition.conditionValue.byteBlob = app_id;
+
+	// A soft permit would lose to the default outbound block of the system firewall in its lower sublayer, so the
+	// permit clears the action right.
+	FWPM_FILTER0 filter = {};
+	filter.displayData.name = L"Firewall Notifier";
+	filter.displayData.description = L"Temporary allow.";
+	filter.flags = FWPM_FILTER_FLAG_CLEAR_ACTION_RIGHT;
+	filter.subLayerKey = SUBLAYER_KEY;
+	filter.weight.type = FWP_EMPTY;
+	filter.action.type = FWP_ACTION_PERMIT;
+	filter.numFilterConditions = 1;
+	filter.filterCondition = &condition;
+
+	GUID const layers[] = { FWPM_LAYER_ALE_AUTH_CONNECT_V4, FWPM_LAYER_ALE_AUTH_CONNECT_V6 };
+
+	b32 result = true;
+	for (size_t i = 0; i < COUNT(layers) && result; ++i) {
+		filter.layerKey = layers[i];
+		result = (FwpmFilterAdd0(m_session, &filter, nullptr, &verdict->filters[i]) == ERROR_SUCCESS);
+	}
+
+	FwpmFreeMemory0((void**)&app_id);
+
+	if (result == false) {
+		delete_filters(verdict);
+	}
+
+	return result;
+}
+
+void Verdicts::delete_filters(Verdict* verdict) {
+	assert(verdict);
+
+	for (size_t i = 0; i < COUNT(verdict->filters); ++i) {
+		if (verdict->filters[i]) {
+			FwpmFilterDeleteById0(m_session, verdict->filters[i]);
+			verdict->filters[i] = 0;
+		}
+	}
+}
+
+void Verdicts::arm() {
+	u64 tick;
+	if (m_wheel.next_tick(&tick) == false) {
+		SetThreadpoolTimer(m_timer, nullptr, 0, 0);
+		return;
+	}
+
+	u64 now = GetTickCount64();
+	u64 due = MAX(tick * VERDICT_TICK_LENGTH, now) - now;
+
+	// A negative due time is relative, in 100 nanosecond units.
+	ULARGE_INTEGER relative;
+	relative.QuadPart = (ULONGLONG)(-(LONGLONG)(due * 10000));
+
+	FILETIME due_time;
+	due_time.dwLowDateTime = relative.LowPart;
+	due_time.dwHighDateTime = relative.HighPart;
+
+	SetThreadpoolTimer(m_timer, &due_time, 0, TIMER_WINDOW);
+}
+
+void Verdicts::collect(u64 now) {
+	Timer* timer = m_wheel.advance(now);
+	while (timer) {
+		Verdict* verdict = (Verdict*)timer;
+		timer = timer->next;
+
+		// The wheel has already let go of the timer.
+		verdict->is_timed = false;
+		remove(verdict);
+	}
+}
+
+void Verdicts::expire() {
+	TRACE_SCOPE("Verdicts::expire");
+
+	AcquireSRWLockExclusive(&m_lock);
+
+	collect(current_tick());
+	arm();
+
+	ReleaseSRWLockExclusive(&m_lock);
+}
+
+void Verdicts::set_firewall(Firewall* firewall) {
+	assert(firewall);
+	m_firewall = firewall;
+}
+
+void CALLBACK Verdicts::expire_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer) {
+	UNREFERENCED_PARAMETER(instance);
+	UNREFERENCED_PARAMETER(timer);
+
+	Verdicts* verdicts = (Verdicts*)context;
+	if (verdicts) {
+		verdicts->expire();
+	}
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "core.h"
+#include "firewall.h"
+#include "timers.h"
+#include <Windows.h>
+
+// Length of a timer wheel tick, in milliseconds.
+#define VERDICT_TICK_LENGTH 1000
+
+// Visitor for the verdicts in effect. Passes back the canonical path of the application, whether it is allowed, the
+// tick count at which it expires or zero for a verdict that lasts until the notifier exits, and the user context data.
+typedef void(*VerdictVisitor)(WCHAR const* path, b32 is_allowed, u64 expiry, void* context);
+
+// Time-bounded verdicts for applications, held in memory only. Temporary verdicts never touch the firewall rules: an
+// allowed application is let through by a hard permit filter in a dynamic filtering session, which the system removes
+// together with the session, and a blocked application is simply left to the default outbound action. The permit sits
+// in a sublayer weighted above the system firewall, so that the default outbound block cannot override it, and is
+// refused to an application that has a block rule. Expiry is driven by a timer wheel and a thread pool timer that is
+// armed only while a verdict is waiting to expire.
+class Verdicts {
+public:
+	// Creates an empty verdict table.
+	Verdicts();
+
+	// Destroys the verdict table, lifting every verdict.
+	~Verdicts();
+
+	Verdicts(Verdicts const&) = delete;
+	Verdicts& operator=(Verdicts const&) = delete;
+
+	// Allows the application at the given canonical path for the given time, in milliseconds, replacing any verdict it
+	// already has. Returns false if the application has a block rule or the verdict could not be added.
+	b32 allow(WCHAR const* path, u32 duration);
+
+	// Blocks the application at the given canonical path until the notifier exits, replacing any verdict it already
+	// has. Returns true on success.
+	b32 block(WCHAR const* path);
+
+	// Finds the verdict for the application at the given canonical path. Returns true if the application has one.
+	b32 find(WCHAR const* path, b32* is_allowed);
+
+	// Returns the number of verdicts in effect.
+	u32 count();
+
+	// Calls the visitor for every verdict in effect. The visitor must not call into the verdicts.
+	void visit(VerdictVisitor visitor, void* context);
+
+	// Removes the expired verdicts and arms the expiry timer again. Runs on the thread pool by itself.
+	void expire();
+
+	// Sets the firewall whose block rules are checked before allowing an application. Must be called before the first
+	// verdict.
+	void set_firewall(Firewall* firewall);
+
+private:
+	// A verdict for an application. The timer comes first, so an expired timer is its verdict.
+	struct Verdict {
+		Timer timer;
+		Verdict* next;
+		size_t hash;
+		UINT64 filters[2];
+		b32 is_allowed;
+		b32 is_timed;
+		WCHAR path[1];
+	};
+
+	// Returns the verdict for the given path, or null. Must be called under the lock.
+	Verdict* lookup(WCHAR const* path, size_t hash);
+
+	// Adds a verdict, replacing any existing one for the path. Returns true on success.
+	b32 insert(WCHAR const* path, b32 is_allowed, u32 duration);
+
+	// Unlinks the verdict from the table and frees it, lifting its filters. Must be called under the lock.
+	void remove(Verdict* verdict);
+
+	// Adds the permit filters for the verdict. Returns true on success.
+	b32 add_filters(Verdict* verdict);
+
+	// Deletes the permit filters of the verdict.
+	void delete_filters(Verdict* verdict);
+
+	// Arms the expiry timer for the next verdict due to expire, or disarms it. Must be called under the lock.
+	void arm();
+
+	// Advances the timer wheel to the given tick and removes the verdicts that expired. Must be called under the lock.
+	void collect(u64 now);
+
+	// Callback from the thread pool to remove the expired verdicts.
+	static void CALLBACK expire_callback(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer);
+
+	SRWLOCK m_lock = SRWLOCK_INIT;
+	TimerWheel m_wheel;
+	Verdict** m_table = nullptr;
+	u32 m_count = 0;
+	HANDLE m_session = nullptr;
+	PTP_TIMER m_timer = nullptr;
+	Firewall* m_firewall = nullptr;
+	b32 m_has_sublayer = false;
+};
@@ -0,0 +1,602 @@
+#include "workload.h"
+
+#ifdef NOTIFIER_WORKLOAD
+
+#include "wstr.h"
+#include <Psapi.h>
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// Number of slots in the injection time table. Must be a power of two.
+static const u32 STAMP_TABLE_SIZE = 0x10000;
+
+// Largest number of applications or endpoints in a workload.
+static const u32 MAX_POPULATION = 0x100000;
+
+// Mean time between bursts, in seconds.
+static const f64 QUIET_TIME = 2.0;
+
+// Mean length of a burst, in seconds.
+static const f64 BURST_TIME = 0.25;
+
+// Interval between generator wakeups, in milliseconds.
+static const DWORD GENERATOR_INTERVAL = 1;
+
+// Directories that applications are installed under, relative to the system drive.
+static WCHAR const* const INSTALL_ROOTS[] = {
+	L"\\program files\\",
+	L"\\program files\\",
+	L"\\program files (x86)\\",
+	L"\\users\\public\\appdata\\local\\",
+	L"\\users\\public\\appdata\\local\\programs\\",
+	L"\\users\\public\\appdata\\roaming\\",
+	L"\\programdata\\",
+	L"\\windows\\system32\\",
+};
+
+// Syllables that directory and executable names are made of.
+static WCHAR const* const NAME_SYLLABLES[] = {
+	L"ka", L"lo", L"mi", L"ne", L"ro", L"su", L"ta", L"vi", L"ex", L"or", L"an", L"el", L"in", L"qu", L"zy", L"dr",
+	L"st", L"pl", L"tek", L"soft", L"net", L"sync", L"cloud", L"up", L"date", L"ser", L"vice", L"host",
+};
+
+// Remote ports that endpoints are spread over, weighted by repetition.
+static u16 const ENDPOINT_PORTS[] = { 443, 443, 443, 443, 80, 80, 53, 123, 8080, 5228 };
+
+// Returns the next number of a xorshift64* sequence.
+static u64 next_random(u64* state) {
+	u64 x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+
+	return x * 0x2545f4914f6cdd1d;
+}
+
+// Returns a uniform number in [0, 1).
+static f64 next_uniform(u64* state) {
+	return (f64)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Mixes the bits of the value, such that nearby values give unrelated results.
+static u64 mix(u64 x) {
+	x += 0x9e3779b97f4a7c15;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+
+	return x ^ (x >> 31);
+}
+
+// Builds the cumulative Zipf distribution over the given number of ranks. Returns null on failure.
+static f64* zipf_table(u32 count, f64 skew) {
+	f64* table = (f64*)malloc(count * sizeof(*table));
+	if (table == nullptr) {
+		return nullptr;
+	}
+
+	f64 sum = 0.0;
+	for (u32 i = 0; i < count; ++i) {
+		sum += 1.0 / pow((f64)(i + 1), skew);
+		table[i] = sum;
+	}
+
+	for (u32 i = 0; i < count; ++i) {
+		table[i] /= sum;
+	}
+
+	return table;
+}
+
+// Draws a rank from a cumulative distribution.
+static u32 zipf_sample(f64 const* table, u32 count, u64* state) {
+	f64 u = next_uniform(state);
+
+	u32 lo = 0;
+	u32 hi = count - 1;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (table[mid] < u) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+// Appends a string to a path buffer of MAX_PATH characters. Returns true on success.
+static b32 append_name(WCHAR* dst, size_t* count, WCHAR const* src) {
+	size_t src_count = wcslen(src);
+	if (*count + src_count >= MAX_PATH) {
+		return false;
+	}
+
+	memcpy(dst + *count, src, (src_count + 1) * sizeof(*src));
+	*count += src_count;
+
+	return true;
+}
+
+// Appends a made up name of a few syllables. Returns true on success.
+static b32 append_word(WCHAR* dst, size_t* count, u64* state) {
+	u32 syllables = 2 + (u32)(next_random(state) % 4);
+
+	for (u32 i = 0; i < syllables; ++i) {
+		if (append_name(dst, count, NAME_SYLLABLES[next_random(state) % COUNT(NAME_SYLLABLES)]) == false) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Returns the histogram bucket of the given latency, in microseconds.
+static u32 bucket_index(u64 value) {
+	if (value < 64) {
+		return (u32)value;
+	}
+
+	u32 msb = 63;
+	while ((value >> msb) == 0) {
+		--msb;
+	}
+
+	u32 index = 64 + (msb - 6) * 32 + (u32)((value >> (msb - 5)) & 31);
+
+	return MIN(index, (u32)WORKLOAD_BUCKETS - 1);
+}
+
+// Returns the smallest latency of the given histogram bucket, in microseconds.
+static u64 bucket_value(u32 index) {
+	if (index < 64) {
+		return index;
+	}
+
+	u32 msb = 6 + (index - 64) / 32;
+	u64 sub = (index - 64) % 32;
+
+	return (32 + sub) << (msb - 5);
+}
+
+b32 workload_parse(int argc, WCHAR** argv, WorkloadConfig* dst) {
+	assert(argv || argc == 0);
+	assert(dst);
+
+	dst->apps = 5000;
+	dst->endpoints = 1024;
+	dst->skew = 1.1;
+	dst->rate = 1000.0;
+	dst->burst = 8.0;
+	dst->churn = 0.01;
+	dst->seconds = 600;
+
+	for (int i = 0; i < argc; ++i) {
+		WCHAR const* arg = argv[i];
+
+		WCHAR const* value = wcschr(arg, L'=');
+		if (value == nullptr) {
+			return false;
+		}
+
+		size_t key_count = (size_t)(value - arg);
+		++value;
+
+		if (key_count == 4 && _wcsnicmp(arg, L"apps", key_count) == 0) {
+			dst->apps = (u32)wcstoul(value, nullptr, 10);
+		} else if (key_count == 9 && _wcsnicmp(arg, L"endpoints", key_count) == 0) {
+			dst->endpoints = (u32)wcstoul(value, nullptr, 10);
+		} else if (key_count == 4 && _wcsnicmp(arg, L"skew", key_count) == 0) {
+			dst->skew = wcstod(value, nullptr);
+		} else if (key_count == 4 && _wcsnicmp(arg, L"rate", key_count) == 0) {
+			dst->rate = wcstod(value, nullptr);
+		} else if (key_count == 5 && _wcsnicmp(arg, L"burst", key_count) == 0) {
+			dst->burst = wcstod(value, nullptr);
+		} else if (key_count == 5 && _wcsnicmp(arg, L"churn", key_count) == 0) {
+			dst->churn = wcstod(value, nullptr);
+		} else if (key_count == 7 && _wcsnicmp(arg, L"seconds", key_count) == 0) {
+			dst->seconds = (u32)wcstoul(value, nullptr, 10);
+		} else {
+			return false;
+		}
+	}
+
+	return dst->apps > 0 && dst->apps <= MAX_POPULATION &&
+		dst->endpoints > 0 && dst->endpoints <= MAX_POPULATION &&
+		dst->skew >= 0.0 && dst->rate > 0.0 && dst->burst >= 1.0 &&
+		dst->churn >= 0.0 && dst->churn <= 1.0 && dst->seconds > 0;
+}
+
+Workload::Workload() {
+	InitializeCriticalSection(&m_lock);
+}
+
+Workload::~Workload() {
+	stop();
+	DeleteCriticalSection(&m_lock);
+}
+
+b32 Workload::start(WorkloadConfig const* config, Monitor* monitor, WCHAR const* report_path, HWND wnd) {
+	assert(config);
+	assert(monitor);
+	assert(report_path);
+
+	if (m_thread) {
+		return false;
+	}
+
+	m_config = *config;
+	m_monitor = monitor;
+	m_wnd = wnd;
+
+	// Synthetic paths live on the system drive, so that they map back the same way as real ones.
+	WCHAR drive[MAX_PATH + 1];
+	if (GetWindowsDirectoryW(drive, COUNT(drive)) < 2 || drive[1] != L':') {
+		return false;
+	}
+
+	m_drive = (WCHAR)towlower(drive[0]);
+	drive[2] = L'\0';
+	if (QueryDosDeviceW(drive, m_device, COUNT(m_device)) == 0) {
+		return false;
+	}
+
+	_wcslwr(m_device);
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	m_frequency = (u64)frequency.QuadPart;
+
+	LARGE_INTEGER seed;
+	QueryPerformanceCounter(&seed);
+	m_random = mix((u64)seed.QuadPart) | 1;
+
+	m_apps = (WorkloadApp*)calloc(m_config.apps, sizeof(*m_apps));
+	m_stamps = (WorkloadStamp*)calloc(STAMP_TABLE_SIZE, sizeof(*m_stamps));
+	m_app_cdf = zipf_table(m_config.apps, m_config.skew);
+	m_endpoint_cdf = zipf_table(m_config.endpoints, m_config.skew);
+
+	b32 result = m_apps && m_stamps && m_app_cdf && m_endpoint_cdf;
+	for (u32 i = 0; i < m_config.apps && result; ++i) {
+		result = make_app(i);
+	}
+
+	if (result) {
+		m_report = CreateFileW(report_path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+
+		static char const header[] = "second,injected,queued,consumed,p50_us,p99_us,p999_us,working_set,private_bytes\r\n";
+
+		DWORD written;
+		result = (m_report != INVALID_HANDLE_VALUE) &&
+			WriteFile(m_report, header, sizeof(header) - 1, &written, nullptr);
+	}
+
+	if (result) {
+		m_stop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		if (m_stop) {
+			m_is_running = true;
+			m_thread = CreateThread(0, 0, generator_thread_callback, this, 0, 0);
+		}
+	}
+
+	if (m_thread == nullptr) {
+		stop();
+		return false;
+	}
+
+	return true;
+}
+
+void Workload::stop() {
+	if (m_thread) {
+		SetEvent(m_stop);
+		WaitForSingleObject(m_thread, INFINITE);
+
+		CloseHandle(m_thread);
+		m_thread = nullptr;
+
+		EnterCriticalSection(&m_lock);
+		WorkloadHistogram total = m_total;
+		LeaveCriticalSection(&m_lock);
+
+		report("total", &total, m_injected);
+	}
+
+	EnterCriticalSection(&m_lock);
+	m_is_running = false;
+	LeaveCriticalSection(&m_lock);
+
+	if (m_stop) {
+		CloseHandle(m_stop);
+		m_stop = nullptr;
+	}
+
+	if (m_report != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_report);
+		m_report = INVALID_HANDLE_VALUE;
+	}
+
+	if (m_apps) {
+		for (u32 i = 0; i < m_config.apps; ++i) {
+			free(m_apps[i].device_path);
+		}
+
+		free(m_apps);
+		m_apps = nullptr;
+	}
+
+	free(m_stamps);
+	m_stamps = nullptr;
+
+	free(m_app_cdf);
+	m_app_cdf = nullptr;
+
+	free(m_endpoint_cdf);
+	m_endpoint_cdf = nullptr;
+}
+
+b32 Workload::consume(WCHAR const* path) {
+	assert(path);
+
+	if (m_is_running == false) {
+		return false;
+	}
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	size_t hash = wcshash(path);
+
+	EnterCriticalSection(&m_lock);
+
+	// The workload may have stopped since the check above, taking the table with it.
+	if (m_is_running == false) {
+		LeaveCriticalSection(&m_lock);
+		return false;
+	}
+
+	WorkloadStamp* stamp = m_stamps + (hash & (STAMP_TABLE_SIZE - 1));
+	if (stamp->time && stamp->hash == hash) {
+		u64 latency = ((u64)now.QuadPart - stamp->time) * 1000000 / m_frequency;
+		u32 index = bucket_index(latency);
+
+		++m_interval.buckets[index];
+		++m_interval.count;
+		++m_total.buckets[index];
+		++m_total.count;
+
+		stamp->time = 0;
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	return true;
+}
+
+b32 Workload::make_app(u32 rank) {
+	assert(rank < m_config.apps);
+
+	u64 state = mix(((u64)rank << 32) ^ ++m_generation) | 1;
+
+	WCHAR path[MAX_PATH + 1];
+	size_t count = 0;
+
+	// Vendor and product directories, an optional version or bin directory, and now and then the deep layout of
+	// bundled runtimes.
+	path[0] = L'\0';
+	b32 result = append_name(path, &count, INSTALL_ROOTS[next_random(&state) % COUNT(INSTALL_ROOTS)]) &&
+		append_word(path, &count, &state) && append_name(path, &count, L"\\") &&
+		append_word(path, &count, &state) && append_name(path, &count, L"\\");
+
+	if (result && next_random(&state) % 3 == 0) {
+		WCHAR version[32];
+		swprintf_s(version, COUNT(version), L"app-%u.%u.%u\\", (u32)(next_random(&state) % 20),
+			(u32)(next_random(&state) % 100), (u32)(next_random(&state) % 1000));
+
+		result = append_name(path, &count, version);
+	} else if (result && next_random(&state) % 3 == 0) {
+		result = append_name(path, &count, L"bin\\");
+	}
+
+	if (result && next_random(&state) % 20 == 0) {
+		u32 depth = 2 + (u32)(next_random(&state) % 5);
+		for (u32 i = 0; i < depth && result; ++i) {
+			result = append_word(path, &count, &state) && append_name(path, &count, L"\\");
+		}
+	}
+
+	result = result && append_word(path, &count, &state) && append_name(path, &count, L".exe");
+	if (result == false) {
+		return false;
+	}
+
+	// The device form is what the system reports, the drive form is what the decision step sees.
+	size_t device_count = wcslen(m_device);
+	WCHAR* buffer = (WCHAR*)malloc((device_count + count + 1 + 2 + count + 1) * sizeof(*buffer));
+	if (buffer == nullptr) {
+		return false;
+	}
+
+	WorkloadApp* app = m_apps + rank;
+	free(app->device_path);
+
+	app->device_path = buffer;
+	memcpy(buffer, m_device, device_count * sizeof(*buffer));
+	memcpy(buffer + device_count, path, (count + 1) * sizeof(*buffer));
+
+	app->path = buffer + device_count + count + 1;
+	app->path[0] = m_drive;
+	app->path[1] = L':';
+	memcpy(app->path + 2, path, (count + 1) * sizeof(*buffer));
+
+	app->hash = wcshash(app->path);
+
+	return true;
+}
+
+void Workload::inject(u32 rank, u32 endpoint) {
+	WorkloadApp* app = m_apps + rank;
+	u64 address = mix(endpoint);
+
+	FWPM_NET_EVENT1 ev = {};
+	ev.type = FWPM_NET_EVENT_TYPE_CLASSIFY_DROP;
+	ev.header.flags = FWPM_NET_EVENT_FLAG_APP_ID_SET | FWPM_NET_EVENT_FLAG_IP_VERSION_SET |
+		FWPM_NET_EVENT_FLAG_REMOTE_ADDR_SET | FWPM_NET_EVENT_FLAG_REMOTE_PORT_SET;
+	ev.header.ipVersion = FWP_IP_VERSION_V4;
+	ev.header.ipProtocol = 6;
+	ev.header.remoteAddrV4 = (UINT32)address;
+	ev.header.remotePort = ENDPOINT_PORTS[(address >> 32) % COUNT(ENDPOINT_PORTS)];
+	ev.header.appId.data = (UINT8*)app->device_path;
+	ev.header.appId.size = (UINT32)((wcslen(app->device_path) + 1) * sizeof(WCHAR));
+	GetSystemTimeAsFileTime(&ev.header.timeStamp);
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	// Only the first pending event of an application is timed. The stamp is taken before injecting, since the event
+	// can be consumed before the injection returns, and dropped again if the monitor deduplicated the event.
+	EnterCriticalSection(&m_lock);
+
+	WorkloadStamp* stamp = m_stamps + (app->hash & (STAMP_TABLE_SIZE - 1));
+	b32 is_stamped = (stamp->time == 0);
+	if (is_stamped) {
+		stamp->hash = app->hash;
+		stamp->time = (u64)now.QuadPart;
+	}
+
+	LeaveCriticalSection(&m_lock);
+
+	b32 is_queued = m_monitor->inject(&ev);
+
+	if (is_stamped && is_queued == false) {
+		EnterCriticalSection(&m_lock);
+
+		if (stamp->hash == app->hash && stamp->time == (u64)now.QuadPart) {
+			stamp->time = 0;
+		}
+
+		LeaveCriticalSection(&m_lock);
+	}
+
+	++m_injected;
+}
+
+void Workload::report(char const* label, WorkloadHistogram const* histogram, u64 injected) {
+	assert(label);
+	assert(histogram);
+
+	u64 percentiles[3] = {};
+	f64 const ranks[3] = { 0.5, 0.99, 0.999 };
+
+	for (size_t i = 0; i < COUNT(ranks); ++i) {
+		u64 target = (u64)ceil(ranks[i] * (f64)histogram->count);
+		u64 seen = 0;
+
+		for (u32 j = 0; j < WORKLOAD_BUCKETS && histogram->count; ++j) {
+			seen += histogram->buckets[j];
+			if (seen >= target) {
+				percentiles[i] = bucket_value(j);
+				break;
+			}
+		}
+	}
+
+	PROCESS_MEMORY_COUNTERS_EX memory = {};
+	memory.cb = sizeof(memory);
+	GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS*)&memory, sizeof(memory));
+
+	char line[256];
+	int len = _snprintf_s(line, sizeof(line), _TRUNCATE, "%s,%llu,%u,%llu,%llu,%llu,%llu,%llu,%llu\r\n", label,
+		injected, m_monitor->queued(), histogram->count, percentiles[0], percentiles[1], percentiles[2],
+		(u64)memory.WorkingSetSize, (u64)memory.PrivateUsage);
+
+	if (len > 0) {
+		DWORD written;
+		WriteFile(m_report, line, (DWORD)len, &written, nullptr);
+	}
+}
+
+DWORD Workload::generator_thread() {
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	WorkloadHistogram* interval = (WorkloadHistogram*)malloc(sizeof(*interval));
+	if (interval == nullptr) {
+		return 0;
+	}
+
+	// Arrivals follow a Poisson process whose rate switches between a quiet and a burst state.
+	b32 is_burst = false;
+	f64 state_end = -log(1.0 - next_uniform(&m_random)) * QUIET_TIME;
+	f64 next = 0.0;
+	u32 second = 0;
+	u64 second_injected = 0;
+
+	while (WaitForSingleObject(m_stop, GENERATOR_INTERVAL) == WAIT_TIMEOUT) {
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		f64 now = (f64)(counter.QuadPart - start.QuadPart) / (f64)m_frequency;
+
+		while (next <= now) {
+			while (next >= state_end) {
+				is_burst = !is_burst;
+				state_end += -log(1.0 - next_uniform(&m_random)) * (is_burst ? BURST_TIME : QUIET_TIME);
+			}
+
+			u32 rank = zipf_sample(m_app_cdf, m_config.apps, &m_random);
+			if (next_uniform(&m_random) < m_config.churn) {
+				make_app(rank);
+			}
+
+			inject(rank, zipf_sample(m_endpoint_cdf, m_config.endpoints, &m_random));
+
+			f64 rate = is_burst ? m_config.rate * m_config.burst : m_config.rate;
+			next += -log(1.0 - next_uniform(&m_random)) / rate;
+		}
+
+		if (now < (f64)(second + 1)) {
+			continue;
+		}
+
+		++second;
+
+		EnterCriticalSection(&m_lock);
+		*interval = m_interval;
+		memset(&m_interval, 0, sizeof(m_interval));
+		LeaveCriticalSection(&m_lock);
+
+		char label[16];
+		_snprintf_s(label, sizeof(label), _TRUNCATE, "%u", second);
+		report(label, interval, m_injected - second_injected);
+		second_injected = m_injected;
+
+		if (second >= m_config.seconds) {
+			if (m_wnd) {
+				PostMessageW(m_wnd, WM_CLOSE, 0, 0);
+			}
+
+			break;
+		}
+	}
+
+	free(interval);
+
+	return 0;
+}
+
+DWORD WINAPI Workload::generator_thread_callback(LPVOID context) {
+	Workload* workload = (Workload*)context;
+	if (workload) {
+		return workload->generator_thread();
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,145 @@
+#pragma once
+#include "core.h"
+#include "monitor.h"
+#include <Windows.h>
+
+// Synthetic drop event workload. Compiles to nothing unless NOTIFIER_WORKLOAD is defined. When enabled, a generator
+// thread feeds the monitor with drop events for Zipf distributed applications and endpoints, arriving in bursts, with
+// paths shaped like real installations and a share of never seen applications. The time from injection to the
+// decision step is recorded per event, and latency percentiles and process memory are written every second to a CSV
+// file for soak runs.
+
+// Workload shape.
+struct WorkloadConfig {
+	// Number of distinct applications.
+	u32 apps;
+
+	// Number of distinct remote endpoints.
+	u32 endpoints;
+
+	// Zipf exponent of the application and endpoint popularity.
+	f64 skew;
+
+	// Mean arrival rate outside bursts, in events per second.
+	f64 rate;
+
+	// Arrival rate multiplier during bursts.
+	f64 burst;
+
+	// Probability that an event comes from an application that was never seen before.
+	f64 churn;
+
+	// Length of the run, in seconds.
+	u32 seconds;
+};
+
+#ifdef NOTIFIER_WORKLOAD
+
+// Number of latency histogram buckets: 64 exact microsecond buckets, then 32 buckets per power of two up to 2^41.
+#define WORKLOAD_BUCKETS 1184
+
+// Parses the workload shape from key=value arguments, such as apps=5000 skew=1.1 rate=2000 burst=8 churn=0.01
+// endpoints=1024 seconds=600. Omitted keys keep their defaults. Returns true on success.
+b32 workload_parse(int argc, WCHAR** argv, WorkloadConfig* dst);
+
+// Drives the notifier pipeline with a synthetic workload.
+class Workload {
+public:
+	// Creates a stopped workload.
+	Workload();
+
+	// Destroys the workload, stopping it if needed.
+	~Workload();
+
+	Workload(Workload const&) = delete;
+	Workload& operator=(Workload const&) = delete;
+
+	// Starts injecting events into the started monitor and writing the report to the given path. The window is sent a
+	// WM_CLOSE once the run is over. Returns true on success.
+	b32 start(WorkloadConfig const* config, Monitor* monitor, WCHAR const* report_path, HWND wnd);
+
+	// Stops injecting events and writes the totals to the report.
+	void stop();
+
+	// Records that the event for the given path reached the decision step. Returns true while a workload runs, in which
+	// case no event is decided on.
+	b32 consume(WCHAR const* path);
+
+private:
+	// A synthetic application.
+	struct WorkloadApp {
+		WCHAR* device_path;
+		WCHAR* path;
+		size_t hash;
+	};
+
+	// Time at which a queued event was injected.
+	struct WorkloadStamp {
+		size_t hash;
+		u64 time;
+	};
+
+	// Latency histogram with logarithmic buckets subdivided linearly.
+	struct WorkloadHistogram {
+		u64 count;
+		u32 buckets[WORKLOAD_BUCKETS];
+	};
+
+	// Gives the application at the given rank a new identity. Returns true on success.
+	b32 make_app(u32 rank);
+
+	// Injects a drop event for the given application and endpoint.
+	void inject(u32 rank, u32 endpoint);
+
+	// Writes a report line for the given histogram.
+	void report(char const* label, WorkloadHistogram const* histogram, u64 injected);
+
+	// Generator thread routine.
+	DWORD generator_thread();
+
+	// Generator thread routine callback.
+	static DWORD WINAPI generator_thread_callback(LPVOID context);
+
+	CRITICAL_SECTION m_lock;
+	WorkloadConfig m_config = {};
+	Monitor* m_monitor = nullptr;
+	HWND m_wnd = nullptr;
+	WCHAR m_device[MAX_PATH + 1] = {};
+	WCHAR m_drive = 0;
+	WorkloadApp* m_apps = nullptr;
+	f64* m_app_cdf = nullptr;
+	f64* m_endpoint_cdf = nullptr;
+	WorkloadStamp* m_stamps = nullptr;
+	WorkloadHistogram m_interval = {};
+	WorkloadHistogram m_total = {};
+	u64 m_random = 0;
+	u64 m_generation = 0;
+	u64 m_injected = 0;
+	u64 m_frequency = 1;
+	volatile b32 m_is_running = false;
+	HANDLE m_report = INVALID_HANDLE_VALUE;
+	HANDLE m_thread = nullptr;
+	HANDLE m_stop = nullptr;
+};
+
+#else
+
+inline b32 workload_parse(int argc, WCHAR** argv, WorkloadConfig* dst) {
+	return false;
+}
+
+class Workload {
+public:
+	b32 start(WorkloadConfig const* config, Monitor* monitor, WCHAR const* report_path, HWND wnd) {
+		return false;
+	}
+
+	void stop() {
+	}
+
+	b32 consume(WCHAR const* path) {
+		return false;
+	}
+};
+
+#endif
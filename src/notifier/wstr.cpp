@@ -16,6 +16,20 @@ size_t wcshash(wchar_t const* src) {
 	return hash;
 }
 
+size_t wcsnhash(wchar_t const* src, size_t count) {
+	assert(src || count == 0);
+
+	/* FNV1-a: http://www.isthe.com/chongo/tech/comp/fnv/ */
+	size_t hash = 14695981039346656037;
+
+	for (size_t i = 0; i < count; ++i) {
+		hash ^= src[i];
+		hash *= 1099511628211;
+	}
+
+	return hash;
+}
+
 void wcsmerge(wchar_t* dst, size_t dst_count, wchar_t const* src1, wchar_t const* src2) {
 	assert(dst);
 	assert(dst_count);
@@ -4,5 +4,8 @@
 // Returns the 64-bit hash of the given string.
 size_t wcshash(wchar_t const* src);
 
+// Returns the 64-bit hash of the first count characters of the given string.
+size_t wcsnhash(wchar_t const* src, size_t count);
+
 // Merges two strings, such that dst = src1 + src2. Truncates to ensure that the string is null terminated.
 void wcsmerge(wchar_t* dst, size_t dst_count, wchar_t const* src1, wchar_t const* src2);